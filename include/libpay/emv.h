@@ -337,6 +337,11 @@ struct emv_ep;
 
 struct emv_ep *emv_ep_new(const char *logging_category);
 
+/* Like emv_ep_new(), but log messages are written asynchronously until the
+ * entry point is freed.  See libtlv_log_async_start() for 'log_ring_size'.  */
+struct emv_ep *emv_ep_new_async(const char *logging_category,
+							 size_t log_ring_size);
+
 void emv_ep_free(struct emv_ep *ep);
 
 int emv_ep_register_hal(struct emv_ep *ep, struct emv_hal *hal);
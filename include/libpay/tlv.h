@@ -42,6 +42,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -49,6 +50,9 @@ extern "C" {
 
 #define TLV_MAX_TAG_LENGTH			8
 
+/* Primitive values shorter than this are copied by tlv_encode_iov.	      */
+#define TLV_IOV_COPY_LIMIT			64
+
 #define TLV_RC_OK				0
 #define TLV_RC_INVALID_ARG			1
 #define TLV_RC_BUFFER_OVERFLOW			2
@@ -59,6 +63,42 @@ extern "C" {
 #define TLV_RC_IO_ERROR				7
 #define TLV_RC_VALUE_OUT_OF_RANGE		8
 #define TLV_RC_UNEXPECTED_END_OF_STREAM		9
+#define TLV_RC_MAX_DEPTH_EXCEEDED		10
+#define TLV_RC_TOO_MANY_NODES			11
+
+#define TLV_DEFAULT_MAX_DEPTH			32
+
+/* Nesting depth tlv_validate and tlv_scan can follow at most.		      */
+#define TLV_VALIDATE_MAX_DEPTH			256
+
+/* Number of steps a path compiled by tlv_path_compile may have at most.      */
+#define TLV_PATH_MAX_STEPS			16
+
+/* Nesting depth of constructed data objects a tlv_writer supports at most.  */
+#define TLV_WRITER_MAX_DEPTH			16
+
+/**
+ * Integer representation of a tag: The octets of the encoded tag packed in
+ * big endian order.  E.g. the key of tag 9F02 is 0x9F02.  Each tag has
+ * exactly one key, so tags can be compared with a single integer compare.
+ */
+typedef uint64_t tlv_key_t;
+
+#define __TLV_KEY_OCTET(tag, i)						      \
+	(sizeof(tag) > (i) + 1 ?					      \
+	 (tlv_key_t)(uint8_t)(tag)[(i) & 7] <<				      \
+				       (8 * ((sizeof(tag) - (i) - 2) & 7)) : 0)
+
+/**
+ * Key of a tag given as string literal, e.g. TLV_KEY(EMV_ID_PDOL).  Folds to
+ * a constant at compile time.  Use libtlv_tag_to_key for tags that are not
+ * string literals.
+ */
+#define TLV_KEY(tag)							      \
+	(__TLV_KEY_OCTET(tag, 0) | __TLV_KEY_OCTET(tag, 1) |		      \
+	 __TLV_KEY_OCTET(tag, 2) | __TLV_KEY_OCTET(tag, 3) |		      \
+	 __TLV_KEY_OCTET(tag, 4) | __TLV_KEY_OCTET(tag, 5) |		      \
+	 __TLV_KEY_OCTET(tag, 6) | __TLV_KEY_OCTET(tag, 7))
 
 /**
  * Structure that represents a complex TLV structure. I.e. for example a single
@@ -66,6 +106,56 @@ extern "C" {
  */
 struct tlv;
 
+/**
+ * Bump allocator that TLV data structures can be parsed into.  All nodes of a
+ * TLV data structure parsed by tlv_parse_arena are carved out of the arena's
+ * memory blocks and released all at once by tlv_arena_reset.
+ */
+struct tlv_arena;
+
+/**
+ * @brief Create a new arena for TLV data structures.
+ *
+ * @param[in]  block_size  Size of the memory blocks the arena allocates from
+ *			     the heap.  Pass 0 to use a sensible default.
+ *
+ * @return A pointer to the new arena if successful. NULL otherwise.
+ */
+struct tlv_arena *tlv_arena_new(size_t block_size);
+
+/**
+ * @brief Release all TLV nodes allocated from an arena.
+ *
+ * This is an O(1) operation regardless of the number of nodes in the arena.
+ * The memory blocks of the arena are kept for re-use by subsequent parses.
+ * Pointers to nodes which were allocated from the arena are dangling after
+ * this call.
+ *
+ * @param[in]  arena  The arena to reset.
+ */
+void tlv_arena_reset(struct tlv_arena *arena);
+
+/**
+ * @brief Free an arena and all memory blocks held by it.
+ *
+ * @param[in]  arena  The arena to free.
+ */
+void tlv_arena_free(struct tlv_arena *arena);
+
+/**
+ * Per call parser state.  Callers provide it to the *_r parse functions to
+ * learn where and why parsing failed.  All parse functions are safe to call
+ * from multiple threads concurrently.
+ */
+struct tlv_parse_ctx {
+	/** Input: Maximum nesting depth, 0 for the libtlv_set_max_depth limit. */
+	unsigned int	max_depth;
+	/** Output: TLV_RC_* code of the last parse using this context. */
+	int		rc;
+	/** Output: Offset into the encoded data at which parsing failed. */
+	size_t		offset;
+};
+
 /**
  * @brief Parse DER-TLV encoded data into a TLV data structure
  *
@@ -77,6 +167,21 @@ struct tlv;
  */
 int tlv_parse(const void *buffer, size_t size, struct tlv **tlv);
 
+/**
+ * @brief Parse DER-TLV encoded data into a TLV data structure, reporting
+ * errors in a caller provided context.
+ *
+ * @param[in]    buffer  The DER-TLV encoded data to parse.
+ * @param[in]    size    Length of the DER-TLV encoded data.
+ * @param[out]   tlv     The corresponding TLV data structure.
+ * @param[inout] ctx     Parser limits on input, error code and offset on
+ *			   output.
+ *
+ * @return TLV_RC_OK on success. Other TLV_RC_* codes on failure.
+ */
+int tlv_parse_r(const void *buffer, size_t size, struct tlv **tlv,
+						     struct tlv_parse_ctx *ctx);
+
 /**
  * @brief Parse DER-TLV encoded data into a TLV data structure, treating constructed
  * tags as primitive.
@@ -93,6 +198,308 @@ int tlv_parse(const void *buffer, size_t size, struct tlv **tlv);
  */
 int tlv_shallow_parse(const void *buffer, size_t size, struct tlv **tlv);
 
+/**
+ * @brief Like tlv_shallow_parse, reporting errors in a caller provided
+ * context.
+ *
+ * @param[in]    buffer  The DER-TLV encoded data to parse.
+ * @param[in]    size    Length of the DER-TLV encoded data.
+ * @param[out]   tlv     The corresponding TLV data structure.
+ * @param[inout] ctx     Parser limits on input, error code and offset on
+ *			   output.
+ *
+ * @return TLV_RC_OK on success. Other TLV_RC_* codes on failure.
+ */
+int tlv_shallow_parse_r(const void *buffer, size_t size, struct tlv **tlv,
+						     struct tlv_parse_ctx *ctx);
+
+/**
+ * @brief Parse DER-TLV encoded data into a TLV data structure allocated from
+ * an arena.
+ *
+ * The resulting TLV data structure may be navigated and modified like any
+ * other.  There is no need to call tlv_free on it, tlv_arena_reset releases
+ * all of its nodes at once.  Note that tlv_free on a node which lives in an
+ * arena only unlinks it (and frees heap allocated nodes that might have been
+ * inserted below it).
+ *
+ * @param[in]  arena   The arena to allocate the TLV nodes from.
+ * @param[in]  buffer  The DER-TLV encoded data to parse.
+ * @param[in]  size    Length of the DER-TLV encoded data.
+ * @param[out] tlv     The corresponding TLV data structure.
+ *
+ * @return TLV_RC_OK on success. Other TLV_RC_* codes on failure.
+ */
+int tlv_parse_arena(struct tlv_arena *arena, const void *buffer, size_t size,
+							      struct tlv **tlv);
+
+/**
+ * @brief Parse DER-TLV encoded data into a TLV data structure which references
+ * the values in the encoded data instead of copying them.
+ *
+ * The values of primitive TLV nodes point directly into the provided buffer.
+ * The caller must therefore keep the buffer alive and unmodified for as long
+ * as the TLV data structure is in use.  Use tlv_view_value to access the
+ * values without copying them.  tlv_set_value never writes to the provided
+ * buffer, the modified node gets a private copy of its new value instead.
+ *
+ * @param[in]  buffer  The DER-TLV encoded data to parse.
+ * @param[in]  size    Length of the DER-TLV encoded data.
+ * @param[out] tlv     The corresponding TLV data structure.
+ *
+ * @return TLV_RC_OK on success. Other TLV_RC_* codes on failure.
+ */
+int tlv_view_parse(const void *buffer, size_t size, struct tlv **tlv);
+
+/**
+ * @brief Parse DER-TLV encoded data into a TLV data structure whose constructed
+ * nodes are only expanded on demand.
+ *
+ * Like tlv_view_parse, but only the top level of the encoded data is parsed.
+ * Constructed nodes reference their encoded value and parse it the first time
+ * their children are accessed, e.g. through tlv_get_child, tlv_is_constructed,
+ * tlv_iterate or tlv_deep_find.  Constructed values that are never looked into
+ * cost nothing beyond their tag and length.  Encoding a TLV data structure
+ * does not expand its lazy nodes.
+ *
+ * Since the nested values have not been checked yet, a constructed value that
+ * turns out to be malformed when it is expanded has no children and is
+ * treated like a primitive value.
+ *
+ * As for tlv_view_parse, the caller must keep the buffer alive and unmodified
+ * for as long as the TLV data structure is in use.
+ *
+ * Expanding a node modifies the TLV data structure, even though it happens
+ * inside accessors that only read, like tlv_get_child or tlv_deep_find.  A
+ * lazily parsed TLV data structure must therefore not be accessed from
+ * several threads at once without locking, unless all of its nodes have
+ * been expanded before, e.g. by walking it once with tlv_iterate.
+ *
+ * @param[in]  buffer  The DER-TLV encoded data to parse.
+ * @param[in]  size    Length of the DER-TLV encoded data.
+ * @param[out] tlv     The corresponding TLV data structure.
+ *
+ * @return TLV_RC_OK on success. Other TLV_RC_* codes on failure.
+ */
+int tlv_lazy_parse(const void *buffer, size_t size, struct tlv **tlv);
+
+/**
+ * Limits enforced by tlv_validate and tlv_scan.
+ */
+struct tlv_limits {
+	/** Maximum nesting depth, 0 for the libtlv_set_max_depth limit.      */
+	unsigned int	max_depth;
+	/** Maximum number of TLV nodes, 0 for no limit.		      */
+	size_t		max_nodes;
+	/** Maximum length of primitive values, 0 for no limit.		      */
+	size_t		max_value_length;
+};
+
+/**
+ * @brief Check that BER-TLV encoded data is well-formed.
+ *
+ * Accepts exactly what tlv_parse accepts, but neither allocates memory nor
+ * logs anything.  Nesting deeper than TLV_VALIDATE_MAX_DEPTH is refused.
+ *
+ * @param[in]  buffer        The BER-TLV encoded data to check.
+ * @param[in]  size          Length of the BER-TLV encoded data.
+ * @param[in]  limits        The limits to enforce or NULL for the default
+ *                           maximum depth only.
+ * @param[out] error_offset  If not NULL, the offset into the encoded data
+ *                           at which the first error was found.
+ *
+ * @return TLV_RC_OK if the data is well-formed.  TLV_RC_MAX_DEPTH_EXCEEDED,
+ *         TLV_RC_TOO_MANY_NODES or TLV_RC_VALUE_LENGTH_TOO_LARGE if a limit
+ *         is exceeded.  Other TLV_RC_* codes if the data is malformed.
+ */
+int tlv_validate(const void *buffer, size_t size,
+		const struct tlv_limits *limits, size_t *error_offset);
+
+/**
+ * A TLV node as reported by tlv_scan.  All pointers point into the scanned
+ * buffer.
+ */
+struct tlv_record {
+	/** The encoded tag of the node.				      */
+	const uint8_t	*tag;
+	/** Key of the tag, see libtlv_tag_to_key.			      */
+	tlv_key_t	 key;
+	/** Length of the encoded tag and length octets.		      */
+	size_t		 header_length;
+	/** The value of the node.					      */
+	const uint8_t	*value;
+	/** Length of the value.					      */
+	size_t		 length;
+	/** Nesting depth of the node, 0 for nodes on the top level.	      */
+	unsigned int	 depth;
+	/** Whether the children of the node are reported next.		      */
+	bool		 constructed;
+};
+
+/**
+ * @brief Walk BER-TLV encoded data without building a TLV data structure.
+ *
+ * Checks the data like tlv_validate and calls a callback for every node in
+ * pre-order, i.e. a constructed node is reported before its children.
+ * Nodes are reported as soon as their header has been checked, so that the
+ * callback may see a few nodes before an error further on is found.
+ *
+ * @param[in]  buffer        The BER-TLV encoded data to scan.
+ * @param[in]  size          Length of the BER-TLV encoded data.
+ * @param[in]  limits        The limits to enforce or NULL for the default
+ *                           maximum depth only.
+ * @param[in]  callback      Called for every node.  Returns TLV_RC_OK to
+ *                           continue.  Any other value stops the scan and is
+ *                           returned by tlv_scan.
+ * @param[in]  priv          First argument passed to the callback.
+ * @param[out] error_offset  If not NULL, the offset into the encoded data
+ *                           at which the scan stopped on failure.
+ *
+ * @return TLV_RC_OK on success.  Other TLV_RC_* codes as for tlv_validate or
+ *         the return value of the callback on failure.
+ */
+int tlv_scan(const void *buffer, size_t size, const struct tlv_limits *limits,
+	      int (*callback)(void *priv, const struct tlv_record *record),
+					     void *priv, size_t *error_offset);
+
+/**
+ * Precompiled path to TLV nodes in BER-TLV encoded data, see
+ * tlv_path_compile.
+ */
+struct tlv_path;
+
+/**
+ * @brief Compile a path expression for tlv_path_eval.
+ *
+ * A path is a list of tags in hex, separated by '/', e.g. "6F/A5/BF0C/61*".
+ * Each step selects the first node with that tag among the children of the
+ * nodes selected by the previous step, the first step among the nodes on the
+ * top level.  A step followed by '*' selects all nodes with that tag.
+ *
+ * @param[in]  expression  The path expression.
+ * @param[out] path        The compiled path.  Free it with tlv_path_free.
+ *
+ * @returns TLV_RC_OK on success, TLV_RC_INVALID_ARG if the expression is
+ *          malformed or has more than TLV_PATH_MAX_STEPS steps, other
+ *          TLV_RC_* codes on failure.
+ */
+int tlv_path_compile(const char *expression, struct tlv_path **path);
+
+/**
+ * @brief Find the nodes a path selects in BER-TLV encoded data.
+ *
+ * Works on the encoded data in a single forward pass without allocating
+ * memory.  Subtrees that cannot match are skipped by their length, so that
+ * only the headers along the path are checked for well-formedness.
+ *
+ * @param[in]  path      The compiled path.
+ * @param[in]  buffer    The BER-TLV encoded data.
+ * @param[in]  size      Length of the BER-TLV encoded data.
+ * @param[in]  callback  Called for every selected node in the order of the
+ *                       encoding.  record->depth is the index of the last
+ *                       step.  Returns TLV_RC_OK to continue.  Any other
+ *                       value stops the evaluation and is returned by
+ *                       tlv_path_eval.
+ * @param[in]  priv      First argument passed to the callback.
+ *
+ * @returns TLV_RC_OK on success, other TLV_RC_* codes if the data along the
+ *          path is malformed or the return value of the callback.
+ */
+int tlv_path_eval(const struct tlv_path *path, const void *buffer,
+		   size_t size,
+		   int (*callback)(void *priv, const struct tlv_record *record),
+								    void *priv);
+
+void tlv_path_free(struct tlv_path *path);
+
+/**
+ * Callbacks of a streaming TLV parser.  Any callback may be NULL.  Callbacks
+ * return TLV_RC_OK to continue parsing.  Any other value stops the parser and
+ * is returned by tlv_stream_parser_feed.  tag points to the encoded tag of the
+ * current node and is only valid for the duration of the call.
+ */
+struct tlv_stream_callbacks {
+	/** Start of a constructed node with a value of length bytes.	      */
+	int (*enter)(void *priv, const void *tag, size_t length);
+	/** End of the constructed node that was entered last.		      */
+	int (*leave)(void *priv, const void *tag);
+	/**
+	 * (Part of) the value of a primitive node.  Values of at most
+	 * buffer_size bytes are delivered in one call with offset 0 and size
+	 * equal to length.  Larger values are delivered in pieces as they
+	 * arrive, offset being the position of data within the value.
+	 */
+	int (*value)(void *priv, const void *tag, size_t length, size_t offset,
+					       const void *data, size_t size);
+};
+
+/**
+ * Push parser for BER-TLV data of unbounded size, e.g. read from a pipe.  The
+ * parser fires callbacks instead of building a TLV data structure and uses
+ * a constant amount of memory.
+ */
+struct tlv_stream_parser;
+
+/**
+ * @brief Create a streaming TLV parser.
+ *
+ * The nesting depth is limited to the libtlv_set_max_depth value at the time
+ * of creation.
+ *
+ * @param[in]  callbacks    The callbacks to fire.
+ * @param[in]  priv         First argument passed to the callbacks.
+ * @param[in]  buffer_size  Values up to this size are delivered in one
+ *                          piece, even if they span several chunks.
+ *
+ * @returns The new parser or NULL if out of memory.
+ */
+struct tlv_stream_parser *tlv_stream_parser_new(
+		const struct tlv_stream_callbacks *callbacks, void *priv,
+							   size_t buffer_size);
+
+/**
+ * @brief Feed the next chunk of input to a streaming TLV parser.
+ *
+ * Chunks may be of any size and may end anywhere, including in the middle of
+ * a tag or a length.
+ *
+ * @param[in]  parser  The parser.
+ * @param[in]  data    The next chunk of BER-TLV data.
+ * @param[in]  size    Size of the chunk in bytes.
+ *
+ * @returns TLV_RC_OK on success, other TLV_RC_* codes or the return value of a
+ *          callback on failure.  Once failed, the parser keeps returning the
+ *          same error.  tlv_stream_parser_get_offset tells where it failed.
+ */
+int tlv_stream_parser_feed(struct tlv_stream_parser *parser,
+					       const void *data, size_t size);
+
+/**
+ * @brief Signal the end of the input to a streaming TLV parser.
+ *
+ * @param[in]  parser  The parser.
+ *
+ * @returns TLV_RC_OK if the input ended after a complete TLV node,
+ *          TLV_RC_UNEXPECTED_END_OF_STREAM if a node was incomplete.
+ */
+int tlv_stream_parser_finish(struct tlv_stream_parser *parser);
+
+/**
+ * @brief Get the number of input bytes a streaming TLV parser consumed.
+ *
+ * @param[in]  parser  The parser.
+ *
+ * @returns The offset into the input stream.
+ */
+uint64_t tlv_stream_parser_get_offset(const struct tlv_stream_parser *parser);
+
+/**
+ * @brief Release a streaming TLV parser.
+ *
+ * @param[in]  parser  The parser to release.
+ */
+void tlv_stream_parser_free(struct tlv_stream_parser *parser);
+
 /**
  * @brief Encode a TLV data structure into a DER-TLV byte stream
  *
@@ -105,12 +512,196 @@ int tlv_shallow_parse(const void *buffer, size_t size, struct tlv **tlv);
  * buffers you would call tlv_encode twice: Once to determine the required size
  * of the buffer and a second time to actually encode the TLV data structure.
  *
+ * The encoded sizes of constructed nodes are cached in the tree and are only
+ * recomputed along the path from a modified node to the root, so encoding is
+ * linear in the size of the tree and the second call is cheap.
+ *
  * @return TLV_RC_OK on success. TLV_RC_BUFFER_OVERFLOW is buffer is too small.
  *         size will hold the required buffer size in this case. Other TLV_RC_*
  *         codes on failure.
  */
 int tlv_encode(const struct tlv *tlv, void *buffer, size_t *size);
 
+/**
+ * @brief Encode at most the first max bytes of a TLV data structure.
+ *
+ * Produces the same bytes as tlv_encode, but stops after @p max bytes.  Nodes
+ * behind those bytes are neither encoded nor sized, so this is cheap even if
+ * the complete encoding would be much longer than @p max.  A node that the
+ * first @p max bytes reach needs its complete content length, though, so its
+ * subtree is sized unless the sizes are still cached from an earlier call.
+ *
+ * @param[in]  tlv     The TLV data structure to encode.
+ * @param[out] buffer  The buffer to write the encoding to.
+ * @param[in]  max     Maximum number of bytes to write to @p buffer.
+ *
+ * @return The number of bytes written, i.e. the smaller of @p max and the
+ *         length of the complete encoding.
+ */
+size_t tlv_encode_prefix(const struct tlv *tlv, void *buffer, size_t max);
+
+/**
+ * @brief Encode a TLV data structure for scatter/gather output.
+ *
+ * Instead of copying the encoding into one contiguous buffer, tlv_encode_iov
+ * fills @p iov with pointers to its pieces, suitable for writev(2) or
+ * sendmsg(2).  Tags and lengths, as well as primitive values shorter than
+ * TLV_IOV_COPY_LIMIT bytes, are written to @p scratch.  Longer values are not
+ * copied at all, their iovecs point to the value storage of the nodes.
+ * Adjacent pieces are merged into a single iovec.
+ *
+ * The iovecs are only valid as long as @p scratch exists and the nodes are
+ * not modified.
+ *
+ * @param[in]    tlv           The TLV data structure to encode.
+ * @param[out]   iov           The iovecs to fill.  May be NULL.
+ * @param[inout] iovcnt        Input: Number of elements of @p iov. Output:
+ *                             Number of iovecs used.
+ * @param[out]   scratch       Buffer for headers and short values.  May be
+ *                             NULL.
+ * @param[inout] scratch_size  Input: Size of @p scratch. Output: Number of
+ *                             bytes used.
+ *
+ * @return TLV_RC_OK on success. TLV_RC_BUFFER_OVERFLOW if @p iov or
+ *         @p scratch is too small (or NULL).  @p iovcnt and @p scratch_size
+ *         will hold the required sizes in this case. Other TLV_RC_* codes on
+ *         failure.
+ */
+int tlv_encode_iov(const struct tlv *tlv, struct iovec *iov, int *iovcnt,
+					   void *scratch, size_t *scratch_size);
+
+/**
+ * @brief Encode a TLV data structure and keep the encoding up to date.
+ *
+ * Works like tlv_encode, but additionally binds @p tlv and its siblings to
+ * @p buffer.  Subsequent calls to tlv_set_value on any of the bound nodes
+ * patch the encoding in place:  A value of the same length is just copied
+ * over the old one, otherwise only the bytes behind the node are shifted and
+ * the length fields of its ancestors are rewritten.  Calling tlv_encode_bind
+ * again with the same arguments then costs nothing.
+ *
+ * Other changes, like inserting or removing nodes, or a new value that
+ * changes the size of the length field of an ancestor or does not fit into
+ * @p buffer any more, are not patched in.  The next call to tlv_encode_bind
+ * encodes the complete TLV data structure again.
+ *
+ * @p buffer must remain valid until the nodes are freed or unbound with
+ * tlv_encode_unbind.
+ *
+ * @param[in]    tlv     The TLV data structure to encode.
+ * @param[out]   buffer  The buffer to encode to and bind to.
+ * @param[inout] size    Input: Size of buffer, Output Length of byte stream.
+ *
+ * @return TLV_RC_OK on success. TLV_RC_BUFFER_OVERFLOW is buffer is too small.
+ *         size will hold the required buffer size in this case. Other TLV_RC_*
+ *         codes on failure.
+ */
+int tlv_encode_bind(struct tlv *tlv, void *buffer, size_t *size);
+
+/**
+ * @brief Stop updating the encoding of a TLV data structure.
+ *
+ * @param[in]  tlv  The TLV data structure previously passed to
+ *                  tlv_encode_bind.
+ */
+void tlv_encode_unbind(struct tlv *tlv);
+
+/**
+ * Writes BER-TLV encoded data front to back into a caller provided buffer,
+ * without building TLV nodes and without allocating memory.  A writer is
+ * usually kept on the stack.  Its members are private.
+ *
+ * One length octet is reserved for each constructed data object and patched
+ * once the data object ends.  Should the length need more octets, the
+ * content is moved up.  The encoding is the same tlv_encode produces.
+ *
+ * All functions return the first error that occurred since
+ * tlv_writer_init, so that it is sufficient to check the result of
+ * tlv_writer_finish.
+ */
+struct tlv_writer {
+	uint8_t		*buffer;
+	size_t		 size;
+	size_t		 offset;
+	unsigned int	 depth;
+	int		 rc;
+	size_t		 starts[TLV_WRITER_MAX_DEPTH];
+};
+
+/**
+ * @brief Start writing BER-TLV encoded data.
+ *
+ * @param[out] writer  The writer to initialize.
+ * @param[out] buffer  The buffer to write to.  May be NULL to learn the
+ *                     required size only.
+ * @param[in]  size    Size of the buffer.
+ */
+void tlv_writer_init(struct tlv_writer *writer, void *buffer, size_t size);
+
+/**
+ * @brief Start a constructed data object.
+ *
+ * The data objects written next make up its value, up to the matching
+ * tlv_writer_end.
+ *
+ * @param[in]  writer  The writer.
+ * @param[in]  tag     The tag of the data object.
+ *
+ * @return TLV_RC_OK on success.  TLV_RC_MAX_DEPTH_EXCEEDED if nested deeper
+ *         than TLV_WRITER_MAX_DEPTH.  Other TLV_RC_* codes on failure.
+ */
+int tlv_writer_begin_constructed(struct tlv_writer *writer, const void *tag);
+
+/**
+ * @brief Write a primitive data object.
+ *
+ * @param[in]  writer  The writer.
+ * @param[in]  tag     The tag of the data object.
+ * @param[in]  value   The value of the data object.
+ * @param[in]  length  The length of the value.
+ *
+ * @return TLV_RC_OK on success.  Other TLV_RC_* codes on failure.
+ */
+int tlv_writer_put_primitive(struct tlv_writer *writer, const void *tag,
+					     const void *value, size_t length);
+
+/**
+ * @brief Copy data that is BER-TLV encoded already, e.g. a data record.
+ *
+ * The data is copied as it is and not checked.
+ *
+ * @param[in]  writer  The writer.
+ * @param[in]  data    The BER-TLV encoded data.
+ * @param[in]  size    Size of the encoded data.
+ *
+ * @return TLV_RC_OK on success.  Other TLV_RC_* codes on failure.
+ */
+int tlv_writer_put_encoded(struct tlv_writer *writer, const void *data,
+								   size_t size);
+
+/**
+ * @brief End the constructed data object started last.
+ *
+ * @param[in]  writer  The writer.
+ *
+ * @return TLV_RC_OK on success.  TLV_RC_INVALID_ARG if there is no
+ *         constructed data object to end.  Other TLV_RC_* codes on failure.
+ */
+int tlv_writer_end(struct tlv_writer *writer);
+
+/**
+ * @brief Finish writing BER-TLV encoded data.
+ *
+ * @param[in]  writer  The writer.
+ * @param[out] size    The length of the encoded data, or the required size
+ *                     of the buffer if TLV_RC_BUFFER_OVERFLOW is returned.
+ *
+ * @return TLV_RC_OK on success.  TLV_RC_BUFFER_OVERFLOW if the buffer is too
+ *         small.  TLV_RC_INVALID_ARG if a constructed data object has not
+ *         been ended.  Other TLV_RC_* codes on failure.
+ */
+int tlv_writer_finish(struct tlv_writer *writer, size_t *size);
+
 /**
  * @brief Create a new TLV node.
  *
@@ -122,15 +713,46 @@ int tlv_encode(const struct tlv *tlv, void *buffer, size_t *size);
  */
 struct tlv *tlv_new(const void *tag, size_t length, const void *value);
 
+/**
+ * @brief Create a new, empty TLV node with room for a value.
+ *
+ * tlv_set_value copies values of up to @p capacity bytes into the node in
+ * place, i.e. the node is neither reallocated nor moved and pointers to it
+ * remain valid.  Use this for data objects that are updated several times.
+ *
+ * @param[in]  tag       The tag of the new TLV node.
+ * @param[in]  capacity  The number of bytes to reserve for the value.
+ *
+ * @return A pointer to the new TLV node if successful. NULL otherwise.
+ */
+struct tlv *tlv_new_reserve(const void *tag, size_t capacity);
+
 /**
  * @brief Create a deep copy of a TLV data structure.
  *
+ * Only the given node and its descendants are copied, its siblings are not.
+ * The copy owns all of its values, even if the original borrows them from a
+ * parse buffer.
+ *
  * @param[in]  tlv  The TLV data structure to create a deep copy from.
  *
  * @return A deep copy of the provided TLV data structure.
  */
 struct tlv *tlv_copy(const struct tlv *tlv);
 
+/**
+ * @brief Create a deep copy of a TLV data structure inside an arena.
+ *
+ * Like tlv_copy, but all nodes of the copy are carved out of @p arena and
+ * are released by tlv_arena_reset or tlv_arena_free.
+ *
+ * @param[in]  arena  The arena to allocate the nodes of the copy from.
+ * @param[in]  tlv    The TLV data structure to create a deep copy from.
+ *
+ * @return A deep copy of the provided TLV data structure, or NULL on failure.
+ */
+struct tlv *tlv_copy_arena(struct tlv_arena *arena, const struct tlv *tlv);
+
 /**
  * @brief Overwrite the identifier (aka tag) of a TLV node.
  *
@@ -150,6 +772,12 @@ struct tlv *tlv_set_identifier(struct tlv *tlv, const void *tag);
  *		The pointers in all the neighbor, child and parent nodes will be
  *		updated automatically in this case, though.
  *
+ * Values that fit into the capacity of the node (at least the size of the
+ * largest value it held so far, or what tlv_new_reserve reserved) are copied in
+ * place and the node stays where it is.  Larger values at least double the
+ * capacity.  Nodes returned by tlv_view_parse are always moved on their
+ * first update.
+ *
  * @note This function only works for primitive type TLV nodes. If called on a
  *	   constructed TLV node, this function will fail and return a NULL
  *	   pointer.
@@ -240,6 +868,24 @@ int tlv_encode_length(const struct tlv *tlv, void *buffer, size_t *size);
  */
 int tlv_encode_value(const struct tlv *tlv, void *buffer, size_t *size);
 
+/**
+ * @brief Returns a pointer to the value octets of the TLV node.
+ *
+ * Other than tlv_encode_value this function does not copy the value.  The
+ * returned pointer is valid until the TLV node is modified or freed, or in
+ * case of TLV data structures created by tlv_view_parse, until the parsed
+ * buffer is released.
+ *
+ * For constructed TLV nodes no value is returned (I.e. NULL is returned and
+ * the value of the size parameter will be set to zero).
+ *
+ * @param[in]  tlv   TLV node whose value shall be returned.
+ * @param[out] size  Size of the value.
+ *
+ * @return Pointer to the value of the TLV node.
+ */
+const void *tlv_view_value(const struct tlv *tlv, size_t *size);
+
 /**
  * @brief Returns whether a TLV node is constructed or primitive.
  *
@@ -301,6 +947,74 @@ struct tlv *tlv_get_prev(const struct tlv *tlv);
  */
 struct tlv *tlv_find(struct tlv *tlv, const void *tag);
 
+/**
+ * @brief Shallow search for a TLV node with a given tag key.
+ *
+ * Like tlv_find, but the tag is given as key, e.g. TLV_KEY(EMV_ID_PDOL).
+ *
+ * @param[in]  tlv  The list of TLV nodes to search.
+ * @param[in]  key  The key of the tag to search for.
+ *
+ * @returns The first occurence of a TLV node with the given tag or NULL if
+ *          there is none.
+ */
+struct tlv *tlv_find_key(struct tlv *tlv, tlv_key_t key);
+
+/**
+ * A data object found by tlv_extract or tlv_extract_buffer.
+ */
+struct tlv_slice {
+	/** Whether the data object was found.  Other fields are 0 if not.  */
+	bool		 present;
+	/** The TLV node.  Set by tlv_extract only.			      */
+	struct tlv	*tlv;
+	/** The encoded data object.  Set by tlv_extract_buffer only.	      */
+	const uint8_t	*data;
+	/** Size of the encoded data object, i.e. of tag, length and value.   */
+	size_t		 size;
+	/** The value.  NULL for TLV nodes with children.		      */
+	const uint8_t	*value;
+	/** Length of the value.					      */
+	size_t		 length;
+};
+
+/**
+ * @brief Shallow search for several TLV nodes at once.
+ *
+ * Like calling tlv_find_key for each key, but walks the list of TLV nodes
+ * only once and stops as soon as all keys have been found.
+ *
+ * @param[in]  tlv       The list of TLV nodes to search.
+ * @param[in]  keys      The keys of the tags to search for.
+ * @param[in]  num_keys  Number of keys.
+ * @param[out] slices    One slice per key, describing the first occurrence
+ *                       of a TLV node with that tag.
+ *
+ * @returns TLV_RC_OK on success, TLV_RC_INVALID_ARG otherwise.
+ */
+int tlv_extract(struct tlv *tlv, const tlv_key_t *keys, size_t num_keys,
+						      struct tlv_slice *slices);
+
+/**
+ * @brief Shallow search for several data objects in BER-TLV encoded data.
+ *
+ * Like tlv_extract, but works on the encoded data in a single pass without
+ * parsing it into TLV nodes.  Constructed data objects are skipped by their
+ * length, i.e. only the data objects on the top level are found.  Data after
+ * the last data object looked for is not checked.
+ *
+ * @param[in]  buffer    The BER-TLV encoded data.
+ * @param[in]  size      Length of the BER-TLV encoded data.
+ * @param[in]  keys      The keys of the tags to search for.
+ * @param[in]  num_keys  Number of keys.
+ * @param[out] slices    One slice per key, pointing into the encoded data.
+ *
+ * @returns TLV_RC_OK on success, other TLV_RC_* codes if the data is
+ *          malformed.
+ */
+int tlv_extract_buffer(const void *buffer, size_t size, const tlv_key_t *keys,
+				    size_t num_keys, struct tlv_slice *slices);
+
 /**
  * @brief Iterate through all TLV nodes in depth first order.
  *
@@ -323,6 +1037,96 @@ struct tlv *tlv_iterate(struct tlv *tlv);
  */
 struct tlv *tlv_deep_find(struct tlv *tlv, const void *tag);
 
+/**
+ * @brief Deep search for a TLV node with a given tag key.
+ *
+ * Like tlv_deep_find, but the tag is given as key.
+ *
+ * @param[in]  tlv  The list of TLV nodes to search.
+ * @param[in]  key  The key of the tag to search for.
+ *
+ * @returns The first occurence of a TLV node with the given tag or NULL if
+ *          there is none.
+ */
+struct tlv *tlv_deep_find_key(struct tlv *tlv, tlv_key_t key);
+
+/**
+ * @brief Get the key of the tag of a TLV node.
+ *
+ * @param[in]  tlv  The TLV node.
+ *
+ * @returns The key of the tag of the TLV node, or 0 if tlv is NULL.
+ */
+tlv_key_t tlv_get_key(const struct tlv *tlv);
+
+/**
+ * Hash table from tags to the TLV nodes of a TLV data structure.  Answers
+ * the same question as tlv_deep_find in constant time.  The index does not
+ * follow modifications of the TLV data structure, i.e. it has to be rebuilt
+ * after nodes have been inserted, removed or had their tags changed, and
+ * after tlv_set_value moved a node (see there).  The nodes returned by the
+ * lookup functions are only valid until the next such modification.
+ */
+struct tlv_index;
+
+/**
+ * @brief Build a hash index over all TLV nodes tlv_deep_find would visit.
+ *
+ * If the TLV data structure was parsed into an arena, the index is allocated
+ * from the same arena and released together with the tree.  Otherwise it is
+ * allocated in a single block of memory.  Either way tlv_index_free has to
+ * be called once the index is no longer needed.
+ *
+ * @param[in]  tlv    The TLV data structure to index.
+ * @param[out] index  The new index.
+ *
+ * @returns TLV_RC_OK on success, TLV_RC_OUT_OF_MEMORY if the index could not
+ *          be allocated.
+ */
+int tlv_index_build(struct tlv *tlv, struct tlv_index **index);
+
+/**
+ * @brief Release an index built by tlv_index_build.
+ *
+ * @param[in]  index  The index to release.
+ */
+void tlv_index_free(struct tlv_index *index);
+
+/**
+ * @brief Look up the first TLV node in depth first order with a given tag.
+ *
+ * @param[in]  index  The index to search.
+ * @param[in]  tag    The tag to search for.
+ *
+ * @returns The same TLV node tlv_deep_find would return, or NULL if there is
+ *          none.
+ */
+struct tlv *tlv_index_lookup(const struct tlv_index *index, const void *tag);
+
+/**
+ * @brief Look up the first TLV node in depth first order with a given key.
+ *
+ * @param[in]  index  The index to search.
+ * @param[in]  key    The key of the tag to search for, e.g. TLV_KEY("\x50").
+ *
+ * @returns The first TLV node with the given tag or NULL if there is none.
+ */
+struct tlv *tlv_index_lookup_key(const struct tlv_index *index, tlv_key_t key);
+
+/**
+ * @brief Look up all TLV nodes with a given key.
+ *
+ * @param[in]  index  The index to search.
+ * @param[in]  key    The key of the tag to search for.
+ * @param[out] tlv    Array receiving the TLV nodes in depth first order.
+ * @param[in]  size   Number of elements in tlv.
+ *
+ * @returns The number of TLV nodes with the given tag, which may be larger
+ *          than size.  Only the first size nodes are stored in this case.
+ */
+size_t tlv_index_lookup_all(const struct tlv_index *index, tlv_key_t key,
+						 struct tlv **tlv, size_t size);
+
 /**
  * @brief Get the number of ancestors a given TLV node has. I.e. the number of parent
  * nodes until the root node is found.
@@ -393,19 +1197,121 @@ void libtlv_get_dol_field(const void *tag, const void *in, size_t in_sz,
 
 size_t libtlv_get_tag_length(const void *tag);
 
+tlv_key_t libtlv_tag_to_key(const void *tag);
+
 const void *dol_tok(const void **dol, size_t *dol_sz);
 const void *dol_find_tag(const void *dol, size_t dol_sz, const void *tag);
 
+/**
+ * Precompiled Data Object List.  A plan holds the tag key, output offset and
+ * length of each DOL entry together with the padding and truncation rules
+ * for its format, so that filling a DOL needs neither parsing nor lookups of
+ * formats.  The formats are resolved when the plan is compiled, i.e. plans
+ * should be compiled after libtlv_register_fmts.
+ */
+struct dol_plan;
+
+/**
+ * Cache of DOL plans keyed by a hash of the DOL bytes.  Not thread-safe.
+ */
+struct dol_plan_cache;
+
+/**
+ * @brief Compile a Data Object List into a plan for dol_plan_fill.
+ *
+ * @param[in]  dol     The Data Object List.
+ * @param[in]  dol_sz  Size of the Data Object List in bytes.
+ * @param[out] plan    The compiled plan.  Free it with dol_plan_free.
+ *
+ * @returns TLV_RC_OK on success, TLV_RC_UNEXPECTED_END_OF_STREAM or
+ *          TLV_RC_TAG_NUMBER_TOO_LARGE if the DOL is malformed, other
+ *          TLV_RC_* codes on failure.
+ */
+int dol_compile(const void *dol, size_t dol_sz, struct dol_plan **plan);
+
+/**
+ * @brief Concatenate the values of data elements as described by a plan.
+ *
+ * Produces the same Data Element List as tlv_and_dol_to_del for the DOL the
+ * plan was compiled from, without allocating memory.
+ *
+ * @param[in]	 plan	 The plan compiled from the Data Object List.
+ * @param[in]	 tlv	 A TLV encoded list of data elements to fetch the values
+ *			   from.
+ * @param[out]	 del	 The concatenated value fields (Data Element List).
+ * @param[inout] del_sz	 On input: The size of the output buffer. On output:
+ *			   The length of the DEL in bytes, or the required size
+ *			   if TLV_RC_BUFFER_OVERFLOW is returned.
+ */
+int dol_plan_fill(const struct dol_plan *plan, struct tlv *tlv, void *del,
+							       size_t *del_sz);
+
+/**
+ * @brief Length in bytes of the Data Element Lists produced by a plan.
+ */
+size_t dol_plan_get_del_size(const struct dol_plan *plan);
+
+/**
+ * @brief Hash of the DOL bytes a plan was compiled from.
+ */
+uint64_t dol_plan_get_hash(const struct dol_plan *plan);
+
+void dol_plan_free(struct dol_plan *plan);
+
+struct dol_plan_cache *dol_plan_cache_new(void);
+
+/**
+ * @brief Look up the plan for a Data Object List, compiling it on a miss.
+ *
+ * @param[in]  cache   The cache of plans.
+ * @param[in]  dol     The Data Object List.
+ * @param[in]  dol_sz  Size of the Data Object List in bytes.
+ * @param[out] plan    The plan.  It is owned by the cache and remains valid
+ *		       until dol_plan_cache_free.
+ *
+ * @returns TLV_RC_OK on success, the return value of dol_compile otherwise.
+ */
+int dol_plan_cache_get(struct dol_plan_cache *cache, const void *dol,
+			       size_t dol_sz, const struct dol_plan **plan);
+
+void dol_plan_cache_free(struct dol_plan_cache *cache);
+
 /**
  * @brief Convert a BCD encoded value into a 64 bit wide unsigned integer.
+ *
+ * @returns TLV_RC_OK on success, TLV_RC_INVALID_ARG if a nibble is not a
+ *	      decimal digit or TLV_RC_VALUE_OUT_OF_RANGE if the value does not
+ *	      fit into 64 bits.
  */
 int libtlv_bcd_to_u64(const void *bcd, size_t len, uint64_t *u64);
 
 /**
  * @brief Convert a 64 bit wide unsigned integer into a BCD encoded value.
+ *
+ * @returns TLV_RC_OK on success or TLV_RC_VALUE_OUT_OF_RANGE if the value
+ *	      has more than 2 * @p len digits.  The low order digits are
+ *	      stored in that case.
  */
 int libtlv_u64_to_bcd(uint64_t u64, void *bcd, size_t len);
 
+/**
+ * @brief Convert a column of @p n BCD encoded values of @p len bytes each,
+ * stored back to back, into 64 bit wide unsigned integers.
+ *
+ * Conversion stops at the first invalid value, see libtlv_bcd_to_u64.  The
+ * integer of that value is set to 0.
+ */
+int libtlv_bcd_to_u64_n(const void *bcd, size_t len, uint64_t *u64, size_t n);
+
+/**
+ * @brief Convert @p n 64 bit wide unsigned integers into BCD encoded values
+ * of @p len bytes each, stored back to back.
+ *
+ * Conversion stops at the first value that does not fit, see
+ * libtlv_u64_to_bcd.
+ */
+int libtlv_u64_to_bcd_n(const uint64_t *u64, size_t n, void *bcd, size_t len);
+
 /**
  * @brief Format a binary string into a hexdecimal (ASCII coded) string.
  *
@@ -434,6 +1340,43 @@ char *libtlv_bin_to_hex(const void *bin, size_t bin_sz, char *hex);
  */
 void *libtlv_hex_to_bin(const char *hex, void *bin, size_t *bin_sz);
 
+/**
+ * @brief Decode a string of hexadecimal digits.
+ *
+ * The string must consist of an even number of hex digits [0-9A-Fa-f] and
+ * nothing else.  Use libtlv_hex_decode_text for input with separators.
+ *
+ * @param[in]    hex	  The hex digits to decode.
+ * @param[in]    hex_len  Number of characters in hex.
+ * @param[out]   bin	  Buffer receiving the decoded bytes.
+ * @param[inout] bin_sz	  Input: Size of bin. Output: Number of decoded bytes.
+ *
+ * @returns TLV_RC_OK on success, TLV_RC_INVALID_ARG if hex contains other
+ *          characters or an odd number of digits, TLV_RC_BUFFER_OVERFLOW if
+ *          bin is too small.  bin_sz holds the required size in this case.
+ */
+int libtlv_hex_decode(const char *hex, size_t hex_len, void *bin,
+							       size_t *bin_sz);
+
+/**
+ * @brief Decode hexadecimal digits embedded in free text.
+ *
+ * Characters other than hex digits are ignored.  A hash mark (#) starts a
+ * comment, which continues until the end of the line.  text_len / 2 bytes
+ * are always sufficient for bin.
+ *
+ * @param[in]    text	   The text to decode.
+ * @param[in]    text_len  Number of characters in text.
+ * @param[out]   bin	   Buffer receiving the decoded bytes.
+ * @param[inout] bin_sz	   Input: Size of bin. Output: Number of decoded bytes.
+ *
+ * @returns TLV_RC_OK on success, TLV_RC_INVALID_ARG if the text contains an
+ *          odd number of hex digits, TLV_RC_BUFFER_OVERFLOW if bin is too
+ *          small.
+ */
+int libtlv_hex_decode_text(const char *text, size_t text_len, void *bin,
+							       size_t *bin_sz);
+
 enum tlv_fmt {
 	fmt_a,
 	fmt_an,
@@ -453,10 +1396,229 @@ struct tlv_id_to_fmt {
 int libtlv_register_fmts(const struct tlv_id_to_fmt *fmts);
 void libtlv_free_fmts(void);
 
+/**
+ * @brief Freeze the registered tag formats into a constant time lookup table.
+ *
+ * Until the registry is frozen, libtlv_id_to_fmt performs a binary search
+ * under the registry's lock.  Afterwards, lookups use a hash table keyed by
+ * tlv_key_t that is read without locks.
+ * Further calls to libtlv_register_fmts or libtlv_fmts_freeze build a new
+ * table and atomically replace the current one, so formats may be
+ * registered while other threads look them up.  The replaced table is
+ * released as soon as the lookups that might still use it have returned,
+ * which the registering thread waits for.  At most two tables exist at any
+ * time.
+ *
+ * @returns TLV_RC_OK on success or TLV_RC_OUT_OF_MEMORY.
+ */
+int libtlv_fmts_freeze(void);
+
 enum tlv_fmt libtlv_id_to_fmt(const void *id);
 
+/**
+ * @brief Like libtlv_id_to_fmt, but for a tag given by its key.
+ */
+enum tlv_fmt libtlv_key_to_fmt(tlv_key_t key);
+
 void libtlv_init(const char *log4c_category);
 
+/**
+ * @brief Initialize libtlv and switch logging to asynchronous mode.
+ *
+ * Same as libtlv_init() followed by libtlv_log_async_start().
+ *
+ * @param[in]  log4c_category  Parent log4c category.
+ * @param[in]  ring_size       See libtlv_log_async_start().
+ *
+ * @returns TLV_RC_OK on success or an error code as described for
+ *	      libtlv_log_async_start().
+ */
+int libtlv_init_async(const char *log4c_category, size_t ring_size);
+
+/**
+ * @brief Start writing log messages of libtlv and libemv from a background
+ * thread.
+ *
+ * While active, log messages are formatted on the calling thread into a
+ * per-thread lock-free ring and handed to the log4c appenders by a background
+ * thread, so a slow appender no longer stalls the caller.  Messages are
+ * truncated to about 500 characters.  If a ring is full, the message is
+ * dropped and counted (see libtlv_log_get_dropped()); the number of dropped
+ * messages is also logged once space is available again.
+ *
+ * Calls nest: the background thread runs until libtlv_log_async_stop() has
+ * been called as often as this function.
+ *
+ * @param[in]  ring_size  Number of messages each logging thread may have
+ *			    outstanding.  Must be a power of two, or 0 to use the
+ *			    default of 256.
+ *
+ * @returns TLV_RC_OK on success, TLV_RC_INVALID_ARG if @p ring_size is not a
+ *	      power of two or TLV_RC_OUT_OF_MEMORY if the background thread
+ *	      could not be created.
+ */
+int libtlv_log_async_start(size_t ring_size);
+
+/**
+ * @brief Stop asynchronous logging.
+ *
+ * The last matching call joins the background thread after it has written
+ * all pending messages.  Other threads must not log concurrently with this
+ * last call.
+ */
+void libtlv_log_async_stop(void);
+
+/**
+ * @brief Get the number of log messages dropped because a log ring was full.
+ */
+uint64_t libtlv_log_get_dropped(void);
+
+/**
+ * @brief Set the maximum nesting depth of constructed TLV nodes accepted by
+ * the parser.
+ *
+ * Encodings which nest deeper are rejected with TLV_RC_MAX_DEPTH_EXCEEDED.
+ * The parser does not recurse, so neither long lists of siblings nor deep
+ * nesting consume call stack.
+ *
+ * @param[in]  max_depth  The maximum nesting depth. 0 restores the default of
+ *			    TLV_DEFAULT_MAX_DEPTH.
+ */
+void libtlv_set_max_depth(unsigned int max_depth);
+
+/**
+ * Independent instance of libtlv state: tag format registry, log category,
+ * parser limits, allocator and the outcome of the last parse.  Components
+ * which share a process but need different settings each use their own
+ * context with the _ctx variants of the parse and DOL functions.  The
+ * functions without a context argument use a process wide default context,
+ * which libtlv_init and libtlv_register_fmts configure.  Passing NULL as
+ * context also selects the default context.
+ *
+ * A context's format registry may be used from several threads as
+ * described for libtlv_fmts_freeze.  Parsing through a context records the
+ * outcome in the context, so each thread that parses should have its own.
+ */
+struct libtlv_ctx;
+
+/**
+ * @brief Create a libtlv context.
+ *
+ * @param[in]  log4c_category  Parent log4c category, see libtlv_init.  NULL
+ *				 logs to the category of the default context.
+ *
+ * @returns The new context or NULL if out of memory.
+ */
+struct libtlv_ctx *libtlv_ctx_new(const char *log4c_category);
+
+/**
+ * @brief Free a context and its format registry.  The default context is
+ * never freed.
+ */
+void libtlv_ctx_free(struct libtlv_ctx *ctx);
+
+/**
+ * @brief Get the default context used by the functions without a context
+ * argument.
+ */
+struct libtlv_ctx *libtlv_get_default_ctx(void);
+
+/**
+ * @brief Let the parse functions of a context allocate TLV nodes from an
+ * arena, see tlv_parse_arena.  NULL, the default, allocates from the heap.
+ */
+void libtlv_ctx_set_arena(struct libtlv_ctx *ctx, struct tlv_arena *arena);
+
+/**
+ * @brief Like libtlv_set_max_depth, for the parse functions of a context.
+ */
+void libtlv_ctx_set_max_depth(struct libtlv_ctx *ctx, unsigned int max_depth);
+
+/**
+ * @brief Get the outcome of the last parse through a context.
+ *
+ * The default context, which NULL stands for, is shared by all threads and
+ * records no outcome; libtlv_ctx_get_error on it always returns TLV_RC_OK.
+ * Use the *_r parse functions to learn why a parse without a context of its
+ * own failed.
+ *
+ * @param[in]  ctx     The context.
+ * @param[out] offset  If not NULL, the offset into the encoded data at which
+ *			 parsing failed.
+ *
+ * @returns The TLV_RC_* code the last parse returned.
+ */
+int libtlv_ctx_get_error(const struct libtlv_ctx *ctx, size_t *offset);
+
+/**
+ * @brief Like tlv_parse, using the limits and allocator of a context.
+ */
+int tlv_parse_ctx(struct libtlv_ctx *ctx, const void *buffer, size_t size,
+							      struct tlv **tlv);
+
+/**
+ * @brief Like tlv_shallow_parse, using the limits and allocator of a
+ * context.
+ */
+int tlv_shallow_parse_ctx(struct libtlv_ctx *ctx, const void *buffer,
+						 size_t size, struct tlv **tlv);
+
+/**
+ * @brief Like tlv_view_parse, using the limits and allocator of a context.
+ */
+int tlv_view_parse_ctx(struct libtlv_ctx *ctx, const void *buffer,
+						 size_t size, struct tlv **tlv);
+
+/**
+ * @brief Like tlv_lazy_parse, using the limits and allocator of a context.
+ *
+ * The nodes are expanded later on through the same context, with its limits
+ * and log category.  A value that turns out to be malformed when its node
+ * is expanded is recorded as the context's last parse outcome, see
+ * libtlv_ctx_get_error.  Hence the context must outlive the TLV data
+ * structure and, like for parsing, should only be used by one thread.
+ */
+int tlv_lazy_parse_ctx(struct libtlv_ctx *ctx, const void *buffer,
+						 size_t size, struct tlv **tlv);
+
+/**
+ * @brief Like tlv_and_dol_to_del, using the tag formats of a context.
+ */
+int tlv_and_dol_to_del_ctx(struct libtlv_ctx *ctx, struct tlv *tlv,
+		      const void *dol, size_t dol_sz, void *del, size_t *del_sz);
+
+/**
+ * @brief Like dol_and_del_to_tlv, allocating the TLV nodes with the
+ * allocator of a context.
+ */
+int dol_and_del_to_tlv_ctx(struct libtlv_ctx *ctx, const void *dol,
+		size_t dol_sz, const void *del, size_t del_sz, struct tlv **tlv);
+
+/**
+ * @brief Like libtlv_get_dol_field, using the tag formats of a context.
+ */
+void libtlv_get_dol_field_ctx(struct libtlv_ctx *ctx, const void *tag,
+		      const void *in, size_t in_sz, void *out, size_t out_sz);
+
+/**
+ * @brief Like dol_compile, using the tag formats of a context.
+ */
+int dol_compile_ctx(struct libtlv_ctx *ctx, const void *dol, size_t dol_sz,
+							struct dol_plan **plan);
+
+/**
+ * @brief Like dol_plan_cache_new, for a cache whose plans use the tag formats
+ * of a context.  The context must outlive the cache.
+ */
+struct dol_plan_cache *dol_plan_cache_new_ctx(struct libtlv_ctx *ctx);
+
+int libtlv_register_fmts_ctx(struct libtlv_ctx *ctx,
+					      const struct tlv_id_to_fmt *fmts);
+void libtlv_free_fmts_ctx(struct libtlv_ctx *ctx);
+int libtlv_fmts_freeze_ctx(struct libtlv_ctx *ctx);
+enum tlv_fmt libtlv_id_to_fmt_ctx(struct libtlv_ctx *ctx, const void *id);
+enum tlv_fmt libtlv_key_to_fmt_ctx(struct libtlv_ctx *ctx, tlv_key_t key);
+
 /**
  * @}
  */
@@ -22,6 +22,7 @@
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(*(x)))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 #define TLV_TAG_CLASS_MASK  0xC0u
 #define TLV_TAG_P_C_MASK    0x20u
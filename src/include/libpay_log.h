@@ -0,0 +1,51 @@
+/*
+ * LibPAY - The Toolkit for Smart Payment Applications
+ *
+ * Copyright (C) 2015, 2016  Michael Jung <mijung@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef __LIBPAY_LOG_H__
+#define __LIBPAY_LOG_H__
+
+#include <log4c.h>
+
+/* Least severe priority that is compiled in at all.  Configuring with
+ * --disable-trace lowers it to LOG4C_PRIORITY_INFO, which removes all TRACE
+ * and DEBUG messages together with the evaluation of their arguments.       */
+#ifndef LIBPAY_LOG_MAX_PRIORITY
+#define LIBPAY_LOG_MAX_PRIORITY LOG4C_PRIORITY_TRACE
+#endif
+
+/* Whether a message of priority 'prio' to category 'cat' would be logged.
+ * Use it to guard work that only serves a log message, e.g. hex dumps.      */
+#define LIBPAY_LOG_ENABLED(cat, prio)					      \
+	(((prio) <= LIBPAY_LOG_MAX_PRIORITY) &&				      \
+	 log4c_category_is_priority_enabled((cat), (prio)))
+
+/* Like log4c_category_log, but the arguments are only evaluated if the
+ * message is actually logged.  While asynchronous logging is active (see
+ * libtlv_log_async_start), the message is only formatted on the calling
+ * thread and written to the log4c appenders by a background thread.	      */
+#define LIBPAY_LOG(cat, prio, ...)					      \
+	do {								      \
+		if (LIBPAY_LOG_ENABLED((cat), (prio)))			      \
+			libtlv_log((cat), (prio), __VA_ARGS__);		      \
+	} while (0)
+
+void libtlv_log(const log4c_category_t *cat, int prio, const char *fmt, ...)
+				__attribute__((format(printf, 3, 4)));
+
+#endif						     /* ndef __LIBPAY_LOG_H__ */
@@ -24,6 +24,7 @@
 #include <time.h>
 #include <log4c.h>
 
+#include <libpay_log.h>
 #include <libpay/emv.h>
 #include <libpay/tlv.h>
 
@@ -130,10 +131,15 @@ struct emv_ep {
 
 	/* Entry point configuration */
 	log4c_category_t		 *log_cat;
+	bool				  log_async;
 	struct emv_hal			 *hal;
 	struct emv_autorun		  autorun;
 	struct emv_ep_combination_set	  combination_set[num_txn_types];
 	struct emv_ep_reg_kernel_set	  reg_kernel_set;
+
+	/* Compiled paths into the FCI of PPSE and application selection.   */
+	struct tlv_path			 *ppse_dir_entry_path;
+	struct tlv_path			 *fci_pdol_path;
 };
 
 int emv_ep_register_kernel(struct emv_ep *ep, struct emv_kernel *kernel,
@@ -167,11 +173,11 @@ done:
 	}
 
 	if (rc == EMV_RC_OK)
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 						  "%s('%s'): success", __func__,
 			      libtlv_bin_to_hex(kernel_id, kernel_id_len, hex));
 	else
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_WARN,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_WARN,
 					   "%s('%s'): failed. rc %d.", __func__,
 			  libtlv_bin_to_hex(kernel_id, kernel_id_len, hex), rc);
 
@@ -198,11 +204,11 @@ static struct emv_kernel *get_kernel(struct emv_ep *ep,
 		memcpy(app_ver_num,
 			       ep->reg_kernel_set.kernel[i_krn].app_ver_num, 2);
 
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 						  "%s('%s'): success", __func__,
 					libtlv_bin_to_hex(kernel_id, len, hex));
 	} else {
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE,
 						   "%s('%s'): failed", __func__,
 					libtlv_bin_to_hex(kernel_id, len, hex));
 	}
@@ -244,21 +250,6 @@ static enum emv_txn_type get_emv_txn_type(uint8_t txn_type)
 	}
 }
 
-static uint64_t bcd_to_u64(const uint8_t *bcd, size_t len)
-{
-	uint64_t u64 = 0;
-	unsigned i = 0;
-
-	for (i = 0, u64 = 0; i < len; i++) {
-		u64 *= 10;
-		u64 += (bcd[i] >> 4);
-		u64 *= 10;
-		u64 += bcd[i] & 0xfu;
-	}
-
-	return u64;
-}
-
 static const char *combination_string(struct emv_ep_combination *combination)
 {
 	static char str[256];
@@ -287,7 +278,7 @@ int emv_ep_preprocessing(struct emv_ep *ep)
 	int rc = EMV_RC_OK;
 	int i = 0;
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
+	LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
 								      __func__);
 
 	assert(ep->parms.txn->type < num_txn_types);
@@ -308,7 +299,7 @@ int emv_ep_preprocessing(struct emv_ep *ep)
 		indicators  = &combination->indicators;
 
 
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 				"%s(): Combination %d/%d: %s", __func__, i + 1,
 						     (int)combination_set->size,
 					       combination_string(combination));
@@ -352,7 +343,7 @@ int emv_ep_preprocessing(struct emv_ep *ep)
 
 			indicators->status_check_requested = true;
 
-			log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+			LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 				"%s(): Status Check Requested for %s", __func__,
 					       combination_string(combination));
 		}
@@ -523,10 +514,10 @@ int emv_ep_preprocessing(struct emv_ep *ep)
 
 done:
 	if (rc == EMV_RC_OK)
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 						     "%s(): success", __func__);
 	else
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_WARN,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_WARN,
 					  "%s(): failed. rc %d.", __func__, rc);
 	return rc;
 }
@@ -536,7 +527,7 @@ int emv_ep_protocol_activation(struct emv_ep *ep)
 	bool collision = false;
 	int rc = EMV_RC_OK;
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
+	LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
 								      __func__);
 
 	REQUIREMENT(EMV_CTLS_BOOK_B_V2_5, "3.2.1.1");
@@ -646,10 +637,10 @@ int emv_ep_protocol_activation(struct emv_ep *ep)
 
 done:
 	if (rc == EMV_RC_OK)
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 						     "%s(): success", __func__);
 	else
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_WARN,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_WARN,
 					  "%s(): failed. rc %d.", __func__, rc);
 	return rc;
 }
@@ -740,143 +731,186 @@ struct ppse_dir_entry {
 	size_t	extended_selection_len;
 };
 
-static int emv_ep_parse_ppse(struct emv_ep *ep, const void *fci, size_t fci_len,
-			    struct ppse_dir_entry *entries, size_t *num_entries)
+/* The first occurrence of a data object in a directory entry.	      */
+struct ppse_field {
+	const uint8_t *value;
+	size_t	       length;
+	bool	       present;
+};
+
+struct ppse_entry_fields {
+	struct ppse_field adf_name;
+	struct ppse_field label;
+	struct ppse_field kernel_id;
+	struct ppse_field ext_sel;
+	struct ppse_field prio;
+};
+
+struct ppse_scan {
+	struct emv_ep	      *ep;
+	struct ppse_dir_entry *entries;
+	size_t		       num_entries;
+	size_t		       max_entries;
+	bool		       overflow;
+};
+
+static int ppse_entry_field(void *priv, const struct tlv_record *record)
 {
-	struct tlv *ppse = NULL, *i_tlv = NULL;
-	size_t num = 0;
-	int rc = EMV_RC_OK;
-	char hex[2 * fci_len + 1];
+	struct ppse_entry_fields *fields = (struct ppse_entry_fields *)priv;
+	struct ppse_field *field = NULL;
+
+	if (record->depth)
+		return TLV_RC_OK;
+
+	if (record->key == TLV_KEY(EMV_ID_ADF_NAME))
+		field = &fields->adf_name;
+	else if (record->key == TLV_KEY(EMV_ID_APPLICATION_LABEL))
+		field = &fields->label;
+	else if (record->key == TLV_KEY(EMV_ID_KERNEL_IDENTIFIER))
+		field = &fields->kernel_id;
+	else if (record->key == TLV_KEY(EMV_ID_EXTENDED_SELECTION))
+		field = &fields->ext_sel;
+	else if (record->key ==
+			      TLV_KEY(EMV_ID_APPLICATION_PRIORITY_INDICATOR))
+		field = &fields->prio;
+
+	if (field && !field->present) {
+		field->value = record->value;
+		field->length = record->length;
+		field->present = true;
+	}
 
-	assert(fci);
-	assert(entries);
-	assert(num_entries);
+	return TLV_RC_OK;
+}
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(fci: '%s')",
-				__func__, libtlv_bin_to_hex(fci, fci_len, hex));
+static bool ppse_field_copy(const struct ppse_field *field, void *buffer,
+						  size_t size, size_t *length)
+{
+	if (field->length > size)
+		return false;
 
-	rc = tlv_parse(fci, fci_len, &ppse);
-	if (rc != TLV_RC_OK) {
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_NOTICE,
-			      "%s(): Failed to parse 2PAY.SYS. rc %d", __func__,
-									    rc);
-		rc = EMV_RC_CARD_PROTOCOL_ERROR;
-		goto done;
+	memcpy(buffer, field->value, field->length);
+	*length = field->length;
+
+	return true;
+}
+
+static int ppse_dir_entry_found(void *priv, const struct tlv_record *record)
+{
+	struct ppse_scan *scan = (struct ppse_scan *)priv;
+	struct emv_ep *ep = scan->ep;
+	struct ppse_entry_fields fields;
+	struct ppse_dir_entry *dir_entry;
+	size_t len = 0;
+	int rc = TLV_RC_OK;
+
+	if (scan->num_entries == scan->max_entries) {
+		scan->overflow = true;
+		return TLV_RC_BUFFER_OVERFLOW;
+	}
+
+	memset(&fields, 0, sizeof(fields));
+	rc = tlv_scan(record->value, record->length, NULL, ppse_entry_field,
+							       &fields, NULL);
+	if (rc != TLV_RC_OK)
+		return rc;
+
+	dir_entry = &scan->entries[scan->num_entries];
+	memset(dir_entry, 0, sizeof(*dir_entry));
+
+	if (fields.adf_name.present &&
+	    (!ppse_field_copy(&fields.adf_name, dir_entry->adf_name,
+		   sizeof(dir_entry->adf_name), &dir_entry->adf_name_len) ||
+	     (dir_entry->adf_name_len < 5))) {
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
+				"entry with malformed ADF ignored!", __func__);
+		return TLV_RC_OK;
 	}
 
-	i_tlv = tlv_find(tlv_get_child(tlv_find(tlv_get_child(tlv_find(
-			     tlv_get_child(tlv_find(ppse, EMV_ID_FCI_TEMPLATE)),
-					      EMV_ID_FCI_PROPRIETARY_TEMPLATE)),
-					 EMV_ID_FCI_ISSUER_DISCRETIONARY_DATA)),
-							EMV_ID_DIRECTORY_ENTRY);
-
-	for (num = 0;
-	     i_tlv && (num < *num_entries);
-	     i_tlv = tlv_find(tlv_get_next(i_tlv), EMV_ID_DIRECTORY_ENTRY)) {
-		struct tlv *adf_name, *label, *prio, *kernel_id, *ext_sel;
-		struct tlv *entry;
-		struct ppse_dir_entry *dir_entry;
-		int rc = TLV_RC_OK;
-
-		entry	  = tlv_get_child(i_tlv);
-		adf_name  = tlv_find(entry, EMV_ID_ADF_NAME);
-		label	  = tlv_find(entry, EMV_ID_APPLICATION_LABEL);
-		kernel_id = tlv_find(entry, EMV_ID_KERNEL_IDENTIFIER);
-		ext_sel	  = tlv_find(entry, EMV_ID_EXTENDED_SELECTION);
-		prio      = tlv_find(entry,
-					 EMV_ID_APPLICATION_PRIORITY_INDICATOR);
-
-		dir_entry = &entries[num];
-		memset(dir_entry, 0, sizeof(*dir_entry));
-
-		if (adf_name) {
-			dir_entry->adf_name_len = sizeof(dir_entry->adf_name);
-			rc = tlv_encode_value(adf_name, dir_entry->adf_name,
-						      &dir_entry->adf_name_len);
-			if ((rc != TLV_RC_OK) ||
-			    (dir_entry->adf_name_len < 5) ||
-			    (dir_entry->adf_name_len > 16)) {
-				log4c_category_log(ep->log_cat,
-					    LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
-					    "entry with malformed ADF ignored!",
+	if (fields.label.present &&
+	    !ppse_field_copy(&fields.label, dir_entry->application_label,
+				       sizeof(dir_entry->application_label),
+					   &dir_entry->application_label_len)) {
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
+				     "entry with malformed label ignored!",
 								      __func__);
-				continue;
-			}
-		}
+		return TLV_RC_OK;
+	}
 
-		if (label) {
-			dir_entry->application_label_len =
-					   sizeof(dir_entry->application_label);
-			rc = tlv_encode_value(label,
-						   dir_entry->application_label,
-					     &dir_entry->application_label_len);
-			if (rc != TLV_RC_OK) {
-				log4c_category_log(ep->log_cat,
-					    LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
-					  "entry with malformed label ignored!",
+	if (fields.kernel_id.present &&
+	    !ppse_field_copy(&fields.kernel_id, dir_entry->kernel_identifier,
+				       sizeof(dir_entry->kernel_identifier),
+					   &dir_entry->kernel_identifier_len)) {
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
+				 "entry with malformed Kernel-ID ignored!",
 								      __func__);
-				continue;
-			}
-		}
+		return TLV_RC_OK;
+	}
 
-		if (kernel_id) {
-			dir_entry->kernel_identifier_len =
-					   sizeof(dir_entry->kernel_identifier);
-			rc = tlv_encode_value(kernel_id,
-						   dir_entry->kernel_identifier,
-					     &dir_entry->kernel_identifier_len);
-			if (rc != TLV_RC_OK) {
-				log4c_category_log(ep->log_cat,
-					    LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
-					       "entry with malformed Kernel-ID "
-							  "ignored!", __func__);
-				continue;
-			}
-		}
+	if (fields.ext_sel.present &&
+	    !ppse_field_copy(&fields.ext_sel, dir_entry->extended_selection,
+				      sizeof(dir_entry->extended_selection),
+					  &dir_entry->extended_selection_len)) {
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
+			"entry with malformed extended selection ignored!",
+								      __func__);
+		return TLV_RC_OK;
+	}
 
-		if (ext_sel) {
-			dir_entry->extended_selection_len =
-					  sizeof(dir_entry->extended_selection);
-			rc = tlv_encode_value(ext_sel,
-						  dir_entry->extended_selection,
-					    &dir_entry->extended_selection_len);
-			if (rc != TLV_RC_OK) {
-				log4c_category_log(ep->log_cat,
-					    LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
-						"entry with malformed extended "
-						"selection ignored!", __func__);
-				continue;
-			}
-		}
+	if (fields.prio.present &&
+	    !ppse_field_copy(&fields.prio,
+				   &dir_entry->application_priority_indicator,
+								   1, &len)) {
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
+				       "entry with malformed API ignored!",
+								      __func__);
+		return TLV_RC_OK;
+	}
 
-		if (prio) {
-			size_t len = 1;
+	scan->num_entries++;
 
-			rc = tlv_encode_value(prio,
-				     &dir_entry->application_priority_indicator,
-									  &len);
-			if (rc != TLV_RC_OK) {
-				log4c_category_log(ep->log_cat,
-					    LOG4C_PRIORITY_NOTICE, "%s(): PPSE "
-					    "entry with malformed API ignored!",
-								      __func__);
-				continue;
-			}
-		}
+	return TLV_RC_OK;
+}
+
+/* The directory entries are picked out of the encoded FCI in a single pass,
+ * without building a TLV tree.					      */
+static int emv_ep_parse_ppse(struct emv_ep *ep, const void *fci, size_t fci_len,
+			    struct ppse_dir_entry *entries, size_t *num_entries)
+{
+	struct ppse_scan scan;
+	int rc = EMV_RC_OK;
+
+	assert(fci);
+	assert(entries);
+	assert(num_entries);
 
-		num++;
+	if (LIBPAY_LOG_ENABLED(ep->log_cat, LOG4C_PRIORITY_TRACE)) {
+		char hex[2 * fci_len + 1];
+
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(fci: '%s')",
+				__func__, libtlv_bin_to_hex(fci, fci_len, hex));
 	}
 
-	if (ppse)
-		tlv_free(ppse);
+	memset(&scan, 0, sizeof(scan));
+	scan.ep = ep;
+	scan.entries = entries;
+	scan.max_entries = *num_entries;
 
-	if ((num == *num_entries) && (i_tlv))
+	rc = tlv_path_eval(ep->ppse_dir_entry_path, fci, fci_len,
+					       ppse_dir_entry_found, &scan);
+	if (scan.overflow)
 		return EMV_RC_OVERFLOW;
 
-	*num_entries = num;
+	if (rc != TLV_RC_OK) {
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE,
+			      "%s(): Failed to parse 2PAY.SYS. rc %d", __func__,
+									    rc);
+		return EMV_RC_CARD_PROTOCOL_ERROR;
+	}
 
-done:
-	return rc;
+	*num_entries = scan.num_entries;
+
+	return EMV_RC_OK;
 }
 
 static uint8_t rid_to_kernel_id(const void *rid)
@@ -1036,7 +1070,7 @@ static int compare_candidates(const void *candidate_a, const void *candidate_b)
 		result = -1;
 	}
 
-	log4c_category_log(a->ep->log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(a->ep->log_cat, LOG4C_PRIORITY_TRACE,
 		       "%s({ api: %d, order: %d }, { api: %d, order: %d }): %d",
 			  __func__, a->application_priority_indicator, a->order,
 			   b->application_priority_indicator, b->order, result);
@@ -1110,7 +1144,7 @@ int emv_ep_combination_selection(struct emv_ep *ep)
 	uint8_t sw[2];
 	int rc = EMV_RC_OK, i_comb, i_dir;
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
+	LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
 								      __func__);
 
 	combination_set = &ep->combination_set[ep->parms.txn->type];
@@ -1170,7 +1204,7 @@ int emv_ep_combination_selection(struct emv_ep *ep)
 	 * Otherwise, Entry Point shall add no Combinations to the Candidate
 	 * List and shall proceed to Step 3.				      */
 	if ((sw[0] != 0x90) || (sw[1] != 0x00)) {
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE,
 				 "%s(): Select 2PAY.SYS sw: %02x%02x", __func__,
 								  sw[0], sw[1]);
 		ep->state = eps_combination_selection_step3;
@@ -1190,14 +1224,14 @@ int emv_ep_combination_selection(struct emv_ep *ep)
 	rc = emv_ep_parse_ppse(ep, fci, fci_len, dir_entry, &num_dir_entries);
 
 	if (rc != EMV_RC_OK) {
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE,
 				    "%s(): Failed to parse 2PAY.SYS", __func__);
 		ep->state = eps_combination_selection_step3;
 		goto done;
 	}
 
 	if (!num_dir_entries) {
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE,
 				"%s(): No entries in 2PAY.SYS found", __func__);
 		ep->state = eps_combination_selection_step3;
 		goto done;
@@ -1225,7 +1259,7 @@ int emv_ep_combination_selection(struct emv_ep *ep)
 		goto done;
 	}
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 		       "%s(): Combinations: %d, 2PAY.SYS entries: %d", __func__,
 			      (int)combination_set->size, (int)num_dir_entries);
 
@@ -1279,20 +1313,25 @@ int emv_ep_combination_selection(struct emv_ep *ep)
 
 done:
 	if (rc == EMV_RC_OK)
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 				       "%s(): success. Number of candiates: %d",
 					__func__, (int)ep->candidate_list.size);
 	else
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_WARN,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_WARN,
 					  "%s(): failed. rc %d.", __func__, rc);
 	return rc;
 }
 
+static int fci_pdol_found(void *priv, const struct tlv_record *record)
+{
+	*(struct tlv_record *)priv = *record;
+
+	return TLV_RC_OK;
+}
+
 static int visa_legacy_kernel_processing(struct emv_ep *ep)
 {
-	struct tlv *tlv_fci = NULL, *tlv_pdol = NULL;
-	uint8_t pdol[256];
-	size_t pdol_sz = sizeof(pdol);
+	struct tlv_record pdol;
 	int tlv_rc = TLV_RC_OK;
 	int rc = EMV_RC_OK;
 
@@ -1313,40 +1352,28 @@ static int visa_legacy_kernel_processing(struct emv_ep *ep)
 	    (ep->parms.kernel_id_len != 1) || (ep->parms.kernel_id[0] != 0x03))
 		goto done;
 
-	tlv_rc = tlv_parse(ep->parms.fci, ep->parms.fci_len, &tlv_fci);
+	memset(&pdol, 0, sizeof(pdol));
+	tlv_rc = tlv_path_eval(ep->fci_pdol_path, ep->parms.fci,
+				      ep->parms.fci_len, fci_pdol_found, &pdol);
 	if (tlv_rc != TLV_RC_OK) {
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE,
 			 "%s(): Failed to parse FCI. rc: %d", __func__, tlv_rc);
 		rc = EMV_RC_CARD_PROTOCOL_ERROR;
 		goto done;
 	}
 
-	tlv_pdol = tlv_find(tlv_get_child(tlv_find(tlv_get_child(tlv_find(
-						 tlv_fci, EMV_ID_FCI_TEMPLATE)),
-				EMV_ID_FCI_PROPRIETARY_TEMPLATE)), EMV_ID_PDOL);
-	if (!tlv_pdol) {
+	if (!pdol.length) {
 		ep->parms.kernel_id[0] = 0x01;
 		goto done;
 	}
 
-	tlv_rc = tlv_encode_value(tlv_pdol, pdol, &pdol_sz);
-	if (tlv_rc != TLV_RC_OK) {
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_NOTICE,
-				       "%s(): Failed to get PDOL value. rc: %d",
-							      __func__, tlv_rc);
-		rc = EMV_RC_CARD_PROTOCOL_ERROR;
-		goto done;
-	}
-
-	if (!dol_find_tag(pdol, pdol_sz,
+	if (!dol_find_tag(pdol.value, pdol.length,
 				      EMV_ID_TERMINAL_TRANSACTION_QUALIFIERS)) {
 		ep->parms.kernel_id[0] = 0x01;
 		goto done;
 	}
 
 done:
-	if (tlv_fci)
-		tlv_free(tlv_fci);
 	return rc;
 }
 
@@ -1421,7 +1448,7 @@ int emv_ep_final_combination_selection(struct emv_ep *ep)
 		ep->parms.aid_len += candidate->extended_selection_len;
 	}
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 				       "%s(): Selecting Candidate %s", __func__,
 				    combination_string(candidate->combination));
 
@@ -1521,15 +1548,30 @@ static void get_time_and_date(uint8_t txn_time[3], uint8_t txn_date[3])
 	libtlv_u64_to_bcd(tm_local.tm_mday,	  &txn_date[2], 1);
 }
 
+/* Kernels expect the data objects of the selected Combination right after the
+ * first object of the configured Terminal Data.  Find the end of that first
+ * object while checking the rest of the encoding.			      */
+static int terminal_data_split(void *priv, const struct tlv_record *record)
+{
+	const uint8_t **split = (const uint8_t **)priv;
+
+	if (!record->depth && !*split)
+		*split = record->value + record->length;
+
+	return TLV_RC_OK;
+}
+
 int emv_ep_kernel_activation(struct emv_ep *ep)
 {
 	uint8_t term_data[2048], app_ver_num[2], txn_seq_ctr[4];
 	uint8_t txn_date[3], txn_time[3];
+	const uint8_t *split = NULL;
 	struct emv_kernel *kernel = NULL;
-	struct tlv *terminal_data = NULL;
+	struct tlv_writer writer;
+	size_t head = 0;
 	int rc = EMV_RC_OK;
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
+	LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
 								      __func__);
 
 	REQUIREMENT(EMV_CTLS_BOOK_B_V2_5, "3.4.1.1");
@@ -1542,53 +1584,58 @@ int emv_ep_kernel_activation(struct emv_ep *ep)
 		goto done;
 	}
 
-	rc = tlv_parse(ep->terminal_data, ep->terminal_data_len,
-								&terminal_data);
+	rc = tlv_scan(ep->terminal_data, ep->terminal_data_len, NULL,
+					terminal_data_split, &split, NULL);
 	if (rc != TLV_RC_OK)
 		goto done;
 
-	get_time_and_date(txn_time, txn_date);
+	if (split)
+		head = split - ep->terminal_data;
 
-	tlv_insert_after(terminal_data,
-		  tlv_new(EMV_ID_TRANSACTION_TIME, sizeof(txn_time), txn_time));
+	tlv_writer_init(&writer, term_data, sizeof(term_data));
+	tlv_writer_put_encoded(&writer, ep->terminal_data, head);
 
-	tlv_insert_after(terminal_data,
-		  tlv_new(EMV_ID_TRANSACTION_DATE, sizeof(txn_date), txn_date));
+	tlv_writer_put_primitive(&writer,
+				 EMV_ID_APPLICATION_IDENTIFIER_TERMINAL,
+					     ep->parms.aid, ep->parms.aid_len);
+	tlv_writer_put_primitive(&writer,
+				 EMV_ID_APPLICATION_VERSION_NUMBER_TERM,
+					     app_ver_num, sizeof(app_ver_num));
+
+	rc = libtlv_u64_to_bcd(ep->txn_seq_ctr, txn_seq_ctr,
+							   sizeof(txn_seq_ctr));
+	if (rc != TLV_RC_OK)
+		goto done;
+
+	tlv_writer_put_primitive(&writer, EMV_ID_TRANSACTION_SEQUENCE_COUNTER,
+					     txn_seq_ctr, sizeof(txn_seq_ctr));
 
 	if (ep->hal->ops->get_interface_device_serial_number) {
 		char ifd_sn[8];
 
 		ep->hal->ops->get_interface_device_serial_number(ep->hal,
 									ifd_sn);
-		tlv_insert_after(terminal_data, tlv_new(
-			  EMV_ID_INTERFACE_DEVICE_SERIAL_NUMBER, sizeof(ifd_sn),
-								       ifd_sn));
+		tlv_writer_put_primitive(&writer,
+				   EMV_ID_INTERFACE_DEVICE_SERIAL_NUMBER,
+						       ifd_sn, sizeof(ifd_sn));
 	}
 
-	rc = libtlv_u64_to_bcd(ep->txn_seq_ctr, txn_seq_ctr,
-							   sizeof(txn_seq_ctr));
-	if (rc != TLV_RC_OK)
-		goto done;
+	get_time_and_date(txn_time, txn_date);
+
+	tlv_writer_put_primitive(&writer, EMV_ID_TRANSACTION_DATE, txn_date,
+							     sizeof(txn_date));
+	tlv_writer_put_primitive(&writer, EMV_ID_TRANSACTION_TIME, txn_time,
+							     sizeof(txn_time));
+
+	tlv_writer_put_encoded(&writer, ep->terminal_data + head,
+						 ep->terminal_data_len - head);
 
-	tlv_insert_after(terminal_data,
-				    tlv_new(EMV_ID_TRANSACTION_SEQUENCE_COUNTER,
-					     sizeof(txn_seq_ctr), txn_seq_ctr));
-	tlv_insert_after(terminal_data,
-				 tlv_new(EMV_ID_APPLICATION_VERSION_NUMBER_TERM,
-					     sizeof(app_ver_num), app_ver_num));
-	tlv_insert_after(terminal_data,
-				 tlv_new(EMV_ID_APPLICATION_IDENTIFIER_TERMINAL,
-					     ep->parms.aid_len, ep->parms.aid));
-
-	ep->parms.terminal_data_len = sizeof(term_data);
 	ep->parms.terminal_data = term_data;
 
-	rc = tlv_encode(terminal_data, term_data, &ep->parms.terminal_data_len);
+	rc = tlv_writer_finish(&writer, &ep->parms.terminal_data_len);
 	if (rc != TLV_RC_OK)
 		goto done;
 
-	tlv_free(terminal_data);
-
 	ep->parms.unpredictable_number =
 				ep->hal->ops->get_unpredictable_number(ep->hal);
 
@@ -1607,10 +1654,10 @@ int emv_ep_kernel_activation(struct emv_ep *ep)
 
 done:
 	if (rc == EMV_RC_OK)
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 						     "%s(): success", __func__);
 	else
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE,
 					  "%s(): failed. rc %d.", __func__, rc);
 	return rc;
 }
@@ -1676,7 +1723,7 @@ int emv_ep_activate(struct emv_ep *ep, enum emv_start start_at,
 {
 	int rc = EMV_RC_OK;
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
+	LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): start",
 								      __func__);
 
 
@@ -1771,10 +1818,10 @@ done:
 	memcpy(outcome, &ep->outcome, sizeof(*outcome));
 
 	if (rc == EMV_RC_OK)
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE,
 						     "%s(): success", __func__);
 	else
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_WARN,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_WARN,
 					  "%s(): failed. rc %d.", __func__, rc);
 	return rc;
 }
@@ -1925,7 +1972,10 @@ static int parse_emv_ep_config(struct tlv *tlv_set, struct emv_ep_config *cfg)
 				return EMV_RC_SYNTAX_ERROR;
 
 			cfg->present.reader_ctls_txn_limit = 1;
-			cfg->reader_ctls_txn_limit = bcd_to_u64(amount, size);
+			rc = libtlv_bcd_to_u64(amount, size,
+						   &cfg->reader_ctls_txn_limit);
+			if (rc != TLV_RC_OK)
+				return EMV_RC_SYNTAX_ERROR;
 
 			continue;
 		}
@@ -1940,7 +1990,10 @@ static int parse_emv_ep_config(struct tlv *tlv_set, struct emv_ep_config *cfg)
 				return EMV_RC_SYNTAX_ERROR;
 
 			cfg->present.reader_ctls_floor_limit = 1;
-			cfg->reader_ctls_floor_limit = bcd_to_u64(amount, size);
+			rc = libtlv_bcd_to_u64(amount, size,
+						 &cfg->reader_ctls_floor_limit);
+			if (rc != TLV_RC_OK)
+				return EMV_RC_SYNTAX_ERROR;
 
 			continue;
 		}
@@ -1955,7 +2008,10 @@ static int parse_emv_ep_config(struct tlv *tlv_set, struct emv_ep_config *cfg)
 				return EMV_RC_SYNTAX_ERROR;
 
 			cfg->present.terminal_floor_limit = 1;
-			cfg->terminal_floor_limit = bcd_to_u64(amount, size);
+			rc = libtlv_bcd_to_u64(amount, size,
+						    &cfg->terminal_floor_limit);
+			if (rc != TLV_RC_OK)
+				return EMV_RC_SYNTAX_ERROR;
 
 			continue;
 		}
@@ -1970,7 +2026,10 @@ static int parse_emv_ep_config(struct tlv *tlv_set, struct emv_ep_config *cfg)
 				return EMV_RC_SYNTAX_ERROR;
 
 			cfg->present.reader_cvm_reqd_limit = 1;
-			cfg->reader_cvm_reqd_limit = bcd_to_u64(amount, size);
+			rc = libtlv_bcd_to_u64(amount, size,
+						   &cfg->reader_cvm_reqd_limit);
+			if (rc != TLV_RC_OK)
+				return EMV_RC_SYNTAX_ERROR;
 
 			continue;
 		}
@@ -2005,7 +2064,7 @@ int emv_ep_configure(struct emv_ep *ep, const void *config, size_t len)
 
 	rc = tlv_parse(config, len, &tlv_config);
 	if (rc != TLV_RC_OK) {
-		log4c_category_log(ep->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_NOTICE,
 				      "%s(): failed to parse config", __func__);
 		rc = EMV_RC_SYNTAX_ERROR;
 		goto error;
@@ -2073,6 +2132,10 @@ int emv_ep_configure(struct emv_ep *ep, const void *config, size_t len)
 			goto error;
 		rc = libtlv_bcd_to_u64(amount, amount_sz,
 					    &ep->autorun.txn.amount_authorized);
+		if (rc != TLV_RC_OK) {
+			rc = EMV_RC_SYNTAX_ERROR;
+			goto error;
+		}
 
 		tlv = tlv_find(tlv_autorun_parms,
 					EMV_ID_LIBEMV_AUTORUN_TRANSACTION_TYPE);
@@ -2097,7 +2160,7 @@ int emv_ep_configure(struct emv_ep *ep, const void *config, size_t len)
 
 	tlv_free(tlv_config);
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): success",
+	LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_TRACE, "%s(): success",
 								      __func__);
 	return EMV_RC_OK;
 
@@ -2105,7 +2168,7 @@ error:
 	if (tlv_config)
 		tlv_free(tlv_config);
 
-	log4c_category_log(ep->log_cat, LOG4C_PRIORITY_ERROR,
+	LIBPAY_LOG(ep->log_cat, LOG4C_PRIORITY_ERROR,
 					  "%s(): failed. rc: %d", __func__, rc);
 
 	return rc;
@@ -2127,6 +2190,31 @@ struct emv_ep *emv_ep_new(const char *log_cat)
 	snprintf(cat, sizeof(cat), "%s.libemv.emv_ep", log_cat);
 	ep->log_cat = log4c_category_get(cat);
 
+	if ((tlv_path_compile("6F/A5/BF0C/61*", &ep->ppse_dir_entry_path) !=
+								  TLV_RC_OK) ||
+	    (tlv_path_compile("6F/A5/9F38", &ep->fci_pdol_path) !=
+								   TLV_RC_OK)) {
+		emv_ep_free(ep);
+		return NULL;
+	}
+
+	return ep;
+}
+
+struct emv_ep *emv_ep_new_async(const char *log_cat, size_t log_ring_size)
+{
+	struct emv_ep *ep = emv_ep_new(log_cat);
+
+	if (!ep)
+		return NULL;
+
+	if (libtlv_log_async_start(log_ring_size) != TLV_RC_OK) {
+		emv_ep_free(ep);
+		return NULL;
+	}
+
+	ep->log_async = true;
+
 	return ep;
 }
 
@@ -2143,5 +2231,12 @@ void emv_ep_free(struct emv_ep *ep)
 	for (i = 0; i < num_txn_types; i++)
 		if (ep->combination_set[i].combinations)
 			free(ep->combination_set[i].combinations);
+
+	tlv_path_free(ep->ppse_dir_entry_path);
+	tlv_path_free(ep->fci_pdol_path);
+
+	if (ep->log_async)
+		libtlv_log_async_stop();
+
 	free(ep);
 }
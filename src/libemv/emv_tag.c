@@ -18,7 +18,6 @@
  */
 
 #include <string.h>
-#include <ctype.h>
 #include <assert.h>
 #include <json-c/json.h>
 
@@ -28,7 +27,7 @@
 static int parse_emv_tag(const char *hex, size_t len, struct emv_tag *tag)
 {
 	uint8_t *result = NULL;
-	int i = 0;
+	size_t result_len = len / 2;
 
 	assert(hex);
 	assert(tag);
@@ -36,25 +35,17 @@ static int parse_emv_tag(const char *hex, size_t len, struct emv_tag *tag)
 	if (len % 2)
 		return EMV_RC_SYNTAX_ERROR;
 
-	result = malloc(len >> 1);
-	memset(result, 0, len >> 1);
+	result = malloc(result_len + 1);
+	if (!result)
+		return EMV_RC_OUT_OF_MEMORY;
 
-	for (i = 0; i < len; i++) {
-		char digit = tolower(hex[i]);
-
-		result[i >> 1] <<= 4;
-		if ((digit >= '0') && (digit <= '9'))
-			result[i >> 1] |= digit - '0';
-		else if ((digit >= 'a') && (digit <= 'f'))
-			result[i >> 1] |= digit - 'a' + 10;
-		else {
-			free(result);
-			return EMV_RC_SYNTAX_ERROR;
-		}
+	if (libtlv_hex_decode(hex, len, result, &result_len) != TLV_RC_OK) {
+		free(result);
+		return EMV_RC_SYNTAX_ERROR;
 	}
 
 	tag->value = (void *)result;
-	tag->len = len >> 1;
+	tag->len = result_len;
 	return EMV_RC_OK;
 }
 
@@ -0,0 +1,208 @@
+/*
+ * LibPAY - The Toolkit for Smart Payment Applications
+ *
+ * Copyright (C) 2015, 2016  Michael Jung <mijung@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libpay_core.h>
+#include <libpay/tlv.h>
+
+#define XX				0xFFu
+
+#define BCD_1E16			10000000000000000ull
+
+/* Value of a BCD byte, i.e. of two decimal digits, or XX if either nibble
+ * is not a decimal digit.						      */
+static const uint8_t bcd_decode[256] = {
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+	10, 11, 12, 13, 14, 15, 16, 17, 18, 19, XX, XX, XX, XX, XX, XX,
+	20, 21, 22, 23, 24, 25, 26, 27, 28, 29, XX, XX, XX, XX, XX, XX,
+	30, 31, 32, 33, 34, 35, 36, 37, 38, 39, XX, XX, XX, XX, XX, XX,
+	40, 41, 42, 43, 44, 45, 46, 47, 48, 49, XX, XX, XX, XX, XX, XX,
+	50, 51, 52, 53, 54, 55, 56, 57, 58, 59, XX, XX, XX, XX, XX, XX,
+	60, 61, 62, 63, 64, 65, 66, 67, 68, 69, XX, XX, XX, XX, XX, XX,
+	70, 71, 72, 73, 74, 75, 76, 77, 78, 79, XX, XX, XX, XX, XX, XX,
+	80, 81, 82, 83, 84, 85, 86, 87, 88, 89, XX, XX, XX, XX, XX, XX,
+	90, 91, 92, 93, 94, 95, 96, 97, 98, 99, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX
+};
+
+/* BCD byte of each value from 0 to 99.					      */
+static const uint8_t bcd_encode[100] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99
+};
+
+#define SWAR_NIBBLES			0x0F0F0F0F0F0F0F0Full
+#define SWAR_LOW_BYTES			0x00FF00FF00FF00FFull
+#define SWAR_LOW_WORDS			0x0000FFFF0000FFFFull
+
+/* Decode up to 8 BCD bytes at once, treating a 64 bit integer as a vector
+ * of bytes.  Up to 16 digits always fit into 64 bits.		      */
+static inline int bcd8_to_u64(const uint8_t *bcd, size_t len, uint64_t *u64)
+{
+	uint64_t x = 0, hi, lo;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		x = (x << 8) | bcd[i];
+
+	/* A nibble is no digit if adding 6 carries out of it.		      */
+	hi = (x >> 4) & SWAR_NIBBLES;
+	lo = x & SWAR_NIBBLES;
+	if (((hi + 0x0606060606060606ull) | (lo + 0x0606060606060606ull)) &
+							       ~SWAR_NIBBLES)
+		return TLV_RC_INVALID_ARG;
+
+	/* Combine pairs of digits, then pairs of bytes, then of words.	      */
+	x = hi * 10u + lo;
+	x = ((x >> 8) & SWAR_LOW_BYTES) * 100u + (x & SWAR_LOW_BYTES);
+	x = ((x >> 16) & SWAR_LOW_WORDS) * 10000u + (x & SWAR_LOW_WORDS);
+	*u64 = (x >> 32) * 100000000u + (x & 0xFFFFFFFFu);
+
+	return TLV_RC_OK;
+}
+
+static inline int bcd_to_u64(const uint8_t *bcd, size_t len, uint64_t *u64)
+{
+	uint64_t value = 0, low = 0;
+	uint8_t digits;
+	size_t i;
+	int rc = TLV_RC_OK;
+
+	if (len <= 8)
+		return bcd8_to_u64(bcd, len, u64);
+
+	/* Only the leading bytes of long values can overflow.		      */
+	for (i = 0; i < len - 8; i++) {
+		digits = bcd_decode[bcd[i]];
+		if (digits == XX)
+			return TLV_RC_INVALID_ARG;
+
+		if (value > (UINT64_MAX - digits) / 100u)
+			return TLV_RC_VALUE_OUT_OF_RANGE;
+
+		value = value * 100u + digits;
+	}
+
+	rc = bcd8_to_u64(&bcd[len - 8], 8, &low);
+	if (rc != TLV_RC_OK)
+		return rc;
+
+	if (value > (UINT64_MAX - low) / BCD_1E16)
+		return TLV_RC_VALUE_OUT_OF_RANGE;
+
+	*u64 = value * BCD_1E16 + low;
+
+	return TLV_RC_OK;
+}
+
+static inline int u64_to_bcd(uint64_t u64, uint8_t *bcd, size_t len)
+{
+	uint32_t u32;
+	size_t i;
+
+	/* One division by 100 per byte, in 32 bit arithmetic as soon as the
+	 * value fits.  Once it is exhausted, the remaining leading bytes are
+	 * all zero.							      */
+	for (i = len; (i > 0) && (u64 > UINT32_MAX); i--) {
+		bcd[i - 1] = bcd_encode[u64 % 100u];
+		u64 /= 100u;
+	}
+
+	if (u64 > UINT32_MAX)
+		return TLV_RC_VALUE_OUT_OF_RANGE;
+
+	for (u32 = (uint32_t)u64; (i > 0) && u32; i--) {
+		bcd[i - 1] = bcd_encode[u32 % 100u];
+		u32 /= 100u;
+	}
+
+	memset(bcd, 0, i);
+
+	return u32 ? TLV_RC_VALUE_OUT_OF_RANGE : TLV_RC_OK;
+}
+
+int libtlv_bcd_to_u64(const void *bcd, size_t len, uint64_t *u64)
+{
+	if (!bcd || !u64)
+		return TLV_RC_INVALID_ARG;
+
+	*u64 = 0;
+
+	return bcd_to_u64((const uint8_t *)bcd, len, u64);
+}
+
+int libtlv_u64_to_bcd(uint64_t u64, void *bcd, size_t len)
+{
+	if (!bcd)
+		return TLV_RC_INVALID_ARG;
+
+	return u64_to_bcd(u64, (uint8_t *)bcd, len);
+}
+
+int libtlv_bcd_to_u64_n(const void *bcd, size_t len, uint64_t *u64, size_t n)
+{
+	const uint8_t *p = (const uint8_t *)bcd;
+	size_t i;
+	int rc = TLV_RC_OK;
+
+	if ((!bcd && n) || (!u64 && n))
+		return TLV_RC_INVALID_ARG;
+
+	for (i = 0; i < n; i++, p += len) {
+		u64[i] = 0;
+		rc = bcd_to_u64(p, len, &u64[i]);
+		if (rc != TLV_RC_OK)
+			return rc;
+	}
+
+	return TLV_RC_OK;
+}
+
+int libtlv_u64_to_bcd_n(const uint64_t *u64, size_t n, void *bcd, size_t len)
+{
+	uint8_t *p = (uint8_t *)bcd;
+	size_t i;
+	int rc = TLV_RC_OK;
+
+	if ((!bcd && n) || (!u64 && n))
+		return TLV_RC_INVALID_ARG;
+
+	for (i = 0; i < n; i++, p += len) {
+		rc = u64_to_bcd(u64[i], p, len);
+		if (rc != TLV_RC_OK)
+			return rc;
+	}
+
+	return TLV_RC_OK;
+}
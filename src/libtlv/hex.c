@@ -0,0 +1,383 @@
+/*
+ * LibPAY - The Toolkit for Smart Payment Applications
+ *
+ * Copyright (C) 2015, 2016  Michael Jung <mijung@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <libpay_core.h>
+#include <libpay/tlv.h>
+
+/* Build with -DLIBTLV_NO_SIMD (configure --disable-simd) to use the scalar
+ * code paths only.							      */
+#if !defined(LIBTLV_NO_SIMD) && defined(__GNUC__) && \
+				       (defined(__x86_64__) || defined(__i386__))
+#define HEX_X86
+#include <immintrin.h>
+#endif
+
+enum hex_impl {
+	hex_impl_unknown = 0,
+	hex_impl_scalar,
+	hex_impl_sse2,
+	hex_impl_avx2
+};
+
+static const char hex_digit[16] = {
+	'0', '1', '2', '3', '4', '5', '6', '7',
+	'8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+/* Value of a hex digit plus one.  Zero for anything that is not a digit.   */
+static const uint8_t hex_nibble[256] = {
+	['0'] = 0x1, ['1'] = 0x2, ['2'] = 0x3, ['3'] = 0x4, ['4'] = 0x5,
+	['5'] = 0x6, ['6'] = 0x7, ['7'] = 0x8, ['8'] = 0x9, ['9'] = 0xA,
+	['A'] = 0xB, ['B'] = 0xC, ['C'] = 0xD, ['D'] = 0xE, ['E'] = 0xF,
+	['F'] = 0x10,
+	['a'] = 0xB, ['b'] = 0xC, ['c'] = 0xD, ['d'] = 0xE, ['e'] = 0xF,
+	['f'] = 0x10
+};
+
+static enum hex_impl hex_impl;
+
+static enum hex_impl hex_get_impl(void)
+{
+	enum hex_impl impl = __atomic_load_n(&hex_impl, __ATOMIC_RELAXED);
+
+	if (impl != hex_impl_unknown)
+		return impl;
+
+	impl = hex_impl_scalar;
+#ifdef HEX_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = hex_impl_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		impl = hex_impl_sse2;
+#endif
+
+	/* Concurrent first calls all store the same value.		      */
+	__atomic_store_n(&hex_impl, impl, __ATOMIC_RELAXED);
+
+	return impl;
+}
+
+static void hex_encode_scalar(const uint8_t *bin, size_t bin_sz, char *hex)
+{
+	size_t i;
+
+	for (i = 0; i < bin_sz; i++) {
+		hex[i * 2]     = hex_digit[bin[i] >> 4];
+		hex[i * 2 + 1] = hex_digit[bin[i] & 0xf];
+	}
+}
+
+/* Decode up to 'pairs' pairs of hex digits.  Stops at the first pair that
+ * contains something else than a hex digit.  Returns the number of bytes
+ * written to 'bin'.							      */
+static size_t hex_decode_scalar(const uint8_t *hex, size_t pairs, uint8_t *bin)
+{
+	uint8_t hi, lo;
+	size_t i;
+
+	for (i = 0; i < pairs; i++) {
+		hi = hex_nibble[hex[i * 2]];
+		lo = hex_nibble[hex[i * 2 + 1]];
+		if (!hi || !lo)
+			break;
+		bin[i] = ((hi - 1) << 4) | (lo - 1);
+	}
+
+	return i;
+}
+
+#ifdef HEX_X86
+
+/* The vector helpers below are instantiated for SSE2 (p = _mm, w = 128) and
+ * AVX2 (p = _mm256, w = 256).						      */
+
+/* Nibbles 0-15 to ASCII '0'-'9', 'A'-'F'.				      */
+#define HEX_SIMD_TO_ASCII(p, w, n)					      \
+	p##_add_epi8(p##_add_epi8((n), p##_set1_epi8('0')),		      \
+		     p##_and_si##w(p##_cmpgt_epi8((n), p##_set1_epi8(9)),     \
+				   p##_set1_epi8('A' - '9' - 1)))
+
+__attribute__((target("sse2")))
+static size_t hex_encode_sse2(const uint8_t *bin, size_t bin_sz, char *hex)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	__m128i v, hi, lo;
+	size_t i;
+
+	for (i = 0; i + 16 <= bin_sz; i += 16) {
+		v  = _mm_loadu_si128((const __m128i *)&bin[i]);
+		hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		lo = _mm_and_si128(v, mask);
+		hi = HEX_SIMD_TO_ASCII(_mm, 128, hi);
+		lo = HEX_SIMD_TO_ASCII(_mm, 128, lo);
+		_mm_storeu_si128((__m128i *)&hex[i * 2],
+						      _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)&hex[i * 2 + 16],
+						      _mm_unpackhi_epi8(hi, lo));
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t hex_encode_avx2(const uint8_t *bin, size_t bin_sz, char *hex)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	__m256i v, hi, lo, a, b;
+	size_t i;
+
+	for (i = 0; i + 32 <= bin_sz; i += 32) {
+		v  = _mm256_loadu_si256((const __m256i *)&bin[i]);
+		hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+		lo = _mm256_and_si256(v, mask);
+		hi = HEX_SIMD_TO_ASCII(_mm256, 256, hi);
+		lo = HEX_SIMD_TO_ASCII(_mm256, 256, lo);
+		/* Unpacking works per 128 bit lane, restore the byte order.  */
+		a = _mm256_unpacklo_epi8(hi, lo);
+		b = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i *)&hex[i * 2],
+				       _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *)&hex[i * 2 + 32],
+				       _mm256_permute2x128_si256(a, b, 0x31));
+	}
+
+	return i;
+}
+
+/* Classify hex digits and compute their nibbles.  Evaluates to a vector with
+ * the nibble of each valid digit and sets 'valid' to 0xFF in the lanes of
+ * valid digits.  Unsigned 'x <= y' is computed as 'subs_epu8(x, y) == 0'.  */
+#define HEX_SIMD_TO_NIBBLE(p, w, c, valid) ({				      \
+	__m##w##i _d = p##_sub_epi8((c), p##_set1_epi8('0'));		      \
+	__m##w##i _l = p##_sub_epi8(p##_or_si##w((c), p##_set1_epi8(0x20)),   \
+				    p##_set1_epi8('a'));		      \
+	__m##w##i _is_d = p##_cmpeq_epi8(p##_subs_epu8(_d, p##_set1_epi8(9)), \
+					 p##_setzero_si##w());		      \
+	__m##w##i _is_l = p##_cmpeq_epi8(p##_subs_epu8(_l, p##_set1_epi8(5)), \
+					 p##_setzero_si##w());		      \
+	(valid) = p##_or_si##w(_is_d, _is_l);				      \
+	p##_or_si##w(p##_and_si##w(_is_d, _d),				      \
+		     p##_andnot_si##w(_is_d,				      \
+				      p##_add_epi8(_l, p##_set1_epi8(10))));  \
+})
+
+/* Combine the nibbles of each pair of digits into a byte in the low half
+ * of each 16 bit lane.							      */
+#define HEX_SIMD_PACK(p, w, n)						      \
+	p##_or_si##w(p##_slli_epi16(p##_and_si##w((n),			      \
+					  p##_set1_epi16(0x00ff)), 4),	      \
+		     p##_srli_epi16((n), 8))
+
+__attribute__((target("sse2")))
+static size_t hex_decode_sse2(const uint8_t *hex, size_t pairs, uint8_t *bin)
+{
+	__m128i c, n, valid;
+	size_t i;
+
+	for (i = 0; i + 8 <= pairs; i += 8) {
+		c = _mm_loadu_si128((const __m128i *)&hex[i * 2]);
+		n = HEX_SIMD_TO_NIBBLE(_mm, 128, c, valid);
+		if (_mm_movemask_epi8(valid) != 0xffff)
+			break;
+		n = HEX_SIMD_PACK(_mm, 128, n);
+		_mm_storel_epi64((__m128i *)&bin[i], _mm_packus_epi16(n, n));
+	}
+
+	return i + hex_decode_scalar(&hex[i * 2], pairs - i, &bin[i]);
+}
+
+__attribute__((target("avx2")))
+static size_t hex_decode_avx2(const uint8_t *hex, size_t pairs, uint8_t *bin)
+{
+	__m256i c, n, valid;
+	size_t i;
+
+	for (i = 0; i + 16 <= pairs; i += 16) {
+		c = _mm256_loadu_si256((const __m256i *)&hex[i * 2]);
+		n = HEX_SIMD_TO_NIBBLE(_mm256, 256, c, valid);
+		if (_mm256_movemask_epi8(valid) != -1)
+			break;
+		n = HEX_SIMD_PACK(_mm256, 256, n);
+		/* Packing works per 128 bit lane, gather both halves.	      */
+		n = _mm256_permute4x64_epi64(_mm256_packus_epi16(n, n), 0xd8);
+		_mm_storeu_si128((__m128i *)&bin[i],
+					       _mm256_castsi256_si128(n));
+	}
+
+	return i + hex_decode_scalar(&hex[i * 2], pairs - i, &bin[i]);
+}
+
+#endif
+
+static size_t hex_decode_run(const uint8_t *hex, size_t pairs, uint8_t *bin)
+{
+	switch (hex_get_impl()) {
+#ifdef HEX_X86
+	case hex_impl_avx2:
+		return hex_decode_avx2(hex, pairs, bin);
+	case hex_impl_sse2:
+		return hex_decode_sse2(hex, pairs, bin);
+#endif
+	default:
+		return hex_decode_scalar(hex, pairs, bin);
+	}
+}
+
+char *libtlv_bin_to_hex(const void *blob, size_t blob_sz, char *buffer)
+{
+	const uint8_t *bin = (const uint8_t *)blob;
+	size_t i = 0;
+
+	switch (hex_get_impl()) {
+#ifdef HEX_X86
+	case hex_impl_avx2:
+		i = hex_encode_avx2(bin, blob_sz, buffer);
+		break;
+	case hex_impl_sse2:
+		i = hex_encode_sse2(bin, blob_sz, buffer);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	hex_encode_scalar(&bin[i], blob_sz - i, &buffer[i * 2]);
+
+	buffer[blob_sz * 2] = '\0';
+
+	return buffer;
+}
+
+int libtlv_hex_decode(const char *hex, size_t hex_len, void *bin,
+							       size_t *bin_sz)
+{
+	size_t decoded = 0;
+
+	if (!hex || !bin_sz || (hex_len && !bin))
+		return TLV_RC_INVALID_ARG;
+
+	if (hex_len % 2)
+		return TLV_RC_INVALID_ARG;
+
+	if (hex_len / 2 > *bin_sz) {
+		*bin_sz = hex_len / 2;
+		return TLV_RC_BUFFER_OVERFLOW;
+	}
+
+	decoded = hex_decode_run((const uint8_t *)hex, hex_len / 2,
+							       (uint8_t *)bin);
+	if (decoded != hex_len / 2)
+		return TLV_RC_INVALID_ARG;
+
+	*bin_sz = decoded;
+
+	return TLV_RC_OK;
+}
+
+int libtlv_hex_decode_text(const char *text, size_t text_len, void *bin,
+							       size_t *bin_sz)
+{
+	const uint8_t *p = (const uint8_t *)text, *end = p + text_len;
+	uint8_t *out = (uint8_t *)bin, *out_end = NULL;
+	uint8_t hi = 0, lo = 0;
+	bool half = false;
+	size_t n;
+
+	if (!text || !bin_sz || (text_len && !bin))
+		return TLV_RC_INVALID_ARG;
+
+	out_end = out + *bin_sz;
+
+	while (p < end) {
+		if (!half && (end - p >= 2)) {
+			hi = hex_nibble[p[0]];
+			lo = hex_nibble[p[1]];
+		} else {
+			lo = 0;
+		}
+
+		/* A pair of hex digits.  Longer runs of digits take the
+		 * vectorized path, short groups as in '9F 02 06' do not.     */
+		if (hi && lo) {
+			if (out == out_end)
+				return TLV_RC_BUFFER_OVERFLOW;
+
+			if ((end - p >= 32) && hex_nibble[p[2]] &&
+							     hex_nibble[p[3]]) {
+				n = hex_decode_run(p, MIN((size_t)(end - p) / 2,
+						     (size_t)(out_end - out)), out);
+				p += 2 * n;
+				out += n;
+				continue;
+			}
+
+			*out++ = ((hi - 1) << 4) | (lo - 1);
+			p += 2;
+			continue;
+		}
+
+		/* Everything else is looked at one character at a time.      */
+		lo = hex_nibble[*p];
+		if (lo) {
+			if (!half) {
+				hi = lo;
+				half = true;
+			} else if (out < out_end) {
+				*out++ = ((hi - 1) << 4) | (lo - 1);
+				half = false;
+			} else {
+				return TLV_RC_BUFFER_OVERFLOW;
+			}
+		} else if (*p == '#') {
+			p = memchr(p, '\n', end - p);
+			if (!p)
+				break;
+		}
+
+		p++;
+	}
+
+	if (half)
+		return TLV_RC_INVALID_ARG;
+
+	*bin_sz = out - (uint8_t *)bin;
+
+	return TLV_RC_OK;
+}
+
+void *libtlv_hex_to_bin(const char *hex, void *bin_buffer,
+							size_t *bin_buffer_len)
+{
+	size_t hex_len = strlen(hex);
+
+	/* Only blanks and line breaks may separate the hex digits.	      */
+	if (strspn(hex, "0123456789ABCDEFabcdef \n\r") != hex_len)
+		return NULL;
+
+	if (libtlv_hex_decode_text(hex, hex_len, bin_buffer, bin_buffer_len) !=
+								      TLV_RC_OK)
+		return NULL;
+
+	return bin_buffer;
+}
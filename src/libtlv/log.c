@@ -0,0 +1,377 @@
+/*
+ * LibPAY - The Toolkit for Smart Payment Applications
+ *
+ * Copyright (C) 2015, 2016  Michael Jung <mijung@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libpay_core.h>
+#include <libpay_log.h>
+#include <libpay/tlv.h>
+
+#define LOG_RING_DEFAULT_SIZE		256u
+#define LOG_RECORD_SIZE			512u
+
+/* A pre-formatted log message.  Longer messages are truncated.	      */
+struct log_record {
+	const log4c_category_t *cat;
+	int			prio;
+	char			msg[LOG_RECORD_SIZE - sizeof(void *) -
+								sizeof(int)];
+};
+
+/* Single producer, single consumer ring of log records.  The owning thread
+ * only advances 'head' and the background thread only advances 'tail', so
+ * neither side needs a lock.  Both counters run freely and are masked on
+ * access.								      */
+struct log_ring {
+	struct log_ring	   *next;
+	size_t		    mask;
+	bool		    orphaned;
+	uint64_t	    dropped;
+	uint64_t	    reported;
+
+	uint64_t	    head __attribute__((aligned(64)));
+	uint64_t	    tail __attribute__((aligned(64)));
+
+	struct log_record   records[] __attribute__((aligned(64)));
+};
+
+/* 'rings', 'running' and 'thread_alive' are protected by 'log_mutex'.  The
+ * background thread walks the list without it, which is safe since new rings
+ * are only ever prepended and no other thread unlinks rings while the
+ * background thread is alive.  'log_ctl_mutex' serializes starting and
+ * stopping the background thread, including the wait for it to exit.	      */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_ctl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The background thread sleeps on 'log_wake' while all rings are empty.
+ * 'waiting' tells producers that it has to be woken up.		      */
+static pthread_mutex_t log_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static bool waiting;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static pthread_t log_thread;
+static struct log_ring *rings;
+static unsigned int log_users;
+static size_t ring_size;
+static bool running;
+static bool thread_alive;
+static bool stopping;
+static uint64_t dropped_total;
+
+static __thread struct log_ring *log_ring;
+
+static void log_thread_wake(void)
+{
+	pthread_mutex_lock(&log_wake_mutex);
+	pthread_cond_signal(&log_wake);
+	pthread_mutex_unlock(&log_wake_mutex);
+}
+
+static void log_ring_free(struct log_ring *ring)
+{
+	struct log_ring **p;
+
+	for (p = &rings; *p; p = &(*p)->next) {
+		if (*p == ring) {
+			*p = ring->next;
+			break;
+		}
+	}
+
+	free(ring);
+}
+
+/* Called on exit of a thread that owned a ring.  Its remaining records still
+ * have to be written, so the ring is only released by the background thread
+ * once it is empty, or by libtlv_log_async_stop once the background thread
+ * has exited.  Only without a background thread it is released right away. */
+static void log_ring_orphan(void *arg)
+{
+	struct log_ring *ring = (struct log_ring *)arg;
+
+	pthread_mutex_lock(&log_mutex);
+	if (thread_alive) {
+		__atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+		log_thread_wake();
+	} else {
+		log_ring_free(ring);
+	}
+	pthread_mutex_unlock(&log_mutex);
+}
+
+static void log_key_create(void)
+{
+	pthread_key_create(&log_key, log_ring_orphan);
+}
+
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *ring = log_ring;
+	size_t size;
+
+	if (ring)
+		return ring;
+
+	size = __atomic_load_n(&ring_size, __ATOMIC_RELAXED);
+
+	ring = (struct log_ring *)aligned_alloc(64, sizeof(*ring) +
+					      size * sizeof(ring->records[0]));
+	if (!ring)
+		return NULL;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->mask = size - 1;
+
+	pthread_once(&log_key_once, log_key_create);
+	pthread_setspecific(log_key, ring);
+
+	pthread_mutex_lock(&log_mutex);
+	ring->next = rings;
+	__atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log_mutex);
+
+	log_ring = ring;
+
+	return ring;
+}
+
+static void log_async(const log4c_category_t *cat, int prio, const char *fmt,
+								 va_list ap)
+{
+	struct log_ring *ring = log_ring_get();
+	struct log_record *record = NULL;
+	uint64_t head, tail;
+
+	if (!ring) {
+		__atomic_add_fetch(&dropped_total, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail > ring->mask) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&dropped_total, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	record = &ring->records[head & ring->mask];
+	record->cat = cat;
+	record->prio = prio;
+	vsnprintf(record->msg, sizeof(record->msg), fmt, ap);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/* The background thread only waits once it has found all rings empty,
+	 * so this is only true if the ring was empty before.  Together with
+	 * the fence in log_thread_wait, either the background thread sees the
+	 * new record or this sees it waiting.				      */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&waiting, __ATOMIC_RELAXED))
+		log_thread_wake();
+}
+
+void libtlv_log(const log4c_category_t *cat, int prio, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+		log_async(cat, prio, fmt, ap);
+	else
+		log4c_category_vlog(cat, prio, fmt, ap);
+	va_end(ap);
+}
+
+/* Write all records of 'ring' to the log4c appenders.  Returns the number of
+ * records written.							      */
+static size_t log_ring_drain(struct log_ring *ring)
+{
+	uint64_t tail = ring->tail, head, dropped;
+	const struct log_record *record = NULL;
+	size_t count = 0;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	for (; tail != head; tail++, count++) {
+		record = &ring->records[tail & ring->mask];
+		log4c_category_log(record->cat, record->prio, "%s",
+								  record->msg);
+
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			log4c_category_log(record->cat, LOG4C_PRIORITY_WARN,
+			       "%llu log message(s) dropped, log ring is full",
+			       (unsigned long long)(dropped - ring->reported));
+			ring->reported = dropped;
+		}
+
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	return count;
+}
+
+static size_t log_drain(void)
+{
+	struct log_ring *ring = NULL, *next = NULL;
+	size_t count = 0;
+
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring;
+								  ring = next) {
+		next = ring->next;
+
+		if (!__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE)) {
+			count += log_ring_drain(ring);
+			continue;
+		}
+
+		/* The owner is gone, so the ring cannot fill up any more.    */
+		count += log_ring_drain(ring);
+
+		pthread_mutex_lock(&log_mutex);
+		log_ring_free(ring);
+		pthread_mutex_unlock(&log_mutex);
+	}
+
+	return count;
+}
+
+static bool log_rings_empty(void)
+{
+	const struct log_ring *ring = NULL;
+
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring;
+							    ring = ring->next)
+		if ((__atomic_load_n(&ring->head, __ATOMIC_RELAXED) !=
+								 ring->tail) ||
+		    __atomic_load_n(&ring->orphaned, __ATOMIC_RELAXED))
+			return false;
+
+	return true;
+}
+
+/* Sleep until a producer or libtlv_log_async_stop wakes us up.	      */
+static void log_thread_wait(void)
+{
+	pthread_mutex_lock(&log_wake_mutex);
+
+	__atomic_store_n(&waiting, true, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) && log_rings_empty())
+		pthread_cond_wait(&log_wake, &log_wake_mutex);
+
+	__atomic_store_n(&waiting, false, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&log_wake_mutex);
+}
+
+static void *log_thread_main(void *arg)
+{
+	(void)arg;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+		if (!log_drain())
+			log_thread_wait();
+
+	log_drain();
+
+	return NULL;
+}
+
+int libtlv_log_async_start(size_t size)
+{
+	int rc = TLV_RC_OK;
+
+	if (size & (size - 1))
+		return TLV_RC_INVALID_ARG;
+
+	pthread_mutex_lock(&log_ctl_mutex);
+
+	if (log_users++)
+		goto done;
+
+	__atomic_store_n(&ring_size, size ? size : LOG_RING_DEFAULT_SIZE,
+							      __ATOMIC_RELAXED);
+	__atomic_store_n(&stopping, false, __ATOMIC_RELAXED);
+
+	if (pthread_create(&log_thread, NULL, log_thread_main, NULL)) {
+		log_users--;
+		rc = TLV_RC_OUT_OF_MEMORY;
+		goto done;
+	}
+
+	pthread_mutex_lock(&log_mutex);
+	thread_alive = true;
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log_mutex);
+
+done:
+	pthread_mutex_unlock(&log_ctl_mutex);
+	return rc;
+}
+
+void libtlv_log_async_stop(void)
+{
+	struct log_ring *ring = NULL, *next = NULL;
+
+	pthread_mutex_lock(&log_ctl_mutex);
+
+	if (!log_users || --log_users) {
+		pthread_mutex_unlock(&log_ctl_mutex);
+		return;
+	}
+
+	pthread_mutex_lock(&log_mutex);
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log_mutex);
+
+	log_thread_wake();
+	pthread_join(log_thread, NULL);
+
+	/* Rings of threads that are still alive are kept for the next start.
+	 * Rings of threads that exited while the background thread was still
+	 * running may not have been drained and released by it.	      */
+	pthread_mutex_lock(&log_mutex);
+	thread_alive = false;
+	for (ring = rings; ring; ring = next) {
+		next = ring->next;
+		if (ring->orphaned) {
+			log_ring_drain(ring);
+			log_ring_free(ring);
+		}
+	}
+	pthread_mutex_unlock(&log_mutex);
+
+	pthread_mutex_unlock(&log_ctl_mutex);
+}
+
+uint64_t libtlv_log_get_dropped(void)
+{
+	return __atomic_load_n(&dropped_total, __ATOMIC_RELAXED);
+}
@@ -23,32 +23,239 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/membarrier.h>
+#endif
 #include <log4c.h>
 
 #include <libpay_core.h>
+#include <libpay_log.h>
 #include <libpay/tlv.h>
 
-static log4c_category_t *log_cat;
+#define TLV_ARENA_DEFAULT_BLOCK_SIZE	4096u
+#define TLV_ARENA_ALIGN(size)		(((size) + 15u) & ~(size_t)15u)
+
+/* The value of the node points into a buffer owned by the caller. */
+#define TLV_NODE_F_BORROWED		0x01u
+/* The cached content length of the constructed node is up to date. */
+#define TLV_NODE_F_SIZE_VALID		0x02u
+/* The children of the constructed node are still encoded in its value, the
+ * context to expand them with is stored in front of it, see tlv_alloc_lazy.  */
+#define TLV_NODE_F_LAZY			0x04u
+
+#define TLV_PARSE_F_SHALLOW		0x01u
+#define TLV_PARSE_F_VIEW		0x02u
+#define TLV_PARSE_F_LAZY		0x04u
+
+/* Levels of nesting the parser handles without allocating its work stack. */
+#define TLV_PARSE_STACK_INLINE		16u
+
+/* Bytes before and after the error offset to include in parse error logs. */
+#define TLV_PARSE_ERROR_WINDOW		16u
+
+#define TLV_STREAM_S_TAG		0
+#define TLV_STREAM_S_LENGTH		1
+#define TLV_STREAM_S_LENGTH_LONG	2
+#define TLV_STREAM_S_VALUE		3
 
 struct tlv {
-	struct tlv	*next;
-	struct tlv	*prev;
-	struct tlv	*parent;
-	struct tlv	*child;
-
-	uint8_t		tag[TLV_MAX_TAG_LENGTH];
-	size_t		length;
-	uint8_t		value[0];
+	struct tlv	 *next;
+	struct tlv	 *prev;
+	struct tlv	 *parent;
+	struct tlv	 *child;
+	struct tlv_arena *arena;
+
+	uint8_t		 tag[TLV_MAX_TAG_LENGTH];
+	tlv_key_t	 key;
+	unsigned int	 flags;
+	size_t		 content_length;
+	size_t		 length;
+	struct tlv_binding *binding;	/* NULL unless bound, see there.      */
+	uint8_t		*value;
+	size_t		 capacity;
+	uint8_t		 data[0];
+};
+
+/* The offset of a bound node in the encoding.			      */
+struct tlv_binding_slot {
+	const struct tlv *node;
+	size_t		  offset;
+};
+
+/* The buffer a list of TLV nodes was last encoded to by tlv_encode_bind.
+ * The offsets of the bound nodes in it are kept in 'slots', a hash table
+ * keyed by node, so tlv_set_value can patch the encoding in place without
+ * every node carrying an offset.  Structural changes mark the encoding
+ * 'stale' instead.  The binding is shared by 'refs' nodes and freed with
+ * the last of them, unless it lives in an arena.			      */
+struct tlv_binding {
+	const struct tlv *head;
+	const struct tlv *parent;
+	struct tlv_arena *arena;
+	uint8_t		 *buffer;
+	size_t		  size;
+	size_t		  used;
+	size_t		  refs;
+	bool		  stale;
+	unsigned int	  shift;
+	size_t		  mask;
+	struct tlv_binding_slot *slots;
+};
+
+struct tlv_arena_block {
+	struct tlv_arena_block *next;
+	size_t			size;
+	uint8_t			data[0] __attribute__((aligned(16)));
+};
+
+struct tlv_arena {
+	struct tlv_arena_block *head;
+	struct tlv_arena_block *current;
+	size_t			used;
+	size_t			block_size;
+};
+
+#define TLV_INDEX_NONE			UINT32_MAX
+
+struct tlv_stream_level {
+	uint64_t		end;
+	uint8_t			tag[TLV_MAX_TAG_LENGTH];
+};
+
+struct tlv_stream_parser {
+	struct tlv_stream_callbacks cb;
+	void		       *priv;
+	int			state;
+	int			rc;
+	uint64_t		offset;
+	uint8_t			tag[TLV_MAX_TAG_LENGTH];
+	size_t			tag_len;
+	size_t			length;
+	size_t			length_octets;
+	size_t			value_done;
+	size_t			depth;
+	size_t			max_depth;
+	struct tlv_stream_level *levels;
+	size_t			buffer_size;
+	uint8_t		       *buffer;
+};
+
+struct tlv_fmt_slot {
+	tlv_key_t		key;
+	enum tlv_fmt		fmt;
+};
+
+struct tlv_fmt_table {
+	unsigned int		shift;
+	size_t			mask;
+	struct tlv_fmt_slot	slots[];
+};
+
+struct tlv_index_slot {
+	tlv_key_t		key;
+	uint32_t		head;
+	uint32_t		tail;
+};
+
+struct tlv_index_entry {
+	struct tlv	       *tlv;
+	uint32_t		next;
+};
+
+struct tlv_index {
+	struct tlv_arena       *arena;
+	unsigned int		shift;
+	size_t			mask;
+	struct tlv_index_slot  *slots;
+	struct tlv_index_entry *entries;
+};
+
+/* The field is right aligned, i.e. padded and truncated on the left.	      */
+#define DOL_FIELD_F_RIGHT		0x01u
+
+#define DOL_PLAN_CACHE_INITIAL_SIZE	16u
+
+struct dol_plan_entry {
+	tlv_key_t	 key;
+	size_t		 offset;
+	size_t		 length;
+	uint8_t		 flags;
+	uint8_t		 pad;
 };
 
-struct tlv_parse_error_info {
-	int	    rc;
-	const void *pos;
+struct dol_plan {
+	uint64_t	       hash;
+	size_t		       dol_sz;
+	size_t		       del_sz;
+	size_t		       num_entries;
+	struct dol_plan_entry *entries;
+	uint8_t		      *dol;
 };
 
-static struct tlv_parse_error_info tlv_parse_error_info;
+struct tlv_path_step {
+	tlv_key_t	key;
+	bool		all;
+};
+
+struct tlv_path {
+	size_t		     num_steps;
+	struct tlv_path_step steps[];
+};
+
+struct dol_plan_cache {
+	struct libtlv_ctx *ctx;
+	size_t		   mask;
+	size_t		   count;
+	struct dol_plan  **slots;
+};
+
+struct libtlv_ctx {
+	log4c_category_t       *log_cat;
+	unsigned int		max_depth;
+	struct tlv_arena       *arena;
+
+	/* Outcome of the last parse through this context.		      */
+	struct tlv_parse_ctx	error;
+
+	/* Registered formats, sorted by key.  Protected by fmts_mutex.      */
+	pthread_mutex_t		fmts_mutex;
+	struct tlv_fmt_slot    *known_formats;
+	size_t			num_known_formats;
+
+	/* The frozen table readers look formats up in, see
+	 * libtlv_fmts_freeze.  A replaced table is released once no reader
+	 * can still use it, see fmts_synchronize.			      */
+	struct tlv_fmt_table   *fmt_table;
+};
+
+/* Used by all functions that do not take a context.			      */
+static struct libtlv_ctx default_ctx = {
+	.max_depth  = TLV_DEFAULT_MAX_DEPTH,
+	.fmts_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct libtlv_ctx *libtlv_ctx_get(struct libtlv_ctx *ctx)
+{
+	return ctx ? ctx : &default_ctx;
+}
+
+static void tlv_expand(const struct tlv *tlv);
 
 bool tlv_is_constructed(const struct tlv *tlv)
+{
+	tlv_expand(tlv);
+
+	return !!tlv->child;
+}
+
+/* Unlike tlv_is_constructed, this leaves lazy nodes alone.  Their value is
+ * the encoding of their children, so they may be treated like primitive
+ * nodes when encoding.							      */
+static bool tlv_has_children(const struct tlv *tlv)
 {
 	return !!tlv->child;
 }
@@ -70,12 +277,190 @@ struct tlv *tlv_get_parent(const struct tlv *tlv)
 
 struct tlv *tlv_get_child(const struct tlv *tlv)
 {
-	return tlv ? tlv->child : NULL;
+	if (!tlv)
+		return NULL;
+
+	tlv_expand(tlv);
+
+	return tlv->child;
+}
+
+struct tlv_arena *tlv_arena_new(size_t block_size)
+{
+	struct tlv_arena *arena = NULL;
+
+	arena = (struct tlv_arena *)calloc(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+
+	arena->block_size = block_size ? block_size :
+						   TLV_ARENA_DEFAULT_BLOCK_SIZE;
+
+	return arena;
+}
+
+void tlv_arena_reset(struct tlv_arena *arena)
+{
+	if (!arena)
+		return;
+
+	/* Blocks are retained for re-use, so that a steady stream of similar
+	 * sized parses does not hit the allocator at all.		      */
+	arena->current = arena->head;
+	arena->used = 0;
+}
+
+void tlv_arena_free(struct tlv_arena *arena)
+{
+	struct tlv_arena_block *block, *next;
+
+	if (!arena)
+		return;
+
+	for (block = arena->head; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+
+	free(arena);
+}
+
+static void *tlv_arena_alloc(struct tlv_arena *arena, size_t size)
+{
+	struct tlv_arena_block *block = NULL;
+	void *p = NULL;
+
+	size = TLV_ARENA_ALIGN(size);
+
+	while (arena->current) {
+		if (arena->current->size - arena->used >= size) {
+			p = &arena->current->data[arena->used];
+			arena->used += size;
+			return p;
+		}
+
+		if (!arena->current->next)
+			break;
+
+		arena->current = arena->current->next;
+		arena->used = 0;
+	}
+
+	block = (struct tlv_arena_block *)malloc(sizeof(*block) +
+					       MAX(size, arena->block_size));
+	if (!block)
+		return NULL;
+
+	block->size = MAX(size, arena->block_size);
+	block->next = NULL;
+
+	if (arena->current)
+		arena->current->next = block;
+	else
+		arena->head = block;
+
+	arena->current = block;
+	arena->used = size;
+
+	return block->data;
+}
+
+static struct tlv *tlv_alloc(struct tlv_arena *arena, size_t length)
+{
+	struct tlv *tlv = NULL;
+
+	if (arena)
+		tlv = (struct tlv *)tlv_arena_alloc(arena,
+						 sizeof(struct tlv) + length);
+	else
+		tlv = (struct tlv *)malloc(sizeof(struct tlv) + length);
+
+	if (tlv) {
+		tlv->arena = arena;
+		tlv->flags = 0;
+		tlv->binding = NULL;
+		tlv->value = tlv->data;
+		tlv->capacity = length;
+	}
+
+	return tlv;
+}
+
+/* Lazy nodes keep the context that expands them in front of their value,
+ * so that no other node pays for it.					      */
+static struct tlv *tlv_alloc_lazy(struct tlv_arena *arena, size_t length,
+						       struct libtlv_ctx *ctx)
+{
+	struct tlv *tlv = NULL;
+
+	tlv = tlv_alloc(arena, sizeof(ctx) + length);
+	if (tlv) {
+		memcpy(tlv->data, &ctx, sizeof(ctx));
+		tlv->flags = TLV_NODE_F_LAZY;
+		tlv->value = tlv->data + sizeof(ctx);
+		tlv->capacity = length;
+	}
+
+	return tlv;
+}
+
+static struct libtlv_ctx *tlv_lazy_ctx(const struct tlv *tlv)
+{
+	struct libtlv_ctx *ctx = NULL;
+
+	memcpy(&ctx, tlv->data, sizeof(ctx));
+
+	return ctx;
+}
+
+static void tlv_release(struct tlv *tlv)
+{
+	/* Nodes which live in an arena are released by tlv_arena_reset. */
+	if (!tlv->arena)
+		free(tlv);
+}
+
+/* Invalidate the cached content lengths of 'tlv' and its ancestors.  A node
+ * with a valid cache only has descendants with valid caches, so the walk can
+ * stop at the first node that is already invalid.			      */
+static void tlv_invalidate_size(struct tlv *tlv)
+{
+	for (; tlv && (tlv->flags & TLV_NODE_F_SIZE_VALID); tlv = tlv->parent)
+		tlv->flags &= ~TLV_NODE_F_SIZE_VALID;
+}
+
+/* The bound encoding of 'tlv' can not be patched any more.		      */
+static void tlv_binding_invalidate(const struct tlv *tlv)
+{
+	if (tlv && tlv->binding)
+		tlv->binding->stale = true;
+}
+
+/* Detach 'tlv' from its binding.					      */
+static void tlv_binding_put(struct tlv *tlv)
+{
+	struct tlv_binding *binding = tlv->binding;
+
+	if (!binding)
+		return;
+
+	tlv->binding = NULL;
+	binding->stale = true;
+
+	if (!--binding->refs && !binding->arena) {
+		free(binding->slots);
+		free(binding);
+	}
 }
 
+static void tlv_binding_move(struct tlv_binding *binding,
+			     const struct tlv *tlv_old, const struct tlv *tlv);
+static void tlv_binding_patch(struct tlv *tlv, size_t old_length);
+
 static int tlv_parse_identifier(const void **buf, size_t len, struct tlv *tlv)
 {
 	const uint8_t *p = NULL;
+	tlv_key_t key;
 	int i;
 
 	if (!buf || !(*buf) || !tlv || !len)
@@ -84,31 +469,29 @@ static int tlv_parse_identifier(const void **buf, size_t len, struct tlv *tlv)
 	p = (uint8_t *)*buf;
 
 	tlv->tag[0] = *p++;
+	key = tlv->tag[0];
 
 	if ((tlv->tag[0] & TLV_TAG_NUMBER_MASK) != 0x1Fu) {
+		tlv->key = key;
 		*buf = (const void *)p;
 		return TLV_RC_OK;
 	}
 
 	for (i = 1; i < MIN(sizeof(tlv->tag), len); i++) {
 		tlv->tag[i] = *p++;
+		key = (key << 8) | tlv->tag[i];
 
 		if (!(tlv->tag[i] & 0x80u))
 			break;
 	}
 
-	if (i == sizeof(tlv->tag)) {
-		tlv_parse_error_info.rc = TLV_RC_TAG_NUMBER_TOO_LARGE;
-		tlv_parse_error_info.pos = *buf;
+	if (i == sizeof(tlv->tag))
 		return TLV_RC_TAG_NUMBER_TOO_LARGE;
-	}
 
-	if (i == len) {
-		tlv_parse_error_info.rc = TLV_RC_UNEXPECTED_END_OF_STREAM;
-		tlv_parse_error_info.pos = *buf;
+	if (i == len)
 		return TLV_RC_UNEXPECTED_END_OF_STREAM;
-	}
 
+	tlv->key = key;
 	*buf = (const void *)p;
 
 	return TLV_RC_OK;
@@ -122,11 +505,8 @@ static int tlv_parse_dol_length(const void **buffer, size_t length,
 	if (!buffer || !(*buffer) || !tlv)
 		return TLV_RC_INVALID_ARG;
 
-	if (!length) {
-		tlv_parse_error_info.rc = TLV_RC_UNEXPECTED_END_OF_STREAM;
-		tlv_parse_error_info.pos = *buffer;
+	if (!length)
 		return TLV_RC_UNEXPECTED_END_OF_STREAM;
-	}
 
 	/* Per EMV v4.3 Book 3, Section 5.4 "Rules for Using a Data Object List
 	 * (DOL)", the a data object lenght field is a "a one-byte length which
@@ -148,20 +528,13 @@ static int tlv_parse_length(const void **buffer, size_t length, struct tlv *tlv)
 	if (!buffer || !(*buffer) || !tlv)
 		return TLV_RC_INVALID_ARG;
 
-	if (!length) {
-		tlv_parse_error_info.rc = TLV_RC_UNEXPECTED_END_OF_STREAM;
-		tlv_parse_error_info.pos = *buffer;
+	if (!length)
 		return TLV_RC_UNEXPECTED_END_OF_STREAM;
-	}
 
 	p = (const uint8_t *)*buffer;
 
-	if (p[0] == 0x80u) {
-		tlv_parse_error_info.rc =
-					 TLV_RC_INDEFINITE_LENGTH_NOT_SUPPORTED;
-		tlv_parse_error_info.pos = *buffer;
+	if (p[0] == 0x80u)
 		return TLV_RC_INDEFINITE_LENGTH_NOT_SUPPORTED;
-	}
 
 	if (!(p[0] & 0x80u)) {
 		tlv->length = (size_t)p[0];
@@ -171,11 +544,11 @@ static int tlv_parse_length(const void **buffer, size_t length, struct tlv *tlv)
 
 	value_length = (int)(p[0] & 0x7fu);
 
-	if (value_length > (int)sizeof(size_t)) {
-		tlv_parse_error_info.rc = TLV_RC_VALUE_LENGTH_TOO_LARGE;
-		tlv_parse_error_info.pos = *buffer;
+	if (value_length > (int)sizeof(size_t))
 		return TLV_RC_VALUE_LENGTH_TOO_LARGE;
-	}
+
+	if (length < (size_t)value_length + 1)
+		return TLV_RC_UNEXPECTED_END_OF_STREAM;
 
 	for (i = 0, tlv->length = 0; i < value_length; i++) {
 		tlv->length <<= 8;
@@ -186,129 +559,308 @@ static int tlv_parse_length(const void **buffer, size_t length, struct tlv *tlv)
 	return TLV_RC_OK;
 }
 
-static int tlv_parse_recursive(const void **buffer, size_t length,
-			 struct tlv **tlv, struct tlv *prev, struct tlv *parent,
-							     bool parse_shallow)
+void libtlv_set_max_depth(unsigned int max_depth)
 {
-	struct tlv temp_tlv;
-	const void *start = *buffer;
-	ssize_t remaining = 0;
-	int rc = TLV_RC_OK;
+	libtlv_ctx_set_max_depth(&default_ctx, max_depth);
+}
 
-	if (!length)
-		goto done;
+/* EMV v4.3 Book 3: 'Before, between, or after TLV-coded data objects, '00'
+ * bytes without any meaning may occur (for example, due to erased or modified
+ * TLV-coded data objects).'						      */
+static const uint8_t *tlv_skip_padding(const uint8_t *p, const uint8_t *end)
+{
+	uint64_t word;
+
+	/* Most data has no padding at all.  Long runs, e.g. erased records in
+	 * a file, are skipped a word at a time.			      */
+	while ((p < end) && (*p == 0x00u)) {
+		if ((size_t)(end - p) >= sizeof(word)) {
+			memcpy(&word, p, sizeof(word));
+			if (!word) {
+				p += sizeof(word);
+				continue;
+			}
+		}
 
-	if (!buffer || !(*buffer) || !tlv) {
-		log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
-			    "%s(buffer: %p, *buffer: %p, length: %d, tlv: %p): "
-					  "Invalid arguments", __func__, buffer,
-				     buffer ? *buffer : NULL, (int)length, tlv);
-		rc = TLV_RC_INVALID_ARG;
-		goto done;
+		p++;
 	}
 
-	*tlv = NULL;
-
-	/* EMV v4.3 Book 3: 'Before, between, or after TLV-coded data
-	 * objects, '00' bytes without any meaning may occur (for example, due
-	 * to erased or modified TLV-coded data objects).'		      */
-	remaining = length;
-	while ((remaining > 0) && (*((uint8_t *)*buffer) == '\x00')) {
-		(*buffer)++;
-		remaining--;
-	}
+	return p;
+}
 
-	if (!remaining)
-		goto done;
+/* Parses without recursion.  The only state kept per level of nesting is the
+ * end of the enclosing constructed value, which lives on an explicit stack.
+ * Siblings therefore cost no stack space at all and nesting is bounded by
+ * the maximum depth.  Errors are reported through ctx only, so that parsing
+ * does not touch any shared state.					      */
+static int tlv_parse_iterative(struct libtlv_ctx *libctx,
+		       const void *buffer, size_t length, struct tlv **tlv,
+		       unsigned int flags, struct tlv_arena *arena,
+						     struct tlv_parse_ctx *ctx)
+{
+	const uint8_t *ends_inline[TLV_PARSE_STACK_INLINE];
+	const uint8_t **ends = ends_inline, **new_ends = NULL;
+	size_t depth = 0, ends_sz = ARRAY_SIZE(ends_inline);
+	const uint8_t *p = (const uint8_t *)buffer, *end = p + length;
+	struct tlv *root = NULL, *parent = NULL, *prev = NULL, *node = NULL;
+	unsigned int max_depth = ctx->max_depth ? ctx->max_depth :
+							       libctx->max_depth;
+	int rc = TLV_RC_OK;
 
-	memset(&temp_tlv, 0, sizeof(temp_tlv));
-	temp_tlv.parent = parent;
-	temp_tlv.prev   = prev;
+	for (;;) {
+		const uint8_t *level_end = depth ? ends[depth - 1] : end;
+		struct tlv temp_tlv;
+		const void *pos = NULL;
+		bool constructed = false, lazy = false;
+		size_t value_length;
 
-	rc = tlv_parse_identifier(buffer, remaining, &temp_tlv);
-	if (rc)
-		goto done;
+		p = tlv_skip_padding(p, level_end);
 
-	remaining = length - (*buffer - start);
-	rc = tlv_parse_length(buffer, remaining, &temp_tlv);
-	if (rc)
-		goto done;
+		if (p == level_end) {
+			if (!depth)
+				break;
 
-	remaining = length - (*buffer - start);
-	if (remaining < temp_tlv.length) {
-		tlv_parse_error_info.rc = TLV_RC_UNEXPECTED_END_OF_STREAM;
-		tlv_parse_error_info.pos = *buffer;
-		rc = TLV_RC_OUT_OF_MEMORY;
-		goto done;
-	}
+			/* End of a constructed value.  Continue with the
+			 * siblings of the constructed TLV node.	      */
+			prev = parent;
+			parent = parent->parent;
+			depth--;
+			continue;
+		}
 
-	*tlv = (struct tlv *)malloc(sizeof(struct tlv) + temp_tlv.length);
-	if (!*tlv) {
-		tlv_parse_error_info.rc = TLV_RC_OUT_OF_MEMORY;
-		tlv_parse_error_info.pos = start;
-		rc = TLV_RC_OUT_OF_MEMORY;
-		goto done;
-	}
+		memset(&temp_tlv, 0, sizeof(temp_tlv));
 
-	memcpy(*tlv, &temp_tlv, sizeof(struct tlv));
+		pos = p;
+		rc = tlv_parse_identifier(&pos, level_end - p, &temp_tlv);
+		if (rc != TLV_RC_OK)
+			goto done;
 
-	if (!parse_shallow && ((*tlv)->tag[0] & TLV_TAG_P_C_MASK)) {
-		rc = tlv_parse_recursive(buffer, (*tlv)->length, &(*tlv)->child,
-						     NULL, *tlv, parse_shallow);
-		if (rc != TLV_RC_OK) {
-			free(*tlv);
-			*tlv = NULL;
+		p = (const uint8_t *)pos;
+		rc = tlv_parse_length(&pos, level_end - p, &temp_tlv);
+		if (rc != TLV_RC_OK)
 			goto done;
-		}
-	} else {
-		remaining = length - (*buffer - start);
-		if (remaining < (*tlv)->length) {
-			tlv_parse_error_info.rc =
-						TLV_RC_UNEXPECTED_END_OF_STREAM;
-			tlv_parse_error_info.pos = start;
+
+		p = (const uint8_t *)pos;
+
+		if ((size_t)(level_end - p) < temp_tlv.length) {
 			rc = TLV_RC_UNEXPECTED_END_OF_STREAM;
 			goto done;
 		}
 
-		memcpy((*tlv)->value, *buffer, (*tlv)->length);
-		*buffer += (*tlv)->length;
-	}
+		constructed = !(flags & (TLV_PARSE_F_SHALLOW |
+						      TLV_PARSE_F_LAZY)) &&
+					   (temp_tlv.tag[0] & TLV_TAG_P_C_MASK);
+		lazy = (flags & TLV_PARSE_F_LAZY) && temp_tlv.length &&
+					   (temp_tlv.tag[0] & TLV_TAG_P_C_MASK);
+
+		/* Only copies of primitive values need storage in the node.  */
+		value_length = (constructed || (flags & TLV_PARSE_F_VIEW)) ?
+							   0 : temp_tlv.length;
+		if (lazy)
+			node = tlv_alloc_lazy(arena, value_length, libctx);
+		else
+			node = tlv_alloc(arena, value_length);
+		if (!node) {
+			rc = TLV_RC_OUT_OF_MEMORY;
+			goto done;
+		}
 
+		memcpy(node->tag, temp_tlv.tag, sizeof(node->tag));
+		node->key = temp_tlv.key;
+		node->length = temp_tlv.length;
+		node->parent = parent;
+		node->prev = prev;
+		node->next = NULL;
+		node->child = NULL;
+
+		if (prev)
+			prev->next = node;
+		else if (parent)
+			parent->child = node;
+		else
+			root = node;
+
+		if (!constructed) {
+			if (flags & TLV_PARSE_F_VIEW) {
+				node->value = (uint8_t *)p;
+				node->flags |= TLV_NODE_F_BORROWED;
+			} else {
+				memcpy(node->value, p, node->length);
+			}
 
-	/* EMV v4.3 Book 3: 'Before, between, or after TLV-coded data
-	 * objects, '00' bytes without any meaning may occur (for example, due
-	 * to erased or modified TLV-coded data objects).'		      */
-	remaining = length - (*buffer - start);
-	while ((remaining > 0) && (*((uint8_t *)*buffer) == '\x00')) {
-		*buffer += 1;
-		remaining--;
-	}
+			p += node->length;
+			prev = node;
+			continue;
+		}
 
-	if (remaining > 0) {
-		rc = tlv_parse_recursive(buffer, remaining,
-				    &(*tlv)->next, *tlv, parent, parse_shallow);
-		if (rc != TLV_RC_OK) {
-			free(*tlv);
-			*tlv = NULL;
+		if (depth == max_depth) {
+			rc = TLV_RC_MAX_DEPTH_EXCEEDED;
 			goto done;
 		}
+
+		if (depth == ends_sz) {
+			new_ends = (const uint8_t **)malloc(2 * ends_sz *
+							       sizeof(*ends));
+			if (!new_ends) {
+				rc = TLV_RC_OUT_OF_MEMORY;
+				goto done;
+			}
+
+			memcpy(new_ends, ends, ends_sz * sizeof(*ends));
+			if (ends != ends_inline)
+				free(ends);
+			ends = new_ends;
+			ends_sz *= 2;
+		}
+
+		/* Descend into the constructed value.			      */
+		ends[depth++] = p + node->length;
+		parent = node;
+		prev = NULL;
 	}
 
 done:
+	if (ends != ends_inline)
+		free(ends);
+
+	ctx->rc = rc;
+	ctx->offset = 0;
+
 	if (rc != TLV_RC_OK) {
-		if (start) {
-			char hex[length * 2 + 1];
+		ctx->offset = p - (const uint8_t *)buffer;
+		tlv_free(root);
+		root = NULL;
+	}
 
-			log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
-				"%s() failed! rc %d, length: %d, ber-tlv: '%s'",
-						      __func__, rc, (int)length,
-					 libtlv_bin_to_hex(start, length, hex));
-		}
+	*tlv = root;
+
+	return rc;
+}
+
+/* Logs a hex dump of at most 2 * TLV_PARSE_ERROR_WINDOW bytes around the
+ * offset at which parsing failed, no matter how large the input was.	      */
+static void tlv_log_parse_error(const struct libtlv_ctx *libctx,
+		       const char *caller, const void *buffer, size_t length,
+					       const struct tlv_parse_ctx *ctx)
+{
+	char hex[4 * TLV_PARSE_ERROR_WINDOW + 1];
+	size_t first = 0, last = 0;
+
+	if (!LIBPAY_LOG_ENABLED(libctx->log_cat, LOG4C_PRIORITY_NOTICE))
+		return;
+
+	first = ctx->offset > TLV_PARSE_ERROR_WINDOW ?
+				      ctx->offset - TLV_PARSE_ERROR_WINDOW : 0;
+	last = MIN(length, ctx->offset + TLV_PARSE_ERROR_WINDOW);
+
+	LIBPAY_LOG(libctx->log_cat, LOG4C_PRIORITY_NOTICE,
+		       "%s() failed at offset %d of %d with rc %d: %s'%s'%s",
+			       caller, (int)ctx->offset, (int)length, ctx->rc,
+						      first ? "..." : "",
+			 libtlv_bin_to_hex((const uint8_t *)buffer + first,
+						     last - first, hex),
+						   last < length ? "..." : "");
+}
+
+static int tlv_parse_buffer(struct libtlv_ctx *libctx, const char *caller,
+		       const void *buffer, size_t length, struct tlv **tlv,
+		       unsigned int flags, struct tlv_arena *arena,
+						     struct tlv_parse_ctx *ctx)
+{
+	struct tlv_parse_ctx local_ctx;
+	int rc = TLV_RC_OK;
+
+	if (!ctx) {
+		memset(&local_ctx, 0, sizeof(local_ctx));
+		ctx = &local_ctx;
+	}
+
+	ctx->rc = TLV_RC_OK;
+	ctx->offset = 0;
+
+	if (!tlv || (length && !buffer)) {
+		LIBPAY_LOG(libctx->log_cat, LOG4C_PRIORITY_NOTICE,
+				   "%s(buffer: %p, length: %d, tlv: %p): "
+				   "Invalid arguments", caller, buffer,
+							      (int)length, tlv);
+		ctx->rc = TLV_RC_INVALID_ARG;
+		return TLV_RC_INVALID_ARG;
 	}
 
+	*tlv = NULL;
+
+	if (!length)
+		return TLV_RC_OK;
+
+	rc = tlv_parse_iterative(libctx, buffer, length, tlv, flags, arena,
+									   ctx);
+	if (rc != TLV_RC_OK)
+		tlv_log_parse_error(libctx, caller, buffer, length, ctx);
+
 	return rc;
 }
 
+/* A lazy node failed to expand.  Log it through the context the node was
+ * parsed with and, unless that is the process wide default context, record
+ * the failure as the context's last parse outcome.			      */
+static void tlv_expand_error(struct libtlv_ctx *libctx,
+		       const struct tlv *node, const struct tlv_parse_ctx *ctx)
+{
+	tlv_log_parse_error(libctx, "tlv_expand", node->value, node->length,
+									   ctx);
+
+	if (libctx != &default_ctx)
+		libctx->error = *ctx;
+}
+
+/* Parse the children of a lazy node on first access, with the limits of the
+ * context the node was parsed with.  Like the cached sizes, this is not part
+ * of the observable state of the tree, hence the cast.  If the value turns
+ * out to be malformed, the node keeps it and is treated like a primitive
+ * node from then on.							      */
+static void tlv_expand(const struct tlv *tlv)
+{
+	struct tlv *node = (struct tlv *)tlv, *child = NULL;
+	unsigned int flags = TLV_PARSE_F_LAZY;
+	struct libtlv_ctx *libctx = NULL;
+	struct tlv_parse_ctx ctx;
+	int rc = TLV_RC_OK;
+
+	if (!(node->flags & TLV_NODE_F_LAZY))
+		return;
+
+	node->flags &= ~TLV_NODE_F_LAZY;
+
+	if (node->flags & TLV_NODE_F_BORROWED)
+		flags |= TLV_PARSE_F_VIEW;
+
+	libctx = libtlv_ctx_get(tlv_lazy_ctx(node));
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	if (tlv_get_depth(node) >= (int)libctx->max_depth) {
+		ctx.rc = TLV_RC_MAX_DEPTH_EXCEEDED;
+		tlv_expand_error(libctx, node, &ctx);
+		return;
+	}
+
+	rc = tlv_parse_iterative(libctx, node->value, node->length, &child,
+						     flags, node->arena, &ctx);
+	if (rc != TLV_RC_OK) {
+		tlv_expand_error(libctx, node, &ctx);
+		return;
+	}
+
+	node->child = child;
+	for (; child; child = child->next)
+		child->parent = node;
+
+	/* The encoding of the children may differ from the value, e.g. if it
+	 * used long form lengths where short ones would do.		      */
+	tlv_invalidate_size(node->parent);
+	tlv_binding_invalidate(node);
+}
+
 struct tlv *tlv_set_identifier(struct tlv *tlv, const void *tag)
 {
 	int rc = TLV_RC_OK;
@@ -317,6 +869,9 @@ struct tlv *tlv_set_identifier(struct tlv *tlv, const void *tag)
 	if (rc != TLV_RC_OK)
 		goto error;
 
+	tlv_invalidate_size(tlv->parent);
+	tlv_binding_invalidate(tlv);
+
 	return tlv;
 error:
 	return NULL;
@@ -325,6 +880,8 @@ error:
 struct tlv *tlv_set_value(struct tlv *tlv, size_t length, const void *value)
 {
 	struct tlv *tlv_old = tlv;
+	bool borrowed = false;
+	size_t old_length, capacity;
 
 	if (!tlv)
 		return NULL;
@@ -334,15 +891,55 @@ struct tlv *tlv_set_value(struct tlv *tlv, size_t length, const void *value)
 
 	assert(!tlv->child);
 
+	/* A node that was lazy before tlv_set_identifier made it primitive
+	 * has no children left to expand.				      */
+	tlv->flags &= ~TLV_NODE_F_LAZY;
+
+	tlv_invalidate_size(tlv->parent);
+
+	old_length = tlv->length;
+
 	if (!length) {
 		tlv->length = 0;
+		if (tlv->binding)
+			tlv_binding_patch(tlv, old_length);
 		return tlv;
 	}
 
 	if (!value)
 		return NULL;
 
-	tlv = realloc(tlv, sizeof(*tlv) + length);
+	borrowed = tlv->flags & TLV_NODE_F_BORROWED;
+
+	if (borrowed) {
+		/* Never write to the caller's buffer.  Move the value into a
+		 * new node instead.					      */
+		tlv = tlv_alloc(tlv_old->arena, length);
+		if (!tlv)
+			return NULL;
+		memcpy(tlv, tlv_old, offsetof(struct tlv, value));
+		tlv->flags &= ~TLV_NODE_F_BORROWED;
+	} else if (length > tlv->capacity) {
+		/* Grow geometrically, so that a value which keeps growing
+		 * only moves the node a logarithmic number of times.	      */
+		capacity = MAX(length, 2 * tlv->capacity);
+
+		if (tlv->arena) {
+			/* Arena nodes can not be realloc'ed.  Move the node
+			 * to a fresh chunk of the same arena.		      */
+			tlv = tlv_alloc(tlv_old->arena, capacity);
+			if (!tlv)
+				return NULL;
+			memcpy(tlv, tlv_old, offsetof(struct tlv, value));
+		} else {
+			tlv = realloc(tlv, sizeof(*tlv) + capacity);
+			if (!tlv)
+				return NULL;
+			tlv->value = tlv->data;
+			tlv->capacity = capacity;
+		}
+	}
+
 	tlv->length = length;
 	memcpy(tlv->value, value, length);
 
@@ -353,16 +950,49 @@ struct tlv *tlv_set_value(struct tlv *tlv, size_t length, const void *value)
 	if (tlv->parent && tlv->parent->child == tlv_old)
 		tlv->parent->child = tlv;
 
-	return tlv;
-}
+	if (tlv->binding) {
+		if (tlv != tlv_old)
+			tlv_binding_move(tlv->binding, tlv_old, tlv);
+		if (tlv->binding->head == tlv_old)
+			tlv->binding->head = tlv;
+		tlv_binding_patch(tlv, old_length);
+	}
+
+	/* After realloc() 'tlv_old' must not be dereferenced any more.     */
+	if (borrowed)
+		tlv_release(tlv_old);
+
+	return tlv;
+}
 
 struct tlv *tlv_unlink(struct tlv *tlv)
 {
+	struct tlv *node = NULL;
+
 	if (!tlv)
 		return tlv;
 
-	if (tlv->parent && tlv->parent->child == tlv)
+	tlv_invalidate_size(tlv->parent);
+
+	/* The subtree leaves the encoding it was bound to.		      */
+	for (node = tlv->binding ? tlv : NULL; node; ) {
+		tlv_binding_put(node);
+
+		if (node->child) {
+			node = node->child;
+			continue;
+		}
+
+		while ((node != tlv) && !node->next)
+			node = node->parent;
+		node = (node == tlv) ? NULL : node->next;
+	}
+
+	if (tlv->parent && tlv->parent->child == tlv) {
 		tlv->parent->child = tlv->next;
+		if (!tlv->next)
+			tlv->parent->length = 0;
+	}
 
 	if (tlv->prev)
 		tlv->prev->next = tlv->next;
@@ -379,261 +1009,1543 @@ struct tlv *tlv_unlink(struct tlv *tlv)
 
 void tlv_free(struct tlv *tlv)
 {
-	struct tlv *current, *next;
+	struct tlv *current, *next, *parent, *stop;
 
 	if (!tlv)
 		return;
 
+	tlv_invalidate_size(tlv->parent);
+
 	/* Unlink from parent, if applicable.				      */
-	if (tlv->parent && tlv->parent->child == tlv)
+	if (tlv->parent && tlv->parent->child == tlv) {
 		tlv->parent->child = NULL;
+		tlv->parent->length = 0;
+	}
 
 	/* Unlink from siblings 'to-the-left', if applicable.		      */
 	if (tlv->prev)
 		tlv->prev->next = NULL;
 
-	for (current = tlv; current; current = next) {
-		if (current->child)
-			tlv_free(current->child);
+	/* Post-order walk without recursion.  A constructed node is released
+	 * once the walk returns to it with all of its children released.   */
+	stop = tlv->parent;
+	for (current = tlv; current; ) {
+		if (current->child) {
+			current = current->child;
+			continue;
+		}
 
 		next = current->next;
-		free(current);
+		parent = current->parent;
+		tlv_binding_put(current);
+		tlv_release(current);
+
+		if (next) {
+			current = next;
+		} else if (parent != stop) {
+			parent->child = NULL;
+			current = parent;
+		} else {
+			current = NULL;
+		}
 	}
 }
 
 int tlv_parse(const void *buffer, size_t length, struct tlv **tlv)
 {
-	const void *start = buffer;
-	int rc = TLV_RC_OK;
+	return tlv_parse_buffer(&default_ctx, __func__, buffer, length, tlv, 0,
+								    NULL, NULL);
+}
 
-	tlv_parse_error_info.rc = TLV_RC_OK;
+int tlv_parse_r(const void *buffer, size_t length, struct tlv **tlv,
+						     struct tlv_parse_ctx *ctx)
+{
+	return tlv_parse_buffer(&default_ctx, __func__, buffer, length, tlv, 0,
+								     NULL, ctx);
+}
 
-	if (!length) {
-		*tlv = NULL;
-		goto done;
-	}
+int tlv_shallow_parse(const void *buffer, size_t length, struct tlv **tlv)
+{
+	return tlv_parse_buffer(&default_ctx, __func__, buffer, length, tlv,
+					       TLV_PARSE_F_SHALLOW, NULL, NULL);
+}
 
-	rc = tlv_parse_recursive(&buffer, length, tlv, NULL, NULL, false);
-done:
-	if (tlv_parse_error_info.rc != TLV_RC_OK) {
-		char hex[length * 2 + 1];
+int tlv_shallow_parse_r(const void *buffer, size_t length, struct tlv **tlv,
+						     struct tlv_parse_ctx *ctx)
+{
+	return tlv_parse_buffer(&default_ctx, __func__, buffer, length, tlv,
+						TLV_PARSE_F_SHALLOW, NULL, ctx);
+}
 
-		log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
-			    "%s('%s') failed at offset %d with rc %d", __func__,
-					  libtlv_bin_to_hex(start, length, hex),
-					(int)(tlv_parse_error_info.pos - start),
-						       tlv_parse_error_info.rc);
-	}
+int tlv_parse_arena(struct tlv_arena *arena, const void *buffer, size_t length,
+							       struct tlv **tlv)
+{
+	if (!arena)
+		return TLV_RC_INVALID_ARG;
 
-	return rc;
+	return tlv_parse_buffer(&default_ctx, __func__, buffer, length, tlv, 0,
+								   arena, NULL);
 }
 
-int tlv_shallow_parse(const void *buffer, size_t length, struct tlv **tlv)
+int tlv_view_parse(const void *buffer, size_t length, struct tlv **tlv)
+{
+	return tlv_parse_buffer(&default_ctx, __func__, buffer, length, tlv,
+						  TLV_PARSE_F_VIEW, NULL, NULL);
+}
+
+int tlv_lazy_parse(const void *buffer, size_t length, struct tlv **tlv)
+{
+	return tlv_parse_buffer(&default_ctx, __func__, buffer, length, tlv,
+			       TLV_PARSE_F_VIEW | TLV_PARSE_F_LAZY, NULL, NULL);
+}
+
+/* Parses through 'ctx' use its limits and allocator and record their outcome
+ * in the context, see libtlv_ctx_get_error.  The process wide default context
+ * is shared by all threads, so parses through it keep their outcome on the
+ * stack like the functions without a context argument.		      */
+static int tlv_parse_with_ctx(struct libtlv_ctx *ctx, const char *caller,
+		const void *buffer, size_t length, struct tlv **tlv,
+							    unsigned int flags)
+{
+	ctx = libtlv_ctx_get(ctx);
+	if (ctx == &default_ctx)
+		return tlv_parse_buffer(ctx, caller, buffer, length, tlv,
+						     flags, ctx->arena, NULL);
+
+	ctx->error.max_depth = 0;
+
+	return tlv_parse_buffer(ctx, caller, buffer, length, tlv, flags,
+						       ctx->arena, &ctx->error);
+}
+
+int tlv_parse_ctx(struct libtlv_ctx *ctx, const void *buffer, size_t length,
+							       struct tlv **tlv)
+{
+	return tlv_parse_with_ctx(ctx, __func__, buffer, length, tlv, 0);
+}
+
+int tlv_shallow_parse_ctx(struct libtlv_ctx *ctx, const void *buffer,
+					       size_t length, struct tlv **tlv)
+{
+	return tlv_parse_with_ctx(ctx, __func__, buffer, length, tlv,
+							  TLV_PARSE_F_SHALLOW);
+}
+
+int tlv_view_parse_ctx(struct libtlv_ctx *ctx, const void *buffer,
+					       size_t length, struct tlv **tlv)
+{
+	return tlv_parse_with_ctx(ctx, __func__, buffer, length, tlv,
+							     TLV_PARSE_F_VIEW);
+}
+
+int tlv_lazy_parse_ctx(struct libtlv_ctx *ctx, const void *buffer,
+					       size_t length, struct tlv **tlv)
+{
+	return tlv_parse_with_ctx(ctx, __func__, buffer, length, tlv,
+					  TLV_PARSE_F_VIEW | TLV_PARSE_F_LAZY);
+}
+
+/* Follows tlv_parse_iterative step by step, so that both accept the same
+ * input and fail at the same offset, but keeps the ends of the enclosing
+ * constructed values in a fixed array on the stack instead of building
+ * nodes.								      */
+static int tlv_walk(const void *buffer, size_t length,
+		const struct tlv_limits *limits,
+		int (*callback)(void *priv, const struct tlv_record *record),
+					     void *priv, size_t *error_offset)
 {
-	const void *start = buffer;
+	const uint8_t *ends[TLV_VALIDATE_MAX_DEPTH];
+	const uint8_t *p = (const uint8_t *)buffer, *end = p + length;
+	struct tlv_record record;
+	unsigned int depth = 0, max_depth = 0;
+	size_t max_nodes = 0, max_value_length = 0, nodes = 0;
 	int rc = TLV_RC_OK;
 
-	if (!length) {
-		*tlv = NULL;
+	if (length && !buffer) {
+		rc = TLV_RC_INVALID_ARG;
 		goto done;
 	}
 
-	tlv_parse_error_info.rc = TLV_RC_OK;
+	if (limits) {
+		max_depth = limits->max_depth;
+		max_nodes = limits->max_nodes;
+		max_value_length = limits->max_value_length;
+	}
+
+	if (!max_depth)
+		max_depth = default_ctx.max_depth;
+	max_depth = MIN(max_depth, TLV_VALIDATE_MAX_DEPTH);
 
-	rc = tlv_parse_recursive(&buffer, length, tlv, NULL, NULL, true);
-done:
-	if (tlv_parse_error_info.rc != TLV_RC_OK) {
-		char hex[length * 2 + 1];
+	for (;;) {
+		const uint8_t *level_end = depth ? ends[depth - 1] : end;
+		const uint8_t *tag = NULL;
+		struct tlv temp_tlv;
+		const void *pos = NULL;
+
+		p = tlv_skip_padding(p, level_end);
+
+		if (p == level_end) {
+			if (!depth)
+				break;
+
+			depth--;
+			continue;
+		}
+
+		tag = p;
+
+		pos = p;
+		rc = tlv_parse_identifier(&pos, level_end - p, &temp_tlv);
+		if (rc != TLV_RC_OK)
+			goto done;
+
+		p = (const uint8_t *)pos;
+		rc = tlv_parse_length(&pos, level_end - p, &temp_tlv);
+		if (rc != TLV_RC_OK)
+			goto done;
+
+		p = (const uint8_t *)pos;
+
+		if ((size_t)(level_end - p) < temp_tlv.length) {
+			rc = TLV_RC_UNEXPECTED_END_OF_STREAM;
+			goto done;
+		}
+
+		if (max_nodes && ++nodes > max_nodes) {
+			p = tag;
+			rc = TLV_RC_TOO_MANY_NODES;
+			goto done;
+		}
+
+		record.tag = tag;
+		record.key = temp_tlv.key;
+		record.header_length = p - tag;
+		record.value = p;
+		record.length = temp_tlv.length;
+		record.depth = depth;
+		record.constructed = temp_tlv.tag[0] & TLV_TAG_P_C_MASK;
+
+		if (!record.constructed && max_value_length &&
+					 (record.length > max_value_length)) {
+			rc = TLV_RC_VALUE_LENGTH_TOO_LARGE;
+			goto done;
+		}
+
+		if (callback) {
+			rc = callback(priv, &record);
+			if (rc != TLV_RC_OK)
+				goto done;
+		}
+
+		if (!record.constructed) {
+			p += record.length;
+			continue;
+		}
+
+		if (depth == max_depth) {
+			rc = TLV_RC_MAX_DEPTH_EXCEEDED;
+			goto done;
+		}
 
-		log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
-			    "%s('%s') failed at offset %d with rc %d", __func__,
-					  libtlv_bin_to_hex(start, length, hex),
-					(int)(tlv_parse_error_info.pos - start),
-						       tlv_parse_error_info.rc);
+		ends[depth++] = p + record.length;
 	}
 
+done:
+	if (error_offset)
+		*error_offset = rc != TLV_RC_OK ?
+					    p - (const uint8_t *)buffer : 0;
+
 	return rc;
 }
 
-static size_t tlv_get_encoded_identifier_size(const struct tlv *tlv)
+int tlv_validate(const void *buffer, size_t length,
+		   const struct tlv_limits *limits, size_t *error_offset)
 {
-	size_t i;
+	return tlv_walk(buffer, length, limits, NULL, NULL, error_offset);
+}
 
-	if (!tlv) {
-		log4c_category_log(log_cat, LOG4C_PRIORITY_ERROR,
-				"%s(tlv: %p): Invalid argument", __func__, tlv);
-		return -1;
+int tlv_scan(const void *buffer, size_t length, const struct tlv_limits *limits,
+	      int (*callback)(void *priv, const struct tlv_record *record),
+					      void *priv, size_t *error_offset)
+{
+	if (!callback) {
+		if (error_offset)
+			*error_offset = 0;
+		return TLV_RC_INVALID_ARG;
 	}
 
-	if ((tlv->tag[0] & TLV_TAG_NUMBER_MASK) != 0x1Fu)
-		return 1;
+	return tlv_walk(buffer, length, limits, callback, priv, error_offset);
+}
 
-	for (i = 1; i < sizeof(tlv->tag); i++)
-		if (!(tlv->tag[i] & 0x80))
-			return i + 1;
+int tlv_path_compile(const char *expression, struct tlv_path **path)
+{
+	uint8_t tag[TLV_MAX_TAG_LENGTH];
+	struct tlv_path *result = NULL;
+	struct tlv_path_step *step = NULL;
+	const char *p = expression;
+	size_t num_steps = 1, tag_sz, len;
+	int rc = TLV_RC_OK;
 
-	return -1;
-}
+	if (!expression || !path)
+		return TLV_RC_INVALID_ARG;
 
-static size_t tlv_get_encoded_length(const struct tlv *tlv);
+	for (p = expression; *p; p++)
+		if (*p == '/')
+			num_steps++;
 
-static size_t tlv_get_encoded_length_size(const struct tlv *tlv)
-{
-	size_t length;
+	if (num_steps > TLV_PATH_MAX_STEPS)
+		return TLV_RC_INVALID_ARG;
 
-	if (tlv_is_constructed(tlv))
-		length = tlv_get_encoded_length(tlv->child);
-	else
-		length = tlv->length;
+	result = (struct tlv_path *)malloc(sizeof(*result) +
+				      num_steps * sizeof(struct tlv_path_step));
+	if (!result)
+		return TLV_RC_OUT_OF_MEMORY;
 
-	if (length < 0x80u)
-		return 1;
-	if (length < 0x100u)
-		return 2;
-	if (length < 0x10000u)
-		return 3;
-	if (length < 0x1000000u)
-		return 4;
-	return 5;
-}
+	result->num_steps = num_steps;
 
-static size_t tlv_get_encoded_length(const struct tlv *tlv)
-{
-	size_t size;
+	for (p = expression, step = result->steps; ; step++) {
+		memset(tag, 0, sizeof(tag));
+		tag_sz = sizeof(tag);
+		len = strcspn(p, "/*");
 
-	if (!tlv)
-		return 0;
+		/* Each step has to be exactly one well-formed tag.	      */
+		rc = libtlv_hex_decode(p, len, tag, &tag_sz);
+		if ((rc != TLV_RC_OK) || !tag_sz ||
+				      (libtlv_get_tag_length(tag) != tag_sz)) {
+			rc = TLV_RC_INVALID_ARG;
+			goto done;
+		}
 
-	size = tlv_get_encoded_identifier_size(tlv);
-	size += tlv_get_encoded_length_size(tlv);
+		step->key = libtlv_tag_to_key(tag);
+		step->all = p[len] == '*';
+		p += len + step->all;
 
-	if (tlv_is_constructed(tlv))
-		size += tlv_get_encoded_length(tlv->child);
-	else
-		size += tlv->length;
+		if (!*p)
+			break;
 
-	if (tlv->next)
-		size += tlv_get_encoded_length(tlv->next);
+		if (*p++ != '/') {
+			rc = TLV_RC_INVALID_ARG;
+			goto done;
+		}
+	}
 
-	return size;
+done:
+	if (rc != TLV_RC_OK) {
+		free(result);
+		result = NULL;
+	}
+
+	*path = result;
+
+	return rc;
 }
 
-static size_t libtlv_copy_tag(void *buffer, size_t size, const void *tag)
+/* Only the ends of the nodes that matched the steps so far are kept, one per
+ * step.  Once a step that selects the first match only has matched, the rest
+ * of its level is skipped.						      */
+int tlv_path_eval(const struct tlv_path *path, const void *buffer,
+		   size_t length,
+		   int (*callback)(void *priv, const struct tlv_record *record),
+								     void *priv)
 {
-	size_t tag_len;
-	uint8_t *b = (uint8_t *)buffer;
-	const uint8_t *t = (const uint8_t *)tag;
+	const uint8_t *ends[TLV_PATH_MAX_STEPS];
+	const uint8_t *p = (const uint8_t *)buffer, *end = p + length;
+	const struct tlv_path_step *step = NULL;
+	struct tlv_record record;
+	unsigned int depth = 0;
+	int rc = TLV_RC_OK;
 
-	if (!buffer || !size || !tag)
-		return -1;
+	if (!path || !callback || (length && !buffer))
+		return TLV_RC_INVALID_ARG;
 
-	b[0] = t[0];
+	for (;;) {
+		const uint8_t *level_end = depth ? ends[depth - 1] : end;
+		struct tlv temp_tlv;
+		const void *pos = NULL;
 
-	if ((t[0] & TLV_TAG_NUMBER_MASK) != 0x1Fu)
-		return 1;
+		step = &path->steps[depth];
 
-	for (tag_len = 1; tag_len < size; ) {
-		b[tag_len] = t[tag_len];
-		if (!(t[tag_len++] & 0x80u))
+		p = tlv_skip_padding(p, level_end);
+
+		if (p == level_end) {
+			if (!depth)
+				break;
+
+			/* Continue after the node that matched the previous
+			 * step, if that step selects all matches.	      */
+			depth--;
+			if (!path->steps[depth].all)
+				p = depth ? ends[depth - 1] : end;
+			continue;
+		}
+
+		record.tag = p;
+
+		pos = p;
+		rc = tlv_parse_identifier(&pos, level_end - p, &temp_tlv);
+		if (rc != TLV_RC_OK)
+			break;
+
+		p = (const uint8_t *)pos;
+		rc = tlv_parse_length(&pos, level_end - p, &temp_tlv);
+		if (rc != TLV_RC_OK)
+			break;
+
+		p = (const uint8_t *)pos;
+
+		if ((size_t)(level_end - p) < temp_tlv.length) {
+			rc = TLV_RC_UNEXPECTED_END_OF_STREAM;
 			break;
+		}
+
+		if (temp_tlv.key != step->key) {
+			p += temp_tlv.length;
+			continue;
+		}
+
+		if (depth + 1 < path->num_steps) {
+			if (temp_tlv.tag[0] & TLV_TAG_P_C_MASK) {
+				ends[depth++] = p + temp_tlv.length;
+				continue;
+			}
+		} else {
+			record.key = temp_tlv.key;
+			record.header_length = p - record.tag;
+			record.value = p;
+			record.length = temp_tlv.length;
+			record.depth = depth;
+			record.constructed = temp_tlv.tag[0] &
+							       TLV_TAG_P_C_MASK;
+
+			rc = callback(priv, &record);
+			if (rc != TLV_RC_OK)
+				break;
+		}
+
+		p += temp_tlv.length;
+		if (!step->all)
+			p = level_end;
 	}
 
-	if (tag_len == size)
-		return -1;
+	return rc;
+}
 
-	return tag_len;
+void tlv_path_free(struct tlv_path *path)
+{
+	free(path);
 }
 
-static void __tlv_encode_length(size_t length, void **buffer)
+struct tlv_stream_parser *tlv_stream_parser_new(
+		const struct tlv_stream_callbacks *callbacks, void *priv,
+							    size_t buffer_size)
 {
-	uint8_t *p = (uint8_t *)*buffer;
+	struct tlv_stream_parser *parser = NULL;
+	size_t levels_sz = 0;
 
-	if (length < (size_t)0x80u) {
-		p[0] = (uint8_t)(length & 0x7fu);
-		*buffer = (void *)&p[1];
-		return;
-	}
+	if (!callbacks)
+		return NULL;
 
-	if (length < 0x100u) {
-		p[0] = 0x81u;
-		p[1] = (uint8_t)length;
-		*buffer = (void *)&p[2];
-		return;
-	}
+	levels_sz = default_ctx.max_depth * sizeof(struct tlv_stream_level);
 
-	if (length < 0x10000u) {
-		p[0] = 0x82u;
-		p[1] = (uint8_t)(length >> 8);
-		p[2] = (uint8_t)length;
-		*buffer = (void *)&p[3];
-		return;
-	}
+	parser = (struct tlv_stream_parser *)calloc(1, sizeof(*parser) +
+						       levels_sz + buffer_size);
+	if (!parser)
+		return NULL;
 
-	if (length < 0x1000000u) {
-		p[0] = 0x83u;
-		p[1] = (uint8_t)(length >> 16);
-		p[2] = (uint8_t)(length >> 8);
-		p[3] = (uint8_t)length;
-		*buffer = (void *)&p[4];
-		return;
-	}
+	parser->cb = *callbacks;
+	parser->priv = priv;
+	parser->state = TLV_STREAM_S_TAG;
+	parser->max_depth = default_ctx.max_depth;
+	parser->levels = (struct tlv_stream_level *)&parser[1];
+	parser->buffer_size = buffer_size;
+	parser->buffer = (uint8_t *)parser->levels + levels_sz;
 
-	p[0] = 0x84u;
-	p[1] = (uint8_t)(length >> 24);
-	p[2] = (uint8_t)(length >> 16);
-	p[3] = (uint8_t)(length >> 8);
-	p[4] = (uint8_t)length;
-	*buffer = (void *)&p[5];
+	return parser;
 }
 
-static void tlv_encode_recursive(const struct tlv *tlv, void **buffer)
+void tlv_stream_parser_free(struct tlv_stream_parser *parser)
 {
-	size_t tag_len = 0;
+	free(parser);
+}
 
-	if (!tlv)
-		return;
+uint64_t tlv_stream_parser_get_offset(const struct tlv_stream_parser *parser)
+{
+	return parser ? parser->offset : 0;
+}
 
-	tag_len = libtlv_copy_tag(*buffer, sizeof(tlv->tag), tlv->tag);
-	*buffer += tag_len;
+/* Leave all constructed nodes that end at the current offset.		      */
+static int tlv_stream_leave(struct tlv_stream_parser *parser)
+{
+	struct tlv_stream_level *level = NULL;
+	int rc = TLV_RC_OK;
 
-	if (tlv_is_constructed(tlv)) {
-		__tlv_encode_length(tlv_get_encoded_length(tlv->child), buffer);
-		tlv_encode_recursive(tlv->child, buffer);
-	} else {
-		__tlv_encode_length(tlv->length, buffer);
-		memcpy(*buffer, tlv->value, tlv->length);
-		*buffer = (void *)(((uint8_t *)*buffer) + tlv->length);
+	while (parser->depth &&
+			  parser->levels[parser->depth - 1].end == parser->offset) {
+		level = &parser->levels[--parser->depth];
+		if (parser->cb.leave) {
+			rc = parser->cb.leave(parser->priv, level->tag);
+			if (rc != TLV_RC_OK)
+				return rc;
+		}
 	}
 
-	if (tlv->next)
-		tlv_encode_recursive(tlv->next, buffer);
+	return TLV_RC_OK;
 }
 
-int tlv_encode(const struct tlv *tlv, void *buffer, size_t *size)
+static int tlv_stream_value(struct tlv_stream_parser *parser, size_t offset,
+					       const void *data, size_t size)
 {
-	size_t encoded_size = 0;
+	if (!parser->cb.value)
+		return TLV_RC_OK;
 
-	if (!size)
-		return TLV_RC_INVALID_ARG;
+	return parser->cb.value(parser->priv, parser->tag, parser->length,
+							   offset, data, size);
+}
+
+/* Tag and length of a node are complete.				      */
+static int tlv_stream_header(struct tlv_stream_parser *parser)
+{
+	struct tlv_stream_level *level = NULL;
+	int rc = TLV_RC_OK;
+
+	if (parser->depth && (parser->levels[parser->depth - 1].end -
+					     parser->offset < parser->length))
+		return TLV_RC_UNEXPECTED_END_OF_STREAM;
+
+	parser->tag_len = 0;
+	parser->value_done = 0;
+
+	if (!(parser->tag[0] & TLV_TAG_P_C_MASK)) {
+		parser->state = TLV_STREAM_S_VALUE;
+		if (parser->length)
+			return TLV_RC_OK;
+
+		parser->state = TLV_STREAM_S_TAG;
+		rc = tlv_stream_value(parser, 0, NULL, 0);
+		if (rc != TLV_RC_OK)
+			return rc;
+
+		return tlv_stream_leave(parser);
+	}
+
+	if (parser->depth == parser->max_depth)
+		return TLV_RC_MAX_DEPTH_EXCEEDED;
+
+	level = &parser->levels[parser->depth++];
+	level->end = parser->offset + parser->length;
+	memcpy(level->tag, parser->tag, sizeof(level->tag));
+
+	parser->state = TLV_STREAM_S_TAG;
+
+	if (parser->cb.enter) {
+		rc = parser->cb.enter(parser->priv, parser->tag,
+							       parser->length);
+		if (rc != TLV_RC_OK)
+			return rc;
+	}
+
+	return tlv_stream_leave(parser);
+}
+
+static int tlv_stream_feed(struct tlv_stream_parser *parser,
+					       const uint8_t *p, size_t size)
+{
+	const uint8_t *end = p + size;
+	size_t n;
+	int rc = TLV_RC_OK;
+
+	while (p < end) {
+		/* Tag and length must not cross the end of the parent.	      */
+		if (parser->depth && (parser->state != TLV_STREAM_S_VALUE) &&
+		    (parser->levels[parser->depth - 1].end == parser->offset))
+			return TLV_RC_UNEXPECTED_END_OF_STREAM;
+
+		switch (parser->state) {
+		case TLV_STREAM_S_TAG:
+			if (!parser->tag_len && (*p == 0x00u)) {
+				/* Padding between TLV nodes.		      */
+				p++;
+				parser->offset++;
+				rc = tlv_stream_leave(parser);
+				break;
+			}
+
+			if (parser->tag_len == sizeof(parser->tag))
+				return TLV_RC_TAG_NUMBER_TOO_LARGE;
+
+			parser->tag[parser->tag_len++] = *p++;
+			parser->offset++;
+
+			if (parser->tag_len == 1 ?
+			    ((parser->tag[0] & TLV_TAG_NUMBER_MASK) != 0x1Fu) :
+			    !(parser->tag[parser->tag_len - 1] & 0x80u))
+				parser->state = TLV_STREAM_S_LENGTH;
+			break;
+
+		case TLV_STREAM_S_LENGTH:
+			parser->offset++;
+
+			if (*p == 0x80u)
+				return TLV_RC_INDEFINITE_LENGTH_NOT_SUPPORTED;
+
+			if (!(*p & 0x80u)) {
+				parser->length = *p++;
+				rc = tlv_stream_header(parser);
+				break;
+			}
+
+			parser->length = 0;
+			parser->length_octets = *p++ & 0x7fu;
+			if (parser->length_octets > sizeof(size_t))
+				return TLV_RC_VALUE_LENGTH_TOO_LARGE;
+
+			parser->state = TLV_STREAM_S_LENGTH_LONG;
+			break;
+
+		case TLV_STREAM_S_LENGTH_LONG:
+			parser->length = (parser->length << 8) | *p++;
+			parser->offset++;
+
+			if (!--parser->length_octets)
+				rc = tlv_stream_header(parser);
+			break;
+
+		case TLV_STREAM_S_VALUE:
+			n = MIN((size_t)(end - p),
+				      parser->length - parser->value_done);
+
+			if (parser->length > parser->buffer_size) {
+				/* Too large to buffer, deliver in pieces.    */
+				rc = tlv_stream_value(parser,
+						       parser->value_done, p, n);
+			} else if (n == parser->length) {
+				/* Complete within this chunk, no copy.	      */
+				rc = tlv_stream_value(parser, 0, p, n);
+			} else {
+				memcpy(&parser->buffer[parser->value_done], p,
+									    n);
+				if (parser->value_done + n == parser->length)
+					rc = tlv_stream_value(parser, 0,
+						parser->buffer, parser->length);
+			}
+
+			p += n;
+			parser->offset += n;
+			parser->value_done += n;
+
+			if ((rc == TLV_RC_OK) &&
+				      (parser->value_done == parser->length)) {
+				parser->state = TLV_STREAM_S_TAG;
+				rc = tlv_stream_leave(parser);
+			}
+			break;
+		}
+
+		if (rc != TLV_RC_OK)
+			return rc;
+	}
+
+	return TLV_RC_OK;
+}
+
+int tlv_stream_parser_feed(struct tlv_stream_parser *parser,
+					       const void *data, size_t size)
+{
+	if (!parser || (size && !data))
+		return TLV_RC_INVALID_ARG;
+
+	if (parser->rc != TLV_RC_OK)
+		return parser->rc;
+
+	parser->rc = tlv_stream_feed(parser, (const uint8_t *)data, size);
+	if (parser->rc != TLV_RC_OK)
+		LIBPAY_LOG(default_ctx.log_cat, LOG4C_PRIORITY_NOTICE,
+				   "%s() failed at offset %llu with rc %d",
+				   __func__,
+				   (unsigned long long)parser->offset,
+				   parser->rc);
+
+	return parser->rc;
+}
+
+int tlv_stream_parser_finish(struct tlv_stream_parser *parser)
+{
+	if (!parser)
+		return TLV_RC_INVALID_ARG;
+
+	if (parser->rc != TLV_RC_OK)
+		return parser->rc;
+
+	if ((parser->state != TLV_STREAM_S_TAG) || parser->tag_len ||
+							      parser->depth)
+		parser->rc = TLV_RC_UNEXPECTED_END_OF_STREAM;
+
+	return parser->rc;
+}
+
+static size_t tlv_get_encoded_identifier_size(const struct tlv *tlv)
+{
+	size_t i;
+
+	if (!tlv) {
+		LIBPAY_LOG(default_ctx.log_cat, LOG4C_PRIORITY_ERROR,
+				"%s(tlv: %p): Invalid argument", __func__, tlv);
+		return -1;
+	}
+
+	if ((tlv->tag[0] & TLV_TAG_NUMBER_MASK) != 0x1Fu)
+		return 1;
+
+	for (i = 1; i < sizeof(tlv->tag); i++)
+		if (!(tlv->tag[i] & 0x80))
+			return i + 1;
+
+	return -1;
+}
+
+static size_t tlv_get_length_size(size_t length)
+{
+	if (length < 0x80u)
+		return 1;
+	if (length < 0x100u)
+		return 2;
+	if (length < 0x10000u)
+		return 3;
+	if (length < 0x1000000u)
+		return 4;
+	return 5;
+}
+
+static size_t tlv_get_content_length(const struct tlv *tlv)
+{
+	if (tlv_has_children(tlv))
+		return tlv->content_length;
+
+	return tlv->length;
+}
+
+static size_t tlv_get_node_size(const struct tlv *tlv)
+{
+	size_t length = tlv_get_content_length(tlv);
+
+	return tlv_get_encoded_identifier_size(tlv) +
+					   tlv_get_length_size(length) + length;
+}
+
+/* Bring the cached content lengths in the subtree below 'tlv' up to date.
+ * Only subtrees with a stale cache are visited, and each of their nodes is
+ * summed up exactly once, so this is O(n) after a full invalidation and
+ * O(depth) after a single modification.  The cache is not part of the
+ * observable state of the tree, hence the cast.			      */
+static void tlv_update_size(const struct tlv *tlv)
+{
+	struct tlv *root = (struct tlv *)tlv, *node, *child;
+	size_t sum;
+
+	if (!root->child || (root->flags & TLV_NODE_F_SIZE_VALID))
+		return;
+
+	for (node = root->child; ; ) {
+		if (node->child && !(node->flags & TLV_NODE_F_SIZE_VALID)) {
+			node = node->child;
+			continue;
+		}
+
+		while (!node->next) {
+			node = node->parent;
+
+			for (sum = 0, child = node->child; child;
+							   child = child->next)
+				sum += tlv_get_node_size(child);
+			node->content_length = sum;
+			node->flags |= TLV_NODE_F_SIZE_VALID;
+
+			if (node == root)
+				return;
+		}
+
+		node = node->next;
+	}
+}
+
+static size_t tlv_get_encoded_length(const struct tlv *tlv)
+{
+	size_t size = 0;
+
+	for (; tlv; tlv = tlv->next) {
+		tlv_update_size(tlv);
+		size += tlv_get_node_size(tlv);
+	}
+
+	return size;
+}
+
+static size_t libtlv_copy_tag(void *buffer, size_t size, const void *tag)
+{
+	size_t tag_len;
+	uint8_t *b = (uint8_t *)buffer;
+	const uint8_t *t = (const uint8_t *)tag;
+
+	if (!buffer || !size || !tag)
+		return -1;
+
+	b[0] = t[0];
+
+	if ((t[0] & TLV_TAG_NUMBER_MASK) != 0x1Fu)
+		return 1;
+
+	for (tag_len = 1; tag_len < size; ) {
+		b[tag_len] = t[tag_len];
+		if (!(t[tag_len++] & 0x80u))
+			break;
+	}
+
+	if (tag_len == size)
+		return -1;
+
+	return tag_len;
+}
+
+static void __tlv_encode_length(size_t length, void **buffer)
+{
+	uint8_t *p = (uint8_t *)*buffer;
+
+	if (length < (size_t)0x80u) {
+		p[0] = (uint8_t)(length & 0x7fu);
+		*buffer = (void *)&p[1];
+		return;
+	}
+
+	if (length < 0x100u) {
+		p[0] = 0x81u;
+		p[1] = (uint8_t)length;
+		*buffer = (void *)&p[2];
+		return;
+	}
+
+	if (length < 0x10000u) {
+		p[0] = 0x82u;
+		p[1] = (uint8_t)(length >> 8);
+		p[2] = (uint8_t)length;
+		*buffer = (void *)&p[3];
+		return;
+	}
+
+	if (length < 0x1000000u) {
+		p[0] = 0x83u;
+		p[1] = (uint8_t)(length >> 16);
+		p[2] = (uint8_t)(length >> 8);
+		p[3] = (uint8_t)length;
+		*buffer = (void *)&p[4];
+		return;
+	}
+
+	p[0] = 0x84u;
+	p[1] = (uint8_t)(length >> 24);
+	p[2] = (uint8_t)(length >> 16);
+	p[3] = (uint8_t)(length >> 8);
+	p[4] = (uint8_t)length;
+	*buffer = (void *)&p[5];
+}
+
+/* Pre-order walk over 'tlv' and its siblings.  All cached content lengths
+ * must be up to date.							      */
+static void tlv_encode_list(const struct tlv *tlv, void **buffer)
+{
+	const struct tlv *stop = tlv ? tlv->parent : NULL;
+	size_t tag_len = 0;
+
+	while (tlv) {
+		tag_len = libtlv_copy_tag(*buffer, sizeof(tlv->tag), tlv->tag);
+		*buffer += tag_len;
+
+		__tlv_encode_length(tlv_get_content_length(tlv), buffer);
+
+		if (tlv_has_children(tlv)) {
+			tlv = tlv->child;
+			continue;
+		}
+
+		memcpy(*buffer, tlv->value, tlv->length);
+		*buffer = (void *)(((uint8_t *)*buffer) + tlv->length);
+
+		while (!tlv->next && tlv->parent != stop)
+			tlv = tlv->parent;
+		tlv = tlv->next;
+	}
+}
+
+int tlv_encode(const struct tlv *tlv, void *buffer, size_t *size)
+{
+	size_t encoded_size = 0;
+
+	if (!size)
+		return TLV_RC_INVALID_ARG;
+
+	encoded_size = tlv_get_encoded_length(tlv);
+
+	if (!buffer) {
+		*size = encoded_size;
+		return TLV_RC_OK;
+	}
+
+	if (encoded_size > *size) {
+		*size = encoded_size;
+		return TLV_RC_BUFFER_OVERFLOW;
+	}
+
+	*size = encoded_size;
+
+	if (!buffer)
+		return TLV_RC_INVALID_ARG;
+
+	tlv_encode_list(tlv, &buffer);
+
+	return TLV_RC_OK;
+}
+
+void tlv_writer_init(struct tlv_writer *writer, void *buffer, size_t size)
+{
+	writer->buffer = (uint8_t *)buffer;
+	writer->size = buffer ? size : 0;
+	writer->offset = 0;
+	writer->depth = 0;
+	writer->rc = TLV_RC_OK;
+}
+
+static void tlv_writer_fail(struct tlv_writer *writer, int rc)
+{
+	if (writer->rc == TLV_RC_OK)
+		writer->rc = rc;
+}
+
+/* Returns where to write the next 'size' bytes, or NULL if they do not fit
+ * or writing failed before.  The offset is advanced in any case, so that it
+ * ends up at the required size of the buffer.				      */
+static uint8_t *tlv_writer_reserve(struct tlv_writer *writer, size_t size)
+{
+	uint8_t *p = NULL;
+
+	if ((writer->rc == TLV_RC_OK) &&
+				      (size <= writer->size - writer->offset))
+		p = &writer->buffer[writer->offset];
+	else
+		tlv_writer_fail(writer, TLV_RC_BUFFER_OVERFLOW);
+
+	writer->offset += size;
+
+	return p;
+}
+
+static void tlv_writer_put_header(struct tlv_writer *writer, const void *tag,
+								 size_t length)
+{
+	size_t tag_len = libtlv_get_tag_length(tag);
+	void *p = tlv_writer_reserve(writer, tag_len +
+					       tlv_get_length_size(length));
+
+	if (!p)
+		return;
+
+	memcpy(p, tag, tag_len);
+	p = (uint8_t *)p + tag_len;
+	__tlv_encode_length(length, &p);
+}
+
+int tlv_writer_begin_constructed(struct tlv_writer *writer, const void *tag)
+{
+	if (!writer || !tag)
+		return TLV_RC_INVALID_ARG;
+
+	if (writer->depth == TLV_WRITER_MAX_DEPTH) {
+		tlv_writer_fail(writer, TLV_RC_MAX_DEPTH_EXCEEDED);
+		return writer->rc;
+	}
+
+	/* Reserves one length octet.					      */
+	tlv_writer_put_header(writer, tag, 0);
+	writer->starts[writer->depth++] = writer->offset;
+
+	return writer->rc;
+}
+
+int tlv_writer_put_primitive(struct tlv_writer *writer, const void *tag,
+					      const void *value, size_t length)
+{
+	uint8_t *p = NULL;
+
+	if (!writer || !tag || (length && !value))
+		return TLV_RC_INVALID_ARG;
+
+	tlv_writer_put_header(writer, tag, length);
+
+	p = tlv_writer_reserve(writer, length);
+	if (p)
+		memcpy(p, value, length);
+
+	return writer->rc;
+}
+
+int tlv_writer_put_encoded(struct tlv_writer *writer, const void *data,
+								    size_t size)
+{
+	uint8_t *p = NULL;
+
+	if (!writer || (size && !data))
+		return TLV_RC_INVALID_ARG;
+
+	p = tlv_writer_reserve(writer, size);
+	if (p)
+		memcpy(p, data, size);
+
+	return writer->rc;
+}
+
+int tlv_writer_end(struct tlv_writer *writer)
+{
+	size_t start, length, extra;
+	void *p = NULL;
+
+	if (!writer)
+		return TLV_RC_INVALID_ARG;
+
+	if (!writer->depth) {
+		tlv_writer_fail(writer, TLV_RC_INVALID_ARG);
+		return writer->rc;
+	}
+
+	start = writer->starts[--writer->depth];
+	length = writer->offset - start;
+
+	/* Make room for the length octets beyond the one reserved.	      */
+	extra = tlv_get_length_size(length) - 1;
+	if (extra && tlv_writer_reserve(writer, extra))
+		memmove(&writer->buffer[start + extra],
+					    &writer->buffer[start], length);
+
+	if (writer->rc != TLV_RC_OK)
+		return writer->rc;
+
+	p = &writer->buffer[start - 1];
+	__tlv_encode_length(length, &p);
+
+	return TLV_RC_OK;
+}
+
+int tlv_writer_finish(struct tlv_writer *writer, size_t *size)
+{
+	if (!writer || !size)
+		return TLV_RC_INVALID_ARG;
+
+	if (writer->depth)
+		tlv_writer_fail(writer, TLV_RC_INVALID_ARG);
+
+	*size = writer->offset;
+
+	return writer->rc;
+}
+
+static size_t tlv_binding_hash(const struct tlv_binding *binding,
+							 const struct tlv *tlv)
+{
+	return (size_t)(((uint64_t)(uintptr_t)tlv * 0x9E3779B97F4A7C15ull) >>
+							      binding->shift);
+}
+
+/* The slot of 'tlv' in the table of 'binding', or the free slot it goes to
+ * if it is not in there.						      */
+static struct tlv_binding_slot *tlv_binding_slot(
+		   const struct tlv_binding *binding, const struct tlv *tlv)
+{
+	size_t mask = binding->mask, i;
+
+	for (i = tlv_binding_hash(binding, tlv);
+	     binding->slots[i].node && (binding->slots[i].node != tlv);
+							   i = (i + 1) & mask)
+		;
+
+	return &binding->slots[i];
+}
+
+/* Make room for 'num_nodes' nodes in the empty table of 'binding'.  A table
+ * that is large enough is reused, so that encoding a list again does not
+ * allocate.								      */
+static int tlv_binding_reserve(struct tlv_binding *binding, size_t num_nodes)
+{
+	struct tlv_binding_slot *slots = NULL;
+	size_t num_slots = 8;
+	unsigned int bits = 3;
+
+	/* Keep the load factor at or below one half.			      */
+	while (num_slots < 2 * num_nodes) {
+		num_slots <<= 1;
+		bits++;
+	}
+
+	if (!binding->slots || (binding->mask + 1 < num_slots)) {
+		if (binding->arena)
+			slots = (struct tlv_binding_slot *)tlv_arena_alloc(
+			      binding->arena, num_slots * sizeof(*slots));
+		else
+			slots = (struct tlv_binding_slot *)malloc(
+					       num_slots * sizeof(*slots));
+		if (!slots)
+			return TLV_RC_OUT_OF_MEMORY;
+
+		if (!binding->arena)
+			free(binding->slots);
+
+		binding->slots = slots;
+		binding->shift = 64 - bits;
+		binding->mask = num_slots - 1;
+	}
+
+	memset(binding->slots, 0, (binding->mask + 1) *
+						     sizeof(*binding->slots));
+
+	return TLV_RC_OK;
+}
+
+/* tlv_set_value moved the bound node 'tlv_old' to 'tlv'.  Take its slot out
+ * of the table, shifting back the slots of the same probe sequence behind
+ * it, and add it again under its new address.			      */
+static void tlv_binding_move(struct tlv_binding *binding,
+			     const struct tlv *tlv_old, const struct tlv *tlv)
+{
+	struct tlv_binding_slot *slots = binding->slots, *slot = NULL;
+	size_t mask = binding->mask, i, j, k, offset;
+
+	if (binding->stale)
+		return;
+
+	i = tlv_binding_slot(binding, tlv_old) - slots;
+	offset = slots[i].offset;
+
+	for (j = (i + 1) & mask; slots[j].node; j = (j + 1) & mask) {
+		k = tlv_binding_hash(binding, slots[j].node);
+		if (((j - k) & mask) >= ((j - i) & mask)) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+
+	slots[i].node = NULL;
+
+	slot = tlv_binding_slot(binding, tlv);
+	slot->node = tlv;
+	slot->offset = offset;
+}
+
+/* Bring the bound encoding up to date after the value of the primitive node
+ * 'tlv' changed from 'old_length' bytes to its current length.  All cached
+ * content lengths of the bound nodes are valid, except for the ancestors of
+ * 'tlv', which still hold their old content lengths.  A new value of the
+ * same length is copied over the old one.  Otherwise the tail of the buffer
+ * is shifted and the length fields of the ancestors are rewritten in place,
+ * unless one of them would need more or fewer octets.			      */
+static void tlv_binding_patch(struct tlv *tlv, size_t old_length)
+{
+	struct tlv_binding *binding = tlv->binding;
+	size_t id_size, old_size, new_size, offset, end;
+	struct tlv_binding_slot *slot = NULL;
+	struct tlv *node = NULL;
+	void *p = NULL;
+
+	if (binding->stale)
+		return;
+
+	offset = tlv_binding_slot(binding, tlv)->offset;
+
+	id_size = tlv_get_encoded_identifier_size(tlv);
+	old_size = id_size + tlv_get_length_size(old_length) + old_length;
+	new_size = id_size + tlv_get_length_size(tlv->length) + tlv->length;
+
+	if (new_size != old_size) {
+		for (node = tlv->parent; node != binding->parent;
+							   node = node->parent)
+			if (tlv_get_length_size(node->content_length) !=
+			    tlv_get_length_size(node->content_length -
+							 old_size + new_size))
+				goto stale;
+
+		if (binding->used - old_size + new_size > binding->size)
+			goto stale;
+
+		end = offset + old_size;
+		memmove(&binding->buffer[offset + new_size],
+				  &binding->buffer[end], binding->used - end);
+		binding->used = binding->used - old_size + new_size;
+	}
+
+	p = &binding->buffer[offset + id_size];
+	__tlv_encode_length(tlv->length, &p);
+	memcpy(p, tlv->value, tlv->length);
+
+	for (node = tlv->parent; node != binding->parent; node = node->parent) {
+		if (new_size != old_size) {
+			node->content_length = node->content_length -
+							    old_size + new_size;
+			p = &binding->buffer[
+				       tlv_binding_slot(binding, node)->offset +
+				       tlv_get_encoded_identifier_size(node)];
+			__tlv_encode_length(node->content_length, &p);
+		}
+		node->flags |= TLV_NODE_F_SIZE_VALID;
+	}
+
+	if (new_size == old_size)
+		return;
+
+	/* Move the offsets of all nodes behind 'tlv' along with the tail.  */
+	for (node = tlv; ; ) {
+		if (node->child) {
+			node = node->child;
+		} else {
+			while (!node->next && node->parent != binding->parent)
+				node = node->parent;
+			node = node->next;
+		}
+
+		if (!node)
+			break;
+
+		slot = tlv_binding_slot(binding, node);
+		slot->offset = slot->offset - old_size + new_size;
+	}
+
+	return;
+
+stale:
+	binding->stale = true;
+}
+
+/* The number of nodes tlv_binding_attach binds.			      */
+static size_t tlv_binding_count(const struct tlv *tlv)
+{
+	const struct tlv *stop = tlv ? tlv->parent : NULL;
+	size_t num_nodes = 0;
+
+	while (tlv) {
+		num_nodes++;
+
+		if (tlv_has_children(tlv)) {
+			tlv = tlv->child;
+			continue;
+		}
+
+		while (!tlv->next && tlv->parent != stop)
+			tlv = tlv->parent;
+		tlv = tlv->next;
+	}
+
+	return num_nodes;
+}
+
+/* Record the offsets of 'tlv' and its siblings in the encoding and bind
+ * them to 'binding', whose table must have room for all of them.  This is
+ * the walk of tlv_encode_list, without the copying.			      */
+static void tlv_binding_attach(struct tlv *tlv, struct tlv_binding *binding)
+{
+	const struct tlv *stop = tlv ? tlv->parent : NULL;
+	struct tlv_binding_slot *slot = NULL;
+	size_t offset = 0, length;
+
+	while (tlv) {
+		if (tlv->binding != binding) {
+			tlv_binding_put(tlv);
+			tlv->binding = binding;
+			binding->refs++;
+		}
+
+		slot = tlv_binding_slot(binding, tlv);
+		slot->node = tlv;
+		slot->offset = offset;
+		length = tlv_get_content_length(tlv);
+		offset += tlv_get_encoded_identifier_size(tlv) +
+						    tlv_get_length_size(length);
+
+		if (tlv_has_children(tlv)) {
+			tlv = tlv->child;
+			continue;
+		}
+
+		offset += length;
+
+		while (!tlv->next && tlv->parent != stop)
+			tlv = tlv->parent;
+		tlv = tlv->next;
+	}
+}
+
+int tlv_encode_bind(struct tlv *tlv, void *buffer, size_t *size)
+{
+	struct tlv_binding *binding = tlv ? tlv->binding : NULL;
+	size_t encoded_size = 0;
+	void *p = buffer;
+	int rc = TLV_RC_OK;
+
+	if (!size)
+		return TLV_RC_INVALID_ARG;
+
+	/* Nothing to do if all changes have been patched in already.	      */
+	if (binding && !binding->stale && (binding->head == tlv) &&
+		    (binding->buffer == buffer) && (binding->size == *size)) {
+		*size = binding->used;
+		return TLV_RC_OK;
+	}
+
+	encoded_size = tlv_get_encoded_length(tlv);
+
+	if (!buffer) {
+		*size = encoded_size;
+		return TLV_RC_OK;
+	}
+
+	if (encoded_size > *size) {
+		*size = encoded_size;
+		return TLV_RC_BUFFER_OVERFLOW;
+	}
+
+	if (!tlv) {
+		*size = 0;
+		return TLV_RC_OK;
+	}
+
+	if (!binding || (binding->head != tlv)) {
+		if (tlv->arena)
+			binding = (struct tlv_binding *)tlv_arena_alloc(
+						  tlv->arena, sizeof(*binding));
+		else
+			binding = (struct tlv_binding *)malloc(
+							     sizeof(*binding));
+		if (!binding)
+			return TLV_RC_OUT_OF_MEMORY;
+
+		memset(binding, 0, sizeof(*binding));
+		binding->head = tlv;
+		binding->arena = tlv->arena;
+	}
+
+	rc = tlv_binding_reserve(binding, tlv_binding_count(tlv));
+	if (rc != TLV_RC_OK) {
+		/* A binding that no node refers to yet goes right away.      */
+		if (!binding->refs && !binding->arena)
+			free(binding);
+		return rc;
+	}
+
+	tlv_encode_list(tlv, &p);
+
+	binding->parent = tlv->parent;
+	binding->buffer = (uint8_t *)buffer;
+	binding->size = *size;
+	binding->used = encoded_size;
+	tlv_binding_attach(tlv, binding);
+	binding->stale = false;
+
+	*size = encoded_size;
+
+	return TLV_RC_OK;
+}
+
+void tlv_encode_unbind(struct tlv *tlv)
+{
+	const struct tlv *stop = tlv ? tlv->parent : NULL;
+
+	while (tlv) {
+		tlv_binding_put(tlv);
+
+		if (tlv->child) {
+			tlv = tlv->child;
+			continue;
+		}
+
+		while (!tlv->next && tlv->parent != stop)
+			tlv = tlv->parent;
+		tlv = tlv->next;
+	}
+}
+
+/* Window of an encoding to emit: 'skip' bytes are dropped, then at most
+ * 'max' bytes are written to 'out'.					      */
+struct tlv_encode_window {
+	size_t	 skip;
+	uint8_t	*out;
+	size_t	 size;
+	size_t	 max;
+};
+
+static void tlv_encode_window_put(struct tlv_encode_window *w,
+					       const void *data, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)data;
+
+	if (w->skip >= length) {
+		w->skip -= length;
+		return;
+	}
+
+	p += w->skip;
+	length = MIN(length - w->skip, w->max - w->size);
+	w->skip = 0;
+
+	memcpy(&w->out[w->size], p, length);
+	w->size += length;
+}
+
+/* Emit the bytes [skip, skip + max) of the encoding of the list 'tlv'.  The
+ * cached sizes let whole subtrees before the window be skipped, and the walk
+ * ends as soon as the window is full.					      */
+static size_t tlv_encode_range(const struct tlv *tlv, size_t skip, void *out,
+								     size_t max)
+{
+	struct tlv_encode_window w = { skip, (uint8_t *)out, 0, max };
+	const struct tlv *stop = tlv ? tlv->parent : NULL;
+	uint8_t header[TLV_MAX_TAG_LENGTH + 1 + sizeof(size_t)];
+	void *p = NULL;
+	size_t size;
+
+	/* Only nodes the window reaches are sized.  Their headers need the
+	 * complete content length, so this covers the subtrees below them,
+	 * which makes sizing their descendants on the way down a no-op.     */
+	while (tlv && (w.size < w.max)) {
+		tlv_update_size(tlv);
+		size = tlv_get_node_size(tlv);
+
+		if (w.skip >= size) {
+			w.skip -= size;
+		} else {
+			p = &header[libtlv_copy_tag(header, sizeof(tlv->tag),
+								   tlv->tag)];
+			__tlv_encode_length(tlv_get_content_length(tlv), &p);
+			tlv_encode_window_put(&w, header,
+					       (uint8_t *)p - (uint8_t *)header);
+
+			if (tlv_has_children(tlv)) {
+				tlv = tlv->child;
+				continue;
+			}
+
+			tlv_encode_window_put(&w, tlv->value, tlv->length);
+		}
+
+		while (!tlv->next && tlv->parent != stop)
+			tlv = tlv->parent;
+		tlv = tlv->next;
+	}
+
+	return w.size;
+}
+
+size_t tlv_encode_prefix(const struct tlv *tlv, void *buffer, size_t max)
+{
+	if (!buffer)
+		return 0;
+
+	return tlv_encode_range(tlv, 0, buffer, max);
+}
+
+/* Gathers the encoding of a TLV list into 'iov'.  Headers and short values
+ * are copied to 'scratch', long values are referenced in place.  Once either
+ * array is full nothing more is written, but 'cnt' and 'used' keep counting
+ * so that the caller learns the required sizes.			      */
+struct tlv_iov_writer {
+	struct iovec	*iov;
+	int		 max_cnt;
+	int		 cnt;
+	uint8_t		*scratch;
+	size_t		 max_used;
+	size_t		 used;
+	const uint8_t	*end;
+	bool		 in_scratch;
+	bool		 overflow;
+};
+
+static void tlv_iov_put(struct tlv_iov_writer *w, const void *data,
+						       size_t length, bool copy)
+{
+	bool merge = false;
+
+	if (!length)
+		return;
+
+	/* Consecutive pieces of scratch, or values that happen to be adjacent
+	 * in memory (e.g. views of one buffer), share a single iovec.	      */
+	if (w->cnt)
+		merge = copy ? w->in_scratch :
+				       (!w->in_scratch && (data == w->end));
+
+	if (copy) {
+		if (w->used + length > w->max_used)
+			w->overflow = true;
+		else if (!w->overflow && (data != &w->scratch[w->used]))
+			memcpy(&w->scratch[w->used], data, length);
+		data = w->overflow ? NULL : &w->scratch[w->used];
+		w->used += length;
+	}
+
+	if (!merge && (w->cnt++ >= w->max_cnt))
+		w->overflow = true;
+
+	if (!w->overflow) {
+		if (!merge) {
+			w->iov[w->cnt - 1].iov_base = (void *)data;
+			w->iov[w->cnt - 1].iov_len = 0;
+		}
+		w->iov[w->cnt - 1].iov_len += length;
+	}
+
+	w->in_scratch = copy;
+	w->end = copy ? NULL : (const uint8_t *)data + length;
+}
+
+int tlv_encode_iov(const struct tlv *tlv, struct iovec *iov, int *iovcnt,
+					   void *scratch, size_t *scratch_size)
+{
+	struct tlv_iov_writer w;
+	const struct tlv *stop = tlv ? tlv->parent : NULL;
+	uint8_t header[TLV_MAX_TAG_LENGTH + 1 + sizeof(size_t)], *hdr = NULL;
+	void *p = NULL;
+
+	if (!iovcnt || !scratch_size || (*iovcnt < 0))
+		return TLV_RC_INVALID_ARG;
+
+	memset(&w, 0, sizeof(w));
+	w.iov = iov;
+	w.max_cnt = iov ? *iovcnt : 0;
+	w.scratch = (uint8_t *)scratch;
+	w.max_used = scratch ? *scratch_size : 0;
+
+	tlv_get_encoded_length(tlv);
+
+	while (tlv) {
+		/* Encode the header in place if it surely fits.	      */
+		hdr = header;
+		if (!w.overflow && (w.max_used - w.used >= sizeof(header)))
+			hdr = &w.scratch[w.used];
 
-	encoded_size = tlv_get_encoded_length(tlv);
+		p = &hdr[libtlv_copy_tag(hdr, sizeof(tlv->tag), tlv->tag)];
+		__tlv_encode_length(tlv_get_content_length(tlv), &p);
+		tlv_iov_put(&w, hdr, (uint8_t *)p - hdr, true);
 
-	if (!buffer) {
-		*size = encoded_size;
-		return TLV_RC_OK;
-	}
+		if (tlv_has_children(tlv)) {
+			tlv = tlv->child;
+			continue;
+		}
 
-	if (encoded_size > *size) {
-		*size = encoded_size;
-		return TLV_RC_BUFFER_OVERFLOW;
-	}
+		tlv_iov_put(&w, tlv->value, tlv->length,
+					     tlv->length < TLV_IOV_COPY_LIMIT);
 
-	*size = encoded_size;
+		while (!tlv->next && tlv->parent != stop)
+			tlv = tlv->parent;
+		tlv = tlv->next;
+	}
 
-	if (!buffer)
-		return TLV_RC_INVALID_ARG;
+	*iovcnt = w.cnt;
+	*scratch_size = w.used;
 
-	tlv_encode_recursive(tlv, &buffer);
+	if (w.overflow)
+		return TLV_RC_BUFFER_OVERFLOW;
 
 	return TLV_RC_OK;
 }
@@ -674,7 +2586,9 @@ int tlv_encode_length(const struct tlv *tlv, void *buffer, size_t *size)
 	if (!tlv || !size)
 		return TLV_RC_INVALID_ARG;
 
-	encoded_size = tlv_get_encoded_length_size(tlv);
+	tlv_update_size(tlv);
+	length = tlv_get_content_length(tlv);
+	encoded_size = tlv_get_length_size(length);
 
 	if (!buffer) {
 		*size = encoded_size;
@@ -691,11 +2605,6 @@ int tlv_encode_length(const struct tlv *tlv, void *buffer, size_t *size)
 	if (!buffer)
 		return TLV_RC_INVALID_ARG;
 
-	if (tlv_is_constructed(tlv))
-		length = tlv_get_encoded_length(tlv->child);
-	else
-		length = tlv->length;
-
 	__tlv_encode_length(length, &buffer);
 
 	return TLV_RC_OK;
@@ -727,6 +2636,21 @@ int tlv_encode_value(const struct tlv *tlv, void *buffer, size_t *size)
 	return TLV_RC_OK;
 }
 
+const void *tlv_view_value(const struct tlv *tlv, size_t *size)
+{
+	if (!tlv || !size)
+		return NULL;
+
+	if (tlv_is_constructed(tlv)) {
+		*size = 0;
+		return NULL;
+	}
+
+	*size = tlv->length;
+
+	return tlv->value;
+}
+
 struct tlv *tlv_insert_after(struct tlv *tlv1, struct tlv *tlv2)
 {
 	struct tlv *tail_of_tlv2 = NULL;
@@ -739,12 +2663,17 @@ struct tlv *tlv_insert_after(struct tlv *tlv1, struct tlv *tlv2)
 
 	assert(!tlv2->prev);
 
-	for (tail_of_tlv2 = tlv2; tail_of_tlv2->next; ) {
+	for (tail_of_tlv2 = tlv2; ; tail_of_tlv2 = tail_of_tlv2->next) {
 		assert(!tail_of_tlv2->parent);
 		tail_of_tlv2->parent = tlv1->parent;
-		tail_of_tlv2 = tail_of_tlv2->next;
+		if (!tail_of_tlv2->next)
+			break;
 	}
 
+	tlv_invalidate_size(tlv1->parent);
+	tlv_binding_invalidate(tlv1);
+	tlv_binding_invalidate(tlv2);
+
 	tail_of_tlv2->next = tlv1->next;
 	if (tail_of_tlv2->next)
 		tail_of_tlv2->next->prev = tail_of_tlv2;
@@ -764,12 +2693,20 @@ struct tlv *tlv_insert_below(struct tlv *parent, struct tlv *child)
 
 	assert(!child->prev);
 
-	for (tail_of_child = child; tail_of_child->next; ) {
+	/* Otherwise the new children would hide the encoded ones.	      */
+	tlv_expand(parent);
+
+	for (tail_of_child = child; ; tail_of_child = tail_of_child->next) {
 		assert(!tail_of_child->parent);
 		tail_of_child->parent = parent;
-		tail_of_child = tail_of_child->next;
+		if (!tail_of_child->next)
+			break;
 	}
 
+	tlv_invalidate_size(parent);
+	tlv_binding_invalidate(parent);
+	tlv_binding_invalidate(child);
+
 	if (parent->child) {
 		tail_of_child->next = parent->child;
 		parent->child->prev = tail_of_child;
@@ -795,29 +2732,173 @@ size_t libtlv_get_tag_length(const void *tag)
 	return i + 1;
 }
 
-struct tlv *tlv_find(struct tlv *tlv, const void *tag)
+tlv_key_t libtlv_tag_to_key(const void *tag)
 {
-	struct tlv *tlv_i = NULL;
-	size_t tag_len;
+	const uint8_t *p = (const uint8_t *)tag;
+	tlv_key_t key = 0;
+	size_t i, tag_len;
+
+	tag_len = libtlv_get_tag_length(tag);
+
+	for (i = 0; i < tag_len; i++)
+		key = (key << 8) | p[i];
+
+	return key;
+}
+
+tlv_key_t tlv_get_key(const struct tlv *tlv)
+{
+	return tlv ? tlv->key : 0;
+}
+
+struct tlv *tlv_find_key(struct tlv *tlv, tlv_key_t key)
+{
+	while (tlv && tlv->key != key)
+		tlv = tlv->next;
+
+	return tlv;
+}
 
+struct tlv *tlv_find(struct tlv *tlv, const void *tag)
+{
 	assert(tag);
 
-	if (!tlv)
-		return NULL;
+	return tlv_find_key(tlv, libtlv_tag_to_key(tag));
+}
 
-	tag_len = libtlv_get_tag_length(tag);
+/* Bloom filter of the keys looked for, one bit per key.  Rejects nearly all
+ * other data objects with a single test.				      */
+static uint64_t tlv_extract_filter(const tlv_key_t *keys, size_t num_keys)
+{
+	uint64_t filter = 0;
+	size_t i;
+
+	for (i = 0; i < num_keys; i++)
+		filter |= 1ull << ((keys[i] * 0x9E3779B97F4A7C15ull) >> 58);
+
+	return filter;
+}
+
+static bool tlv_extract_maybe(uint64_t filter, tlv_key_t key)
+{
+	return filter & (1ull << ((key * 0x9E3779B97F4A7C15ull) >> 58));
+}
+
+int tlv_extract(struct tlv *tlv, const tlv_key_t *keys, size_t num_keys,
+						       struct tlv_slice *slices)
+{
+	size_t missing = num_keys, i;
+	uint64_t filter;
+
+	if (!num_keys)
+		return TLV_RC_OK;
+
+	if (!keys || !slices)
+		return TLV_RC_INVALID_ARG;
+
+	memset(slices, 0, num_keys * sizeof(*slices));
+	filter = tlv_extract_filter(keys, num_keys);
+
+	for (; tlv && missing; tlv = tlv->next) {
+		if (!tlv_extract_maybe(filter, tlv->key))
+			continue;
+
+		for (i = 0; i < num_keys; i++) {
+			if (slices[i].present || (keys[i] != tlv->key))
+				continue;
+
+			slices[i].present = true;
+			slices[i].tlv = tlv;
+			if (!tlv_has_children(tlv)) {
+				slices[i].value = tlv->value;
+				slices[i].length = tlv->length;
+			}
+			missing--;
+		}
+	}
 
-	for (tlv_i = tlv; tlv_i; tlv_i = tlv_i->next) {
-		uint8_t encoded_tag[6];
-		size_t encoded_tag_len = sizeof(encoded_tag);
+	return TLV_RC_OK;
+}
+
+int tlv_extract_buffer(const void *buffer, size_t length, const tlv_key_t *keys,
+				     size_t num_keys, struct tlv_slice *slices)
+{
+	const uint8_t *p = (const uint8_t *)buffer, *end = p + length;
+	size_t missing = num_keys, i;
+	uint64_t filter;
+	int rc = TLV_RC_OK;
+
+	if (!num_keys)
+		return TLV_RC_OK;
+
+	if ((length && !buffer) || !keys || !slices)
+		return TLV_RC_INVALID_ARG;
+
+	memset(slices, 0, num_keys * sizeof(*slices));
+	filter = tlv_extract_filter(keys, num_keys);
 
-		tlv_encode_identifier(tlv_i, encoded_tag, &encoded_tag_len);
-		if ((tag_len == encoded_tag_len) &&
-					   (!memcmp(tag, encoded_tag, tag_len)))
+	while (missing) {
+		const uint8_t *data = NULL;
+		struct tlv temp_tlv;
+		const void *pos = NULL;
+
+		p = tlv_skip_padding(p, end);
+		if (p == end)
 			break;
+
+		data = p;
+
+		/* One and two byte tags with a short length, i.e. almost all
+		 * data objects in EMV, are decoded inline.		      */
+		if (((p[0] & TLV_TAG_NUMBER_MASK) != 0x1Fu) && (end - p >= 2) &&
+							      !(p[1] & 0x80u)) {
+			temp_tlv.key = p[0];
+			temp_tlv.length = p[1];
+			p += 2;
+		} else if ((end - p >= 3) && !(p[1] & 0x80u) &&
+			   !(p[2] & 0x80u) &&
+			   ((p[0] & TLV_TAG_NUMBER_MASK) == 0x1Fu)) {
+			temp_tlv.key = (tlv_key_t)p[0] << 8 | p[1];
+			temp_tlv.length = p[2];
+			p += 3;
+		} else {
+			pos = p;
+			rc = tlv_parse_identifier(&pos, end - p, &temp_tlv);
+			if (rc != TLV_RC_OK)
+				return rc;
+
+			p = (const uint8_t *)pos;
+			rc = tlv_parse_length(&pos, end - p, &temp_tlv);
+			if (rc != TLV_RC_OK)
+				return rc;
+
+			p = (const uint8_t *)pos;
+		}
+
+		if ((size_t)(end - p) < temp_tlv.length)
+			return TLV_RC_UNEXPECTED_END_OF_STREAM;
+
+		if (!tlv_extract_maybe(filter, temp_tlv.key)) {
+			p += temp_tlv.length;
+			continue;
+		}
+
+		for (i = 0; i < num_keys; i++) {
+			if (slices[i].present || (keys[i] != temp_tlv.key))
+				continue;
+
+			slices[i].present = true;
+			slices[i].data = data;
+			slices[i].size = p + temp_tlv.length - data;
+			slices[i].value = p;
+			slices[i].length = temp_tlv.length;
+			missing--;
+		}
+
+		p += temp_tlv.length;
 	}
 
-	return tlv_i;
+	return TLV_RC_OK;
 }
 
 int tlv_get_depth(struct tlv *tlv)
@@ -853,33 +2934,164 @@ struct tlv *tlv_iterate(struct tlv *tlv)
 	return NULL;
 }
 
-struct tlv *tlv_deep_find(struct tlv *tlv, const void *tag)
+struct tlv *tlv_deep_find_key(struct tlv *tlv, tlv_key_t key)
 {
-	size_t tag_len;
+	while (tlv && tlv->key != key)
+		tlv = tlv_iterate(tlv);
+
+	return tlv;
+}
 
+struct tlv *tlv_deep_find(struct tlv *tlv, const void *tag)
+{
 	assert(tag);
 
-	if (!tlv)
+	return tlv_deep_find_key(tlv, libtlv_tag_to_key(tag));
+}
+
+static size_t tlv_index_hash(const struct tlv_index *index, tlv_key_t key)
+{
+	return (size_t)((key * 0x9E3779B97F4A7C15ull) >> index->shift);
+}
+
+static const struct tlv_index_slot *tlv_index_find_slot(
+			      const struct tlv_index *index, tlv_key_t key)
+{
+	const struct tlv_index_slot *slot = NULL;
+	size_t i;
+
+	for (i = tlv_index_hash(index, key); ; i = (i + 1) & index->mask) {
+		slot = &index->slots[i];
+		if (slot->head == TLV_INDEX_NONE || slot->key == key)
+			return slot;
+	}
+}
+
+int tlv_index_build(struct tlv *tlv, struct tlv_index **index)
+{
+	struct tlv_index *idx = NULL;
+	struct tlv_index_slot *slot = NULL;
+	struct tlv *i_tlv = NULL;
+	size_t num_nodes = 0, num_slots = 8, size;
+	unsigned int bits = 3;
+	uint32_t n;
+
+	if (!index)
+		return TLV_RC_INVALID_ARG;
+
+	*index = NULL;
+
+	for (i_tlv = tlv; i_tlv; i_tlv = tlv_iterate(i_tlv))
+		num_nodes++;
+
+	if (num_nodes >= TLV_INDEX_NONE)
+		return TLV_RC_OUT_OF_MEMORY;
+
+	/* Keep the load factor at or below one half.			      */
+	while (num_slots < 2 * num_nodes) {
+		num_slots <<= 1;
+		bits++;
+	}
+
+	size = TLV_ARENA_ALIGN(sizeof(*idx)) +
+	       TLV_ARENA_ALIGN(num_slots * sizeof(*idx->slots)) +
+	       num_nodes * sizeof(*idx->entries);
+
+	if (tlv && tlv->arena)
+		idx = (struct tlv_index *)tlv_arena_alloc(tlv->arena, size);
+	else
+		idx = (struct tlv_index *)malloc(size);
+	if (!idx)
+		return TLV_RC_OUT_OF_MEMORY;
+
+	idx->arena = tlv ? tlv->arena : NULL;
+	idx->shift = 64 - bits;
+	idx->mask = num_slots - 1;
+	idx->slots = (struct tlv_index_slot *)((uint8_t *)idx +
+					      TLV_ARENA_ALIGN(sizeof(*idx)));
+	idx->entries = (struct tlv_index_entry *)((uint8_t *)idx->slots +
+		       TLV_ARENA_ALIGN(num_slots * sizeof(*idx->slots)));
+
+	for (n = 0; n < num_slots; n++)
+		idx->slots[n].head = TLV_INDEX_NONE;
+
+	/* Nodes are appended to the chain of their tag in depth first order,
+	 * so the head of each chain is what tlv_deep_find would return.     */
+	for (i_tlv = tlv, n = 0; i_tlv; i_tlv = tlv_iterate(i_tlv), n++) {
+		slot = (struct tlv_index_slot *)tlv_index_find_slot(idx,
+								  i_tlv->key);
+
+		idx->entries[n].tlv = i_tlv;
+		idx->entries[n].next = TLV_INDEX_NONE;
+
+		if (slot->head == TLV_INDEX_NONE) {
+			slot->key = i_tlv->key;
+			slot->head = n;
+		} else {
+			idx->entries[slot->tail].next = n;
+		}
+
+		slot->tail = n;
+	}
+
+	*index = idx;
+
+	return TLV_RC_OK;
+}
+
+void tlv_index_free(struct tlv_index *index)
+{
+	/* Indices in an arena are released by tlv_arena_reset/_free.	      */
+	if (index && !index->arena)
+		free(index);
+}
+
+struct tlv *tlv_index_lookup_key(const struct tlv_index *index, tlv_key_t key)
+{
+	const struct tlv_index_slot *slot = NULL;
+
+	if (!index)
 		return NULL;
 
-	tag_len = libtlv_get_tag_length(tag);
+	slot = tlv_index_find_slot(index, key);
+	if (slot->head == TLV_INDEX_NONE)
+		return NULL;
 
-	while (tlv) {
-		uint8_t encoded_tag[6];
-		size_t encoded_tag_len = sizeof(encoded_tag);
+	return index->entries[slot->head].tlv;
+}
 
-		tlv_encode_identifier(tlv, encoded_tag, &encoded_tag_len);
-		if ((tag_len == encoded_tag_len) &&
-					   (!memcmp(tag, encoded_tag, tag_len)))
-			break;
+struct tlv *tlv_index_lookup(const struct tlv_index *index, const void *tag)
+{
+	assert(tag);
 
-		tlv = tlv_iterate(tlv);
+	return tlv_index_lookup_key(index, libtlv_tag_to_key(tag));
+}
+
+size_t tlv_index_lookup_all(const struct tlv_index *index, tlv_key_t key,
+						  struct tlv **tlv, size_t size)
+{
+	const struct tlv_index_slot *slot = NULL;
+	size_t count = 0;
+	uint32_t n;
+
+	if (!index)
+		return 0;
+
+	slot = tlv_index_find_slot(index, key);
+
+	for (n = slot->head; n != TLV_INDEX_NONE; n = index->entries[n].next) {
+		if (tlv && count < size)
+			tlv[count] = index->entries[n].tlv;
+		count++;
 	}
 
-	return tlv;
+	return count;
 }
 
-struct tlv *tlv_new(const void *tag, size_t length, const void *value)
+/* Create a node with room for values of up to 'capacity' bytes, or 'length'
+ * bytes if that is more.						      */
+static struct tlv *tlv_new_in(struct tlv_arena *arena, const void *tag,
+			     size_t capacity, size_t length, const void *value)
 {
 	struct tlv *tlv = NULL;
 	int rc = TLV_RC_OK;
@@ -887,11 +3099,18 @@ struct tlv *tlv_new(const void *tag, size_t length, const void *value)
 	if (!tag || (length && !value))
 		goto error;
 
-	tlv = (struct tlv *)calloc(1, sizeof(struct tlv) + length);
+	capacity = MAX(capacity, length);
+
+	tlv = tlv_alloc(arena, capacity);
 
 	if (!tlv)
 		goto error;
 
+	memset(tlv, 0, sizeof(*tlv));
+	tlv->arena = arena;
+	tlv->value = tlv->data;
+	tlv->capacity = capacity;
+
 	rc = tlv_parse_identifier(&tag, libtlv_get_tag_length(tag), tlv);
 	if (rc != TLV_RC_OK)
 		goto error;
@@ -904,57 +3123,108 @@ struct tlv *tlv_new(const void *tag, size_t length, const void *value)
 	return tlv;
 
 error:
-	free(tlv);
+	if (tlv)
+		tlv_release(tlv);
 	return NULL;
 }
 
-struct tlv *tlv_copy(const struct tlv *tlv)
+struct tlv *tlv_new(const void *tag, size_t length, const void *value)
 {
-	struct tlv *result = NULL;
-	int rc = TLV_RC_OK;
-
-	if (!tlv)
-		return NULL;
-
-	if (tlv_is_constructed(tlv)) {
-		struct tlv *childs = NULL;
-		uint8_t *buffer = NULL;
-		size_t size = 0;
-
-		rc = tlv_encode(tlv_get_child(tlv), buffer, &size);
-		if ((rc != TLV_RC_OK) || (size == 0))
-			return NULL;
+	return tlv_new_in(NULL, tag, 0, length, value);
+}
 
-		buffer = (uint8_t *)malloc(size);
-		if (!buffer)
-			return NULL;
+struct tlv *tlv_new_reserve(const void *tag, size_t capacity)
+{
+	return tlv_new_in(NULL, tag, capacity, 0, NULL);
+}
 
-		rc = tlv_encode(tlv_get_child(tlv), buffer, &size);
-		if (rc != TLV_RC_OK) {
-			free(buffer);
-			return NULL;
+/* Clone 'tlv' and its descendants (but not its siblings) node by node in a
+ * single pre-order walk.  'parent' and 'prev' always refer to the copies of
+ * the source node's parent and left sibling, so every new node is linked in
+ * as soon as it is allocated.  Primitive values are always copied into the
+ * new nodes, so copies of borrowed nodes do not depend on the parse buffer.
+ * Lazy nodes stay lazy, with a private copy of their encoded children.
+ * The cached content lengths remain valid since the subtree is identical.  */
+static struct tlv *tlv_clone(struct tlv_arena *arena, const struct tlv *tlv)
+{
+	const struct tlv *src = tlv;
+	struct tlv *root = NULL, *parent = NULL, *prev = NULL, *node = NULL;
+
+	for (;;) {
+		if (src->flags & TLV_NODE_F_LAZY)
+			node = tlv_alloc_lazy(arena, src->length,
+							    tlv_lazy_ctx(src));
+		else
+			node = tlv_alloc(arena, src->child ? 0 : src->length);
+		if (!node)
+			goto error;
+
+		memcpy(node->tag, src->tag, sizeof(node->tag));
+		node->key = src->key;
+		node->flags |= src->flags & (TLV_NODE_F_SIZE_VALID |
+							      TLV_NODE_F_LAZY);
+		node->content_length = src->content_length;
+		node->length = src->length;
+		node->parent = parent;
+		node->prev = prev;
+		node->next = NULL;
+		node->child = NULL;
+
+		if (prev)
+			prev->next = node;
+		else if (parent)
+			parent->child = node;
+		else
+			root = node;
+
+		if (src->child) {
+			parent = node;
+			prev = NULL;
+			src = src->child;
+			continue;
 		}
 
-		rc = tlv_parse(buffer, size, &childs);
-		if (rc != TLV_RC_OK) {
-			free(buffer);
-			return NULL;
+		if (src->length)
+			memcpy(node->value, src->value, src->length);
+
+		prev = node;
+		while (src != tlv && !src->next) {
+			src = src->parent;
+			prev = parent;
+			parent = parent->parent;
 		}
 
-		result = tlv_new(tlv->tag, 0, NULL);
-		if (!result)
-			return NULL;
+		if (src == tlv)
+			break;
 
-		tlv_insert_below(result, childs);
-	} else {
-		result = tlv_new(tlv->tag, tlv->length, tlv->value);
+		src = src->next;
 	}
 
-	return result;
+	return root;
+
+error:
+	tlv_free(root);
+	return NULL;
 }
 
-void libtlv_get_dol_field(const void *tag, const void *in, size_t in_sz,
-						       void *out, size_t out_sz)
+struct tlv *tlv_copy(const struct tlv *tlv)
+{
+	if (!tlv)
+		return NULL;
+
+	return tlv_clone(NULL, tlv);
+}
+
+struct tlv *tlv_copy_arena(struct tlv_arena *arena, const struct tlv *tlv)
+{
+	if (!arena || !tlv)
+		return NULL;
+
+	return tlv_clone(arena, tlv);
+}
+
+void libtlv_get_dol_field_ctx(struct libtlv_ctx *ctx, const void *tag,
+		     const void *in, size_t in_sz, void *out, size_t out_sz)
 {
 	const uint8_t *i = (const uint8_t *)in;
 	uint8_t *o = (uint8_t *)out;
@@ -964,7 +3234,7 @@ void libtlv_get_dol_field(const void *tag, const void *in, size_t in_sz,
 	if (out_sz == in_sz) {
 		memcpy(o, i, out_sz);
 	} else if (out_sz < in_sz) {
-		switch (libtlv_id_to_fmt(tag)) {
+		switch (libtlv_id_to_fmt_ctx(ctx, tag)) {
 		case fmt_n:	       /* truncate leftmost bytes if numeric. */
 			memcpy(o, &i[in_sz - out_sz], out_sz);
 			break;
@@ -973,7 +3243,7 @@ void libtlv_get_dol_field(const void *tag, const void *in, size_t in_sz,
 			break;
 		}
 	} else {
-		switch (libtlv_id_to_fmt(tag)) {
+		switch (libtlv_id_to_fmt_ctx(ctx, tag)) {
 		case fmt_cn:			/* trailing hexadecimal 'FF's */
 			memcpy(o, i, in_sz);
 			memset(&o[in_sz], 0xff, out_sz - in_sz);
@@ -990,14 +3260,91 @@ void libtlv_get_dol_field(const void *tag, const void *in, size_t in_sz,
 	}
 }
 
-int tlv_and_dol_to_del(struct tlv *tlv, const void *dol,
-				       size_t dol_sz, void *del, size_t *del_sz)
+void libtlv_get_dol_field(const void *tag, const void *in, size_t in_sz,
+						       void *out, size_t out_sz)
+{
+	libtlv_get_dol_field_ctx(&default_ctx, tag, in, in_sz, out, out_sz);
+}
+
+/* The padding and truncation rules of libtlv_get_dol_field, resolved once. */
+static void dol_plan_entry_set_rules(struct libtlv_ctx *ctx,
+			      struct dol_plan_entry *entry, const uint8_t *tag)
+{
+	switch (libtlv_id_to_fmt_ctx(ctx, tag)) {
+	case fmt_n:
+		entry->flags = DOL_FIELD_F_RIGHT;
+		entry->pad = 0x00u;
+		break;
+	case fmt_cn:
+		entry->flags = 0;
+		entry->pad = 0xFFu;
+		break;
+	default:
+		entry->flags = 0;
+		entry->pad = 0x00u;
+		break;
+	}
+}
+
+static void dol_plan_fill_field(const struct dol_plan_entry *entry,
+				     const void *value, size_t length, uint8_t *o)
+{
+	const uint8_t *i = (const uint8_t *)value;
+	size_t pad;
+
+	if (length >= entry->length) {
+		if (entry->flags & DOL_FIELD_F_RIGHT)
+			i = &i[length - entry->length];
+		memcpy(o, i, entry->length);
+		return;
+	}
+
+	pad = entry->length - length;
+
+	if (entry->flags & DOL_FIELD_F_RIGHT) {
+		memset(o, entry->pad, pad);
+		memcpy(&o[pad], i, length);
+	} else {
+		memcpy(o, i, length);
+		memset(&o[length], entry->pad, pad);
+	}
+}
+
+/* Constructed data elements contribute the encoding of their children,
+ * which is written straight into the field.  Only the part of it that ends
+ * up in the field is encoded.						      */
+static void dol_plan_fill_constructed(const struct dol_plan_entry *entry,
+					    const struct tlv *tlv, uint8_t *o)
+{
+	size_t length = tlv_get_encoded_length(tlv->child), pad;
+
+	if (length >= entry->length) {
+		tlv_encode_range(tlv->child, (entry->flags & DOL_FIELD_F_RIGHT) ?
+			       length - entry->length : 0, o, entry->length);
+		return;
+	}
+
+	pad = entry->length - length;
+
+	if (entry->flags & DOL_FIELD_F_RIGHT) {
+		memset(o, entry->pad, pad);
+		tlv_encode_range(tlv->child, 0, &o[pad], length);
+	} else {
+		tlv_encode_range(tlv->child, 0, o, length);
+		memset(&o[length], entry->pad, pad);
+	}
+}
+
+int tlv_and_dol_to_del_ctx(struct libtlv_ctx *ctx, struct tlv *tlv,
+		       const void *dol, size_t dol_sz, void *del, size_t *del_sz)
 {
 	const void *i_dol = dol;
 	uint8_t *out_data = (uint8_t *)del;
 	size_t out_data_sz = 0;
 	int rc = TLV_RC_OK;
 
+	ctx = libtlv_ctx_get(ctx);
+
 	while (i_dol - dol < dol_sz) {
 		size_t dol_sz_left = 0;
 		struct tlv tlv_do, *tlv_de;
@@ -1007,7 +3354,7 @@ int tlv_and_dol_to_del(struct tlv *tlv, const void *dol,
 		dol_sz_left = dol_sz - (i_dol - dol);
 		rc = tlv_parse_identifier(&i_dol, dol_sz_left, &tlv_do);
 		if (rc != TLV_RC_OK) {
-			log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(ctx->log_cat, LOG4C_PRIORITY_NOTICE,
 					 "%s(): tlv_parse_identifier failed!\n",
 								      __func__);
 			goto done;
@@ -1016,7 +3363,7 @@ int tlv_and_dol_to_del(struct tlv *tlv, const void *dol,
 		dol_sz_left = dol_sz - (i_dol - dol);
 		rc = tlv_parse_dol_length(&i_dol, dol_sz_left, &tlv_do);
 		if (rc != TLV_RC_OK) {
-			log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(ctx->log_cat, LOG4C_PRIORITY_NOTICE,
 				    "%s(): tlv_parse_dol_length failed! rc: %d",
 								  __func__, rc);
 			goto done;
@@ -1024,7 +3371,7 @@ int tlv_and_dol_to_del(struct tlv *tlv, const void *dol,
 
 		rc = tlv_encode_identifier(&tlv_do, tag, &tag_sz);
 		if (rc != TLV_RC_OK) {
-			log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(ctx->log_cat, LOG4C_PRIORITY_NOTICE,
 					"%s(): tlv_encode_identifier failed!\n",
 								      __func__);
 			goto done;
@@ -1040,35 +3387,18 @@ int tlv_and_dol_to_del(struct tlv *tlv, const void *dol,
 		if (!tlv_de) {
 			memset(&out_data[out_data_sz], 0, tlv_do.length);
 			out_data_sz += tlv_do.length;
-		} else if (tlv_is_constructed(tlv_de)) {
-			uint8_t *value = NULL;
-			size_t length = 0;
-
-			rc = tlv_encode(tlv_get_child(tlv_de), value, &length);
-			if (rc != TLV_RC_OK)
-				goto done;
-
-			value = (uint8_t *)malloc(length);
-			if (!value) {
-				rc = TLV_RC_OUT_OF_MEMORY;
-				goto done;
-			}
-
-			rc = tlv_encode(tlv_get_child(tlv_de), value, &length);
-			if (rc != TLV_RC_OK) {
-				free(value);
-				goto done;
-			}
-
-			libtlv_get_dol_field(tlv_do.tag, value, length,
-					 &out_data[out_data_sz], tlv_do.length);
-			out_data_sz += tlv_do.length;
+		} else if (tlv_has_children(tlv_de)) {
+			struct dol_plan_entry entry;
 
-			free(value);
+			entry.length = tlv_do.length;
+			dol_plan_entry_set_rules(ctx, &entry, tlv_do.tag);
+			dol_plan_fill_constructed(&entry, tlv_de,
+						       &out_data[out_data_sz]);
+			out_data_sz += tlv_do.length;
 		} else {
-			libtlv_get_dol_field(tlv_do.tag, tlv_de->value,
-					 tlv_de->length, &out_data[out_data_sz],
-								 tlv_do.length);
+			libtlv_get_dol_field_ctx(ctx, tlv_do.tag,
+					 tlv_de->value, tlv_de->length,
+				       &out_data[out_data_sz], tlv_do.length);
 			out_data_sz += tlv_do.length;
 		}
 	}
@@ -1079,6 +3409,13 @@ done:
 	return rc;
 }
 
+int tlv_and_dol_to_del(struct tlv *tlv, const void *dol,
+				       size_t dol_sz, void *del, size_t *del_sz)
+{
+	return tlv_and_dol_to_del_ctx(&default_ctx, tlv, dol, dol_sz, del,
+									del_sz);
+}
+
 const void *dol_tok(const void **dol, size_t *dol_sz)
 {
 	const void *tok = *dol;
@@ -1090,13 +3427,13 @@ const void *dol_tok(const void **dol, size_t *dol_sz)
 		goto done;
 	}
 
-	log4c_category_log(log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(default_ctx.log_cat, LOG4C_PRIORITY_TRACE,
 		      "%s(dol: %p, *dol: %p, dol_sz: %p, *dol_sz: %d) -> start",
 				     __func__, dol, *dol, dol_sz, (int)*dol_sz);
 
 	rc = tlv_parse_identifier(dol, *dol_sz, &tlv_do);
 	if (rc != TLV_RC_OK) {
-		log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(default_ctx.log_cat, LOG4C_PRIORITY_NOTICE,
 				   "%s(): tlv_parse_identifier failed! rc %d\n",
 								  __func__, rc);
 		tok = NULL;
@@ -1106,7 +3443,7 @@ const void *dol_tok(const void **dol, size_t *dol_sz)
 
 	rc = tlv_parse_dol_length(dol, *dol_sz - (*dol - tok), &tlv_do);
 	if (rc != TLV_RC_OK) {
-		log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(default_ctx.log_cat, LOG4C_PRIORITY_NOTICE,
 			 "%s(): tlv_parse_dol_length failed! rc %d\n", __func__,
 									    rc);
 		tok = NULL;
@@ -1117,7 +3454,7 @@ const void *dol_tok(const void **dol, size_t *dol_sz)
 	*dol_sz -= (*dol - tok);
 
 done:
-	log4c_category_log(log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(default_ctx.log_cat, LOG4C_PRIORITY_TRACE,
 		       "%s(dol: %p, *dol: %p, dol_sz: %p, *dol_sz: %d) <- done",
 				     __func__, dol, *dol, dol_sz, (int)*dol_sz);
 	return tok;
@@ -1136,23 +3473,28 @@ const void *dol_find_tag(const void *dol, size_t dol_sz, const void *tag)
 	return tok;
 }
 
-int dol_and_del_to_tlv(const void *dol, size_t dol_sz,
-			       const void *del, size_t del_sz, struct tlv **out)
+int dol_and_del_to_tlv_ctx(struct libtlv_ctx *ctx, const void *dol,
+		size_t dol_sz, const void *del, size_t del_sz, struct tlv **out)
 {
-	char hex_dol[2 * dol_sz + 1], hex_del[2 * del_sz + 1];
 	const void *i_dol = NULL, *i_del = NULL;
 	struct tlv *tlv = NULL;
 	int rc = TLV_RC_OK;
 
+	ctx = libtlv_ctx_get(ctx);
+
 	if (!dol || !del || !out) {
 		rc = TLV_RC_INVALID_ARG;
 		goto done;
 	}
 
-	log4c_category_log(log_cat, LOG4C_PRIORITY_TRACE,
+	if (LIBPAY_LOG_ENABLED(ctx->log_cat, LOG4C_PRIORITY_TRACE)) {
+		char hex_dol[2 * dol_sz + 1], hex_del[2 * del_sz + 1];
+
+		LIBPAY_LOG(ctx->log_cat, LOG4C_PRIORITY_TRACE,
 				  "%s(dol: '%s', del: '%s') -> start", __func__,
 					libtlv_bin_to_hex(dol, dol_sz, hex_dol),
 				       libtlv_bin_to_hex(del, del_sz, hex_del));
+	}
 
 	*out = NULL;
 
@@ -1168,7 +3510,7 @@ int dol_and_del_to_tlv(const void *dol, size_t dol_sz,
 		dol_sz_left = dol_sz - (i_dol - dol);
 		rc = tlv_parse_identifier(&i_dol, dol_sz_left, &tlv_do);
 		if (rc != TLV_RC_OK) {
-			log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(ctx->log_cat, LOG4C_PRIORITY_NOTICE,
 					 "%s(): tlv_parse_identifier failed!\n",
 								      __func__);
 			goto done;
@@ -1177,7 +3519,7 @@ int dol_and_del_to_tlv(const void *dol, size_t dol_sz,
 		dol_sz_left = dol_sz - (i_dol - dol);
 		rc = tlv_parse_dol_length(&i_dol, dol_sz_left, &tlv_do);
 		if (rc != TLV_RC_OK) {
-			log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(ctx->log_cat, LOG4C_PRIORITY_NOTICE,
 					 "%s(): tlv_parse_dol_length failed!\n",
 								      __func__);
 			goto done;
@@ -1185,7 +3527,7 @@ int dol_and_del_to_tlv(const void *dol, size_t dol_sz,
 
 		rc = tlv_encode_identifier(&tlv_do, tag, &tag_sz);
 		if (rc != TLV_RC_OK) {
-			log4c_category_log(log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(ctx->log_cat, LOG4C_PRIORITY_NOTICE,
 					"%s(): tlv_encode_identifier failed!\n",
 								      __func__);
 			goto done;
@@ -1197,10 +3539,10 @@ int dol_and_del_to_tlv(const void *dol, size_t dol_sz,
 			goto done;
 		}
 
-		tlv = tlv_insert_after(tlv, tlv_new(tag, tlv_do.length, i_del));
+		tlv = tlv_insert_after(tlv, tlv_new_in(ctx->arena, tag, 0,
+							tlv_do.length, i_del));
 		i_del += tlv_do.length;
 
-
 		if (!*out)
 			*out = tlv;
 	}
@@ -1219,219 +3561,720 @@ done:
 	return rc;
 }
 
-int libtlv_bcd_to_u64(const void *buffer, size_t len, uint64_t *u64)
+int dol_and_del_to_tlv(const void *dol, size_t dol_sz,
+			       const void *del, size_t del_sz, struct tlv **out)
 {
-	const uint8_t *bcd = (const uint8_t *)buffer;
-	size_t i = 0, j = 0;
+	return dol_and_del_to_tlv_ctx(&default_ctx, dol, dol_sz, del, del_sz,
+									   out);
+}
 
-	if (!bcd || !u64)
-		return TLV_RC_INVALID_ARG;
+/* 64-bit FNV-1a over the DOL bytes.					      */
+static uint64_t dol_hash(const void *dol, size_t dol_sz)
+{
+	const uint8_t *p = (const uint8_t *)dol;
+	uint64_t hash = 0xCBF29CE484222325ull;
+	size_t i;
+
+	for (i = 0; i < dol_sz; i++)
+		hash = (hash ^ p[i]) * 0x100000001B3ull;
+
+	return hash;
+}
+
+int dol_compile_ctx(struct libtlv_ctx *ctx, const void *dol, size_t dol_sz,
+							 struct dol_plan **plan)
+{
+	struct dol_plan *result = NULL;
+	const void *i_dol = NULL;
+	size_t num_entries = 0, i;
+	int rc = TLV_RC_OK;
 
-	for (i = 0, *u64 = 0; i < len; i++) {
-		for (j = 0; j < 2; j++) {
-			uint8_t digit = ((bcd[i] >> ((1 - j) * 4)) & 0xf);
+	if ((!dol && dol_sz) || !plan)
+		return TLV_RC_INVALID_ARG;
 
-			if (digit > 9)
-				return TLV_RC_INVALID_ARG;
+	ctx = libtlv_ctx_get(ctx);
 
-			if (*u64 > (UINT64_MAX - digit) / 10)
-				return TLV_RC_VALUE_OUT_OF_RANGE;
+	/* First pass: validate the DOL and count its entries.		      */
+	for (i_dol = dol; i_dol - dol < dol_sz; num_entries++) {
+		struct tlv tlv_do;
 
-			*u64 = *u64 * 10 + digit;
+		rc = tlv_parse_identifier(&i_dol, dol_sz - (i_dol - dol),
+								       &tlv_do);
+		if (rc == TLV_RC_OK)
+			rc = tlv_parse_dol_length(&i_dol,
+					       dol_sz - (i_dol - dol), &tlv_do);
+		if (rc != TLV_RC_OK) {
+			LIBPAY_LOG(ctx->log_cat, LOG4C_PRIORITY_NOTICE,
+				   "%s(): malformed DOL at offset %zu! rc: %d",
+				__func__, (size_t)(i_dol - dol), rc);
+			goto done;
 		}
 	}
 
-	return TLV_RC_OK;
+	/* The plan, its entries and a copy of the DOL share one allocation. */
+	result = (struct dol_plan *)malloc(sizeof(*result) +
+			    num_entries * sizeof(*result->entries) + dol_sz);
+	if (!result) {
+		rc = TLV_RC_OUT_OF_MEMORY;
+		goto done;
+	}
+
+	result->hash = dol_hash(dol, dol_sz);
+	result->dol_sz = dol_sz;
+	result->del_sz = 0;
+	result->num_entries = num_entries;
+	result->entries = (struct dol_plan_entry *)&result[1];
+	result->dol = (uint8_t *)&result->entries[num_entries];
+	if (dol_sz)
+		memcpy(result->dol, dol, dol_sz);
+
+	/* Second pass: the DOL is known to be well-formed by now.	      */
+	for (i_dol = dol, i = 0; i < num_entries; i++) {
+		struct dol_plan_entry *entry = &result->entries[i];
+		struct tlv tlv_do;
+
+		tlv_parse_identifier(&i_dol, dol_sz - (i_dol - dol), &tlv_do);
+		tlv_parse_dol_length(&i_dol, dol_sz - (i_dol - dol), &tlv_do);
+
+		entry->key = tlv_do.key;
+		entry->offset = result->del_sz;
+		entry->length = tlv_do.length;
+		dol_plan_entry_set_rules(ctx, entry, tlv_do.tag);
+
+		result->del_sz += tlv_do.length;
+	}
+
+	*plan = result;
+
+done:
+	return rc;
+}
+
+int dol_compile(const void *dol, size_t dol_sz, struct dol_plan **plan)
+{
+	return dol_compile_ctx(&default_ctx, dol, dol_sz, plan);
 }
 
-int libtlv_u64_to_bcd(uint64_t u64, void *buffer, size_t len)
+int dol_plan_fill(const struct dol_plan *plan, struct tlv *tlv, void *del,
+							     size_t *del_sz)
 {
-	uint8_t *bcd = (uint8_t *)buffer;
-	size_t i = 0, j = 0;
+	const struct dol_plan_entry *entry = NULL;
+	uint8_t *out = (uint8_t *)del;
+	struct tlv *tlv_de = NULL;
+	size_t i;
 
-	if (!bcd)
+	if (!plan || !del_sz || (!del && plan->del_sz))
 		return TLV_RC_INVALID_ARG;
 
-	memset(bcd, 0, len);
+	if (plan->del_sz > *del_sz) {
+		*del_sz = plan->del_sz;
+		return TLV_RC_BUFFER_OVERFLOW;
+	}
+
+	for (i = 0; i < plan->num_entries; i++) {
+		entry = &plan->entries[i];
+		tlv_de = tlv_find_key(tlv, entry->key);
 
-	for (i = len; i > 0; i--) {
-		for (j = 0; j < 2; j++) {
-			bcd[i - 1] |= (u64 % 10) << (j * 4);
-			u64 /= 10;
+		if (!tlv_de) {
+			memset(&out[entry->offset], 0, entry->length);
+		} else if (tlv_has_children(tlv_de)) {
+			dol_plan_fill_constructed(entry, tlv_de,
+							 &out[entry->offset]);
+		} else {
+			dol_plan_fill_field(entry, tlv_de->value,
+				      tlv_de->length, &out[entry->offset]);
 		}
 	}
 
-	if (u64)
-		return TLV_RC_VALUE_OUT_OF_RANGE;
+	*del_sz = plan->del_sz;
 
 	return TLV_RC_OK;
 }
 
-char *libtlv_bin_to_hex(const void *blob, size_t blob_sz, char *buffer)
+size_t dol_plan_get_del_size(const struct dol_plan *plan)
 {
-	const char hex_digit[16] = {
-		'0', '1', '2', '3', '4', '5', '6', '7',
-		'8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
-	};
-	const uint8_t *bin = (const uint8_t *)blob;
-	size_t i;
+	return plan ? plan->del_sz : 0;
+}
+
+uint64_t dol_plan_get_hash(const struct dol_plan *plan)
+{
+	return plan ? plan->hash : 0;
+}
+
+void dol_plan_free(struct dol_plan *plan)
+{
+	free(plan);
+}
+
+struct dol_plan_cache *dol_plan_cache_new_ctx(struct libtlv_ctx *ctx)
+{
+	struct dol_plan_cache *cache = NULL;
+
+	cache = (struct dol_plan_cache *)malloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
 
-	for (i = 0; i < blob_sz; i++) {
-		buffer[i * 2]     = hex_digit[bin[i] >> 4];
-		buffer[i * 2 + 1] = hex_digit[bin[i] & 0xf];
+	cache->slots = (struct dol_plan **)calloc(DOL_PLAN_CACHE_INITIAL_SIZE,
+							 sizeof(*cache->slots));
+	if (!cache->slots) {
+		free(cache);
+		return NULL;
 	}
 
-	buffer[i * 2] = '\0';
+	cache->ctx = libtlv_ctx_get(ctx);
+	cache->mask = DOL_PLAN_CACHE_INITIAL_SIZE - 1;
+	cache->count = 0;
 
-	return buffer;
+	return cache;
 }
 
-static uint8_t nibble_from_hex(char hex)
+struct dol_plan_cache *dol_plan_cache_new(void)
 {
-	uint8_t byte;
-	byte = (hex <= '9') ? (hex - '0') :
-		(10 + ((hex <= 'F') ? (hex - 'A') : (hex - 'a')));
-	if (byte & 0xf0)
-		return 0xff;
-	return byte;
+	return dol_plan_cache_new_ctx(&default_ctx);
 }
 
-void * libtlv_hex_to_bin(const char *hex, void * bin_buffer,
-							size_t * bin_buffer_len)
+/* Double the number of slots, keeping the load factor below one half.      */
+static int dol_plan_cache_grow(struct dol_plan_cache *cache)
 {
-	const char * ptr;
-	uint8_t * bin_ptr = bin_buffer;
-	const uint8_t * bin_buffer_end = bin_ptr + *bin_buffer_len;
-	int nibble_idx = 1; /* 1 upper, 0 lower */
-	uint8_t byte = 0;
+	struct dol_plan **slots = NULL;
+	size_t mask = cache->mask * 2 + 1, i, j;
 
-	for (ptr = hex; *ptr != 0; ++ptr) {
-		uint8_t nibble;
+	slots = (struct dol_plan **)calloc(mask + 1, sizeof(*slots));
+	if (!slots)
+		return TLV_RC_OUT_OF_MEMORY;
 
-		if (bin_ptr >= bin_buffer_end) /* bin buffer too small */
-			return NULL;
-		if (*ptr == ' ' || *ptr == '\n' || *ptr == '\r')
+	for (i = 0; i <= cache->mask; i++) {
+		if (!cache->slots[i])
 			continue;
-		nibble = nibble_from_hex(*ptr);
-		if (nibble &0xf0)
-			return NULL;
-		if (nibble_idx) {
-			byte = nibble << 4;
-			nibble_idx = 0;
-		}
-		else {
-			byte |= nibble;
-			nibble_idx++;
-			*bin_ptr++ = byte;
-		}
+
+		for (j = cache->slots[i]->hash & mask; slots[j];
+							      j = (j + 1) & mask)
+			;
+		slots[j] = cache->slots[i];
 	}
 
-	*bin_buffer_len = bin_ptr - (const uint8_t *)bin_buffer;
-	return bin_buffer;
-}
+	free(cache->slots);
+	cache->slots = slots;
+	cache->mask = mask;
 
-static struct tlv_id_to_fmt *known_formats;
-static size_t num_known_formats;
+	return TLV_RC_OK;
+}
 
-static size_t id_sz(const uint8_t *id)
+int dol_plan_cache_get(struct dol_plan_cache *cache, const void *dol,
+			       size_t dol_sz, const struct dol_plan **plan)
 {
-	size_t sz = 1;
+	struct dol_plan *result = NULL;
+	uint64_t hash;
+	size_t i;
+	int rc = TLV_RC_OK;
+
+	if (!cache || (!dol && dol_sz) || !plan)
+		return TLV_RC_INVALID_ARG;
 
-	if ((id[0] & TLV_TAG_NUMBER_MASK) != 0x1Fu)
-		return sz;
+	hash = dol_hash(dol, dol_sz);
 
-	while (id[sz++] & 0x80u)
-		;
+	for (i = hash & cache->mask; cache->slots[i];
+						 i = (i + 1) & cache->mask) {
+		result = cache->slots[i];
+		if ((result->hash == hash) && (result->dol_sz == dol_sz) &&
+		    (!dol_sz || !memcmp(result->dol, dol, dol_sz))) {
+			*plan = result;
+			return TLV_RC_OK;
+		}
+	}
 
-	return sz;
+	rc = dol_compile_ctx(cache->ctx, dol, dol_sz, &result);
+	if (rc != TLV_RC_OK)
+		return rc;
+
+	if ((cache->count + 1) * 2 > cache->mask + 1) {
+		rc = dol_plan_cache_grow(cache);
+		if (rc != TLV_RC_OK) {
+			dol_plan_free(result);
+			return rc;
+		}
+
+		for (i = hash & cache->mask; cache->slots[i];
+						      i = (i + 1) & cache->mask)
+			;
+	}
+
+	cache->slots[i] = result;
+	cache->count++;
+	*plan = result;
+
+	return TLV_RC_OK;
 }
 
-static int compare_ids(const uint8_t *id_a, const uint8_t *id_b)
+void dol_plan_cache_free(struct dol_plan_cache *cache)
 {
-	size_t id_a_sz = 0, id_b_sz = 0, min_id_sz = 0;
-	int rc = 0;
+	size_t i;
+
+	if (!cache)
+		return;
 
-	id_a_sz = id_sz(id_a);
-	id_b_sz = id_sz(id_b);
+	for (i = 0; i <= cache->mask; i++)
+		dol_plan_free(cache->slots[i]);
 
-	min_id_sz = (id_a_sz < id_b_sz) ? id_a_sz : id_b_sz;
+	free(cache->slots);
+	free(cache);
+}
 
-	rc = memcmp(id_a, id_b, min_id_sz);
-	if (rc)
-		return rc;
+static int compare_formats(const void *a, const void *b)
+{
+	const struct tlv_fmt_slot *fmt_a = (const struct tlv_fmt_slot *)a;
+	const struct tlv_fmt_slot *fmt_b = (const struct tlv_fmt_slot *)b;
 
-	if (id_a_sz < id_b_sz)
+	if (fmt_a->key < fmt_b->key)
 		return -1;
 
-	if (id_a_sz > id_b_sz)
+	if (fmt_a->key > fmt_b->key)
 		return 1;
 
 	return 0;
 }
 
-static int compare_formats(const void *a, const void *b)
+static size_t fmt_table_hash(const struct tlv_fmt_table *table, tlv_key_t key)
+{
+	return (size_t)((key * 0x9E3779B97F4A7C15ull) >> table->shift);
+}
+
+static int fmt_table_build(const struct libtlv_ctx *ctx,
+					       struct tlv_fmt_table **table)
 {
-	const struct tlv_id_to_fmt *fmt_a = NULL, *fmt_b = NULL;
+	struct tlv_fmt_table *tbl = NULL;
+	size_t num_slots = 8, i, j;
+	unsigned int bits = 3;
+
+	/* Keep the load factor at or below one quarter, so that almost all
+	 * lookups are answered by the first slot probed.		      */
+	while (num_slots < 4 * ctx->num_known_formats) {
+		num_slots <<= 1;
+		bits++;
+	}
+
+	tbl = (struct tlv_fmt_table *)calloc(1, sizeof(*tbl) +
+					    num_slots * sizeof(tbl->slots[0]));
+	if (!tbl)
+		return TLV_RC_OUT_OF_MEMORY;
+
+	tbl->shift = 64 - bits;
+	tbl->mask = num_slots - 1;
+
+	/* known_formats is sorted and free of duplicates, so every key is
+	 * inserted exactly once.  Key 0 marks an empty slot.		      */
+	for (i = 0; i < ctx->num_known_formats; i++) {
+		for (j = fmt_table_hash(tbl, ctx->known_formats[i].key);
+		     tbl->slots[j].key; j = (j + 1) & tbl->mask)
+			;
+		tbl->slots[j] = ctx->known_formats[i];
+	}
 
-	fmt_a = (const struct tlv_id_to_fmt *)a;
-	fmt_b = (const struct tlv_id_to_fmt *)b;
+	*table = tbl;
 
-	return compare_ids(fmt_a->id, fmt_b->id);
+	return TLV_RC_OK;
 }
 
-static int compare_id_with_format(const void *a, const void *b)
+/* Every thread that looks formats up in a frozen table owns a reader.  Its
+ * sequence number is odd while a lookup is in progress.  Readers are never
+ * freed, the reader of an exited thread is reused by the next new thread.
+ * Hence the list only ever grows at its head, up to the largest number of
+ * threads that used it at the same time, and can be walked without a lock
+ * once its head has been read.  Adding and claiming readers is serialized
+ * by 'fmt_readers_mutex'.						      */
+struct fmt_reader {
+	struct fmt_reader      *next;
+	unsigned long		seq;
+	bool			in_use;
+};
+
+static pthread_mutex_t fmt_readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fmt_reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fmt_reader_key;
+static struct fmt_reader *fmt_readers;
+
+/* Whether fmts_synchronize issues a barrier on all threads of the process,
+ * which spares readers a fence of their own.				      */
+static bool fmt_membarrier;
+
+static __thread struct fmt_reader *fmt_reader;
+
+static void fmt_reader_release(void *arg)
 {
-	const uint8_t *id = (const uint8_t *)a;
-	const struct tlv_id_to_fmt *fmt = (const struct tlv_id_to_fmt *)b;
+	struct fmt_reader *reader = (struct fmt_reader *)arg;
 
-	return compare_ids(id, fmt->id);
+	pthread_mutex_lock(&fmt_readers_mutex);
+	reader->in_use = false;
+	pthread_mutex_unlock(&fmt_readers_mutex);
 }
 
-int libtlv_register_fmts(const struct tlv_id_to_fmt *fmts)
+static void fmt_reader_init(void)
+{
+	pthread_key_create(&fmt_reader_key, fmt_reader_release);
+
+#if defined(__linux__) && defined(__NR_membarrier)
+	fmt_membarrier = !syscall(__NR_membarrier,
+			       MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0);
+#endif
+}
+
+static void fmt_reader_barrier(void)
+{
+#if defined(__linux__) && defined(__NR_membarrier)
+	if (fmt_membarrier &&
+	    !syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0))
+		return;
+#endif
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static struct fmt_reader *fmt_reader_get(void)
+{
+	struct fmt_reader *reader = fmt_reader;
+
+	if (reader)
+		return reader;
+
+	pthread_once(&fmt_reader_once, fmt_reader_init);
+
+	pthread_mutex_lock(&fmt_readers_mutex);
+
+	for (reader = fmt_readers; reader && reader->in_use;
+							 reader = reader->next)
+		;
+
+	if (!reader) {
+		reader = (struct fmt_reader *)calloc(1, sizeof(*reader));
+		if (!reader) {
+			pthread_mutex_unlock(&fmt_readers_mutex);
+			return NULL;
+		}
+
+		reader->next = fmt_readers;
+		__atomic_store_n(&fmt_readers, reader, __ATOMIC_RELEASE);
+	}
+
+	reader->in_use = true;
+
+	pthread_mutex_unlock(&fmt_readers_mutex);
+
+	pthread_setspecific(fmt_reader_key, reader);
+	fmt_reader = reader;
+
+	return reader;
+}
+
+/* Wait until no reader can still use a table that was unpublished before the
+ * call.  A reader makes its sequence number odd before it loads the table
+ * pointer, and the barrier orders the two on every thread, so a reader seen
+ * idle here will load the current table.  Readers added later on do so as
+ * well.  Readers seen in a lookup are waited for until that lookup has
+ * returned, which takes no longer than a few probes unless their thread is
+ * preempted.  No lock is held meanwhile, so neither new readers nor other
+ * lookups are held up.							      */
+static void fmts_synchronize(void)
+{
+	const struct fmt_reader *reader = NULL;
+	unsigned long seq;
+
+	pthread_once(&fmt_reader_once, fmt_reader_init);
+	fmt_reader_barrier();
+
+	for (reader = __atomic_load_n(&fmt_readers, __ATOMIC_ACQUIRE); reader;
+						       reader = reader->next) {
+		seq = __atomic_load_n(&reader->seq, __ATOMIC_SEQ_CST);
+		if (!(seq & 1))
+			continue;
+
+		while (__atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE) == seq)
+			sched_yield();
+	}
+}
+
+/* Release a table that has been replaced, once no reader can still use it.
+ * Called without fmts_mutex, so that registrations and lookups before a
+ * freeze do not wait for the readers of the frozen table.		      */
+static void fmt_table_retire(struct tlv_fmt_table *table)
+{
+	if (!table)
+		return;
+
+	fmts_synchronize();
+	free(table);
+}
+
+/* Build a new table and publish it.  The replaced table is returned in
+ * 'old' for fmt_table_retire.  Must be called with fmts_mutex held.	      */
+static int fmts_freeze(struct libtlv_ctx *ctx, struct tlv_fmt_table **old)
+{
+	struct tlv_fmt_table *table = NULL;
+	int rc = TLV_RC_OK;
+
+	rc = fmt_table_build(ctx, &table);
+	if (rc != TLV_RC_OK)
+		return rc;
+
+	*old = __atomic_exchange_n(&ctx->fmt_table, table, __ATOMIC_SEQ_CST);
+
+	return TLV_RC_OK;
+}
+
+int libtlv_register_fmts_ctx(struct libtlv_ctx *ctx,
+					       const struct tlv_id_to_fmt *fmts)
 {
 	const struct tlv_id_to_fmt *i_fmt;
+	struct tlv_fmt_slot *formats = NULL;
+	struct tlv_fmt_table *old = NULL;
 	int rc = TLV_RC_OK;
-	size_t num_fmts = 0;
+	size_t num_fmts = 0, i, j;
 
 	for (i_fmt = fmts, num_fmts = 0; i_fmt->id; i_fmt++)
 		num_fmts++;
 
-	known_formats = (struct tlv_id_to_fmt *)realloc(known_formats,
-				(num_known_formats + num_fmts) * sizeof(*fmts));
-	if (!known_formats) {
+	if (!num_fmts)
+		return TLV_RC_OK;
+
+	ctx = libtlv_ctx_get(ctx);
+
+	pthread_mutex_lock(&ctx->fmts_mutex);
+
+	formats = (struct tlv_fmt_slot *)realloc(ctx->known_formats,
+		       (ctx->num_known_formats + num_fmts) * sizeof(*formats));
+	if (!formats) {
 		rc = TLV_RC_OUT_OF_MEMORY;
 		goto done;
 	}
+	ctx->known_formats = formats;
+
+	for (i_fmt = fmts, i = ctx->num_known_formats; i_fmt->id; i_fmt++) {
+		formats[i].key = libtlv_tag_to_key(i_fmt->id);
+		formats[i].fmt = i_fmt->fmt;
+		if (formats[i].key)
+			i++;
+	}
+
+	/* Collapse tags that are registered more than once.		      */
+	qsort(formats, i, sizeof(*formats), compare_formats);
+
+	for (ctx->num_known_formats = 0, j = 0; j < i; j++) {
+		if (ctx->num_known_formats &&
+		    formats[ctx->num_known_formats - 1].key == formats[j].key)
+			continue;
+		formats[ctx->num_known_formats++] = formats[j];
+	}
 
-	memcpy(&known_formats[num_known_formats], fmts,
-						      num_fmts * sizeof(*fmts));
-	num_known_formats += num_fmts;
-	qsort(known_formats, num_known_formats, sizeof(*fmts), compare_formats);
+	/* Keep a frozen registry in sync with the registered formats.	      */
+	if (ctx->fmt_table)
+		rc = fmts_freeze(ctx, &old);
 
 done:
+	pthread_mutex_unlock(&ctx->fmts_mutex);
+	fmt_table_retire(old);
+	return rc;
+}
+
+int libtlv_register_fmts(const struct tlv_id_to_fmt *fmts)
+{
+	return libtlv_register_fmts_ctx(&default_ctx, fmts);
+}
+
+int libtlv_fmts_freeze_ctx(struct libtlv_ctx *ctx)
+{
+	struct tlv_fmt_table *old = NULL;
+	int rc = TLV_RC_OK;
+
+	ctx = libtlv_ctx_get(ctx);
+
+	pthread_mutex_lock(&ctx->fmts_mutex);
+	rc = fmts_freeze(ctx, &old);
+	pthread_mutex_unlock(&ctx->fmts_mutex);
+
+	fmt_table_retire(old);
+
 	return rc;
 }
 
+int libtlv_fmts_freeze(void)
+{
+	return libtlv_fmts_freeze_ctx(&default_ctx);
+}
+
+void libtlv_free_fmts_ctx(struct libtlv_ctx *ctx)
+{
+	struct tlv_fmt_table *table = NULL;
+
+	ctx = libtlv_ctx_get(ctx);
+
+	pthread_mutex_lock(&ctx->fmts_mutex);
+
+	free(ctx->known_formats);
+	ctx->known_formats = NULL;
+	ctx->num_known_formats = 0;
+
+	table = __atomic_exchange_n(&ctx->fmt_table, NULL, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&ctx->fmts_mutex);
+
+	fmt_table_retire(table);
+}
+
 void libtlv_free_fmts(void)
 {
-	free(known_formats);
-	known_formats = NULL;
+	libtlv_free_fmts_ctx(&default_ctx);
 }
 
-enum tlv_fmt libtlv_id_to_fmt(const void *id)
+static enum tlv_fmt fmt_table_lookup(const struct tlv_fmt_table *table,
+								tlv_key_t key)
+{
+	const struct tlv_fmt_slot *fmt = NULL;
+	size_t i;
+
+	for (i = fmt_table_hash(table, key); ; i = (i + 1) & table->mask) {
+		fmt = &table->slots[i];
+		if (fmt->key == key)
+			return fmt->fmt;
+		if (!fmt->key)
+			return fmt_unknown;
+	}
+}
+
+enum tlv_fmt libtlv_key_to_fmt_ctx(struct libtlv_ctx *ctx, tlv_key_t key)
 {
-	const struct tlv_id_to_fmt *fmt = NULL;
+	const struct tlv_fmt_table *table = NULL;
+	const struct tlv_fmt_slot *fmt = NULL;
+	struct fmt_reader *reader = NULL;
+	struct tlv_fmt_slot needle;
+	enum tlv_fmt result = fmt_unknown;
+
+	ctx = libtlv_ctx_get(ctx);
+
+	/* Registration reallocates the sorted formats, so they may only be
+	 * searched with fmts_mutex held.				      */
+	if (__atomic_load_n(&ctx->fmt_table, __ATOMIC_ACQUIRE))
+		reader = fmt_reader_get();
+
+	if (!reader) {
+		pthread_mutex_lock(&ctx->fmts_mutex);
+		if (ctx->fmt_table) {
+			result = fmt_table_lookup(ctx->fmt_table, key);
+		} else if (ctx->known_formats) {
+			needle.key = key;
+			fmt = (const struct tlv_fmt_slot *)bsearch(&needle,
+			       ctx->known_formats, ctx->num_known_formats,
+				sizeof(*ctx->known_formats), compare_formats);
+			if (fmt)
+				result = fmt->fmt;
+		}
+		pthread_mutex_unlock(&ctx->fmts_mutex);
+		return result;
+	}
+
+	__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELAXED);
+	if (fmt_membarrier)
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	else
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	table = __atomic_load_n(&ctx->fmt_table, __ATOMIC_ACQUIRE);
+	if (table)
+		result = fmt_table_lookup(table, key);
 
-	fmt = (const struct tlv_id_to_fmt *)bsearch(id, known_formats,
-		       num_known_formats, sizeof(*fmt), compare_id_with_format);
+	__atomic_store_n(&reader->seq, reader->seq + 1, __ATOMIC_RELEASE);
 
-	return fmt ? fmt->fmt : fmt_unknown;
+	return result;
 }
 
-void libtlv_init(const char *log4c_category)
+enum tlv_fmt libtlv_key_to_fmt(tlv_key_t key)
+{
+	return libtlv_key_to_fmt_ctx(&default_ctx, key);
+}
+
+enum tlv_fmt libtlv_id_to_fmt_ctx(struct libtlv_ctx *ctx, const void *id)
+{
+	return libtlv_key_to_fmt_ctx(ctx, libtlv_tag_to_key(id));
+}
+
+enum tlv_fmt libtlv_id_to_fmt(const void *id)
+{
+	return libtlv_key_to_fmt_ctx(&default_ctx, libtlv_tag_to_key(id));
+}
+
+static void libtlv_ctx_set_log_category(struct libtlv_ctx *ctx,
+						    const char *log4c_category)
 {
 	char cat[64];
 
 	snprintf(cat, sizeof(cat), "%s.libtlv", log4c_category);
-	log_cat = log4c_category_get(cat);
+	ctx->log_cat = log4c_category_get(cat);
+}
+
+void libtlv_init(const char *log4c_category)
+{
+	libtlv_ctx_set_log_category(&default_ctx, log4c_category);
+}
+
+struct libtlv_ctx *libtlv_ctx_new(const char *log4c_category)
+{
+	struct libtlv_ctx *ctx = NULL;
+
+	ctx = (struct libtlv_ctx *)calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	if (pthread_mutex_init(&ctx->fmts_mutex, NULL)) {
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->max_depth = TLV_DEFAULT_MAX_DEPTH;
+	if (log4c_category)
+		libtlv_ctx_set_log_category(ctx, log4c_category);
+	else
+		ctx->log_cat = default_ctx.log_cat;
+
+	return ctx;
+}
+
+void libtlv_ctx_free(struct libtlv_ctx *ctx)
+{
+	if (!ctx || (ctx == &default_ctx))
+		return;
+
+	libtlv_free_fmts_ctx(ctx);
+	pthread_mutex_destroy(&ctx->fmts_mutex);
+	free(ctx);
+}
+
+struct libtlv_ctx *libtlv_get_default_ctx(void)
+{
+	return &default_ctx;
+}
+
+void libtlv_ctx_set_arena(struct libtlv_ctx *ctx, struct tlv_arena *arena)
+{
+	libtlv_ctx_get(ctx)->arena = arena;
+}
+
+void libtlv_ctx_set_max_depth(struct libtlv_ctx *ctx, unsigned int max_depth)
+{
+	libtlv_ctx_get(ctx)->max_depth = max_depth ? max_depth :
+							  TLV_DEFAULT_MAX_DEPTH;
+}
+
+int libtlv_ctx_get_error(const struct libtlv_ctx *ctx, size_t *offset)
+{
+	if (!ctx)
+		ctx = &default_ctx;
+
+	if (offset)
+		*offset = ctx->error.offset;
+
+	return ctx->error.rc;
+}
+
+int libtlv_init_async(const char *log4c_category, size_t ring_size)
+{
+	libtlv_init(log4c_category);
+
+	return libtlv_log_async_start(ring_size);
 }
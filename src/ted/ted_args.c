@@ -125,8 +125,8 @@ static int hex_to_binary(const uint8_t *hex, size_t hex_len, uint8_t **binary,
 							     size_t *binary_len)
 {
 	uint8_t *result = NULL;
-	size_t buffer_len = 256, i_hex = 0, nibbles = 0;
-	bool comment = false;
+	size_t result_len = 0;
+	int rc = TLV_RC_OK;
 
 	assert(binary);
 	assert(binary_len);
@@ -137,54 +137,21 @@ static int hex_to_binary(const uint8_t *hex, size_t hex_len, uint8_t **binary,
 	if (!hex || !hex_len)
 		goto done;
 
-	result = malloc(buffer_len);
+	result_len = hex_len / 2;
+	result = malloc(result_len + 1);
 	if (!result)
 		return TLV_RC_OUT_OF_MEMORY;
 
-	for (i_hex = 0, nibbles = 0, comment = false; i_hex < hex_len;
-								      i_hex++) {
-
-		if ((nibbles / 2) >= buffer_len) {
-			uint8_t *new_buffer = NULL;
-
-			buffer_len *= 2;
-			new_buffer = realloc(result, buffer_len);
-			if (!new_buffer) {
-				free(result);
-				return TLV_RC_OUT_OF_MEMORY;
-			}
-			result = new_buffer;
-		}
-
-		if (!comment) {
-			if ((hex[i_hex] >= '0') && (hex[i_hex] <= '9')) {
-				result[nibbles >> 1] <<= 4;
-				result[nibbles >> 1] |= hex[i_hex] - '0';
-				nibbles++;
-			}
-			if ((tolower(hex[i_hex]) >= 'a') &&
-						 (tolower(hex[i_hex]) <= 'f')) {
-				result[nibbles >> 1] <<= 4;
-				result[nibbles >> 1] |= tolower(hex[i_hex]) -
-								       'a' + 10;
-				nibbles++;
-			}
-			if (hex[i_hex] == '#')
-				comment = true;
-		} else {
-			if (hex[i_hex] == '\n')
-				comment = false;
-		}
-	}
-
-	if (nibbles % 2) {
+	rc = libtlv_hex_decode_text((const char *)hex, hex_len, result,
+								  &result_len);
+	if (rc != TLV_RC_OK) {
 		free(result);
-		return TLV_RC_INVALID_ARG;
+		return rc;
 	}
 
 done:
 	*binary = result;
-	*binary_len = nibbles / 2;
+	*binary_len = result_len;
 	return TLV_RC_OK;
 }
 
@@ -49,7 +49,8 @@ static uint8_t get_txn_type(enum emv_txn_type txn_type)
 	}
 }
 
-static struct tlv *get_txn_types(enum emv_txn_type *txn_types)
+static void put_txn_types(struct tlv_writer *writer,
+					    const enum emv_txn_type *txn_types)
 {
 	size_t len, i;
 	uint8_t value[4];
@@ -61,238 +62,188 @@ static struct tlv *get_txn_types(enum emv_txn_type *txn_types)
 	for (i = 0; i < len; i++)
 		value[i] = get_txn_type(txn_types[i]);
 
-	return tlv_new(EMV_ID_LIBEMV_TRANSACTION_TYPES, len, value);
+	tlv_writer_put_primitive(writer, EMV_ID_LIBEMV_TRANSACTION_TYPES, value,
+									   len);
 }
 
-static struct tlv *get_combinations(struct emv_ep_aid_kernel *aid_kernel)
+static void put_combination(struct tlv_writer *writer,
+				    const struct emv_ep_aid_kernel *aid_kernel)
 {
-	struct tlv *tlv_combinations = NULL;
+	tlv_writer_begin_constructed(writer, EMV_ID_LIBEMV_COMBINATION);
+	tlv_writer_put_primitive(writer, EMV_ID_LIBEMV_AID, aid_kernel->aid,
+							   aid_kernel->aid_len);
+	tlv_writer_put_primitive(writer, EMV_ID_LIBEMV_KERNEL_ID,
+			     aid_kernel->kernel_id, aid_kernel->kernel_id_len);
+	tlv_writer_end(writer);
+}
 
-	for (; aid_kernel->aid_len; aid_kernel++) {
-		struct tlv *tlv = NULL, *tail = NULL;
+static void put_combinations(struct tlv_writer *writer,
+				    const struct emv_ep_aid_kernel *aid_kernel)
+{
+	size_t num = 0;
 
-		tlv = tlv_new(EMV_ID_LIBEMV_COMBINATION, 0, NULL);
-		tail = tlv_insert_below(tlv, tlv_new(EMV_ID_LIBEMV_AID,
-					 aid_kernel->aid_len, aid_kernel->aid));
-		tail = tlv_insert_after(tail, tlv_new(EMV_ID_LIBEMV_KERNEL_ID,
-			     aid_kernel->kernel_id_len, aid_kernel->kernel_id));
+	while (aid_kernel[num].aid_len)
+		num++;
 
-		if (!tlv_combinations)
-			tlv_combinations = tlv;
-		else
-			tlv_insert_after(tlv_combinations, tlv);
-	}
+	if (!num)
+		return;
 
-	return tlv_combinations;
+	/* Each further Combination has always been inserted right behind the
+	 * first one, which lists the others in reverse order.  Entry Point
+	 * builds its Candidate List in this order, so keep it.		      */
+	put_combination(writer, &aid_kernel[0]);
+	while (--num)
+		put_combination(writer, &aid_kernel[num]);
 }
 
-static struct tlv *get_combination_set(struct emv_ep_combination *comb)
+/* An amount with too many digits is still written, with its low order
+ * digits, so that the writer keeps track of the size.  The error is kept in
+ * 'rc' unless an earlier one is there already.				      */
+static void put_amount(struct tlv_writer *writer, const void *tag,
+						     uint64_t amount, int *rc)
 {
-	struct tlv *tlv = NULL, *tail = NULL;
+	uint8_t bcd[6];
+	int bcd_rc;
 
-	tlv = tlv_new(EMV_ID_LIBEMV_COMBINATION_SET, 0, NULL);
+	bcd_rc = libtlv_u64_to_bcd(amount, bcd, sizeof(bcd));
+	if (*rc == TLV_RC_OK)
+		*rc = bcd_rc;
 
-	tail = tlv_insert_below(tlv, get_txn_types(comb->txn_types));
+	tlv_writer_put_primitive(writer, tag, bcd, sizeof(bcd));
+}
 
-	tail = tlv_insert_after(tail, get_combinations(comb->combinations));
+static void put_combination_set(struct tlv_writer *writer,
+			     const struct emv_ep_combination *comb, int *rc)
+{
+	tlv_writer_begin_constructed(writer, EMV_ID_LIBEMV_COMBINATION_SET);
 
-	while (tlv_get_next(tail))
-		tail = tlv_get_next(tail);
+	put_txn_types(writer, comb->txn_types);
+
+	put_combinations(writer, comb->combinations);
 
 	if (comb->config.present.status_check_support) {
 		uint8_t enabled = comb->config.enabled.status_check_support;
 
-		tail = tlv_insert_after(tail, tlv_new(
-			    EMV_ID_LIBEMV_STATUS_CHECK_SUPPORTED, 1, &enabled));
+		tlv_writer_put_primitive(writer,
+			     EMV_ID_LIBEMV_STATUS_CHECK_SUPPORTED, &enabled, 1);
 	}
 
 	if (comb->config.present.zero_amount_allowed) {
 		uint8_t enabled = comb->config.enabled.zero_amount_allowed;
 
-		tail = tlv_insert_after(tail, tlv_new(
-			       EMV_ID_LIBEMV_ZERO_AMOUNT_ALLOWED, 1, &enabled));
+		tlv_writer_put_primitive(writer,
+				EMV_ID_LIBEMV_ZERO_AMOUNT_ALLOWED, &enabled, 1);
 	}
 
 	if (comb->config.present.ext_selection_support) {
 		uint8_t enabled = comb->config.enabled.ext_selection_support;
 
-		tail = tlv_insert_after(tail, tlv_new(
-			   EMV_ID_LIBEMV_EXT_SELECTION_SUPPORTED, 1, &enabled));
-	}
-
-	if (comb->config.present.reader_ctls_txn_limit) {
-		uint8_t amount[6];
-		int rc;
-
-		rc = libtlv_u64_to_bcd(comb->config.reader_ctls_txn_limit,
-							amount, sizeof(amount));
-		if (rc != EMV_RC_OK)
-			goto error;
-
-		tail = tlv_insert_after(tail, tlv_new(
-					       EMV_ID_LIBEMV_RDR_CTLS_TXN_LIMIT,
-						       sizeof(amount), amount));
+		tlv_writer_put_primitive(writer,
+			    EMV_ID_LIBEMV_EXT_SELECTION_SUPPORTED, &enabled, 1);
 	}
 
-	if (comb->config.present.reader_ctls_floor_limit) {
-		uint8_t amount[6];
-		int rc;
+	if (comb->config.present.reader_ctls_txn_limit)
+		put_amount(writer, EMV_ID_LIBEMV_RDR_CTLS_TXN_LIMIT,
+				       comb->config.reader_ctls_txn_limit, rc);
 
-		rc = libtlv_u64_to_bcd(comb->config.reader_ctls_floor_limit,
-							amount, sizeof(amount));
-		if (rc != EMV_RC_OK)
-			goto error;
-
-		tail = tlv_insert_after(tail, tlv_new(
-					     EMV_ID_LIBEMV_RDR_CTLS_FLOOR_LIMIT,
-						       sizeof(amount), amount));
-	}
+	if (comb->config.present.reader_ctls_floor_limit)
+		put_amount(writer, EMV_ID_LIBEMV_RDR_CTLS_FLOOR_LIMIT,
+				     comb->config.reader_ctls_floor_limit, rc);
 
-	if (comb->config.present.terminal_floor_limit) {
-		uint8_t amount[6];
-		int rc;
-
-		rc = libtlv_u64_to_bcd(comb->config.terminal_floor_limit,
-							amount, sizeof(amount));
-		if (rc != EMV_RC_OK)
-			goto error;
-
-		tail = tlv_insert_after(tail, tlv_new(
-					     EMV_ID_LIBEMV_TERMINAL_FLOOR_LIMIT,
-						       sizeof(amount), amount));
-	}
+	if (comb->config.present.terminal_floor_limit)
+		put_amount(writer, EMV_ID_LIBEMV_TERMINAL_FLOOR_LIMIT,
+					comb->config.terminal_floor_limit, rc);
 
-	if (comb->config.present.reader_cvm_reqd_limit) {
-		uint8_t amount[6];
-		int rc;
-
-		rc = libtlv_u64_to_bcd(comb->config.reader_cvm_reqd_limit,
-							amount, sizeof(amount));
-		if (rc != EMV_RC_OK)
-			goto error;
-
-		tail = tlv_insert_after(tail, tlv_new(
-					   EMV_ID_LIBEMV_RDR_CVM_REQUIRED_LIMIT,
-						       sizeof(amount), amount));
-	}
+	if (comb->config.present.reader_cvm_reqd_limit)
+		put_amount(writer, EMV_ID_LIBEMV_RDR_CVM_REQUIRED_LIMIT,
+				       comb->config.reader_cvm_reqd_limit, rc);
 
 	if (comb->config.present.ttq)
-		tail = tlv_insert_after(tail, tlv_new(EMV_ID_LIBEMV_TTQ,
-				   sizeof(comb->config.ttq), comb->config.ttq));
-
-	return tlv;
+		tlv_writer_put_primitive(writer, EMV_ID_LIBEMV_TTQ,
+				  comb->config.ttq, sizeof(comb->config.ttq));
 
-error:
-	if (tlv)
-		tlv_free(tlv);
-
-	return NULL;
+	tlv_writer_end(writer);
 }
 
-static struct tlv *get_autorun(const struct emv_ep_autorun *autorun)
+static void put_autorun(struct tlv_writer *writer,
+			       const struct emv_ep_autorun *autorun, int *rc)
 {
-	struct tlv *tlv = NULL, *tail = NULL;
-	uint8_t amount[6], txn_type = get_txn_type(autorun->txn_type);
-	int rc = EMV_RC_OK;
+	uint8_t txn_type = get_txn_type(autorun->txn_type);
 
-	tlv = tlv_new(EMV_ID_LIBEMV_AUTORUN, 0, NULL);
+	tlv_writer_begin_constructed(writer, EMV_ID_LIBEMV_AUTORUN);
 
-	rc = libtlv_u64_to_bcd(autorun->amount_authorized, amount,
-								sizeof(amount));
-	if (rc != EMV_RC_OK)
-		goto error;
-
-	tail = tlv_insert_below(tlv,
-				tlv_new(EMV_ID_LIBEMV_AUTORUN_AMOUNT_AUTHORIZED,
-						       sizeof(amount), amount));
-	tail = tlv_insert_after(tail,
-				 tlv_new(EMV_ID_LIBEMV_AUTORUN_TRANSACTION_TYPE,
-						  sizeof(txn_type), &txn_type));
-	if (!tail)
-		goto error;
-
-	return tlv;
-
-error:
-	tlv_free(tlv);
-	return NULL;
+	put_amount(writer, EMV_ID_LIBEMV_AUTORUN_AMOUNT_AUTHORIZED,
+					       autorun->amount_authorized, rc);
+
+	tlv_writer_put_primitive(writer, EMV_ID_LIBEMV_AUTORUN_TRANSACTION_TYPE,
+						   &txn_type, sizeof(txn_type));
+
+	tlv_writer_end(writer);
 }
 
-static struct tlv *get_terminal_data(struct emv_ep_terminal_data *data)
+static int put_terminal_data(struct tlv_writer *writer,
+				       const struct emv_ep_terminal_data *data)
 {
-	struct tlv *term_data = NULL, *tail = NULL;
-
-	term_data = tlv_new(EMV_ID_LIBEMV_TERMINAL_DATA, 0, NULL);
-
-	tail = tlv_insert_below(term_data, tlv_new(EMV_ID_ACQUIRER_IDENTIFIER,
-		 sizeof(data->acquirer_identifier), data->acquirer_identifier));
-	tail = tlv_insert_after(tail, tlv_new(EMV_ID_MERCHANT_CATEGORY_CODE,
-					   sizeof(data->merchant_category_code),
-						 data->merchant_category_code));
-	tail = tlv_insert_after(tail, tlv_new(EMV_ID_MERCHANT_IDENTIFIER,
-		 strlen(data->merchant_identifier), data->merchant_identifier));
-	tail = tlv_insert_after(tail, tlv_new(EMV_ID_TERMINAL_COUNTRY_CODE,
-					    sizeof(data->terminal_country_code),
-						  data->terminal_country_code));
-	tail = tlv_insert_after(tail, tlv_new(EMV_ID_TERMINAL_IDENTIFICATION,
-					  sizeof(data->terminal_identification),
-						data->terminal_identification));
-	tail = tlv_insert_after(tail, tlv_new(EMV_ID_TERMINAL_TYPE,
-			    sizeof(data->terminal_type), &data->terminal_type));
-	tail = tlv_insert_after(tail, tlv_new(EMV_ID_POS_ENTRY_MODE,
-			  sizeof(data->pos_entry_mode), &data->pos_entry_mode));
-	tail = tlv_insert_after(tail,
-				tlv_new(EMV_ID_ADDITIONAL_TERMINAL_CAPABILITIES,
-				 sizeof(data->additional_terminal_capabilities),
-				       data->additional_terminal_capabilities));
-	tail = tlv_insert_after(tail, tlv_new(EMV_ID_TERMINAL_CAPABILITIES,
-					    sizeof(data->terminal_capabilities),
-						  data->terminal_capabilities));
-	tail = tlv_insert_after(tail, tlv_new(EMV_ID_MERCHANT_NAME_AND_LOCATION,
-				       strlen(data->merchant_name_and_location),
-					     data->merchant_name_and_location));
-	if (!tail) {
-		tlv_free(term_data);
-		term_data = NULL;
-	}
-
-	return term_data;
+	tlv_writer_begin_constructed(writer, EMV_ID_LIBEMV_TERMINAL_DATA);
+
+	tlv_writer_put_primitive(writer, EMV_ID_ACQUIRER_IDENTIFIER,
+		 data->acquirer_identifier, sizeof(data->acquirer_identifier));
+	tlv_writer_put_primitive(writer, EMV_ID_MERCHANT_CATEGORY_CODE,
+						  data->merchant_category_code,
+					 sizeof(data->merchant_category_code));
+	tlv_writer_put_primitive(writer, EMV_ID_MERCHANT_IDENTIFIER,
+		 data->merchant_identifier, strlen(data->merchant_identifier));
+	tlv_writer_put_primitive(writer, EMV_ID_TERMINAL_COUNTRY_CODE,
+						   data->terminal_country_code,
+					  sizeof(data->terminal_country_code));
+	tlv_writer_put_primitive(writer, EMV_ID_TERMINAL_IDENTIFICATION,
+						 data->terminal_identification,
+					sizeof(data->terminal_identification));
+	tlv_writer_put_primitive(writer, EMV_ID_TERMINAL_TYPE,
+			    &data->terminal_type, sizeof(data->terminal_type));
+	tlv_writer_put_primitive(writer, EMV_ID_POS_ENTRY_MODE,
+			  &data->pos_entry_mode, sizeof(data->pos_entry_mode));
+	tlv_writer_put_primitive(writer,
+				       EMV_ID_ADDITIONAL_TERMINAL_CAPABILITIES,
+					data->additional_terminal_capabilities,
+			       sizeof(data->additional_terminal_capabilities));
+	tlv_writer_put_primitive(writer, EMV_ID_TERMINAL_CAPABILITIES,
+						   data->terminal_capabilities,
+					  sizeof(data->terminal_capabilities));
+	tlv_writer_put_primitive(writer, EMV_ID_MERCHANT_NAME_AND_LOCATION,
+					      data->merchant_name_and_location,
+				     strlen(data->merchant_name_and_location));
+
+	return tlv_writer_end(writer);
 };
 
 static int get_termsetting(const struct emv_ep_terminal_settings *settings,
 						     void *buffer, size_t *size)
 {
-	struct tlv *tlv = NULL, *tail = NULL;
-	int i = 0, rc = TLV_RC_OK;
+	struct tlv_writer writer;
+	int i = 0, rc = TLV_RC_OK, amount_rc = TLV_RC_OK;
 
-	tlv = tlv_new(EMV_ID_LIBEMV_CONFIGURATION, 0, NULL);
-	if (!tlv) {
-		rc = TLV_RC_OUT_OF_MEMORY;
-		goto done;
-	}
+	tlv_writer_init(&writer, buffer, *size);
 
-	tail = tlv_insert_below(tlv,
-			   get_combination_set(&settings->combination_sets[0]));
+	tlv_writer_begin_constructed(&writer, EMV_ID_LIBEMV_CONFIGURATION);
 
-	for (i = 1; i < settings->num_combination_sets; i++)
-		tail = tlv_insert_after(tail,
-			   get_combination_set(&settings->combination_sets[i]));
+	for (i = 0; i < settings->num_combination_sets; i++)
+		put_combination_set(&writer, &settings->combination_sets[i],
+								   &amount_rc);
 
 	if (settings->autorun.enabled)
-		tail = tlv_insert_after(tail, get_autorun(&settings->autorun));
+		put_autorun(&writer, &settings->autorun, &amount_rc);
 
 	if (settings->terminal_data)
-		tail = tlv_insert_after(tail,
-				    get_terminal_data(settings->terminal_data));
-	if (!tail) {
-		rc = TLV_RC_OUT_OF_MEMORY;
-		goto done;
-	}
+		put_terminal_data(&writer, settings->terminal_data);
 
-	rc = tlv_encode(tlv, buffer, size);
+	tlv_writer_end(&writer);
 
-done:
-	tlv_free(tlv);
+	/* The writer reports the required size even if it ran out of room
+	 * or an amount was out of range.				      */
+	rc = tlv_writer_finish(&writer, size);
+	if (rc == TLV_RC_OK)
+		rc = amount_rc;
 
 	return rc;
 }
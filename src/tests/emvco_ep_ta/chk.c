@@ -21,6 +21,8 @@
 #include <time.h>
 #include <log4c.h>
 
+#include <libpay_log.h>
+
 #include "emvco_ep_ta.h"
 
 static struct tk_id tk_kernel_id[] = {
@@ -100,11 +102,11 @@ done:
 		libtlv_bin_to_hex(val, val_sz, hex_val);
 
 		if (val_sz)
-			log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE,
 			       "Wrong value: tag '%s', expected '%s', got '%s'",
 						 hex_tag, hex_dol_val, hex_val);
 		else
-			log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE,
 						  "Missing: tag '%s'", hex_tag);
 	}
 
@@ -145,11 +147,11 @@ done:
 		libtlv_bin_to_hex(val, val_sz, hex_val);
 
 		if (val_sz)
-			log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE,
 			       "Wrong value: tag '%s', expected '%s', got '%s'",
 						 hex_tag, hex_dol_val, hex_val);
 		else
-			log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE,
 						  "Missing: tag '%s'", hex_tag);
 	}
 
@@ -216,7 +218,7 @@ static bool check_terminal_data(struct checker *chk, struct tlv *data)
 	return true;
 
 check_failed:
-	log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE, "%s(): failed!",
+	LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE, "%s(): failed!",
 								      __func__);
 	return false;
 }
@@ -264,7 +266,7 @@ static bool check_txn_date_and_time(struct checker *chk, struct tlv *data)
 	return true;
 
 check_failed:
-	log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE,
+	LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE,
 			  "%s(): failed! transaction time: %snow: %s", __func__,
 					       ctime_r(&time_txn, str_time_txn),
 					      ctime_r(&time_now, str_time_now));
@@ -1842,7 +1844,7 @@ static void checker_select(struct emv_chk *checker, const uint8_t *data,
 	if (!chk->pass_criteria_met) {
 		char hex[2 * len + 1];
 
-		log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE,
 			       "%s('%s): pass criteria check failed!", __func__,
 					     libtlv_bin_to_hex(data, len, hex));
 	}
@@ -3363,7 +3365,7 @@ static void checker_gpo_data(struct emv_chk *checker, struct tlv *data)
 		if (rc == TLV_RC_OK) {
 			char hex[2 * len + 1];
 
-			log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE,
+			LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE,
 				       "%s('%s'): pass criteria check failed!",
 				   __func__, libtlv_bin_to_hex(bin, len, hex));
 		}
@@ -3473,7 +3475,7 @@ static void checker_ui_request(struct emv_chk *checker,
 {
 	struct checker *chk = (struct checker *)checker;
 
-	log4c_category_log(chk->log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_TRACE,
 						"%s(msg_id = 0x%02x)", __func__,
 						  (unsigned)ui_request->msg_id);
 
@@ -3741,7 +3743,7 @@ static void checker_ui_request(struct emv_chk *checker,
 	}
 
 	if (chk->pass_criteria_met == false)
-		log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE,
 			"%s(msg_id = 0x%02x): pass criteria not met!", __func__,
 						  (unsigned)ui_request->msg_id);
 }
@@ -3810,7 +3812,7 @@ static void checker_outcome(struct emv_chk *checker,
 	}
 
 	if (!chk->pass_criteria_met)
-		log4c_category_log(chk->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(chk->log_cat, LOG4C_PRIORITY_NOTICE,
 				      "%s(): pass criteria not met!", __func__);
 }
 
@@ -3877,7 +3879,7 @@ static bool checker_pass_criteria_met(struct emv_chk *chk)
 	}
 
 	if (!ok)
-		log4c_category_log(checker->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(checker->log_cat, LOG4C_PRIORITY_NOTICE,
 			 "Pass criteria %d not met! checked %d met %d state %d",
 						    (int)checker->pass_criteria,
 					    (int)checker->pass_criteria_checked,
@@ -20,6 +20,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <check.h>
 #include <log4c.h>
 #include <arpa/inet.h>
@@ -27,6 +29,8 @@
 
 #include "emvco_ep_ta.h"
 
+#define EMVCO_EP_TA_BENCH_TXNS	1000
+
 static const char log4c_category[] = "emvco_ep_ta";
 
 static const struct tlv_id_to_fmt id_fmts[] = {
@@ -250,6 +254,60 @@ done:
 	return rc;
 }
 
+/* Run the same purchase over and over again to measure the cost of a single
+ * transaction through the entry point, the test kernel and the test card.
+ * The test card replays a script, so every transaction gets a fresh fixture.
+ * Only emv_ep_activate is timed.  The log levels of log4crc apply.	      */
+static int emvco_ep_ta_bench(void)
+{
+	struct emvco_ep_ta_tc_fixture fixture;
+	struct timespec start, end;
+	struct emv_chk *chk = NULL;
+	struct emv_txn txn;
+	double seconds = 0.0;
+	int rc = EMV_RC_OK, i_txn = 0;
+
+	memset(&txn, 0, sizeof(txn));
+	txn.type = txn_purchase;
+	txn.amount_authorized = 10;
+
+	for (i_txn = 0; i_txn < EMVCO_EP_TA_BENCH_TXNS; i_txn++) {
+		chk = chk_pass_criteria_new(pc_2ea_001_00_case01,
+							       log4c_category);
+		if (!chk)
+			return EMV_RC_OUT_OF_MEMORY;
+
+		rc = emvco_ep_ta_tc_fixture_setup(&fixture, chk, termsetting2,
+						       ltsetting1_1, LT_NORMAL);
+		if (rc != EMV_RC_OK) {
+			emv_chk_free(chk);
+			return rc;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rc = emv_ep_wrapper_activate(fixture.ep, &txn);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		seconds += (double)(end.tv_sec - start.tv_sec) +
+				   (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+		if ((rc == EMV_RC_OK) && !emv_chk_pass_criteria_met(chk))
+			rc = EMV_RC_FAIL;
+
+		emvco_ep_ta_tc_fixture_teardown(&fixture);
+		emv_chk_free(chk);
+
+		if (rc != EMV_RC_OK)
+			return rc;
+	}
+
+	seconds /= EMVCO_EP_TA_BENCH_TXNS;
+	printf("emv_ep_activate: %d transactions, %.1f us/transaction\n",
+					 EMVCO_EP_TA_BENCH_TXNS, seconds * 1e6);
+
+	return EMV_RC_OK;
+}
+
 /* 2EA.001.00 Entry of Amount Authorized				      */
 START_TEST(test_2EA_001_00)
 {
@@ -4181,13 +4239,17 @@ int main(int argc, char **argv)
 	Suite *suite;
 	SRunner *srunner;
 	void *plugin;
+	bool bench = false;
 	int failed;
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s ENTRY_POINT_PLUGIN\n", argv[0]);
+	if ((argc != 2) && ((argc != 3) || strcmp(argv[2], "--bench"))) {
+		fprintf(stderr, "Usage: %s ENTRY_POINT_PLUGIN [--bench]\n",
+								       argv[0]);
 		return EXIT_FAILURE;
 	}
 
+	bench = (argc == 3);
+
 	plugin = dlopen(argv[1], RTLD_NOW);
 	if (!plugin) {
 		fprintf(stderr, "dlopen(%s) failed: %s\n", argv[1], dlerror());
@@ -4210,17 +4272,22 @@ int main(int argc, char **argv)
 	libtlv_init(log4c_category);
 	libtlv_register_fmts(id_fmts);
 	libtlv_register_fmts(libemv_get_id_fmts());
+	libtlv_fmts_freeze();
 
 	term_init();
 	lt_init();
 	chk_init();
 
-	suite = emvco_ep_ta_test_suite();
-	srunner = srunner_create(suite);
-	srunner_set_fork_status(srunner, CK_NOFORK);
-	srunner_run_all(srunner, CK_VERBOSE);
-	failed = srunner_ntests_failed(srunner);
-	srunner_free(srunner);
+	if (bench) {
+		failed = emvco_ep_ta_bench() != EMV_RC_OK;
+	} else {
+		suite = emvco_ep_ta_test_suite();
+		srunner = srunner_create(suite);
+		srunner_set_fork_status(srunner, CK_NOFORK);
+		srunner_run_all(srunner, CK_VERBOSE);
+		failed = srunner_ntests_failed(srunner);
+		srunner_free(srunner);
+	}
 
 	libtlv_free_fmts();
 	log4c_fini();
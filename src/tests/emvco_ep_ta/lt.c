@@ -25,6 +25,8 @@
 #include <log4c.h>
 #include <assert.h>
 
+#include <libpay_log.h>
+
 #include "emvco_ep_ta.h"
 
 struct lt;
@@ -7202,38 +7204,33 @@ static struct lt_setting ltsetting[] = {
 struct lt_app *lt_def_app_factory(struct lt *lt, const uint8_t *aid,
 				  size_t aid_sz, const struct aid_fci *aid_fci);
 
-static struct tlv *tlv_get_ppse_entry(const struct ppse_entry *ent)
+static void put_ppse_entry(struct tlv_writer *writer,
+					       const struct ppse_entry *ent)
 {
-	struct tlv *tlv_ppse_entry = NULL, *tlv = NULL;
+	tlv_writer_begin_constructed(writer, EMV_ID_DIRECTORY_ENTRY);
 
 	if (ent->aid_len)
-		tlv = tlv_insert_after(tlv, tlv_new(EMV_ID_ADF_NAME,
-						       ent->aid_len, ent->aid));
+		tlv_writer_put_primitive(writer, EMV_ID_ADF_NAME, ent->aid,
+								  ent->aid_len);
 
 	if (ent->app_label_len)
-		tlv = tlv_insert_after(tlv, tlv_new(EMV_ID_APPLICATION_LABEL,
-					   ent->app_label_len, ent->app_label));
+		tlv_writer_put_primitive(writer, EMV_ID_APPLICATION_LABEL,
+					   ent->app_label, ent->app_label_len);
 
 	if (ent->app_prio_len)
-		tlv = tlv_insert_after(tlv,
-				  tlv_new(EMV_ID_APPLICATION_PRIORITY_INDICATOR,
-					    ent->app_prio_len, &ent->app_prio));
+		tlv_writer_put_primitive(writer,
+				   EMV_ID_APPLICATION_PRIORITY_INDICATOR,
+					     &ent->app_prio, ent->app_prio_len);
 
 	if (ent->kernel_id_len)
-		tlv = tlv_insert_after(tlv, tlv_new(EMV_ID_KERNEL_IDENTIFIER,
-					   ent->kernel_id_len, ent->kernel_id));
+		tlv_writer_put_primitive(writer, EMV_ID_KERNEL_IDENTIFIER,
+					   ent->kernel_id, ent->kernel_id_len);
 
 	if (ent->ext_select_len)
-		tlv = tlv_insert_after(tlv, tlv_new(EMV_ID_EXTENDED_SELECTION,
-					 ent->ext_select_len, ent->ext_select));
-
-	while (tlv_get_prev(tlv))
-		tlv = tlv_get_prev(tlv);
-
-	tlv_ppse_entry = tlv_new(EMV_ID_DIRECTORY_ENTRY, 0, NULL);
-	tlv_insert_below(tlv_ppse_entry, tlv);
+		tlv_writer_put_primitive(writer, EMV_ID_EXTENDED_SELECTION,
+					 ent->ext_select, ent->ext_select_len);
 
-	return tlv_ppse_entry;
+	tlv_writer_end(writer);
 }
 
 static void outcome_to_gpo_outcome(const struct emv_outcome_parms *in,
@@ -7269,17 +7266,15 @@ static int ber_get_gpo_resp(const struct gpo_resp *resp, void *ber,
 								 size_t *ber_sz)
 {
 	struct outcome_gpo_resp out_resp;
-	struct tlv *gpo_resp = NULL, *tlv = NULL;
-	int rc = TLV_RC_OK;
+	struct tlv_writer writer;
 
-	gpo_resp = tlv_new(EMV_ID_RESP_MSG_TEMPLATE_FMT_2, 0, NULL);
-	if (!gpo_resp)
-		return TLV_RC_OUT_OF_MEMORY;
+	tlv_writer_init(&writer, ber, *ber_sz);
+	tlv_writer_begin_constructed(&writer, EMV_ID_RESP_MSG_TEMPLATE_FMT_2);
 
 	outcome_to_gpo_outcome(&resp->outcome_parms, &out_resp);
 
-	tlv = tlv_insert_below(gpo_resp, tlv_new(EMV_ID_OUTCOME_DATA,
-						  sizeof(out_resp), &out_resp));
+	tlv_writer_put_primitive(&writer, EMV_ID_OUTCOME_DATA, &out_resp,
+							     sizeof(out_resp));
 
 	if (resp->outcome_parms.present.ui_request_on_outcome) {
 		struct ui_req_gpo_resp ui_req_resp;
@@ -7287,8 +7282,8 @@ static int ber_get_gpo_resp(const struct gpo_resp *resp, void *ber,
 		ui_req_to_gpo_ui_req(&resp->outcome_parms.ui_request_on_outcome,
 								  &ui_req_resp);
 
-		tlv = tlv_insert_after(tlv, tlv_new(EMV_ID_UI_REQ_ON_OUTCOME,
-					    sizeof(ui_req_resp), &ui_req_resp));
+		tlv_writer_put_primitive(&writer, EMV_ID_UI_REQ_ON_OUTCOME,
+					     &ui_req_resp, sizeof(ui_req_resp));
 	}
 
 	if (resp->outcome_parms.present.ui_request_on_restart) {
@@ -7297,58 +7292,42 @@ static int ber_get_gpo_resp(const struct gpo_resp *resp, void *ber,
 		ui_req_to_gpo_ui_req(&resp->outcome_parms.ui_request_on_restart,
 								  &ui_req_resp);
 
-		tlv = tlv_insert_after(tlv, tlv_new(EMV_ID_UI_REQ_ON_RESTART,
-					    sizeof(ui_req_resp), &ui_req_resp));
+		tlv_writer_put_primitive(&writer, EMV_ID_UI_REQ_ON_RESTART,
+					     &ui_req_resp, sizeof(ui_req_resp));
 	}
 
-	if (resp->outcome_parms.data_record.len) {
-		struct tlv *tlv_data_record = NULL;
+	/* The data record was encoded by the test kernel.		      */
+	tlv_writer_put_encoded(&writer, resp->outcome_parms.data_record.data,
+					   resp->outcome_parms.data_record.len);
 
-		rc = tlv_shallow_parse(resp->outcome_parms.data_record.data,
-					    resp->outcome_parms.data_record.len,
-							      &tlv_data_record);
-		if (rc != TLV_RC_OK)
-			goto done;
-
-		tlv = tlv_insert_after(tlv, tlv_data_record);
-	}
-
-	rc = tlv_encode(gpo_resp, ber, ber_sz);
-
-done:
-	tlv_free(gpo_resp);
+	tlv_writer_end(&writer);
 
-	return rc;
+	return tlv_writer_finish(&writer, ber_sz);
 }
 
 static int ber_get_ppse(const struct ppse_entry *entries, size_t num_entries,
 						      void *ber, size_t *ber_sz)
 {
-	struct tlv *tlv_ppse = NULL, *tlv = NULL;
+	struct tlv_writer writer;
 	size_t i = 0;
-	int rc = TLV_RC_OK;
-
-	tlv_ppse = tlv_new(EMV_ID_FCI_TEMPLATE, 0, NULL);
 
-	tlv = tlv_insert_below(tlv_ppse, tlv_new(EMV_ID_DF_NAME,
-		       strlen(DF_NAME_2PAY_SYS_DDF01), DF_NAME_2PAY_SYS_DDF01));
-	tlv = tlv_insert_after(tlv,
-			     tlv_new(EMV_ID_FCI_PROPRIETARY_TEMPLATE, 0, NULL));
-	tlv = tlv_insert_below(tlv,
-			tlv_new(EMV_ID_FCI_ISSUER_DISCRETIONARY_DATA, 0, NULL));
+	tlv_writer_init(&writer, ber, *ber_sz);
 
-	if (num_entries) {
-		tlv = tlv_insert_below(tlv, tlv_get_ppse_entry(&entries[0]));
-		for (i = 1; i < num_entries; i++)
-			tlv = tlv_insert_after(tlv,
-					       tlv_get_ppse_entry(&entries[i]));
-	}
+	tlv_writer_begin_constructed(&writer, EMV_ID_FCI_TEMPLATE);
+	tlv_writer_put_primitive(&writer, EMV_ID_DF_NAME,
+		       DF_NAME_2PAY_SYS_DDF01, strlen(DF_NAME_2PAY_SYS_DDF01));
+	tlv_writer_begin_constructed(&writer, EMV_ID_FCI_PROPRIETARY_TEMPLATE);
+	tlv_writer_begin_constructed(&writer,
+					 EMV_ID_FCI_ISSUER_DISCRETIONARY_DATA);
 
-	rc = tlv_encode(tlv_ppse, ber, ber_sz);
+	for (i = 0; i < num_entries; i++)
+		put_ppse_entry(&writer, &entries[i]);
 
-	tlv_free(tlv_ppse);
+	tlv_writer_end(&writer);
+	tlv_writer_end(&writer);
+	tlv_writer_end(&writer);
 
-	return rc;
+	return tlv_writer_finish(&writer, ber_sz);
 }
 
 static int ber_get_aid_fci(const struct aid_fci *aid_fci, void *ber,
@@ -7417,7 +7396,7 @@ int lt_field_on(struct emv_hal *hal)
 
 	emv_chk_field_on(lt->checker);
 
-	log4c_category_log(lt->log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_TRACE,
 						     "%s(): success", __func__);
 	return EMV_RC_OK;
 }
@@ -7428,7 +7407,7 @@ int lt_field_off(struct emv_hal *hal, int hold_time)
 
 	emv_chk_field_off(lt->checker, hold_time);
 
-	log4c_category_log(lt->log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_TRACE,
 			  "%s(hold_time: %d ms): success", __func__, hold_time);
 	return EMV_RC_OK;
 }
@@ -7437,7 +7416,7 @@ int lt_wait_for_card(struct emv_hal *hal, int timeout)
 {
 	struct lt *lt = (struct lt *)hal;
 
-	log4c_category_log(lt->log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_TRACE,
 						     "%s(): success", __func__);
 
 	if (lt->mode == LT_NORMAL)
@@ -7545,16 +7524,18 @@ static int lt_get_processing_options(struct lt *lt, uint8_t p1, uint8_t p2,
 {
 	const struct gpo_resp *gpo_resp = NULL;
 	int rc = EMV_RC_OK;
-	char hex[lc * 2 + 1];
 	struct tlv *tlv = NULL;
 	uint8_t ber_tlv[2048];
 	size_t ber_tlv_len = sizeof(ber_tlv);
-	char ber_tlv_hex[4096];
 	const struct aid_fci *aid_fci = NULL;
 
-	log4c_category_log(lt->log_cat, LOG4C_PRIORITY_TRACE,
+	if (LIBPAY_LOG_ENABLED(lt->log_cat, LOG4C_PRIORITY_TRACE)) {
+		char hex[lc * 2 + 1];
+
+		LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_TRACE,
 						"%s(PDOL data: '%s')", __func__,
 					      libtlv_bin_to_hex(data, lc, hex));
+	}
 
 	memcpy(sw, EMV_SW_9000_OK, 2);
 
@@ -7562,7 +7543,7 @@ static int lt_get_processing_options(struct lt *lt, uint8_t p1, uint8_t p2,
 
 	rc = ber_get_gpo_resp(gpo_resp, resp, le);
 	if (rc != EMV_RC_OK) {
-		log4c_category_log(lt->log_cat, LOG4C_PRIORITY_ERROR,
+		LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_ERROR,
 			   "%s() ber_get_gpo_resp failed. rc %d", __func__, rc);
 		goto done;
 	}
@@ -7573,21 +7554,25 @@ static int lt_get_processing_options(struct lt *lt, uint8_t p1, uint8_t p2,
 	rc = dol_and_del_to_tlv(aid_fci->pdol, aid_fci->pdol_len, data, lc,
 									  &tlv);
 	if (rc != EMV_RC_OK) {
-		log4c_category_log(lt->log_cat, LOG4C_PRIORITY_ERROR,
+		LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_ERROR,
 			 "%s() dol_and_del_to_tlv failed. rc %d", __func__, rc);
 		goto done;
 	}
 
 	rc = tlv_encode(tlv, ber_tlv, &ber_tlv_len);
 	if (rc != TLV_RC_OK) {
-		log4c_category_log(lt->log_cat, LOG4C_PRIORITY_ERROR,
+		LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_ERROR,
 				 "%s() tlv_encode failed. rc %d", __func__, rc);
 		goto done;
 	}
 
-	log4c_category_log(lt->log_cat, LOG4C_PRIORITY_TRACE,
+	if (LIBPAY_LOG_ENABLED(lt->log_cat, LOG4C_PRIORITY_TRACE)) {
+		char ber_tlv_hex[2 * ber_tlv_len + 1];
+
+		LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_TRACE,
 					"%s(): TLV(PDOL, DEL) = '%s'", __func__,
 			  libtlv_bin_to_hex(ber_tlv, ber_tlv_len, ber_tlv_hex));
+	}
 
 	emv_chk_gpo_data(lt->checker, tlv);
 
@@ -7622,13 +7607,17 @@ int lt_transceive(struct emv_hal *hal, const void *capdu, size_t capdu_sz,
 	uint8_t *requ = (uint8_t *)capdu;
 	uint8_t resp[256];
 	uint8_t sw[2];
-	char hex[256 * 2 + 1], capdu_hex[capdu_sz * 2 + 1];
+	char hex[256 * 2 + 1];
 	size_t resp_sz = sizeof(resp);
 	int i = 0;
 	int rc = EMV_RC_OK;
 
-	log4c_category_log(lt->log_cat, LOG4C_PRIORITY_TRACE, "%s(capdu: '%s')",
+	if (LIBPAY_LOG_ENABLED(lt->log_cat, LOG4C_PRIORITY_TRACE)) {
+		char capdu_hex[capdu_sz * 2 + 1];
+
+		LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_TRACE, "%s(capdu: '%s')",
 		       __func__, libtlv_bin_to_hex(capdu, capdu_sz, capdu_hex));
+	}
 
 	memcpy(sw, EMV_SW_9000_OK, 2);
 
@@ -7671,7 +7660,7 @@ done:
 	*rapdu_sz = resp_sz;
 
 	if (rc != EMV_RC_OK) {
-		log4c_category_log(lt->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(lt->log_cat, LOG4C_PRIORITY_NOTICE,
 					  "%s(): failed. rc: %d", __func__, rc);
 	} else {
 		log4c_priority_level_t prio = LOG4C_PRIORITY_TRACE;
@@ -7679,7 +7668,7 @@ done:
 		if (memcmp(sw, EMV_SW_9000_OK, 2))
 			prio = LOG4C_PRIORITY_NOTICE;
 
-		log4c_category_log(lt->log_cat, prio,
+		LIBPAY_LOG(lt->log_cat, prio,
 					 "%s(): success, rapdu: '%s'", __func__,
 				      libtlv_bin_to_hex(rapdu, *rapdu_sz, hex));
 	}
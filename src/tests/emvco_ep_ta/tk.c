@@ -22,11 +22,14 @@
 #include <assert.h>
 #include <string.h>
 
+#include <libpay_log.h>
+
 #include "emvco_ep_ta.h"
 
 struct tk {
 	const struct emv_kernel_ops *ops;
 	log4c_category_t *log_cat;
+	struct tlv_path *pdol_path;
 };
 
 static int tk_configure(struct emv_kernel *kernel, const void *config,
@@ -34,7 +37,7 @@ static int tk_configure(struct emv_kernel *kernel, const void *config,
 {
 	struct tk *tk = (struct tk *)kernel;
 
-	log4c_category_log(tk->log_cat,
+	LIBPAY_LOG(tk->log_cat,
 			       LOG4C_PRIORITY_TRACE, "%s(): success", __func__);
 	return EMV_RC_OK;
 }
@@ -156,7 +159,7 @@ static struct tlv *tlv_kernel_parms(struct tk *tk,
 		struct tlv *tlv_online_response = NULL;
 		char hex[parms->online_response_len * 2 + 1];
 
-		log4c_category_log(tk->log_cat,
+		LIBPAY_LOG(tk->log_cat,
 			       LOG4C_PRIORITY_TRACE, "%s() online resp '%s'",
 			  __func__, libtlv_bin_to_hex(parms->online_response,
 					   parms->online_response_len, hex));
@@ -221,38 +224,57 @@ static void gpo_ui_req_to_ui_req(const struct ui_req_gpo_resp *in,
 						     sizeof(in->currency_code));
 }
 
+static int tk_pdol_found(void *priv, const struct tlv_record *record)
+{
+	*(struct tlv_record *)priv = *record;
+
+	return TLV_RC_OK;
+}
+
+/* Data objects looked for in the GPO response, in the order of 'resp' in
+ * tk_activate.								      */
+static const tlv_key_t resp_keys[] = {
+	TLV_KEY(EMV_ID_OUTCOME_DATA),
+	TLV_KEY(EMV_ID_UI_REQ_ON_OUTCOME),
+	TLV_KEY(EMV_ID_UI_REQ_ON_RESTART),
+	TLV_KEY(EMV_ID_ISSUER_AUTHENTICATION_DATA),
+	TLV_KEY(EMV_ID_ISSUER_SCRIPT_TEMPLATE_1),
+	TLV_KEY(EMV_ID_ISSUER_SCRIPT_TEMPLATE_2)
+};
+
 static int tk_activate(struct emv_kernel *kernel, struct emv_hal *hal,
 	      struct emv_kernel_parms *parms, struct emv_outcome_parms *outcome)
 {
 	struct tk *tk = (struct tk *)kernel;
-	struct tlv *tlv_fci = NULL, *tlv = NULL, *tlv_parms = NULL;
+	struct tlv *tlv = NULL, *tlv_parms = NULL;
 	struct tlv *tlv_resp = NULL, *tlv_data_record = NULL;
 	struct tlv *tlv_resp_msg = NULL;
+	struct tlv_slice resp[ARRAY_SIZE(resp_keys)];
+	struct tlv_record pdol_record;
 	uint8_t pdol[256], gpo_data[256], gpo_resp[256], sw[2];
-	uint8_t resp_msg[256];
 	char hex[513];
 	size_t pdol_sz = sizeof(pdol), gpo_data_sz = sizeof(gpo_data);
 	size_t gpo_resp_sz = sizeof(gpo_resp);
-	size_t resp_msg_sz = sizeof(resp_msg);
 	int rc = EMV_RC_OK;
 
-	rc = tlv_parse(parms->fci, parms->fci_len, &tlv_fci);
+	memset(&pdol_record, 0, sizeof(pdol_record));
+	rc = tlv_path_eval(tk->pdol_path, parms->fci, parms->fci_len,
+					       tk_pdol_found, &pdol_record);
 	if (rc != TLV_RC_OK) {
 		rc = EMV_RC_CARD_PROTOCOL_ERROR;
 		goto done;
 	}
 
-	tlv = tlv_find(tlv_get_child(tlv_find(tlv_get_child(tlv_find(tlv_fci,
-		       EMV_ID_FCI_TEMPLATE)), EMV_ID_FCI_PROPRIETARY_TEMPLATE)),
-								   EMV_ID_PDOL);
-	if (tlv) {
-		rc = tlv_encode_value(tlv, pdol, &pdol_sz);
-		if (rc != TLV_RC_OK) {
+	if (pdol_record.value) {
+		if (pdol_record.length > pdol_sz) {
 			rc = EMV_RC_CARD_PROTOCOL_ERROR;
 			goto done;
 		}
 
-		log4c_category_log(tk->log_cat, LOG4C_PRIORITY_TRACE,
+		pdol_sz = pdol_record.length;
+		memcpy(pdol, pdol_record.value, pdol_sz);
+
+		LIBPAY_LOG(tk->log_cat, LOG4C_PRIORITY_TRACE,
 						    "%s(): PDOL='%s'", __func__,
 					 libtlv_bin_to_hex(pdol, pdol_sz, hex));
 	} else {
@@ -272,7 +294,7 @@ static int tk_activate(struct emv_kernel *kernel, struct emv_hal *hal,
 		goto done;
 	}
 
-	log4c_category_log(tk->log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(tk->log_cat, LOG4C_PRIORITY_TRACE,
 					       "%s(): GPO DATA ='%s'", __func__,
 				 libtlv_bin_to_hex(gpo_data, gpo_data_sz, hex));
 
@@ -284,38 +306,34 @@ static int tk_activate(struct emv_kernel *kernel, struct emv_hal *hal,
 		goto done;
 	}
 
-	log4c_category_log(tk->log_cat, LOG4C_PRIORITY_TRACE,
+	LIBPAY_LOG(tk->log_cat, LOG4C_PRIORITY_TRACE,
 			    "%s(): GPO RESP = '%s' SW: %02hhX%02hhX", __func__,
 		  libtlv_bin_to_hex(gpo_resp, gpo_resp_sz, hex), sw[0], sw[1]);
 
-	rc = tlv_shallow_parse(gpo_resp, gpo_resp_sz, &tlv_resp);
+	/* Only the response message template is looked into.  Its nested
+	 * templates are copied to the data record as they are.	      */
+	rc = tlv_lazy_parse(gpo_resp, gpo_resp_sz, &tlv_resp);
 	if (rc != TLV_RC_OK) {
-		log4c_category_log(tk->log_cat, LOG4C_PRIORITY_ERROR,
+		LIBPAY_LOG(tk->log_cat, LOG4C_PRIORITY_ERROR,
 				"%s(): Failed to parse GPO response", __func__);
 		rc = EMV_RC_CARD_PROTOCOL_ERROR;
 		goto done;
 	}
 
-	rc = tlv_encode_value(tlv_find(tlv_resp,
-		       EMV_ID_RESP_MSG_TEMPLATE_FMT_2), resp_msg, &resp_msg_sz);
-	if (rc != TLV_RC_OK) {
-		log4c_category_log(tk->log_cat, LOG4C_PRIORITY_ERROR,
-				       "%s() no response message found. rc: %d",
-							     __func__, (int)rc);
+	tlv_resp_msg = tlv_get_child(tlv_find(tlv_resp,
+					       EMV_ID_RESP_MSG_TEMPLATE_FMT_2));
+	if (!tlv_resp_msg) {
+		LIBPAY_LOG(tk->log_cat, LOG4C_PRIORITY_ERROR,
+				    "%s() no response message found", __func__);
 		rc = EMV_RC_CARD_PROTOCOL_ERROR;
 		goto done;
 	}
 
-	rc = tlv_shallow_parse(resp_msg, resp_msg_sz, &tlv_resp_msg);
-	if (rc != TLV_RC_OK) {
-		log4c_category_log(tk->log_cat, LOG4C_PRIORITY_ERROR,
-				"%s() failed to parse response message. rc: %d",
-							     __func__, (int)rc);
-		rc = EMV_RC_CARD_PROTOCOL_ERROR;
+	rc = tlv_extract(tlv_resp_msg, resp_keys, ARRAY_SIZE(resp_keys), resp);
+	if (rc != TLV_RC_OK)
 		goto done;
-	}
 
-	tlv = tlv_find(tlv_resp_msg, EMV_ID_OUTCOME_DATA);
+	tlv = resp[0].tlv;
 	if (tlv) {
 		struct outcome_gpo_resp gpo_outcome;
 		size_t gpo_outcome_sz = sizeof(gpo_outcome);
@@ -327,12 +345,12 @@ static int tk_activate(struct emv_kernel *kernel, struct emv_hal *hal,
 		gpo_outcome_to_outcome(&gpo_outcome, outcome);
 	}
 
-	tlv = tlv_find(tlv_resp_msg, EMV_ID_UI_REQ_ON_OUTCOME);
+	tlv = resp[1].tlv;
 	if (tlv) {
 		struct ui_req_gpo_resp gpo_ui_req;
 		size_t gpo_ui_req_sz = sizeof(gpo_ui_req);
 
-		log4c_category_log(tk->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(tk->log_cat, LOG4C_PRIORITY_TRACE,
 			       "%s(): UI Request on Outcome present", __func__);
 
 		rc = tlv_encode_value(tlv, &gpo_ui_req, &gpo_ui_req_sz);
@@ -344,12 +362,12 @@ static int tk_activate(struct emv_kernel *kernel, struct emv_hal *hal,
 		outcome->present.ui_request_on_outcome = true;
 	}
 
-	tlv = tlv_find(tlv_resp_msg, EMV_ID_UI_REQ_ON_RESTART);
+	tlv = resp[2].tlv;
 	if (tlv) {
 		struct ui_req_gpo_resp gpo_ui_req;
 		size_t gpo_ui_req_sz = sizeof(gpo_ui_req);
 
-		log4c_category_log(tk->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(tk->log_cat, LOG4C_PRIORITY_TRACE,
 			       "%s(): UI Request on Restart present", __func__);
 
 		rc = tlv_encode_value(tlv, &gpo_ui_req, &gpo_ui_req_sz);
@@ -361,18 +379,15 @@ static int tk_activate(struct emv_kernel *kernel, struct emv_hal *hal,
 		outcome->present.ui_request_on_restart = true;
 	}
 
-	tlv = tlv_copy(tlv_find(tlv_resp_msg,
-					    EMV_ID_ISSUER_AUTHENTICATION_DATA));
+	tlv = tlv_copy(resp[3].tlv);
 	if (!tlv_data_record)
 		tlv_data_record = tlv;
 
-	tlv = tlv_insert_after(tlv, tlv_copy(tlv_find(tlv_resp_msg,
-					     EMV_ID_ISSUER_SCRIPT_TEMPLATE_1)));
+	tlv = tlv_insert_after(tlv, tlv_copy(resp[4].tlv));
 	if (!tlv_data_record)
 		tlv_data_record = tlv;
 
-	tlv = tlv_insert_after(tlv, tlv_copy(tlv_find(tlv_resp_msg,
-					     EMV_ID_ISSUER_SCRIPT_TEMPLATE_2)));
+	tlv = tlv_insert_after(tlv, tlv_copy(resp[5].tlv));
 	if (!tlv_data_record)
 		tlv_data_record = tlv;
 
@@ -386,16 +401,14 @@ static int tk_activate(struct emv_kernel *kernel, struct emv_hal *hal,
 
 done:
 	tlv_free(tlv_resp);
-	tlv_free(tlv_resp_msg);
 	tlv_free(tlv_parms);
-	tlv_free(tlv_fci);
 	tlv_free(tlv_data_record);
 
 	if (rc == EMV_RC_OK) {
-		log4c_category_log(tk->log_cat, LOG4C_PRIORITY_TRACE,
+		LIBPAY_LOG(tk->log_cat, LOG4C_PRIORITY_TRACE,
 						     "%s(): success", __func__);
 	} else {
-		log4c_category_log(tk->log_cat, LOG4C_PRIORITY_NOTICE,
+		LIBPAY_LOG(tk->log_cat, LOG4C_PRIORITY_NOTICE,
 					     "%s(): fail. rc %d", __func__, rc);
 	}
 
@@ -418,14 +431,23 @@ struct emv_kernel *tk_new(const char *log4c_category)
 
 	tk->ops = &tk_ops;
 
+	if (tlv_path_compile("6F/A5/9F38", &tk->pdol_path) != TLV_RC_OK) {
+		free(tk);
+		return NULL;
+	}
+
 	snprintf(cat, sizeof(cat), "%s.tk", log4c_category);
 	tk->log_cat = log4c_category_get(cat);
 
 	return (struct emv_kernel *)tk;
 }
 
-void tk_free(struct emv_kernel *tk)
+void tk_free(struct emv_kernel *kernel)
 {
-	if (tk)
+	struct tk *tk = (struct tk *)kernel;
+
+	if (tk) {
+		tlv_path_free(tk->pdol_path);
 		free(tk);
+	}
 }
@@ -0,0 +1,1319 @@
+/*
+ * LibPAY - The Toolkit for Smart Payment Applications
+ *
+ * Copyright (C) 2015, 2016  Michael Jung <mijung@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <log4c.h>
+
+#include <libpay/tlv.h>
+
+#define BENCH_INPUT_SIZE	(1024u * 1024u)
+#define BENCH_DEEP_LEVELS	200000u
+#define BENCH_ENCODE_LEVELS	10u
+#define BENCH_CHUNK_SIZE	4096u
+#define BENCH_BLOB_SIZE		4096u
+#define BENCH_PAD_SIZE		64u
+#define BENCH_RECORD_TAGS	60u
+#define BENCH_LOOKUP_ROUNDS	100000u
+#define BENCH_PPSE_ROUNDS	1000000u
+#define BENCH_FMT_TAGS		9u
+#define BENCH_HEX_SIZE		(4u * 1024u * 1024u)
+#define BENCH_HEX_ROUNDS	50u
+#define BENCH_BCD_VALUES	(1024u * 1024u)
+#define BENCH_BCD_SIZE		6u
+
+struct bench_input {
+	uint8_t *data;
+	size_t	 size;
+	size_t	 num_nodes;
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bench_report(const char *name, const struct bench_input *input,
+					       size_t iterations, double seconds)
+{
+	printf("%-36s %9.1f MB/s %9.1f ns/node\n", name,
+	       (double)input->size * iterations / seconds / 1e6,
+	       seconds * 1e9 / ((double)input->num_nodes * iterations));
+}
+
+/* Headers always use the three byte long form, so that lengths can be
+ * written before the size of the content is known.			      */
+static uint8_t *put_header(uint8_t *p, uint8_t tag, size_t length)
+{
+	p[0] = tag;
+	p[1] = 0x83u;
+	p[2] = (uint8_t)(length >> 16);
+	p[3] = (uint8_t)(length >> 8);
+	p[4] = (uint8_t)length;
+
+	return &p[5];
+}
+
+static uint8_t *put_leaf(uint8_t *p)
+{
+	memcpy(p, "\x9F\x02\x06\x00\x00\x00\x00\x10\x00", 9);
+
+	return &p[9];
+}
+
+/* A flat list of small primitive TLV nodes. E.g. a batch of amounts.	      */
+static void build_flat(struct bench_input *input)
+{
+	uint8_t *p;
+
+	input->data = (uint8_t *)malloc(BENCH_INPUT_SIZE);
+	input->num_nodes = 0;
+
+	for (p = input->data; p + 9 <= input->data + BENCH_INPUT_SIZE; ) {
+		p = put_leaf(p);
+		input->num_nodes++;
+	}
+
+	input->size = p - input->data;
+}
+
+/* Towers of 'height' nested constructed nodes with a primitive TLV node at
+ * the bottom, repeated until the input is full.			      */
+static void build_towers(struct bench_input *input, size_t height)
+{
+	const size_t tower_sz = height * 5 + 9;
+	uint8_t *p;
+	size_t i;
+
+	input->data = (uint8_t *)malloc(BENCH_INPUT_SIZE);
+	input->num_nodes = 0;
+
+	for (p = input->data; p + tower_sz <= input->data + BENCH_INPUT_SIZE; ) {
+		for (i = 0; i < height; i++)
+			p = put_header(p, 0xA0u, (height - i - 1) * 5 + 9);
+
+		p = put_leaf(p);
+		input->num_nodes += height + 1;
+	}
+
+	input->size = p - input->data;
+}
+
+/* Primitive TLV nodes separated by runs of '00' padding, e.g. a file with
+ * erased records.							      */
+static void build_padded(struct bench_input *input)
+{
+	uint8_t *p;
+
+	input->data = (uint8_t *)calloc(1, BENCH_INPUT_SIZE);
+	input->num_nodes = 0;
+
+	for (p = input->data; p + BENCH_PAD_SIZE <= input->data +
+					     BENCH_INPUT_SIZE; ) {
+		put_leaf(p);
+		p += BENCH_PAD_SIZE;
+		input->num_nodes++;
+	}
+
+	input->size = p - input->data;
+}
+
+/* A single chain of BENCH_DEEP_LEVELS nested constructed nodes.	      */
+static void build_deep(struct bench_input *input)
+{
+	uint8_t *p;
+	size_t i;
+
+	input->size = BENCH_DEEP_LEVELS * 5 + 9;
+	input->data = (uint8_t *)malloc(input->size);
+	input->num_nodes = BENCH_DEEP_LEVELS + 1;
+
+	for (i = 0, p = input->data; i < BENCH_DEEP_LEVELS; i++)
+		p = put_header(p, 0xA0u, (BENCH_DEEP_LEVELS - i - 1) * 5 + 9);
+
+	put_leaf(p);
+}
+
+static void bench_parse(const char *name, const struct bench_input *input,
+							      size_t iterations)
+{
+	struct tlv_arena *arena = NULL;
+	struct tlv *tlv = NULL;
+	char label[64];
+	double start;
+	size_t i;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (tlv_parse(input->data, input->size, &tlv) != TLV_RC_OK) {
+			fprintf(stderr, "%s: tlv_parse failed!\n", name);
+			exit(EXIT_FAILURE);
+		}
+		tlv_free(tlv);
+	}
+	snprintf(label, sizeof(label), "%s (heap)", name);
+	bench_report(label, input, iterations, bench_now() - start);
+
+	arena = tlv_arena_new(0);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (tlv_parse_arena(arena, input->data, input->size, &tlv) !=
+								    TLV_RC_OK) {
+			fprintf(stderr, "%s: tlv_parse_arena failed!\n", name);
+			exit(EXIT_FAILURE);
+		}
+		tlv_arena_reset(arena);
+	}
+	snprintf(label, sizeof(label), "%s (arena)", name);
+	bench_report(label, input, iterations, bench_now() - start);
+
+	tlv_arena_free(arena);
+}
+
+/* Parse the input and look up the first leaf only, like a kernel that only
+ * needs a single data object out of a large response.		      */
+static void bench_find_first(const char *name,
+		  const struct bench_input *input, size_t iterations,
+		  int (*parse)(const void *, size_t, struct tlv **))
+{
+	struct tlv *tlv = NULL;
+	double start;
+	size_t i;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if ((parse(input->data, input->size, &tlv) != TLV_RC_OK) ||
+					      !tlv_deep_find(tlv, "\x9F\x02")) {
+			fprintf(stderr, "%s: parse failed!\n", name);
+			exit(EXIT_FAILURE);
+		}
+		tlv_free(tlv);
+	}
+	bench_report(name, input, iterations, bench_now() - start);
+}
+
+static void bench_validate(const char *name, const struct bench_input *input,
+							      size_t iterations)
+{
+	double start;
+	size_t i;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (tlv_validate(input->data, input->size, NULL, NULL) !=
+								    TLV_RC_OK) {
+			fprintf(stderr, "%s: tlv_validate failed!\n", name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	bench_report(name, input, iterations, bench_now() - start);
+}
+
+static int bench_stream_value(void *priv, const void *tag, size_t length,
+			       size_t offset, const void *data, size_t size)
+{
+	(*(size_t *)priv)++;
+
+	return TLV_RC_OK;
+}
+
+/* Feed the input in chunks as read(2) from a pipe would deliver it.	      */
+static void bench_stream(const char *name, const struct bench_input *input,
+							      size_t iterations)
+{
+	const struct tlv_stream_callbacks callbacks = {
+		NULL, NULL, bench_stream_value
+	};
+	struct tlv_stream_parser *parser = NULL;
+	size_t i, pos, values = 0;
+	double start;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		parser = tlv_stream_parser_new(&callbacks, &values, 256);
+
+		for (pos = 0; pos < input->size; pos += BENCH_CHUNK_SIZE)
+			if (tlv_stream_parser_feed(parser, &input->data[pos],
+				  input->size - pos < BENCH_CHUNK_SIZE ?
+				  input->size - pos : BENCH_CHUNK_SIZE) !=
+								      TLV_RC_OK)
+				break;
+
+		if (tlv_stream_parser_finish(parser) != TLV_RC_OK) {
+			fprintf(stderr, "%s: tlv_stream_parser failed!\n",
+									  name);
+			exit(EXIT_FAILURE);
+		}
+
+		tlv_stream_parser_free(parser);
+	}
+	bench_report(name, input, iterations, bench_now() - start);
+}
+
+static void bench_parser(void)
+{
+	struct bench_input flat, towers, deep, padded;
+
+	build_flat(&flat);
+	build_towers(&towers, TLV_DEFAULT_MAX_DEPTH);
+	build_deep(&deep);
+	build_padded(&padded);
+
+	printf("\nParsing (%u byte inputs):\n", BENCH_INPUT_SIZE);
+
+	bench_parse("tlv_parse flat", &flat, 20);
+	bench_parse("tlv_parse nested", &towers, 20);
+	bench_stream("tlv_stream_parser flat", &flat, 20);
+	bench_stream("tlv_stream_parser nested", &towers, 20);
+	bench_find_first("tlv_view_parse + find first", &towers, 20,
+							       tlv_view_parse);
+	bench_find_first("tlv_lazy_parse + find first", &towers, 20,
+							       tlv_lazy_parse);
+	bench_parse("tlv_parse padded", &padded, 20);
+	bench_validate("tlv_validate flat", &flat, 20);
+	bench_validate("tlv_validate nested", &towers, 20);
+	bench_validate("tlv_validate padded", &padded, 20);
+
+	libtlv_set_max_depth(BENCH_DEEP_LEVELS);
+	bench_parse("tlv_parse single chain", &deep, 5);
+	libtlv_set_max_depth(0);
+
+	free(flat.data);
+	free(towers.data);
+	free(deep.data);
+	free(padded.data);
+}
+
+static void bench_encode(const char *name, const struct bench_input *input,
+							      size_t iterations)
+{
+	struct tlv *tlv = NULL, *leaf = NULL;
+	uint8_t *buffer = NULL;
+	double start;
+	size_t i, size;
+
+	if (tlv_parse(input->data, input->size, &tlv) != TLV_RC_OK) {
+		fprintf(stderr, "%s: tlv_parse failed!\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	buffer = (uint8_t *)malloc(input->size);
+
+	/* Every iteration modifies one leaf, i.e. the encoder has to bring
+	 * the sizes along one path from the leaf to the root up to date.   */
+	leaf = tlv_deep_find(tlv, "\x9F\x02");
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (leaf)
+			leaf = tlv_set_value(leaf, 6,
+					    "\x00\x00\x00\x00\x20\x00");
+		size = input->size;
+		if (tlv_encode(tlv, buffer, &size) != TLV_RC_OK) {
+			fprintf(stderr, "%s: tlv_encode failed!\n", name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	bench_report(name, input, iterations, bench_now() - start);
+
+	free(buffer);
+	tlv_free(tlv);
+}
+
+/* A flat list of primitive TLV nodes with large values, e.g. certificates. */
+static void build_blobs(struct bench_input *input)
+{
+	const size_t blob_sz = 4 + BENCH_BLOB_SIZE;
+	uint8_t *p;
+
+	input->data = (uint8_t *)malloc(BENCH_INPUT_SIZE);
+	input->num_nodes = 0;
+
+	for (p = input->data; p + blob_sz <= input->data + BENCH_INPUT_SIZE; ) {
+		p[0] = 0x04u;
+		p[1] = 0x82u;
+		p[2] = (uint8_t)(BENCH_BLOB_SIZE >> 8);
+		p[3] = (uint8_t)BENCH_BLOB_SIZE;
+		memset(&p[4], input->num_nodes, BENCH_BLOB_SIZE);
+		p += blob_sz;
+		input->num_nodes++;
+	}
+
+	input->size = p - input->data;
+}
+
+/* Gather the encoding into iovecs instead of a contiguous buffer.  Only the
+ * headers are copied, so this scales with the number of nodes rather than
+ * with the number of bytes.						      */
+static void bench_encode_iov(const char *name, const struct bench_input *input,
+							      size_t iterations)
+{
+	struct tlv *tlv = NULL, *leaf = NULL;
+	struct iovec *iov = NULL;
+	uint8_t *scratch = NULL;
+	double start;
+	size_t i, scratch_size;
+	int iovcnt;
+
+	if (tlv_parse(input->data, input->size, &tlv) != TLV_RC_OK) {
+		fprintf(stderr, "%s: tlv_parse failed!\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	iov = (struct iovec *)malloc(2 * input->num_nodes * sizeof(*iov));
+	scratch = (uint8_t *)malloc(input->size);
+
+	leaf = tlv_deep_find(tlv, "\x9F\x02");
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (leaf)
+			leaf = tlv_set_value(leaf, 6,
+					    "\x00\x00\x00\x00\x20\x00");
+		iovcnt = 2 * input->num_nodes;
+		scratch_size = input->size;
+		if (tlv_encode_iov(tlv, iov, &iovcnt, scratch, &scratch_size)
+								 != TLV_RC_OK) {
+			fprintf(stderr, "%s: tlv_encode_iov failed!\n", name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	bench_report(name, input, iterations, bench_now() - start);
+
+	free(scratch);
+	free(iov);
+	tlv_free(tlv);
+}
+
+static void bench_encoder(void)
+{
+	struct bench_input towers, flat, blobs;
+
+	build_towers(&towers, BENCH_ENCODE_LEVELS);
+	build_flat(&flat);
+	build_blobs(&blobs);
+
+	printf("\nEncoding (%u byte inputs):\n", BENCH_INPUT_SIZE);
+
+	bench_encode("tlv_encode nested", &towers, 20);
+	bench_encode_iov("tlv_encode_iov nested", &towers, 20);
+	bench_encode("tlv_encode flat", &flat, 20);
+	bench_encode_iov("tlv_encode_iov flat", &flat, 20);
+	bench_encode("tlv_encode 4k values", &blobs, 200);
+	bench_encode_iov("tlv_encode_iov 4k values", &blobs, 200);
+
+	free(blobs.data);
+	free(flat.data);
+	free(towers.data);
+}
+
+/* The former implementation of tlv_copy: encode the children, parse them
+ * again and link the result below a new node.  Kept as a baseline.	      */
+static struct tlv *copy_roundtrip(const struct tlv *tlv)
+{
+	struct tlv *result = NULL, *childs = NULL;
+	uint8_t tag[8], *buffer = NULL;
+	const void *value = NULL;
+	size_t size = sizeof(tag);
+
+	if (tlv_encode_identifier(tlv, tag, &size) != TLV_RC_OK)
+		return NULL;
+
+	if (!tlv_is_constructed(tlv)) {
+		value = tlv_view_value(tlv, &size);
+		return tlv_new(tag, size, value);
+	}
+
+	if (tlv_encode(tlv_get_child(tlv), NULL, &size) != TLV_RC_OK)
+		return NULL;
+
+	buffer = (uint8_t *)malloc(size);
+	if (tlv_encode(tlv_get_child(tlv), buffer, &size) != TLV_RC_OK ||
+	    tlv_parse(buffer, size, &childs) != TLV_RC_OK) {
+		free(buffer);
+		return NULL;
+	}
+	free(buffer);
+
+	result = tlv_new(tag, 0, NULL);
+	tlv_insert_below(result, childs);
+
+	return result;
+}
+
+static void bench_copy(const char *name, const struct bench_input *input,
+			    size_t iterations, struct tlv_arena *arena,
+			    struct tlv *(*copy)(const struct tlv *tlv))
+{
+	struct tlv *tlv = NULL, *node = NULL, *result = NULL;
+	double start;
+	size_t i;
+
+	if (tlv_parse(input->data, input->size, &tlv) != TLV_RC_OK) {
+		fprintf(stderr, "%s: tlv_parse failed!\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Every top level tower is copied on its own, like the data objects
+	 * the test kernel copies from responses into the data record.	      */
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		for (node = tlv; node; node = tlv_get_next(node)) {
+			if (arena)
+				result = tlv_copy_arena(arena, node);
+			else
+				result = copy(node);
+
+			if (!result) {
+				fprintf(stderr, "%s: copy failed!\n", name);
+				exit(EXIT_FAILURE);
+			}
+
+			if (!arena)
+				tlv_free(result);
+		}
+
+		tlv_arena_reset(arena);
+	}
+	bench_report(name, input, iterations, bench_now() - start);
+
+	tlv_free(tlv);
+}
+
+static void bench_copier(void)
+{
+	struct tlv_arena *arena = tlv_arena_new(0);
+	struct bench_input towers;
+
+	build_towers(&towers, BENCH_ENCODE_LEVELS);
+
+	printf("\nCopying (%u byte inputs):\n", BENCH_INPUT_SIZE);
+
+	bench_copy("encode + tlv_parse (former tlv_copy)", &towers, 10, NULL,
+								copy_roundtrip);
+	bench_copy("tlv_copy", &towers, 10, NULL, tlv_copy);
+	bench_copy("tlv_copy_arena", &towers, 10, arena, NULL);
+
+	tlv_arena_free(arena);
+	free(towers.data);
+}
+
+/* A record template with BENCH_RECORD_TAGS primitive data objects, similar
+ * to what a card returns over all READ RECORD commands of a transaction.     */
+static struct tlv *build_record(void)
+{
+	uint8_t record[2 + 3 + BENCH_RECORD_TAGS * 7], *p = record;
+	struct tlv *tlv = NULL;
+	size_t i;
+
+	p[0] = 0x70u;
+	p[1] = 0x82u;
+	p[2] = (uint8_t)((BENCH_RECORD_TAGS * 7) >> 8);
+	p[3] = (uint8_t)(BENCH_RECORD_TAGS * 7);
+	p += 4;
+
+	for (i = 0; i < BENCH_RECORD_TAGS; i++, p += 7) {
+		memcpy(p, "\x9F\x00\x04\x00\x00\x00\x00", 7);
+		p[1] = (uint8_t)(i + 1);
+	}
+
+	if (tlv_parse(record, p - record, &tlv) != TLV_RC_OK) {
+		fprintf(stderr, "build_record: tlv_parse failed!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return tlv;
+}
+
+static void bench_lookup_report(const char *name, double seconds)
+{
+	printf("%-36s %9.1f ns/record %6.1f ns/lookup\n", name,
+	       seconds * 1e9 / BENCH_LOOKUP_ROUNDS,
+	       seconds * 1e9 / (BENCH_LOOKUP_ROUNDS * BENCH_RECORD_TAGS));
+}
+
+static void bench_lookup(void)
+{
+	struct tlv_index *index = NULL;
+	struct tlv *tlv = NULL;
+	size_t i, j, found = 0;
+	uint8_t tag[2] = { 0x9Fu, 0x00u };
+	double start;
+
+	tlv = build_record();
+
+	printf("\nLooking up all %u tags of a record:\n", BENCH_RECORD_TAGS);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++)
+		for (j = 1; j <= BENCH_RECORD_TAGS; j++) {
+			tag[1] = j;
+			found += !!tlv_deep_find(tlv, tag);
+		}
+	bench_lookup_report("tlv_deep_find", bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++)
+		for (j = 1; j <= BENCH_RECORD_TAGS; j++)
+			found += !!tlv_deep_find_key(tlv, 0x9F00u | j);
+	bench_lookup_report("tlv_deep_find_key", bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		if (tlv_index_build(tlv, &index) != TLV_RC_OK) {
+			fprintf(stderr, "tlv_index_build failed!\n");
+			exit(EXIT_FAILURE);
+		}
+		for (j = 1; j <= BENCH_RECORD_TAGS; j++)
+			found += !!tlv_index_lookup_key(index, 0x9F00u | j);
+		tlv_index_free(index);
+	}
+	bench_lookup_report("tlv_index_build + lookup", bench_now() - start);
+
+	if (found != 3 * BENCH_LOOKUP_ROUNDS * BENCH_RECORD_TAGS) {
+		fprintf(stderr, "bench_lookup: tags not found!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tlv_free(tlv);
+}
+
+static void bench_set_value_report(const char *name, double seconds)
+{
+	printf("%-36s %9.1f ns/update\n", name,
+					  seconds * 1e9 / BENCH_LOOKUP_ROUNDS);
+}
+
+/* Alternate the value of a data object between 'min' and 'max' bytes. */
+static double bench_set_value(struct tlv *tlv, size_t min, size_t max)
+{
+	const uint8_t value[32] = { 0 };
+	double start;
+	size_t i;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++)
+		tlv = tlv_set_value(tlv, (i & 1) ? max : min, value);
+	start = bench_now() - start;
+
+	tlv_free(tlv);
+
+	return start;
+}
+
+/* Pick six data objects out of a record, the way a kernel reads a few
+ * fields of a card response.						      */
+static void bench_extract(void)
+{
+	const tlv_key_t keys[] = {
+		0x9F0Au, 0x9F14u, 0x9F1Eu, 0x9F28u, 0x9F32u, 0x9F3Cu
+	};
+	struct tlv_slice slices[6];
+	uint8_t buffer[4 + BENCH_RECORD_TAGS * 7];
+	size_t i, j, size = sizeof(buffer), found = 0;
+	struct tlv *tlv = NULL, *copy = NULL;
+	double start;
+
+	tlv = build_record();
+	if (tlv_encode(tlv, buffer, &size) != TLV_RC_OK) {
+		fprintf(stderr, "bench_extract: tlv_encode failed!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("\nExtracting 6 of %u tags of a record:\n", BENCH_RECORD_TAGS);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++)
+		for (j = 0; j < 6; j++)
+			found += !!tlv_find_key(tlv_get_child(tlv), keys[j]);
+	printf("%-36s %9.1f ns/record\n", "tlv_find_key",
+			     (bench_now() - start) * 1e9 / BENCH_LOOKUP_ROUNDS);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		tlv_extract(tlv_get_child(tlv), keys, 6, slices);
+		found += slices[5].present;
+	}
+	printf("%-36s %9.1f ns/record\n", "tlv_extract",
+			     (bench_now() - start) * 1e9 / BENCH_LOOKUP_ROUNDS);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		if (tlv_view_parse(&buffer[4], size - 4, &copy) != TLV_RC_OK) {
+			fprintf(stderr, "bench_extract: parse failed!\n");
+			exit(EXIT_FAILURE);
+		}
+		for (j = 0; j < 6; j++)
+			found += !!tlv_find_key(copy, keys[j]);
+		tlv_free(copy);
+	}
+	printf("%-36s %9.1f ns/record\n", "tlv_view_parse + tlv_find_key",
+			     (bench_now() - start) * 1e9 / BENCH_LOOKUP_ROUNDS);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		tlv_extract_buffer(&buffer[4], size - 4, keys, 6, slices);
+		found += slices[5].present;
+	}
+	printf("%-36s %9.1f ns/record\n", "tlv_extract_buffer",
+			     (bench_now() - start) * 1e9 / BENCH_LOOKUP_ROUNDS);
+
+	if (found != 14 * BENCH_LOOKUP_ROUNDS) {
+		fprintf(stderr, "bench_extract: tags not found!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tlv_free(tlv);
+}
+
+/* A PPSE FCI with six directory entries.				      */
+static size_t build_ppse(uint8_t *fci)
+{
+	const uint8_t head[] = {
+		0x6F, 0x81, 0x8A,
+			0x84, 0x02, 0x32, 0x50,
+			0xA5, 0x81, 0x83,
+				0x88, 0x00,
+				0xBF, 0x0C, 0x7E
+	};
+	const uint8_t entry[] = {
+		0x61, 0x13,
+			0x4F, 0x07, 0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10,
+			0x87, 0x01, 0x01,
+			0x9F, 0x2A, 0x01, 0x03,
+			0x50, 0x01, 0x56
+	};
+	uint8_t *p = fci;
+	size_t i;
+
+	memcpy(p, head, sizeof(head));
+	for (i = 0, p += sizeof(head); i < 6; i++, p += sizeof(entry))
+		memcpy(p, entry, sizeof(entry));
+
+	return p - fci;
+}
+
+static int bench_count_record(void *priv, const struct tlv_record *record)
+{
+	(*(size_t *)priv)++;
+
+	return TLV_RC_OK;
+}
+
+/* Find the directory entries of a PPSE, once through a parsed tree and once
+ * on the encoding with a compiled path.				      */
+static void bench_path(void)
+{
+	struct tlv *tlv = NULL, *entry = NULL;
+	struct tlv_path *path = NULL;
+	size_t i, fci_sz, found = 0;
+	uint8_t fci[256];
+	double start;
+
+	fci_sz = build_ppse(fci);
+
+	printf("\nFinding the directory entries of a PPSE:\n");
+
+	start = bench_now();
+	for (i = 0; i < BENCH_PPSE_ROUNDS; i++) {
+		if (tlv_view_parse(fci, fci_sz, &tlv) != TLV_RC_OK) {
+			fprintf(stderr, "tlv_view_parse failed!\n");
+			exit(EXIT_FAILURE);
+		}
+		for (entry = tlv_find(tlv_get_child(tlv_find(tlv_get_child(
+				 tlv_find(tlv_get_child(tlv_find(tlv, "\x6F")),
+				     "\xA5")), "\xBF\x0C")), "\x61");
+		     entry; entry = tlv_find(tlv_get_next(entry), "\x61"))
+			found++;
+		tlv_free(tlv);
+	}
+	printf("%-36s %9.1f ns/FCI\n", "tlv_view_parse + tlv_find",
+			       (bench_now() - start) * 1e9 / BENCH_PPSE_ROUNDS);
+
+	if (tlv_path_compile("6F/A5/BF0C/61*", &path) != TLV_RC_OK) {
+		fprintf(stderr, "tlv_path_compile failed!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	start = bench_now();
+	for (i = 0; i < BENCH_PPSE_ROUNDS; i++)
+		if (tlv_path_eval(path, fci, fci_sz, bench_count_record,
+							 &found) != TLV_RC_OK) {
+			fprintf(stderr, "tlv_path_eval failed!\n");
+			exit(EXIT_FAILURE);
+		}
+	printf("%-36s %9.1f ns/FCI\n", "tlv_path_eval",
+			       (bench_now() - start) * 1e9 / BENCH_PPSE_ROUNDS);
+
+	tlv_path_free(path);
+
+	if (found != 2 * 6 * BENCH_PPSE_ROUNDS) {
+		fprintf(stderr, "bench_path: entries not found!\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static const uint8_t bench_aid[] = { 0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10 };
+
+/* The PPSE FCI of build_ppse, assembled from a TLV data structure.	      */
+static size_t build_ppse_tree(uint8_t *fci, size_t size)
+{
+	struct tlv *tlv = NULL, *tail = NULL, *entries = NULL;
+	const uint8_t prio = 0x01, kernel_id = 0x03;
+	size_t i;
+
+	tlv = tlv_new("\x6F", 0, NULL);
+	tail = tlv_insert_below(tlv, tlv_new("\x84", 2, "\x32\x50"));
+	tail = tlv_insert_after(tail, tlv_new("\xA5", 0, NULL));
+	entries = tlv_insert_below(tail, tlv_new("\x88", 0, NULL));
+	entries = tlv_insert_after(entries, tlv_new("\xBF\x0C", 0, NULL));
+
+	for (i = 0, tail = NULL; i < 6; i++) {
+		struct tlv *entry = tlv_new("\x61", 0, NULL), *field = NULL;
+
+		field = tlv_insert_below(entry, tlv_new("\x4F",
+						 sizeof(bench_aid), bench_aid));
+		field = tlv_insert_after(field, tlv_new("\x87", 1, &prio));
+		field = tlv_insert_after(field, tlv_new("\x9F\x2A", 1,
+								  &kernel_id));
+		tlv_insert_after(field, tlv_new("\x50", 1, "V"));
+
+		if (tail)
+			tail = tlv_insert_after(tail, entry);
+		else
+			tail = tlv_insert_below(entries, entry);
+	}
+
+	if (tlv_encode(tlv, fci, &size) != TLV_RC_OK)
+		size = 0;
+
+	tlv_free(tlv);
+
+	return size;
+}
+
+/* The same PPSE FCI, streamed with a tlv_writer.			      */
+static size_t build_ppse_writer(uint8_t *fci, size_t size)
+{
+	const uint8_t prio = 0x01, kernel_id = 0x03;
+	struct tlv_writer writer;
+	size_t i;
+
+	tlv_writer_init(&writer, fci, size);
+
+	tlv_writer_begin_constructed(&writer, "\x6F");
+	tlv_writer_put_primitive(&writer, "\x84", "\x32\x50", 2);
+	tlv_writer_begin_constructed(&writer, "\xA5");
+	tlv_writer_put_primitive(&writer, "\x88", NULL, 0);
+	tlv_writer_begin_constructed(&writer, "\xBF\x0C");
+
+	for (i = 0; i < 6; i++) {
+		tlv_writer_begin_constructed(&writer, "\x61");
+		tlv_writer_put_primitive(&writer, "\x4F", bench_aid,
+							    sizeof(bench_aid));
+		tlv_writer_put_primitive(&writer, "\x87", &prio, 1);
+		tlv_writer_put_primitive(&writer, "\x9F\x2A", &kernel_id, 1);
+		tlv_writer_put_primitive(&writer, "\x50", "V", 1);
+		tlv_writer_end(&writer);
+	}
+
+	tlv_writer_end(&writer);
+	tlv_writer_end(&writer);
+	tlv_writer_end(&writer);
+
+	if (tlv_writer_finish(&writer, &size) != TLV_RC_OK)
+		size = 0;
+
+	return size;
+}
+
+static void bench_writer(void)
+{
+	uint8_t expected[256], fci[256];
+	size_t i, size, expected_size;
+	double start;
+
+	expected_size = build_ppse(expected);
+
+	printf("\nBuilding a PPSE FCI with 6 directory entries:\n");
+
+	start = bench_now();
+	for (i = 0; i < BENCH_PPSE_ROUNDS; i++)
+		size = build_ppse_tree(fci, sizeof(fci));
+	printf("%-36s %9.1f ns/FCI\n", "tlv_new + tlv_encode",
+			       (bench_now() - start) * 1e9 / BENCH_PPSE_ROUNDS);
+
+	if (size != expected_size || memcmp(fci, expected, size)) {
+		fprintf(stderr, "bench_writer: tlv_encode mismatch!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	start = bench_now();
+	for (i = 0; i < BENCH_PPSE_ROUNDS; i++)
+		size = build_ppse_writer(fci, sizeof(fci));
+	printf("%-36s %9.1f ns/FCI\n", "tlv_writer",
+			       (bench_now() - start) * 1e9 / BENCH_PPSE_ROUNDS);
+
+	if (size != expected_size || memcmp(fci, expected, size)) {
+		fprintf(stderr, "bench_writer: tlv_writer mismatch!\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void bench_set_values(void)
+{
+	printf("\nUpdating the value of a data object:\n");
+
+	bench_set_value_report("tlv_new, same length",
+		   bench_set_value(tlv_new("\x9F\x37", 4, "\0\0\0\0"), 4, 4));
+	bench_set_value_report("tlv_new_reserve, same length",
+		      bench_set_value(tlv_new_reserve("\x9F\x37", 32), 4, 4));
+	bench_set_value_report("tlv_new, 4 and 32 bytes",
+		  bench_set_value(tlv_new("\x9F\x37", 4, "\0\0\0\0"), 4, 32));
+	bench_set_value_report("tlv_new_reserve, 4 and 32 bytes",
+		     bench_set_value(tlv_new_reserve("\x9F\x37", 32), 4, 32));
+}
+
+static void bench_reencode_report(const char *name, double seconds)
+{
+	printf("%-36s %9.1f ns/edit\n", name,
+					  seconds * 1e9 / BENCH_LOOKUP_ROUNDS);
+}
+
+/* Change one data object of a record and encode the record again, like a
+ * kernel that updates the unpredictable number before every command.      */
+static void bench_reencode(void)
+{
+	uint8_t buffer[2048], value[5] = { 0 };
+	struct tlv *tlv = NULL, *node = NULL;
+	size_t i, size;
+	double start;
+	int rc = TLV_RC_OK;
+
+	tlv = build_record();
+	node = tlv_deep_find(tlv, "\x9F\x1E");
+
+	printf("\nChanging one tag of a %u tag record and encoding it:\n",
+							     BENCH_RECORD_TAGS);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		value[0] = (uint8_t)i;
+		node = tlv_set_value(node, 4, value);
+		size = sizeof(buffer);
+		rc |= tlv_encode(tlv, buffer, &size);
+	}
+	bench_reencode_report("tlv_encode, same length", bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		value[0] = (uint8_t)i;
+		node = tlv_set_value(node, 4, value);
+		size = sizeof(buffer);
+		rc |= tlv_encode_bind(tlv, buffer, &size);
+	}
+	bench_reencode_report("tlv_encode_bind, same length",
+							   bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		node = tlv_set_value(node, 4 + (i & 1), value);
+		size = sizeof(buffer);
+		rc |= tlv_encode(tlv, buffer, &size);
+	}
+	bench_reencode_report("tlv_encode, new length", bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		node = tlv_set_value(node, 4 + (i & 1), value);
+		size = sizeof(buffer);
+		rc |= tlv_encode_bind(tlv, buffer, &size);
+	}
+	bench_reencode_report("tlv_encode_bind, new length",
+							   bench_now() - start);
+
+	if (rc != TLV_RC_OK) {
+		fprintf(stderr, "bench_reencode: encoding failed!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tlv_free(tlv);
+}
+
+/* A typical contactless PDOL and the terminal data it refers to.	      */
+static const uint8_t bench_pdol[] = {
+	0x9F, 0x66, 0x04, 0x9F, 0x02, 0x06, 0x9F, 0x03, 0x06, 0x9F, 0x1A,
+	0x02, 0x95, 0x05, 0x5F, 0x2A, 0x02, 0x9A, 0x03, 0x9C, 0x01, 0x9F,
+	0x37, 0x04
+};
+
+static const uint8_t bench_terminal_data[] = {
+	0x9F, 0x66, 0x04, 0x36, 0x00, 0x40, 0x00,
+	0x9F, 0x02, 0x06, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+	0x9F, 0x03, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x9F, 0x1A, 0x02, 0x02, 0x80,
+	0x95, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x5F, 0x2A, 0x02, 0x09, 0x78,
+	0x9A, 0x03, 0x26, 0x10, 0x17,
+	0x9C, 0x01, 0x00,
+	0x9F, 0x37, 0x04, 0x12, 0x34, 0x56, 0x78
+};
+
+static void bench_dol_report(const char *name, double seconds)
+{
+	printf("%-36s %9.1f ns/fill\n", name,
+					  seconds * 1e9 / BENCH_LOOKUP_ROUNDS);
+}
+
+static void bench_dol(void)
+{
+	struct dol_plan_cache *cache = dol_plan_cache_new();
+	const struct dol_plan *plan = NULL;
+	struct tlv *tlv = NULL;
+	uint8_t del[64];
+	size_t i, del_sz;
+	double start;
+
+	tlv_parse(bench_terminal_data, sizeof(bench_terminal_data), &tlv);
+
+	printf("\nDOL filling (%zu byte PDOL):\n", sizeof(bench_pdol));
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		del_sz = sizeof(del);
+		tlv_and_dol_to_del(tlv, bench_pdol, sizeof(bench_pdol), del,
+								       &del_sz);
+	}
+	bench_dol_report("tlv_and_dol_to_del", bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		del_sz = sizeof(del);
+		dol_plan_cache_get(cache, bench_pdol, sizeof(bench_pdol),
+									 &plan);
+		dol_plan_fill(plan, tlv, del, &del_sz);
+	}
+	bench_dol_report("dol_plan_cache_get + dol_plan_fill",
+							   bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++) {
+		del_sz = sizeof(del);
+		dol_plan_fill(plan, tlv, del, &del_sz);
+	}
+	bench_dol_report("dol_plan_fill", bench_now() - start);
+
+	dol_plan_cache_free(cache);
+	tlv_free(tlv);
+}
+
+/* Register formats for the tags 5F00..5F7F, 9F00..9F7F and DF00..DF7F plus
+ * the single octet tags 80..9E, a registry of about the size of libemv's.  */
+static void bench_fmts_register(void)
+{
+	static const uint8_t first[] = { 0x5Fu, 0x9Fu, 0xDFu };
+	static uint8_t ids[3 * 128 + 31][2];
+	struct tlv_id_to_fmt fmts[sizeof(ids) / sizeof(ids[0]) + 1];
+	size_t i, j, n = 0;
+
+	for (i = 0; i < sizeof(first); i++) {
+		for (j = 0; j < 128; j++, n++) {
+			ids[n][0] = first[i];
+			ids[n][1] = (uint8_t)j;
+			fmts[n].id = ids[n];
+			fmts[n].fmt = (enum tlv_fmt)(j % fmt_unknown);
+		}
+	}
+
+	for (j = 0x80u; j < 0x9Fu; j++, n++) {
+		ids[n][0] = (uint8_t)j;
+		fmts[n].id = ids[n];
+		fmts[n].fmt = fmt_b;
+	}
+
+	fmts[n].id = NULL;
+
+	libtlv_register_fmts(fmts);
+}
+
+static void bench_fmts_report(const char *name, double seconds)
+{
+	printf("%-36s %9.1f ns/lookup\n", name,
+			seconds * 1e9 / BENCH_LOOKUP_ROUNDS / BENCH_FMT_TAGS);
+}
+
+static void bench_fmts(void)
+{
+	const void *tags[BENCH_FMT_TAGS];
+	const void *dol = bench_pdol;
+	size_t i, j, dol_sz = sizeof(bench_pdol);
+	volatile enum tlv_fmt fmt;
+	double start;
+
+	for (i = 0; i < BENCH_FMT_TAGS; i++)
+		tags[i] = dol_tok(&dol, &dol_sz);
+
+	bench_fmts_register();
+
+	printf("\nTag format lookup (%u PDOL tags):\n", BENCH_FMT_TAGS);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++)
+		for (j = 0; j < BENCH_FMT_TAGS; j++)
+			fmt = libtlv_id_to_fmt(tags[j]);
+	bench_fmts_report("libtlv_id_to_fmt (sorted)", bench_now() - start);
+
+	libtlv_fmts_freeze();
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUP_ROUNDS; i++)
+		for (j = 0; j < BENCH_FMT_TAGS; j++)
+			fmt = libtlv_id_to_fmt(tags[j]);
+	bench_fmts_report("libtlv_id_to_fmt (frozen)", bench_now() - start);
+
+	(void)fmt;
+	libtlv_free_fmts();
+}
+
+/* The digit at a time conversions libtlv used before, for comparison.     */
+static int bcd_to_u64_nibbles(const uint8_t *bcd, size_t len, uint64_t *u64)
+{
+	size_t i = 0, j = 0;
+
+	for (i = 0, *u64 = 0; i < len; i++) {
+		for (j = 0; j < 2; j++) {
+			uint8_t digit = ((bcd[i] >> ((1 - j) * 4)) & 0xf);
+
+			if (digit > 9)
+				return TLV_RC_INVALID_ARG;
+
+			if (*u64 > (UINT64_MAX - digit) / 10)
+				return TLV_RC_VALUE_OUT_OF_RANGE;
+
+			*u64 = *u64 * 10 + digit;
+		}
+	}
+
+	return TLV_RC_OK;
+}
+
+static int u64_to_bcd_nibbles(uint64_t u64, uint8_t *bcd, size_t len)
+{
+	size_t i = 0, j = 0;
+
+	memset(bcd, 0, len);
+
+	for (i = len; i > 0; i--) {
+		for (j = 0; j < 2; j++) {
+			bcd[i - 1] |= (u64 % 10) << (j * 4);
+			u64 /= 10;
+		}
+	}
+
+	return u64 ? TLV_RC_VALUE_OUT_OF_RANGE : TLV_RC_OK;
+}
+
+static void bench_bcd_report(const char *name, double seconds)
+{
+	printf("%-36s %9.1f ns/value\n", name,
+					     seconds * 1e9 / BENCH_BCD_VALUES);
+}
+
+static void bench_bcd(void)
+{
+	uint64_t *values = NULL, *decoded = NULL, sum = 0;
+	uint8_t *bcd = NULL;
+	size_t i;
+	double start;
+
+	values = (uint64_t *)malloc(BENCH_BCD_VALUES * sizeof(*values));
+	decoded = (uint64_t *)malloc(BENCH_BCD_VALUES * sizeof(*decoded));
+	bcd = (uint8_t *)malloc(BENCH_BCD_VALUES * BENCH_BCD_SIZE);
+
+	/* Amounts of up to 10000.00 in minor units.			      */
+	for (i = 0; i < BENCH_BCD_VALUES; i++)
+		values[i] = (i * 2654435761u) % 1000000u;
+
+	printf("\nBCD conversion (%u values of %u bytes):\n",
+					     BENCH_BCD_VALUES, BENCH_BCD_SIZE);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_BCD_VALUES; i++)
+		u64_to_bcd_nibbles(values[i], &bcd[i * BENCH_BCD_SIZE],
+								BENCH_BCD_SIZE);
+	bench_bcd_report("u64 to BCD, digit at a time", bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_BCD_VALUES; i++)
+		libtlv_u64_to_bcd(values[i], &bcd[i * BENCH_BCD_SIZE],
+								BENCH_BCD_SIZE);
+	bench_bcd_report("libtlv_u64_to_bcd", bench_now() - start);
+
+	start = bench_now();
+	libtlv_u64_to_bcd_n(values, BENCH_BCD_VALUES, bcd, BENCH_BCD_SIZE);
+	bench_bcd_report("libtlv_u64_to_bcd_n", bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_BCD_VALUES; i++)
+		bcd_to_u64_nibbles(&bcd[i * BENCH_BCD_SIZE], BENCH_BCD_SIZE,
+								   &decoded[i]);
+	bench_bcd_report("BCD to u64, digit at a time", bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_BCD_VALUES; i++)
+		libtlv_bcd_to_u64(&bcd[i * BENCH_BCD_SIZE], BENCH_BCD_SIZE,
+								   &decoded[i]);
+	bench_bcd_report("libtlv_bcd_to_u64", bench_now() - start);
+
+	start = bench_now();
+	libtlv_bcd_to_u64_n(bcd, BENCH_BCD_SIZE, decoded, BENCH_BCD_VALUES);
+	bench_bcd_report("libtlv_bcd_to_u64_n", bench_now() - start);
+
+	for (i = 0; i < BENCH_BCD_VALUES; i++)
+		sum += decoded[i] ^ values[i];
+	if (sum) {
+		fprintf(stderr, "BCD round trip failed!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	free(bcd);
+	free(decoded);
+	free(values);
+}
+
+static void bench_hex_report(const char *name, size_t bytes, double seconds)
+{
+	printf("%-36s %9.2f GB/s\n", name,
+		       (double)bytes * BENCH_HEX_ROUNDS / seconds / 1e9);
+}
+
+static void bench_hex(void)
+{
+	uint8_t *bin = NULL;
+	char *hex = NULL, *text = NULL;
+	size_t i, size, text_len = 0;
+	double start;
+
+	bin = (uint8_t *)malloc(BENCH_HEX_SIZE);
+	hex = (char *)malloc(2 * BENCH_HEX_SIZE + 1);
+	text = (char *)malloc(3 * BENCH_HEX_SIZE);
+
+	for (i = 0; i < BENCH_HEX_SIZE; i++)
+		bin[i] = (uint8_t)(i * 167 + 13);
+
+	printf("\nHex conversion (%u bytes of binary data):\n",
+								BENCH_HEX_SIZE);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_HEX_ROUNDS; i++)
+		libtlv_bin_to_hex(bin, BENCH_HEX_SIZE, hex);
+	bench_hex_report("libtlv_bin_to_hex", BENCH_HEX_SIZE,
+							   bench_now() - start);
+
+	start = bench_now();
+	for (i = 0; i < BENCH_HEX_ROUNDS; i++) {
+		size = BENCH_HEX_SIZE;
+		if (libtlv_hex_decode(hex, 2 * BENCH_HEX_SIZE, bin, &size) !=
+								    TLV_RC_OK) {
+			fprintf(stderr, "libtlv_hex_decode failed!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	bench_hex_report("libtlv_hex_decode", BENCH_HEX_SIZE,
+							   bench_now() - start);
+
+	/* Hex dump style text: 32 digits per line, grouped into pairs.      */
+	for (i = 0; i < 2 * BENCH_HEX_SIZE; i += 2) {
+		text[text_len++] = hex[i];
+		text[text_len++] = hex[i + 1];
+		text[text_len++] = (i % 32 == 30) ? '\n' : ' ';
+	}
+
+	start = bench_now();
+	for (i = 0; i < BENCH_HEX_ROUNDS; i++) {
+		size = BENCH_HEX_SIZE;
+		if (libtlv_hex_decode_text(text, text_len, bin, &size) !=
+								    TLV_RC_OK) {
+			fprintf(stderr, "libtlv_hex_decode_text failed!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	bench_hex_report("libtlv_hex_decode_text (hex dump)", BENCH_HEX_SIZE,
+							   bench_now() - start);
+
+	/* One record per line, preceded by a comment.			      */
+	for (i = 0, text_len = 0; i < 2 * BENCH_HEX_SIZE; i += 256) {
+		memcpy(&text[text_len], "# rec\n", 6);
+		memcpy(&text[text_len + 6], &hex[i], 256);
+		text[text_len + 262] = '\n';
+		text_len += 263;
+	}
+
+	start = bench_now();
+	for (i = 0; i < BENCH_HEX_ROUNDS; i++) {
+		size = BENCH_HEX_SIZE;
+		if (libtlv_hex_decode_text(text, text_len, bin, &size) !=
+								    TLV_RC_OK) {
+			fprintf(stderr, "libtlv_hex_decode_text failed!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	bench_hex_report("libtlv_hex_decode_text (records)", BENCH_HEX_SIZE,
+							   bench_now() - start);
+
+	free(text);
+	free(hex);
+	free(bin);
+}
+
+int main(int argc, char **argv)
+{
+	if (log4c_init()) {
+		fprintf(stderr, "log4c_init() failed!\n");
+		return EXIT_FAILURE;
+	}
+
+	libtlv_init("libtlv_bench");
+
+	bench_parser();
+	bench_encoder();
+	bench_copier();
+	bench_lookup();
+	bench_extract();
+	bench_path();
+	bench_writer();
+	bench_set_values();
+	bench_reencode();
+	bench_dol();
+	bench_fmts();
+	bench_bcd();
+	bench_hex();
+
+	log4c_fini();
+
+	return EXIT_SUCCESS;
+}
@@ -19,9 +19,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <check.h>
 #include <log4c.h>
 
+#include <libpay_log.h>
 #include <libpay/tlv.h>
 
 START_TEST(test_tlv_malformed_input)
@@ -414,13 +417,1863 @@ START_TEST(test_tlv_set_value)
 }
 END_TEST
 
+START_TEST(test_tlv_arena)
+{
+	const unsigned char ppse[] = {
+		0x6F, 0x2F,
+			0x84, 0x0E, 0x32, 0x50, 0x41, 0x59, 0x2E, 0x53, 0x59,
+				    0x53, 0x2E, 0x44, 0x44, 0x46, 0x30, 0x31,
+			0xA5, 0x1D,
+				0xBF, 0x0C, 0x1A,
+					0x61, 0x18,
+						0x4F, 0x07, 0xA0, 0x00, 0x00,
+						      0x00, 0x04, 0x10, 0x10,
+						0x50, 0x0A, 0x4D, 0x61, 0x73,
+						      0x74, 0x65, 0x72, 0x43,
+						      0x61, 0x72, 0x64,
+						0x87, 0x01, 0x01
+	};
+	const char *label = "SomeLongApplicationLabel";
+	struct tlv_arena *arena = NULL;
+	struct tlv *tlv = NULL, *tlv_label = NULL;
+	unsigned char buffer[256];
+	size_t size;
+	int rc, i;
+
+	arena = tlv_arena_new(64);
+	ck_assert(arena);
+
+	for (i = 0; i < 3; i++) {
+		rc = tlv_parse_arena(arena, ppse, sizeof(ppse), &tlv);
+		ck_assert(rc == TLV_RC_OK);
+
+		tlv_label = tlv_deep_find(tlv, "\x50");
+		ck_assert(tlv_label);
+		ck_assert(tlv_get_parent(tlv_label) ==
+				  tlv_find(tlv_get_child(tlv_find(tlv_get_child(
+				  tlv_find(tlv_get_child(tlv), "\xA5")),
+				  "\xBF\x0C")), "\x61"));
+
+		size = sizeof(buffer);
+		rc = tlv_encode(tlv, buffer, &size);
+		ck_assert(rc == TLV_RC_OK);
+		ck_assert(size == sizeof(ppse));
+		ck_assert(!memcmp(buffer, ppse, size));
+
+		tlv_label = tlv_set_value(tlv_label, strlen(label), label);
+		ck_assert(tlv_label);
+		ck_assert(tlv_deep_find(tlv, "\x50") == tlv_label);
+
+		tlv_arena_reset(arena);
+	}
+
+	tlv_arena_free(arena);
+}
+END_TEST
+
+START_TEST(test_tlv_view_parse)
+{
+	uint8_t fci[] = {
+		0x6F, 0x1A,
+			0x84, 0x07, 0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10,
+			0xA5, 0x0F,
+				0x50, 0x04, 0x56, 0x49, 0x53, 0x41,
+				0x9F, 0x38, 0x06, 0x9F, 0x66, 0x04, 0x9F, 0x02,
+				0x06
+	};
+	const uint8_t new_label[] = { 0x43, 0x41, 0x52, 0x44, 0x21 };
+	struct tlv *tlv = NULL, *pdol = NULL, *label = NULL;
+	const void *value = NULL;
+	uint8_t buffer[sizeof(fci) + 1];
+	size_t size = 0;
+	int rc;
+
+	rc = tlv_view_parse(fci, sizeof(fci), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	pdol = tlv_find(tlv_get_child(tlv_find(tlv_get_child(tlv), "\xA5")),
+								    "\x9F\x38");
+	ck_assert(pdol);
+
+	value = tlv_view_value(pdol, &size);
+	ck_assert(value == &fci[22]);
+	ck_assert(size == 6);
+
+	ck_assert(!tlv_view_value(tlv, &size));
+	ck_assert(size == 0);
+
+	label = tlv_set_value(tlv_find(tlv_get_child(tlv_find(
+			tlv_get_child(tlv), "\xA5")), "\x50"), sizeof(new_label),
+								     new_label);
+	ck_assert(label);
+	ck_assert(fci[15] == 0x56);
+
+	size = sizeof(buffer);
+	rc = tlv_encode(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(buffer));
+	ck_assert(buffer[1] == 0x1B);
+	ck_assert(!memcmp(&buffer[15], new_label, sizeof(new_label)));
+
+	tlv_free(tlv);
+}
+END_TEST
+
+START_TEST(test_tlv_parse_limits)
+{
+	const size_t num_siblings = 100000, depth = 40;
+	uint8_t *flat = NULL, nested[2 * 40 + 3];
+	struct tlv *tlv = NULL, *i_tlv = NULL;
+	size_t i, num;
+	int rc;
+
+	flat = (uint8_t *)malloc(3 * num_siblings);
+	ck_assert(flat);
+
+	for (i = 0; i < num_siblings; i++) {
+		flat[3 * i]	= 0x80;
+		flat[3 * i + 1] = 0x01;
+		flat[3 * i + 2] = (uint8_t)i;
+	}
+
+	rc = tlv_parse(flat, 3 * num_siblings, &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	for (i_tlv = tlv, num = 0; i_tlv; i_tlv = tlv_get_next(i_tlv))
+		num++;
+	ck_assert(num == num_siblings);
+
+	tlv_free(tlv);
+	free(flat);
+
+	for (i = 0; i < depth; i++) {
+		nested[2 * i]	  = 0xA0;
+		nested[2 * i + 1] = (uint8_t)(2 * (depth - i) + 1);
+	}
+	nested[2 * depth]     = 0x80;
+	nested[2 * depth + 1] = 0x01;
+	nested[2 * depth + 2] = 0x42;
+
+	rc = tlv_parse(nested, sizeof(nested), &tlv);
+	ck_assert(rc == TLV_RC_MAX_DEPTH_EXCEEDED);
+	ck_assert(!tlv);
+
+	libtlv_set_max_depth(depth);
+	rc = tlv_parse(nested, sizeof(nested), &tlv);
+	libtlv_set_max_depth(0);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(tlv_get_depth(tlv_deep_find(tlv, "\x80")) == (int)depth);
+	tlv_free(tlv);
+
+	nested[1]++;
+	rc = tlv_parse(nested, sizeof(nested), &tlv);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+}
+END_TEST
+
+START_TEST(test_tlv_parse_ctx)
+{
+	const uint8_t nested[] = {
+		0x70, 0x0A,
+			0x9F, 0x02, 0x02, 0x00, 0x01,
+			0xA5, 0x03,
+				0x50, 0x01, 0x41
+	};
+	const uint8_t truncated[] = {
+		0x70, 0x0A,
+			0x9F, 0x02, 0x02, 0x00, 0x01,
+			0xA5, 0x03,
+				0x50, 0x04, 0x41
+	};
+	struct tlv_parse_ctx ctx;
+	struct tlv *tlv = NULL;
+	uint8_t *large = NULL;
+	int rc;
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	rc = tlv_parse_r(nested, sizeof(nested), &tlv, &ctx);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(ctx.rc == TLV_RC_OK);
+	tlv_free(tlv);
+
+	rc = tlv_parse_r(truncated, sizeof(truncated), &tlv, &ctx);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+	ck_assert(ctx.rc == rc);
+	ck_assert(ctx.offset == 11);
+	ck_assert(!tlv);
+
+	ctx.max_depth = 1;
+	rc = tlv_parse_r(nested, sizeof(nested), &tlv, &ctx);
+	ck_assert(rc == TLV_RC_MAX_DEPTH_EXCEEDED);
+	ck_assert(ctx.offset == 9);
+
+	rc = tlv_shallow_parse_r(nested, sizeof(nested), &tlv, &ctx);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(!tlv_get_next(tlv));
+	tlv_free(tlv);
+
+	/* Large malformed input must not be hex dumped in its entirety.     */
+	large = (uint8_t *)calloc(1, 1024 * 1024);
+	ck_assert(large);
+	large[1024 * 1024 - 1] = 0x1F;
+	rc = tlv_parse_r(large, 1024 * 1024, &tlv, &ctx);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+	ck_assert(ctx.offset == 1024 * 1024 - 1);
+	free(large);
+}
+END_TEST
+
+START_TEST(test_tlv_encode_cache)
+{
+	const uint8_t nested[] = {
+		0x70, 0x0A,
+			0x9F, 0x02, 0x02, 0x00, 0x01,
+			0xA5, 0x03,
+				0x50, 0x01, 0x41
+	};
+	uint8_t value[0x80], buffer[256];
+	struct tlv *tlv = NULL, *leaf = NULL;
+	size_t size;
+	int rc;
+
+	rc = tlv_parse(nested, sizeof(nested), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	size = sizeof(buffer);
+	rc = tlv_encode(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(nested));
+	ck_assert(!memcmp(buffer, nested, sizeof(nested)));
+
+	/* Growing a leaf past 127 bytes widens the lengths of all ancestors. */
+	memset(value, 0x41, sizeof(value));
+	leaf = tlv_set_value(tlv_deep_find(tlv, "\x50"), sizeof(value), value);
+	ck_assert(leaf);
+
+	size = sizeof(buffer);
+	rc = tlv_encode(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == 142);
+	ck_assert(!memcmp(buffer, "\x70\x81\x8B", 3));
+	ck_assert(!memcmp(&buffer[8], "\xA5\x81\x83\x50\x81\x80", 6));
+
+	tlv_free(tlv_unlink(tlv_find(tlv_get_child(tlv), "\x9F\x02")));
+
+	size = sizeof(buffer);
+	rc = tlv_encode(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == 137);
+	ck_assert(!memcmp(buffer, "\x70\x81\x86\xA5\x81\x83", 6));
+
+	leaf = tlv_insert_below(tlv_find(tlv_get_child(tlv), "\xA5"),
+					 tlv_new("\x9F\x02", 2, "\x00\x01"));
+	ck_assert(leaf);
+	ck_assert(tlv_get_parent(tlv_get_next(leaf)) == tlv_get_parent(leaf));
+
+	size = sizeof(buffer);
+	rc = tlv_encode_length(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == 2);
+	ck_assert(!memcmp(buffer, "\x81\x8B", 2));
+
+	size = sizeof(buffer);
+	rc = tlv_encode(tlv_get_child(tlv), buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == 139);
+	ck_assert(!memcmp(buffer, "\xA5\x81\x88\x9F\x02\x02\x00\x01", 8));
+
+	tlv_free(tlv);
+}
+END_TEST
+
+START_TEST(test_tlv_find_key)
+{
+	const uint8_t nested[] = {
+		0x70, 0x0A,
+			0x9F, 0x02, 0x02, 0x00, 0x01,
+			0xA5, 0x03,
+				0x50, 0x01, 0x41
+	};
+	struct tlv *tlv = NULL;
+	int rc;
+
+	ck_assert(TLV_KEY("\x50") == 0x50u);
+	ck_assert(TLV_KEY("\x9F\x02") == 0x9F02u);
+	ck_assert(TLV_KEY("\xDF\x81\x81\x01") == 0xDF818101u);
+	ck_assert(libtlv_tag_to_key("\x9F\x02\xFF") == TLV_KEY("\x9F\x02"));
+	ck_assert(libtlv_tag_to_key("\xDF\x81\x81\x01") == 0xDF818101u);
+
+	rc = tlv_parse(nested, sizeof(nested), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	ck_assert(tlv_get_key(tlv) == 0x70u);
+	ck_assert(!tlv_find_key(tlv_get_child(tlv), TLV_KEY("\x50")));
+	ck_assert(tlv_find_key(tlv_get_child(tlv), TLV_KEY("\xA5")) ==
+				   tlv_find(tlv_get_child(tlv), "\xA5"));
+	ck_assert(tlv_get_key(tlv_deep_find_key(tlv, TLV_KEY("\x50"))) == 0x50);
+	ck_assert(tlv_get_key(tlv_deep_find(tlv, "\x9F\x02")) == 0x9F02u);
+	ck_assert(!tlv_deep_find_key(tlv, TLV_KEY("\x9F\x03")));
+
+	ck_assert(tlv_set_identifier(tlv_deep_find(tlv, "\x9F\x02"), "\x5A"));
+	ck_assert(!tlv_deep_find_key(tlv, TLV_KEY("\x9F\x02")));
+	ck_assert(tlv_deep_find_key(tlv, TLV_KEY("\x5A")));
+
+	tlv_free(tlv);
+}
+END_TEST
+
+START_TEST(test_tlv_index)
+{
+	const uint8_t record[] = {
+		0x70, 0x12,
+			0x5A, 0x01, 0x11,
+			0xA5, 0x06,
+				0x50, 0x01, 0x41,
+				0x5A, 0x01, 0x22,
+			0x9F, 0x02, 0x01, 0x00,
+			0x5A, 0x01, 0x33
+	};
+	struct tlv_arena *arena = NULL;
+	struct tlv_index *index = NULL;
+	struct tlv *tlv = NULL, *found[2];
+	uint8_t value = 0;
+	size_t size = sizeof(value);
+	int rc;
+
+	rc = tlv_parse(record, sizeof(record), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	rc = tlv_index_build(tlv, &index);
+	ck_assert(rc == TLV_RC_OK);
+
+	ck_assert(tlv_index_lookup(index, "\x70") == tlv);
+	ck_assert(tlv_index_lookup(index, "\x50") == tlv_deep_find(tlv, "\x50"));
+	ck_assert(tlv_index_lookup_key(index, TLV_KEY("\x9F\x02")) ==
+					      tlv_deep_find(tlv, "\x9F\x02"));
+	ck_assert(!tlv_index_lookup(index, "\x9F\x03"));
+	ck_assert(!tlv_index_lookup_all(index, TLV_KEY("\x9F\x03"), NULL, 0));
+
+	/* Duplicates are returned in depth first order.		      */
+	ck_assert(tlv_index_lookup_all(index, TLV_KEY("\x5A"), found, 2) == 3);
+	rc = tlv_encode_value(found[0], &value, &size);
+	ck_assert(rc == TLV_RC_OK && value == 0x11);
+	rc = tlv_encode_value(found[1], &value, &size);
+	ck_assert(rc == TLV_RC_OK && value == 0x22);
+
+	tlv_index_free(index);
+	tlv_free(tlv);
+
+	/* The index of an arena tree lives in the arena.		      */
+	arena = tlv_arena_new(0);
+	ck_assert(arena);
+
+	rc = tlv_parse_arena(arena, record, sizeof(record), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	rc = tlv_index_build(tlv, &index);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(tlv_index_lookup(index, "\xA5") == tlv_deep_find(tlv, "\xA5"));
+	tlv_index_free(index);
+
+	tlv_arena_free(arena);
+
+	rc = tlv_index_build(NULL, &index);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(!tlv_index_lookup(index, "\x5A"));
+	tlv_index_free(index);
+}
+END_TEST
+
+START_TEST(test_tlv_hex)
+{
+	const char text[] = "# Amount, Authorised\n9F02 06 000000001000\r\n"
+			    "  9f03 06 00 00 00 00 00 00 # Amount, Other\n";
+	const uint8_t expected[] = {
+		0x9F, 0x02, 0x06, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+		0x9F, 0x03, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+	};
+	uint8_t bin[256], decoded[256];
+	char hex[2 * sizeof(bin) + 1], ref[3];
+	size_t i, len, size;
+	int rc;
+
+	for (i = 0; i < sizeof(bin); i++)
+		bin[i] = (uint8_t)(i * 167 + 13);
+
+	/* All lengths, so that both vector widths and the tails are used.   */
+	for (len = 0; len <= sizeof(bin); len++) {
+		libtlv_bin_to_hex(bin, len, hex);
+		ck_assert(strlen(hex) == 2 * len);
+		for (i = 0; i < len; i++) {
+			snprintf(ref, sizeof(ref), "%02X", bin[i]);
+			ck_assert(!memcmp(&hex[2 * i], ref, 2));
+		}
+
+		size = sizeof(decoded);
+		rc = libtlv_hex_decode(hex, 2 * len, decoded, &size);
+		ck_assert(rc == TLV_RC_OK);
+		ck_assert(size == len);
+		ck_assert(!memcmp(decoded, bin, len));
+	}
+
+	/* An invalid digit is detected in any position.		      */
+	for (i = 0; i < 2 * sizeof(bin); i++) {
+		libtlv_bin_to_hex(bin, sizeof(bin), hex);
+		hex[i] = (i % 2) ? 'g' : ':';
+		size = sizeof(decoded);
+		rc = libtlv_hex_decode(hex, 2 * sizeof(bin), decoded, &size);
+		ck_assert(rc == TLV_RC_INVALID_ARG);
+	}
+
+	size = sizeof(decoded);
+	rc = libtlv_hex_decode("0aBc", 4, decoded, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == 2 && decoded[0] == 0x0A && decoded[1] == 0xBC);
+
+	size = 1;
+	rc = libtlv_hex_decode("0aBc", 4, decoded, &size);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+	ck_assert(size == 2);
+
+	size = sizeof(decoded);
+	rc = libtlv_hex_decode("0aB", 3, decoded, &size);
+	ck_assert(rc == TLV_RC_INVALID_ARG);
+
+	size = sizeof(decoded);
+	rc = libtlv_hex_decode_text(text, strlen(text), decoded, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(expected));
+	ck_assert(!memcmp(decoded, expected, sizeof(expected)));
+
+	size = sizeof(decoded);
+	rc = libtlv_hex_decode_text("9F 0", 4, decoded, &size);
+	ck_assert(rc == TLV_RC_INVALID_ARG);
+
+	size = 1;
+	rc = libtlv_hex_decode_text("9F 02", 5, decoded, &size);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+
+	size = sizeof(decoded);
+	ck_assert(libtlv_hex_to_bin("9F02 06\n0000", decoded, &size));
+	ck_assert(size == 5);
+	ck_assert(!memcmp(decoded, expected, 5));
+
+	size = sizeof(decoded);
+	ck_assert(!libtlv_hex_to_bin("9F02 # comment", decoded, &size));
+}
+END_TEST
+
+struct stream_log {
+	char   text[512];
+	size_t len;
+	size_t pieces;
+};
+
+static int stream_enter(void *priv, const void *tag, size_t length)
+{
+	struct stream_log *log = (struct stream_log *)priv;
+	char hex[2 * TLV_MAX_TAG_LENGTH + 1];
+
+	libtlv_bin_to_hex(tag, libtlv_get_tag_length(tag), hex);
+	log->len += snprintf(&log->text[log->len], sizeof(log->text) - log->len,
+						  "<%s:%d>", hex, (int)length);
+	return TLV_RC_OK;
+}
+
+static int stream_leave(void *priv, const void *tag)
+{
+	struct stream_log *log = (struct stream_log *)priv;
+	char hex[2 * TLV_MAX_TAG_LENGTH + 1];
+
+	libtlv_bin_to_hex(tag, libtlv_get_tag_length(tag), hex);
+	log->len += snprintf(&log->text[log->len], sizeof(log->text) - log->len,
+								 "</%s>", hex);
+	return TLV_RC_OK;
+}
+
+static int stream_value(void *priv, const void *tag, size_t length,
+			       size_t offset, const void *data, size_t size)
+{
+	struct stream_log *log = (struct stream_log *)priv;
+	char hex[2 * 64 + 1];
+
+	if ((size > 64) || (offset + size > length))
+		return TLV_RC_VALUE_OUT_OF_RANGE;
+
+	if (!offset) {
+		libtlv_bin_to_hex(tag, libtlv_get_tag_length(tag), hex);
+		log->len += snprintf(&log->text[log->len],
+				 sizeof(log->text) - log->len, "%s=", hex);
+	}
+
+	libtlv_bin_to_hex(data, size, hex);
+	log->len += snprintf(&log->text[log->len], sizeof(log->text) - log->len,
+							       "%s", hex);
+	log->pieces++;
+
+	if (offset + size == length)
+		log->len += snprintf(&log->text[log->len],
+				       sizeof(log->text) - log->len, ";");
+
+	return TLV_RC_OK;
+}
+
+START_TEST(test_tlv_stream_parser)
+{
+	const uint8_t stream[] = {
+		0x70, 0x11,
+			0x5F, 0x20, 0x04, 0x41, 0x42, 0x43, 0x44,
+			0x00,
+			0xA5, 0x06,
+				0x9F, 0x02, 0x00,
+				0xBF, 0x0C, 0x00,
+		0x00, 0x00,
+		0x9F, 0x03, 0x81, 0x02, 0x12, 0x34
+	};
+	const char expected[] = "<70:17>5F20=41424344;<A5:6>9F02=;<BF0C:0>"
+				"</BF0C></A5></70>9F03=1234;";
+	const struct tlv_stream_callbacks callbacks = {
+		stream_enter, stream_leave, stream_value
+	};
+	struct tlv_stream_parser *parser = NULL;
+	struct stream_log log;
+	size_t chunk, i;
+	int rc;
+
+	/* Chunk boundaries may be anywhere, even inside tags and lengths.   */
+	for (chunk = 1; chunk <= sizeof(stream); chunk++) {
+		memset(&log, 0, sizeof(log));
+		parser = tlv_stream_parser_new(&callbacks, &log, 16);
+		ck_assert(parser);
+
+		for (i = 0; i < sizeof(stream); i += chunk) {
+			rc = tlv_stream_parser_feed(parser, &stream[i],
+				    i + chunk < sizeof(stream) ? chunk :
+							  sizeof(stream) - i);
+			ck_assert(rc == TLV_RC_OK);
+		}
+
+		rc = tlv_stream_parser_finish(parser);
+		ck_assert(rc == TLV_RC_OK);
+		ck_assert(!strcmp(log.text, expected));
+		ck_assert(log.pieces == 3);
+		ck_assert(tlv_stream_parser_get_offset(parser) ==
+							       sizeof(stream));
+		tlv_stream_parser_free(parser);
+	}
+
+	/* Without a buffer, values arrive in pieces.			      */
+	memset(&log, 0, sizeof(log));
+	parser = tlv_stream_parser_new(&callbacks, &log, 0);
+	ck_assert(parser);
+	for (i = 0; i < sizeof(stream); i++)
+		ck_assert(tlv_stream_parser_feed(parser, &stream[i], 1) ==
+								    TLV_RC_OK);
+	ck_assert(tlv_stream_parser_finish(parser) == TLV_RC_OK);
+	ck_assert(!strcmp(log.text, expected));
+	ck_assert(log.pieces == 7);
+	tlv_stream_parser_free(parser);
+
+	/* Truncated input.						      */
+	memset(&log, 0, sizeof(log));
+	parser = tlv_stream_parser_new(&callbacks, &log, 16);
+	ck_assert(parser);
+	rc = tlv_stream_parser_feed(parser, stream, 10);
+	ck_assert(rc == TLV_RC_OK);
+	rc = tlv_stream_parser_finish(parser);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+	tlv_stream_parser_free(parser);
+
+	/* A child that is larger than its parent.			      */
+	memset(&log, 0, sizeof(log));
+	parser = tlv_stream_parser_new(&callbacks, &log, 16);
+	ck_assert(parser);
+	rc = tlv_stream_parser_feed(parser, "\x70\x03\x50\x02\x41\x41", 6);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+	ck_assert(tlv_stream_parser_get_offset(parser) == 4);
+	rc = tlv_stream_parser_feed(parser, "\x50\x00", 2);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+	tlv_stream_parser_free(parser);
+
+	/* Nesting depth is limited.					      */
+	libtlv_set_max_depth(1);
+	parser = tlv_stream_parser_new(&callbacks, &log, 16);
+	libtlv_set_max_depth(0);
+	ck_assert(parser);
+	rc = tlv_stream_parser_feed(parser, "\x70\x02\xA5\x00", 4);
+	ck_assert(rc == TLV_RC_MAX_DEPTH_EXCEEDED);
+	tlv_stream_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_tlv_copy)
+{
+	const uint8_t fci[] = {
+		0x6F, 0x1A,
+			0x84, 0x07, 0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10,
+			0xA5, 0x0F,
+				0x50, 0x04, 0x56, 0x49, 0x53, 0x41,
+				0x9F, 0x38, 0x06, 0x9F, 0x66, 0x04, 0x9F, 0x02,
+				0x06,
+		0x9F, 0x03, 0x00
+	};
+	struct tlv_arena *arena = NULL;
+	struct tlv *tlv = NULL, *copy = NULL, *a5 = NULL;
+	uint8_t source[sizeof(fci)], buffer[sizeof(fci)];
+	size_t size = 0;
+	int rc;
+
+	memcpy(source, fci, sizeof(source));
+	rc = tlv_view_parse(source, sizeof(source), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	/* Only the node and its descendants are copied, not its siblings.    */
+	copy = tlv_copy(tlv);
+	ck_assert(copy);
+	ck_assert(copy != tlv);
+	ck_assert(!tlv_get_next(copy));
+	ck_assert(!tlv_get_parent(copy));
+
+	/* The copy owns its values.					      */
+	memset(source, 0, sizeof(source));
+	tlv_free(tlv);
+
+	size = sizeof(buffer);
+	rc = tlv_encode(copy, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(fci) - 3);
+	ck_assert(!memcmp(buffer, fci, size));
+
+	/* Copying an inner node detaches it from its parent and siblings.    */
+	a5 = tlv_copy(tlv_find(tlv_get_child(copy), "\xA5"));
+	ck_assert(a5);
+	ck_assert(!tlv_get_parent(a5));
+	ck_assert(!tlv_get_next(a5));
+	ck_assert(tlv_get_parent(tlv_get_child(a5)) == a5);
+	ck_assert(tlv_find(tlv_get_child(a5), "\x9F\x38"));
+
+	size = sizeof(buffer);
+	rc = tlv_encode(a5, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == 17);
+	ck_assert(!memcmp(buffer, &fci[11], size));
+
+	/* Modifying the copy leaves the original untouched.		      */
+	ck_assert(tlv_set_value(tlv_get_child(a5), 2, "\x41\x42"));
+	size = sizeof(buffer);
+	rc = tlv_encode(copy, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(!memcmp(buffer, fci, size));
+	tlv_free(a5);
+
+	arena = tlv_arena_new(0);
+	ck_assert(arena);
+	ck_assert(!tlv_copy_arena(NULL, copy));
+	ck_assert(!tlv_copy_arena(arena, NULL));
+	ck_assert(!tlv_copy(NULL));
+
+	tlv = tlv_copy_arena(arena, copy);
+	ck_assert(tlv);
+	tlv_free(copy);
+
+	size = sizeof(buffer);
+	rc = tlv_encode(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(fci) - 3);
+	ck_assert(!memcmp(buffer, fci, size));
+
+	tlv_arena_free(arena);
+}
+END_TEST
+
+START_TEST(test_tlv_encode_prefix)
+{
+	const uint8_t fci[] = {
+		0x6F, 0x1A,
+			0x84, 0x07, 0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10,
+			0xA5, 0x0F,
+				0x50, 0x04, 0x56, 0x49, 0x53, 0x41,
+				0x9F, 0x38, 0x06, 0x9F, 0x66, 0x04, 0x9F, 0x02,
+				0x06,
+		0x9F, 0x03, 0x00,
+		0x5A, 0x02, 0x12, 0x34
+	};
+	uint8_t buffer[sizeof(fci) + 2];
+	struct tlv *tlv = NULL;
+	size_t max, size;
+	int rc;
+
+	rc = tlv_parse(fci, sizeof(fci), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	for (max = 0; max <= sizeof(buffer); max++) {
+		memset(buffer, 0xCC, sizeof(buffer));
+		size = tlv_encode_prefix(tlv, buffer, max);
+		ck_assert(size == (max < sizeof(fci) ? max : sizeof(fci)));
+		ck_assert(!memcmp(buffer, fci, size));
+		ck_assert(size == sizeof(buffer) || buffer[size] == 0xCC);
+	}
+
+	/* The prefix of an inner node covers that node and its siblings.     */
+	size = tlv_encode_prefix(tlv_get_child(tlv), buffer, 4);
+	ck_assert(size == 4);
+	ck_assert(!memcmp(buffer, &fci[2], size));
+
+	ck_assert(tlv_encode_prefix(NULL, buffer, sizeof(buffer)) == 0);
+
+	tlv_free(tlv);
+}
+END_TEST
+
+START_TEST(test_tlv_encode_iov)
+{
+	const uint8_t tag_70[] = { 0x70 }, tag_5a[] = { 0x5A };
+	const uint8_t tag_9f4b[] = { 0x9F, 0x4B }, tag_9f10[] = { 0x9F, 0x10 };
+	const uint8_t pan[] = { 0x12, 0x34, 0x56, 0x78 };
+	uint8_t sdad[300], iad[TLV_IOV_COPY_LIMIT];
+	uint8_t expected[512], gathered[512], scratch[64];
+	struct iovec iov[8];
+	struct tlv *tlv = NULL, *tlv_sdad = NULL;
+	size_t size, scratch_size, expected_size = sizeof(expected), i;
+	const void *value = NULL;
+	int rc, iovcnt;
+
+	memset(sdad, 0xA5, sizeof(sdad));
+	memset(iad, 0x5A, sizeof(iad));
+
+	tlv = tlv_new(tag_70, 0, NULL);
+	tlv_insert_below(tlv, tlv_new(tag_5a, sizeof(pan), pan));
+	tlv_sdad = tlv_insert_after(tlv_get_child(tlv),
+				       tlv_new(tag_9f4b, sizeof(sdad), sdad));
+	tlv_insert_after(tlv_sdad, tlv_new(tag_9f10, sizeof(iad), iad));
+
+	rc = tlv_encode(tlv, expected, &expected_size);
+	ck_assert(rc == TLV_RC_OK);
+
+	/* Without buffers only the required sizes are reported.	      */
+	iovcnt = 0;
+	scratch_size = 0;
+	rc = tlv_encode_iov(tlv, NULL, &iovcnt, NULL, &scratch_size);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+	ck_assert(iovcnt == 4);
+	ck_assert(scratch_size == 4 + 2 + sizeof(pan) + 5 + 3);
+
+	iovcnt = 3;
+	scratch_size = sizeof(scratch);
+	rc = tlv_encode_iov(tlv, iov, &iovcnt, scratch, &scratch_size);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+	ck_assert(iovcnt == 4);
+
+	iovcnt = 8;
+	scratch_size = 4;
+	rc = tlv_encode_iov(tlv, iov, &iovcnt, scratch, &scratch_size);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+	ck_assert(scratch_size == 18);
+
+	iovcnt = 8;
+	scratch_size = sizeof(scratch);
+	rc = tlv_encode_iov(tlv, iov, &iovcnt, scratch, &scratch_size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(iovcnt == 4);
+	ck_assert(scratch_size == 18);
+
+	/* Headers and the short PAN are gathered in scratch, the long values
+	 * are referenced in place.					      */
+	value = tlv_view_value(tlv_sdad, &size);
+	ck_assert(iov[0].iov_base == scratch && iov[0].iov_len == 15);
+	ck_assert(iov[1].iov_base == value && iov[1].iov_len == size);
+	ck_assert(iov[2].iov_base == &scratch[15] && iov[2].iov_len == 3);
+	value = tlv_view_value(tlv_get_next(tlv_sdad), &size);
+	ck_assert(iov[3].iov_base == value && iov[3].iov_len == size);
+
+	for (i = 0, size = 0; i < (size_t)iovcnt; size += iov[i++].iov_len)
+		memcpy(&gathered[size], iov[i].iov_base, iov[i].iov_len);
+	ck_assert(size == expected_size);
+	ck_assert(!memcmp(gathered, expected, size));
+
+	iovcnt = 0;
+	scratch_size = 0;
+	rc = tlv_encode_iov(NULL, NULL, &iovcnt, NULL, &scratch_size);
+	ck_assert(rc == TLV_RC_OK && iovcnt == 0 && scratch_size == 0);
+
+	rc = tlv_encode_iov(tlv, iov, NULL, scratch, &scratch_size);
+	ck_assert(rc == TLV_RC_INVALID_ARG);
+
+	tlv_free(tlv);
+}
+END_TEST
+
+/* Encode 'tlv' from scratch and compare it to the bound encoding.	      */
+static void check_bound_encoding(struct tlv *tlv, const uint8_t *bound,
+								    size_t size)
+{
+	uint8_t expected[512];
+	size_t expected_size = sizeof(expected);
+
+	ck_assert(tlv_encode(tlv, expected, &expected_size) == TLV_RC_OK);
+	ck_assert(size == expected_size);
+	ck_assert(!memcmp(bound, expected, size));
+}
+
+START_TEST(test_tlv_encode_bind)
+{
+	const uint8_t terminal_data[] = {
+		0x9F, 0x1A, 0x02, 0x02, 0x80,
+		0xBF, 0x0C, 0x0C,
+			0x9F, 0x37, 0x04, 0x11, 0x22, 0x33, 0x44,
+			0x9A, 0x03, 0x16, 0x01, 0x31,
+		0x9F, 0x35, 0x01, 0x22
+	};
+	const uint8_t tag_9f21[] = { 0x9F, 0x21 };
+	uint8_t buffer[512], unpredictable_number[4] = { 1, 2, 3, 4 };
+	uint8_t large[200], before[sizeof(terminal_data)];
+	struct tlv *tlv = NULL, *un = NULL, *date = NULL;
+	size_t size;
+	int rc;
+
+	memset(large, 0xAB, sizeof(large));
+
+	rc = tlv_parse(terminal_data, sizeof(terminal_data), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	size = 4;
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+	ck_assert(size == sizeof(terminal_data));
+
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	check_bound_encoding(tlv, buffer, size);
+
+	/* A value of the same length is patched in by tlv_set_value alone. */
+	un = tlv_find(tlv_get_child(tlv_get_next(tlv)), "\x9F\x37");
+	un = tlv_set_value(un, sizeof(unpredictable_number),
+							 unpredictable_number);
+	ck_assert(!memcmp(&buffer[11], unpredictable_number,
+						 sizeof(unpredictable_number)));
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	check_bound_encoding(tlv, buffer, size);
+
+	/* Shrinking and growing shift the tail and fix the ancestor.	      */
+	date = tlv_get_next(un);
+	date = tlv_set_value(date, 2, "\x16\x02");
+	memcpy(before, buffer, sizeof(before));
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(terminal_data) - 1);
+	ck_assert(!memcmp(before, buffer, size));
+	check_bound_encoding(tlv, buffer, size);
+
+	un = tlv_set_value(un, 8, "\x01\x02\x03\x04\x05\x06\x07\x08");
+	date = tlv_set_value(date, 3, "\x16\x02\x29");
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(terminal_data) + 4);
+	check_bound_encoding(tlv, buffer, size);
+
+	/* The length field of the template would grow, so the whole record
+	 * is encoded again by the next tlv_encode_bind.		      */
+	un = tlv_set_value(un, sizeof(large), large);
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	check_bound_encoding(tlv, buffer, size);
+
+	un = tlv_set_value(un, 0, NULL);
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	check_bound_encoding(tlv, buffer, size);
+
+	/* So are structural changes.					      */
+	tlv_insert_after(tlv, tlv_new(tag_9f21, 3, "\x12\x00\x00"));
+	tlv_free(tlv_unlink(date));
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	check_bound_encoding(tlv, buffer, size);
+
+	un = tlv_set_value(un, sizeof(unpredictable_number),
+							 unpredictable_number);
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	check_bound_encoding(tlv, buffer, size);
+
+	/* Unbound nodes leave the buffer alone.			      */
+	tlv_encode_unbind(tlv);
+	memcpy(before, buffer, sizeof(before));
+	tlv_set_value(un, 4, "\xFF\xFF\xFF\xFF");
+	ck_assert(!memcmp(before, buffer, sizeof(before)));
+
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	check_bound_encoding(tlv, buffer, size);
+
+	tlv_free(tlv);
+
+	/* Borrowed nodes move on their first tlv_set_value, and stay bound. */
+	rc = tlv_view_parse(terminal_data, sizeof(terminal_data), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+	size = sizeof(buffer);
+	rc = tlv_encode_bind(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+
+	un = tlv_find(tlv_get_child(tlv_get_next(tlv)), "\x9F\x37");
+	date = tlv_get_next(un);
+	un = tlv_set_value(un, sizeof(unpredictable_number),
+							 unpredictable_number);
+	date = tlv_set_value(date, 3, "\x17\x12\x24");
+	ck_assert(!memcmp(&buffer[11], unpredictable_number,
+						 sizeof(unpredictable_number)));
+	ck_assert(!memcmp(&buffer[17], "\x17\x12\x24", 3));
+	check_bound_encoding(tlv, buffer, size);
+
+	tlv_free(tlv);
+}
+END_TEST
+
+START_TEST(test_tlv_new_reserve)
+{
+	const uint8_t tag_9f37[] = { 0x9F, 0x37 }, tag_9a[] = { 0x9A };
+	const uint8_t tag_bf0c[] = { 0xBF, 0x0C };
+	const uint8_t expected[] = {
+		0xBF, 0x0C, 0x0A,
+			0x9F, 0x37, 0x04, 0x01, 0x02, 0x03, 0x04,
+			0x9A, 0x01, 0x26
+	};
+	uint8_t buffer[64], value[16];
+	struct tlv *tlv = NULL, *un = NULL, *date = NULL, *node = NULL;
+	size_t size = sizeof(buffer), length;
+	int rc;
+
+	memset(value, 0x5A, sizeof(value));
+
+	tlv = tlv_new(tag_bf0c, 0, NULL);
+	un = tlv_insert_below(tlv, tlv_new_reserve(tag_9f37, 8));
+	date = tlv_insert_after(un, tlv_new(tag_9a, 3, "\x26\x10\x17"));
+	ck_assert(un && date && tlv_get_child(tlv) == un);
+
+	length = sizeof(value);
+	ck_assert(tlv_view_value(un, &length) && length == 0);
+
+	/* Values within the capacity never move the node.		      */
+	for (length = 0; length <= 8; length++)
+		ck_assert(tlv_set_value(un, length, value) == un);
+	ck_assert(tlv_set_value(un, 4, "\x01\x02\x03\x04") == un);
+
+	ck_assert(tlv_set_value(date, 1, "\x26") == date);
+	ck_assert(tlv_set_value(date, 3, "\x26\x10\x17") == date);
+	ck_assert(tlv_set_value(date, 1, "\x26") == date);
+
+	rc = tlv_encode(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(expected));
+	ck_assert(!memcmp(buffer, expected, size));
+
+	/* Growing beyond the capacity at least doubles it.		      */
+	node = tlv_set_value(un, 9, value);
+	ck_assert(node && tlv_get_child(tlv) == node);
+	ck_assert(tlv_get_next(node) == date && tlv_get_parent(node) == tlv);
+	ck_assert(tlv_set_value(node, 16, value) == node);
+
+	length = 0;
+	ck_assert(tlv_view_value(node, &length) && length == 16);
+	ck_assert(!memcmp(tlv_view_value(node, &length), value, length));
+
+	tlv_free(tlv);
+}
+END_TEST
+
+START_TEST(test_tlv_lazy_parse)
+{
+	const uint8_t fci[] = {
+		0x6F, 0x1A,
+			0x84, 0x07, 0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10,
+			0xA5, 0x0F,
+				0x50, 0x04, 0x56, 0x49, 0x53, 0x41,
+				0xBF, 0x0C, 0x06,
+					0x9F, 0x4D, 0x02, 0x0B, 0x0A,
+					0x00,
+		/* A proprietary template with malformed content.	      */
+		0xE1, 0x03, 0x9F, 0x4B, 0x05
+	};
+	const uint8_t tag_50[] = { 0x50 }, tag_9f4d[] = { 0x9F, 0x4D };
+	const uint8_t tag_87[] = { 0x87 };
+	uint8_t buffer[64], copy_buffer[sizeof(fci)];
+	struct tlv *tlv = NULL, *node = NULL, *copy = NULL;
+	struct libtlv_ctx *ctx = NULL;
+	size_t size = sizeof(buffer), count = 0, offset = 0;
+	int rc;
+
+	/* Unlike a full parse, a lazy parse does not look into 'E1'.	      */
+	rc = tlv_parse(fci, sizeof(fci), &tlv);
+	ck_assert(rc != TLV_RC_OK);
+
+	rc = tlv_lazy_parse(fci, sizeof(fci), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	/* Encoding does not need to expand anything.			      */
+	rc = tlv_encode(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(fci));
+	ck_assert(!memcmp(buffer, fci, size));
+
+	memcpy(copy_buffer, fci, sizeof(fci));
+	rc = tlv_lazy_parse(copy_buffer, sizeof(copy_buffer), &copy);
+	ck_assert(rc == TLV_RC_OK);
+	node = tlv_copy(copy);
+	tlv_free(copy);
+	copy = node;
+	memset(copy_buffer, 0, sizeof(copy_buffer));
+
+	/* The first access to the children expands a node.		      */
+	node = tlv_deep_find(tlv, tag_9f4d);
+	ck_assert(node);
+	ck_assert(!memcmp(tlv_view_value(node, &size), "\x0B\x0A", 2));
+	ck_assert(tlv_get_parent(tlv_get_parent(node)) ==
+				    tlv_find(tlv_get_child(tlv), "\xA5"));
+	ck_assert(tlv_find(tlv_get_child(tlv_get_parent(node)), tag_50) ==
+								  NULL);
+
+	for (node = tlv; node; node = tlv_iterate(node))
+		count++;
+	ck_assert(count == 7);
+
+	/* A malformed value leaves the node without children.	      */
+	node = tlv_get_next(tlv);
+	ck_assert(!tlv_get_child(node) && !tlv_is_constructed(node));
+
+	size = sizeof(buffer);
+	rc = tlv_encode(tlv, buffer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == sizeof(fci) - 1);
+
+	/* Copies of lazy nodes own their encoded children.		      */
+	node = tlv_deep_find(copy, tag_50);
+	ck_assert(node);
+	ck_assert(!memcmp(tlv_view_value(node, &size), "VISA", 4));
+
+	/* New children are added to the expanded ones.		      */
+	tlv_free(tlv);
+	rc = tlv_lazy_parse(fci, sizeof(fci), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+	node = tlv_find(tlv_get_child(tlv), "\xA5");
+	tlv_insert_below(node, tlv_new(tag_87, 1, "\x01"));
+	ck_assert(tlv_find(tlv_get_child(node), tag_50));
+	ck_assert(tlv_deep_find(node, tag_9f4d));
+
+	/* Nodes are expanded with the limits of the context they were parsed
+	 * with, which also records failures.  The default context does not.  */
+	ctx = libtlv_ctx_new(NULL);
+	ck_assert(ctx);
+	libtlv_ctx_set_max_depth(ctx, 2);
+
+	tlv_free(copy);
+	rc = tlv_lazy_parse_ctx(ctx, fci, sizeof(fci), &copy);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(libtlv_ctx_get_error(ctx, NULL) == TLV_RC_OK);
+
+	node = tlv_find(tlv_get_child(copy), "\xA5");
+	ck_assert(tlv_find(tlv_get_child(node), tag_50));
+	node = tlv_find(tlv_get_child(node), "\xBF\x0C");
+	ck_assert(node && !tlv_get_child(node));
+	ck_assert(libtlv_ctx_get_error(ctx, &offset) ==
+						    TLV_RC_MAX_DEPTH_EXCEEDED);
+
+	node = tlv_get_next(copy);
+	ck_assert(!tlv_get_child(node));
+	ck_assert(libtlv_ctx_get_error(ctx, &offset) ==
+					      TLV_RC_UNEXPECTED_END_OF_STREAM);
+	ck_assert(offset == 3);
+
+	ck_assert(libtlv_ctx_get_error(libtlv_get_default_ctx(), NULL) ==
+								    TLV_RC_OK);
+
+	tlv_free(copy);
+	tlv_free(tlv);
+	libtlv_ctx_free(ctx);
+}
+END_TEST
+
+struct scan_log {
+	char	text[256];
+	size_t	len;
+	size_t	limit;
+};
+
+static int scan_record(void *priv, const struct tlv_record *record)
+{
+	struct scan_log *log = (struct scan_log *)priv;
+	char hex[64];
+
+	if (log->limit && !--log->limit)
+		return TLV_RC_IO_ERROR;
+
+	libtlv_bin_to_hex(record->tag, record->header_length, hex);
+	log->len += snprintf(&log->text[log->len], sizeof(log->text) - log->len,
+			       "%u:%s%s:%d ", record->depth, hex,
+			   record->constructed ? "*" : "", (int)record->length);
+	return TLV_RC_OK;
+}
+
+START_TEST(test_tlv_validate)
+{
+	const uint8_t fci[] = {
+		0x00, 0x6F, 0x13,
+			0x84, 0x02, 0xA0, 0x00,
+			0xA5, 0x0D,
+				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+				0x00, 0x00,
+				0x50, 0x01, 0x41,
+		0x00, 0x00
+	};
+	const uint8_t *malformed[] = {
+		(const uint8_t *)"\x6F\x05\x84\x04\xA0\x00",
+		(const uint8_t *)"\x6F\x02\x84\x80",
+		(const uint8_t *)"\x9F\x82\x83\x84\x85\x86\x87\x88\x89\x01",
+		(const uint8_t *)"\x84\x84\xFF\xFF\xFF\xFF",
+		(const uint8_t *)"\x6F\x01\x9F",
+	};
+	const size_t malformed_len[] = { 6, 4, 10, 6, 3 };
+	struct tlv_limits limits;
+	struct tlv_parse_ctx ctx;
+	struct scan_log log;
+	struct tlv *tlv = NULL;
+	size_t offset = 0;
+	int i, rc;
+
+	rc = tlv_validate(fci, sizeof(fci), NULL, &offset);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(offset == 0);
+
+	memset(&log, 0, sizeof(log));
+	rc = tlv_scan(fci, sizeof(fci), NULL, scan_record, &log, NULL);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(!strcmp(log.text,
+			      "0:6F13*:19 1:8402:2 1:A50D*:13 2:5001:1 "));
+
+	/* Malformed data fails with the same code and at the same offset as
+	 * it does when parsed.						      */
+	memset(&ctx, 0, sizeof(ctx));
+	for (i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+		rc = tlv_validate(malformed[i], malformed_len[i], NULL,
+								      &offset);
+		ck_assert(rc != TLV_RC_OK);
+		ck_assert(tlv_parse_r(malformed[i], malformed_len[i], &tlv,
+							       &ctx) == rc);
+		ck_assert(ctx.offset == offset);
+	}
+
+	memset(&limits, 0, sizeof(limits));
+	limits.max_nodes = 3;
+	rc = tlv_validate(fci, sizeof(fci), &limits, &offset);
+	ck_assert(rc == TLV_RC_TOO_MANY_NODES);
+	ck_assert(offset == 19);
+
+	memset(&limits, 0, sizeof(limits));
+	limits.max_value_length = 1;
+	rc = tlv_validate(fci, sizeof(fci), &limits, &offset);
+	ck_assert(rc == TLV_RC_VALUE_LENGTH_TOO_LARGE);
+	ck_assert(offset == 5);
+
+	memset(&limits, 0, sizeof(limits));
+	limits.max_depth = 1;
+	rc = tlv_validate(fci, sizeof(fci), &limits, &offset);
+	ck_assert(rc == TLV_RC_MAX_DEPTH_EXCEEDED);
+	ck_assert(offset == 9);
+
+	/* The callback may stop the scan.				      */
+	memset(&log, 0, sizeof(log));
+	log.limit = 3;
+	rc = tlv_scan(fci, sizeof(fci), NULL, scan_record, &log, &offset);
+	ck_assert(rc == TLV_RC_IO_ERROR);
+	ck_assert(offset == 9);
+	ck_assert(!strcmp(log.text, "0:6F13*:19 1:8402:2 "));
+}
+END_TEST
+
+START_TEST(test_tlv_path)
+{
+	const uint8_t ppse[] = {
+		0x6F, 0x27,
+			0x84, 0x02, 0x32, 0x50,
+			0xA5, 0x21,
+				0xBF, 0x0C, 0x1E,
+					0x61, 0x09,
+						0x4F, 0x02, 0xA0, 0x01,
+						0x87, 0x01, 0x01,
+						0x00, 0x00,
+					0x9F, 0x0A, 0x01, 0x00,
+					0x61, 0x07,
+						0x4F, 0x02, 0xA0, 0x02,
+						0x87, 0x01, 0x02,
+					/* Not looked into by the path.	      */
+					0x62, 0x04, 0x9F, 0x9F, 0x9F, 0x9F,
+		0x6F, 0x02, 0x84, 0x00
+	};
+	const char *invalid[] = {
+		"", "6F/", "/6F", "6F//A5", "6F*A5", "9F", "9F0", "6F/XY",
+		"6F/A5/BF0C/61/4F/01/02/03/04/05/06/07/08/09/10/11/12"
+	};
+	struct tlv_path *path = NULL;
+	struct scan_log log;
+	int i, rc;
+
+	for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		rc = tlv_path_compile(invalid[i], &path);
+		ck_assert(rc == TLV_RC_INVALID_ARG);
+		ck_assert(!path);
+	}
+
+	rc = tlv_path_compile("6F/A5/BF0C/61*/4F", &path);
+	ck_assert(rc == TLV_RC_OK);
+
+	memset(&log, 0, sizeof(log));
+	rc = tlv_path_eval(path, ppse, sizeof(ppse), scan_record, &log);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(!strcmp(log.text, "4:4F02:2 4:4F02:2 "));
+	tlv_path_free(path);
+
+	/* Only the first '6F' is looked into.			      */
+	rc = tlv_path_compile("6f/84", &path);
+	ck_assert(rc == TLV_RC_OK);
+
+	memset(&log, 0, sizeof(log));
+	rc = tlv_path_eval(path, ppse, sizeof(ppse), scan_record, &log);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(!strcmp(log.text, "1:8402:2 "));
+	tlv_path_free(path);
+
+	rc = tlv_path_compile("6F*/A5/BF0C/61*", &path);
+	ck_assert(rc == TLV_RC_OK);
+
+	memset(&log, 0, sizeof(log));
+	rc = tlv_path_eval(path, ppse, sizeof(ppse), scan_record, &log);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(!strcmp(log.text, "3:6109*:9 3:6107*:7 "));
+
+	/* The callback may stop the evaluation.			      */
+	memset(&log, 0, sizeof(log));
+	log.limit = 2;
+	rc = tlv_path_eval(path, ppse, sizeof(ppse), scan_record, &log);
+	ck_assert(rc == TLV_RC_IO_ERROR);
+	ck_assert(!strcmp(log.text, "3:6109*:9 "));
+
+	/* Headers along the path are checked.				      */
+	rc = tlv_path_eval(path, ppse, sizeof(ppse) - 1, scan_record, &log);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+	tlv_path_free(path);
+}
+END_TEST
+
+START_TEST(test_tlv_extract)
+{
+	const uint8_t resp[] = {
+		0x9F, 0x27, 0x01, 0x80,
+		0x00,
+		0x71, 0x03, 0x86, 0x01, 0x01,
+		0x91, 0x02, 0x12, 0x34,
+		0x9F, 0x27, 0x01, 0x40,
+		0x5A, 0x80
+	};
+	const tlv_key_t keys[] = {
+		0x91u, 0x71u, 0x72u, 0x9F27u, 0x91u
+	};
+	const size_t num_keys = sizeof(keys) / sizeof(keys[0]);
+	struct tlv_slice slices[5];
+	struct tlv *tlv = NULL;
+	int rc;
+
+	/* The malformed data object at the end is never looked at.	      */
+	rc = tlv_extract_buffer(resp, sizeof(resp), keys, 2, slices);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(slices[0].present && slices[1].present);
+	ck_assert(slices[0].data == &resp[10] && slices[0].size == 4);
+	ck_assert(slices[0].value == &resp[12] && slices[0].length == 2);
+	ck_assert(slices[1].data == &resp[5] && slices[1].size == 5);
+
+	rc = tlv_extract_buffer(resp, sizeof(resp), keys, num_keys, slices);
+	ck_assert(rc == TLV_RC_INDEFINITE_LENGTH_NOT_SUPPORTED);
+
+	rc = tlv_extract_buffer(resp, sizeof(resp) - 2, keys, num_keys, slices);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(!slices[2].present && !slices[2].data && !slices[2].size);
+	ck_assert(slices[3].value == &resp[3]);
+	ck_assert(slices[4].data == slices[0].data);
+
+	rc = tlv_parse(resp, sizeof(resp) - 2, &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	rc = tlv_extract(tlv, keys, num_keys, slices);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(slices[0].tlv == tlv_find(tlv, "\x91"));
+	ck_assert(!memcmp(slices[0].value, "\x12\x34", slices[0].length));
+	ck_assert(slices[1].tlv == tlv_find(tlv, "\x71"));
+	ck_assert(!slices[1].value && !slices[1].data);
+	ck_assert(!slices[2].present && !slices[2].tlv);
+	ck_assert(slices[3].tlv == tlv && slices[3].value[0] == 0x80);
+	ck_assert(slices[4].tlv == slices[0].tlv);
+
+	tlv_free(tlv);
+}
+END_TEST
+
+START_TEST(test_tlv_writer)
+{
+	uint8_t value[300], buffer[1024], expected[1024];
+	struct tlv *tlv = NULL, *node = NULL;
+	size_t size = 0, expected_sz = sizeof(expected);
+	struct tlv_writer writer;
+	int rc, i;
+
+	for (i = 0; i < sizeof(value); i++)
+		value[i] = (uint8_t)i;
+
+	/* Content lengths that need one, two and three length octets.	      */
+	tlv = tlv_new("\x70", 0, NULL);
+	node = tlv_insert_below(tlv, tlv_new("\xA5", 0, NULL));
+	node = tlv_insert_below(node, tlv_new("\x9F\x38", 3, value));
+	node = tlv_insert_after(node, tlv_new("\xBF\x0C", 0, NULL));
+	tlv_insert_below(node, tlv_new("\x50", 200, value));
+	node = tlv_insert_after(node, tlv_new("\xE1", 0, NULL));
+	tlv_insert_after(tlv_get_parent(node), tlv_new("\x5A", 300, value));
+	rc = tlv_encode(tlv, expected, &expected_sz);
+	ck_assert(rc == TLV_RC_OK);
+	tlv_free(tlv);
+
+	tlv_writer_init(&writer, buffer, sizeof(buffer));
+	tlv_writer_begin_constructed(&writer, "\x70");
+	tlv_writer_begin_constructed(&writer, "\xA5");
+	tlv_writer_put_primitive(&writer, "\x9F\x38", value, 3);
+	tlv_writer_begin_constructed(&writer, "\xBF\x0C");
+	tlv_writer_put_primitive(&writer, "\x50", value, 200);
+	tlv_writer_end(&writer);
+	tlv_writer_begin_constructed(&writer, "\xE1");
+	tlv_writer_end(&writer);
+	tlv_writer_end(&writer);
+	tlv_writer_put_encoded(&writer, &expected[expected_sz - 304], 304);
+	rc = tlv_writer_end(&writer);
+	ck_assert(rc == TLV_RC_OK);
+	rc = tlv_writer_finish(&writer, &size);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(size == expected_sz);
+	ck_assert(!memcmp(buffer, expected, size));
+
+	/* Without a buffer, the writer tells the required size.	      */
+	tlv_writer_init(&writer, NULL, 0);
+	tlv_writer_begin_constructed(&writer, "\x70");
+	tlv_writer_put_primitive(&writer, "\x5A", value, 300);
+	tlv_writer_end(&writer);
+	rc = tlv_writer_finish(&writer, &size);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+	ck_assert(size == 1 + 3 + 1 + 3 + 300);
+
+	tlv_writer_init(&writer, buffer, 10);
+	tlv_writer_put_primitive(&writer, "\x5A", value, 8);
+	rc = tlv_writer_put_primitive(&writer, "\x5A", value, 1);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+	rc = tlv_writer_finish(&writer, &size);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+	ck_assert(size == 13);
+
+	/* Constructed data objects have to be balanced.		      */
+	tlv_writer_init(&writer, buffer, sizeof(buffer));
+	rc = tlv_writer_end(&writer);
+	ck_assert(rc == TLV_RC_INVALID_ARG);
+
+	tlv_writer_init(&writer, buffer, sizeof(buffer));
+	tlv_writer_begin_constructed(&writer, "\x70");
+	rc = tlv_writer_finish(&writer, &size);
+	ck_assert(rc == TLV_RC_INVALID_ARG);
+
+	tlv_writer_init(&writer, buffer, sizeof(buffer));
+	for (i = 0; i < TLV_WRITER_MAX_DEPTH; i++)
+		tlv_writer_begin_constructed(&writer, "\x70");
+	rc = tlv_writer_begin_constructed(&writer, "\x70");
+	ck_assert(rc == TLV_RC_MAX_DEPTH_EXCEEDED);
+}
+END_TEST
+
+START_TEST(test_dol_plan)
+{
+	const struct tlv_id_to_fmt fmts[] = {
+		{ .id = "\x5A",     .fmt = fmt_cn },
+		{ .id = "\x70",     .fmt = fmt_n  },
+		{ .id = "\x9F\x02", .fmt = fmt_n  },
+		{ .id = "\x9F\x1A", .fmt = fmt_n  },
+		{ .id = NULL }
+	};
+	const uint8_t data[] = {
+		0x5A, 0x08, 0x54, 0x13, 0x33, 0x00, 0x89, 0x02, 0x00, 0x13,
+		0x9F, 0x02, 0x04, 0x00, 0x00, 0x12, 0x34,
+		0x9F, 0x1A, 0x03, 0x00, 0x02, 0x80,
+		0x9F, 0x37, 0x04, 0xDE, 0xAD, 0xBE, 0xEF,
+		0xA5, 0x06,
+			0x50, 0x04, 0x56, 0x49, 0x53, 0x41,
+		0x70, 0x05,
+			0x9F, 0x10, 0x02, 0x01, 0x02
+	};
+	/* cn padded, n padded, n truncated, b truncated, missing, and
+	 * constructed data elements padded and truncated on either side.     */
+	const uint8_t dol[] = {
+		0x5A, 0x0A, 0x9F, 0x02, 0x06, 0x9F, 0x1A, 0x02, 0x9F, 0x37,
+		0x02, 0x9F, 0x66, 0x04, 0xA5, 0x08, 0xA5, 0x03, 0x70, 0x07,
+		0x70, 0x03
+	};
+	const uint8_t expected[] = {
+		0x54, 0x13, 0x33, 0x00, 0x89, 0x02, 0x00, 0x13, 0xFF, 0xFF,
+		0x00, 0x00, 0x00, 0x00, 0x12, 0x34,
+		0x02, 0x80,
+		0xDE, 0xAD,
+		0x00, 0x00, 0x00, 0x00,
+		0x50, 0x04, 0x56, 0x49, 0x53, 0x41, 0x00, 0x00,
+		0x50, 0x04, 0x56,
+		0x00, 0x00, 0x9F, 0x10, 0x02, 0x01, 0x02,
+		0x02, 0x01, 0x02
+	};
+	const struct dol_plan *cached = NULL, *other = NULL;
+	uint8_t del[sizeof(expected)], ref[sizeof(expected)];
+	struct dol_plan_cache *cache = NULL;
+	struct dol_plan *plan = NULL;
+	struct tlv *tlv = NULL;
+	size_t del_sz, ref_sz, i;
+	uint8_t many[3];
+	int rc;
+
+	ck_assert(libtlv_register_fmts(fmts) == TLV_RC_OK);
+
+	rc = tlv_parse(data, sizeof(data), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	rc = dol_compile(dol, sizeof(dol), &plan);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(dol_plan_get_del_size(plan) == sizeof(expected));
+
+	del_sz = sizeof(del) - 1;
+	rc = dol_plan_fill(plan, tlv, del, &del_sz);
+	ck_assert(rc == TLV_RC_BUFFER_OVERFLOW);
+	ck_assert(del_sz == sizeof(expected));
+
+	memset(del, 0xCC, sizeof(del));
+	del_sz = sizeof(del);
+	rc = dol_plan_fill(plan, tlv, del, &del_sz);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(del_sz == sizeof(expected));
+	ck_assert(!memcmp(del, expected, sizeof(expected)));
+
+	ref_sz = sizeof(ref);
+	rc = tlv_and_dol_to_del(tlv, dol, sizeof(dol), ref, &ref_sz);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(ref_sz == del_sz);
+	ck_assert(!memcmp(del, ref, ref_sz));
+
+	rc = dol_compile("\x9F\x02", 2, &plan);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+	rc = dol_compile("\x9F", 1, &plan);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+
+	/* Equal DOLs share a plan, also after the cache had to grow.	      */
+	cache = dol_plan_cache_new();
+	ck_assert(cache);
+
+	rc = dol_plan_cache_get(cache, dol, sizeof(dol), &cached);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(dol_plan_get_hash(cached) == dol_plan_get_hash(plan));
+
+	for (i = 0; i < 100; i++) {
+		many[0] = 0x9Fu;
+		many[1] = (uint8_t)i;
+		many[2] = 0x04u;
+		rc = dol_plan_cache_get(cache, many, sizeof(many), &other);
+		ck_assert(rc == TLV_RC_OK);
+		ck_assert(other != cached);
+		ck_assert(dol_plan_get_del_size(other) == 4);
+	}
+
+	rc = dol_plan_cache_get(cache, dol, sizeof(dol), &other);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(other == cached);
+
+	rc = dol_plan_cache_get(cache, "\x9F", 1, &other);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+
+	dol_plan_cache_free(cache);
+	dol_plan_free(plan);
+	tlv_free(tlv);
+	libtlv_free_fmts();
+}
+END_TEST
+
+START_TEST(test_tlv_bcd)
+{
+	const uint8_t amount[6] = { 0x00, 0x00, 0x00, 0x12, 0x34, 0x56 };
+	const uint8_t max[10] = {
+		0x18, 0x44, 0x67, 0x44, 0x07, 0x37, 0x09, 0x55, 0x16, 0x15
+	};
+	const uint8_t too_large[10] = {
+		0x18, 0x44, 0x67, 0x44, 0x07, 0x37, 0x09, 0x55, 0x16, 0x16
+	};
+	const uint8_t column[3][2] = {
+		{ 0x00, 0x01 }, { 0x99, 0x99 }, { 0x12, 0x3A }
+	};
+	const uint64_t values[3] = { 1, 9999, 10000 };
+	uint8_t bcd[10], out[3][2];
+	uint64_t u64 = 0, u64s[3];
+	size_t i;
+
+	ck_assert(libtlv_bcd_to_u64(amount, sizeof(amount), &u64) == TLV_RC_OK);
+	ck_assert(u64 == 123456);
+	ck_assert(libtlv_bcd_to_u64(amount, 0, &u64) == TLV_RC_OK);
+	ck_assert(u64 == 0);
+	ck_assert(libtlv_bcd_to_u64(max, sizeof(max), &u64) == TLV_RC_OK);
+	ck_assert(u64 == UINT64_MAX);
+	ck_assert(libtlv_bcd_to_u64(too_large, sizeof(too_large), &u64) ==
+						     TLV_RC_VALUE_OUT_OF_RANGE);
+	ck_assert(libtlv_bcd_to_u64("\x1A", 1, &u64) == TLV_RC_INVALID_ARG);
+	ck_assert(libtlv_bcd_to_u64("\xA1", 1, &u64) == TLV_RC_INVALID_ARG);
+	ck_assert(libtlv_bcd_to_u64(NULL, 1, &u64) == TLV_RC_INVALID_ARG);
+
+	ck_assert(libtlv_u64_to_bcd(123456, bcd, 6) == TLV_RC_OK);
+	ck_assert(!memcmp(bcd, amount, sizeof(amount)));
+	ck_assert(libtlv_u64_to_bcd(UINT64_MAX, bcd, 10) == TLV_RC_OK);
+	ck_assert(!memcmp(bcd, max, sizeof(max)));
+	ck_assert(libtlv_u64_to_bcd(100, bcd, 1) == TLV_RC_VALUE_OUT_OF_RANGE);
+	ck_assert(bcd[0] == 0x00);
+
+	/* Every value of a byte round trips.				      */
+	for (i = 0; i < 100; i++) {
+		ck_assert(libtlv_u64_to_bcd(i, bcd, 1) == TLV_RC_OK);
+		ck_assert(bcd[0] == (((i / 10) << 4) | (i % 10)));
+		ck_assert(libtlv_bcd_to_u64(bcd, 1, &u64) == TLV_RC_OK);
+		ck_assert(u64 == i);
+	}
+
+	ck_assert(libtlv_bcd_to_u64_n(column, 2, u64s, 2) == TLV_RC_OK);
+	ck_assert(u64s[0] == 1 && u64s[1] == 9999);
+	ck_assert(libtlv_bcd_to_u64_n(column, 2, u64s, 3) ==
+							    TLV_RC_INVALID_ARG);
+	ck_assert(u64s[2] == 0);
+
+	ck_assert(libtlv_u64_to_bcd_n(values, 2, out, 2) == TLV_RC_OK);
+	ck_assert(!memcmp(out, column, 2 * sizeof(out[0])));
+	ck_assert(libtlv_u64_to_bcd_n(values, 3, out, 2) ==
+						     TLV_RC_VALUE_OUT_OF_RANGE);
+}
+END_TEST
+
+static bool fmts_reader_stop;
+
+static void *fmts_reader(void *arg)
+{
+	size_t *errors = (size_t *)arg;
+
+	while (!__atomic_load_n(&fmts_reader_stop, __ATOMIC_RELAXED)) {
+		if (libtlv_id_to_fmt("\x5F\x20") != fmt_ans)
+			(*errors)++;
+		if (libtlv_id_to_fmt("\x9A") != fmt_n)
+			(*errors)++;
+	}
+
+	return NULL;
+}
+
+START_TEST(test_tlv_fmts)
+{
+	const struct tlv_id_to_fmt fmts[] = {
+		{ .id = "\x9A",	 .fmt = fmt_n	},
+		{ .id = "\x5F\x20",	 .fmt = fmt_ans },
+		{ .id = "\x9F\x02",	 .fmt = fmt_n	},
+		{ .id = "\x5A",	 .fmt = fmt_cn	},
+		{ .id = "\xDF\x81\x01", .fmt = fmt_b	},
+		{ .id = NULL }
+	};
+	const struct tlv_id_to_fmt more[] = {
+		{ .id = "\x9F\x1A",	 .fmt = fmt_n	},
+		{ .id = "\x5A",	 .fmt = fmt_cn	},
+		{ .id = NULL }
+	};
+	struct tlv_id_to_fmt many[129];
+	uint8_t ids[128][2];
+	pthread_t reader;
+	size_t errors = 0;
+	int i, frozen;
+
+	for (frozen = 0; frozen < 2; frozen++) {
+		ck_assert(libtlv_register_fmts(fmts) == TLV_RC_OK);
+		if (frozen)
+			ck_assert(libtlv_fmts_freeze() == TLV_RC_OK);
+
+		ck_assert(libtlv_id_to_fmt("\x9A") == fmt_n);
+		ck_assert(libtlv_id_to_fmt("\x5F\x20") == fmt_ans);
+		ck_assert(libtlv_id_to_fmt("\x9F\x02") == fmt_n);
+		ck_assert(libtlv_id_to_fmt("\x5A") == fmt_cn);
+		ck_assert(libtlv_id_to_fmt("\xDF\x81\x01") == fmt_b);
+		ck_assert(libtlv_id_to_fmt("\xDF\x81") == fmt_unknown);
+		ck_assert(libtlv_id_to_fmt("\x9F\x1A") == fmt_unknown);
+		ck_assert(libtlv_key_to_fmt(0x9F02u) == fmt_n);
+		ck_assert(libtlv_key_to_fmt(0x9Fu) == fmt_unknown);
+
+		/* Registrations after freezing are visible right away.	      */
+		ck_assert(libtlv_register_fmts(more) == TLV_RC_OK);
+		ck_assert(libtlv_id_to_fmt("\x9F\x1A") == fmt_n);
+		ck_assert(libtlv_id_to_fmt("\x5A") == fmt_cn);
+
+		libtlv_free_fmts();
+		ck_assert(libtlv_id_to_fmt("\x9A") == fmt_unknown);
+	}
+
+	/* Readers may run concurrently with updates, whether the registry is
+	 * frozen or not.						      */
+	for (frozen = 0; frozen < 2; frozen++) {
+		ck_assert(libtlv_register_fmts(fmts) == TLV_RC_OK);
+		if (frozen)
+			ck_assert(libtlv_fmts_freeze() == TLV_RC_OK);
+
+		__atomic_store_n(&fmts_reader_stop, false, __ATOMIC_RELAXED);
+		ck_assert(pthread_create(&reader, NULL, fmts_reader,
+							       &errors) == 0);
+
+		for (i = 0; i < 128; i++) {
+			ids[i][0] = 0xDFu;
+			ids[i][1] = (uint8_t)i;
+			many[0].id = ids[i];
+			many[0].fmt = fmt_b;
+			many[1].id = NULL;
+			ck_assert(libtlv_register_fmts(many) == TLV_RC_OK);
+		}
+
+		__atomic_store_n(&fmts_reader_stop, true, __ATOMIC_RELAXED);
+		pthread_join(reader, NULL);
+		ck_assert(errors == 0);
+		ck_assert(libtlv_id_to_fmt("\xDF\x7F") == fmt_b);
+
+		libtlv_free_fmts();
+	}
+}
+END_TEST
+
+START_TEST(test_libtlv_ctx)
+{
+	const struct tlv_id_to_fmt fmts_n[] = {
+		{ .id = "\x9F\x02", .fmt = fmt_n },
+		{ .id = NULL }
+	};
+	const struct tlv_id_to_fmt fmts_b[] = {
+		{ .id = "\x9F\x02", .fmt = fmt_b },
+		{ .id = NULL }
+	};
+	const uint8_t data[] = { 0x9F, 0x02, 0x02, 0x12, 0x34 };
+	const uint8_t dol[] = { 0x9F, 0x02, 0x04 };
+	const uint8_t del_n[] = { 0x00, 0x00, 0x12, 0x34 };
+	const uint8_t del_b[] = { 0x12, 0x34, 0x00, 0x00 };
+	const uint8_t nested[] = { 0x70, 0x04, 0x70, 0x02, 0x5A, 0x00 };
+	const uint8_t truncated[] = { 0x5A, 0x01, 0x00, 0x9F, 0x02, 0x05 };
+	struct libtlv_ctx *ctx_n = NULL, *ctx_b = NULL;
+	struct tlv_arena *arena = NULL;
+	struct tlv *tlv = NULL, *out = NULL;
+	uint8_t del[4];
+	size_t del_sz = sizeof(del), offset = 0;
+	int rc;
+
+	ctx_n = libtlv_ctx_new("libtlv_test.n");
+	ck_assert(ctx_n != NULL);
+	ctx_b = libtlv_ctx_new(NULL);
+	ck_assert(ctx_b != NULL);
+	ck_assert(libtlv_get_default_ctx() != NULL);
+
+	/* Each context has a registry of its own.			      */
+	ck_assert(libtlv_register_fmts_ctx(ctx_n, fmts_n) == TLV_RC_OK);
+	ck_assert(libtlv_register_fmts_ctx(ctx_b, fmts_b) == TLV_RC_OK);
+	ck_assert(libtlv_fmts_freeze_ctx(ctx_b) == TLV_RC_OK);
+	ck_assert(libtlv_id_to_fmt_ctx(ctx_n, "\x9F\x02") == fmt_n);
+	ck_assert(libtlv_id_to_fmt_ctx(ctx_b, "\x9F\x02") == fmt_b);
+	ck_assert(libtlv_key_to_fmt_ctx(ctx_b, 0x9F02u) == fmt_b);
+	ck_assert(libtlv_id_to_fmt("\x9F\x02") == fmt_unknown);
+
+	rc = tlv_parse_ctx(ctx_n, data, sizeof(data), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(libtlv_ctx_get_error(ctx_n, &offset) == TLV_RC_OK);
+
+	rc = tlv_and_dol_to_del_ctx(ctx_n, tlv, dol, sizeof(dol), del, &del_sz);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(del_sz == sizeof(del_n) && !memcmp(del, del_n, del_sz));
+
+	del_sz = sizeof(del);
+	rc = tlv_and_dol_to_del_ctx(ctx_b, tlv, dol, sizeof(dol), del, &del_sz);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(del_sz == sizeof(del_b) && !memcmp(del, del_b, del_sz));
+
+	libtlv_get_dol_field_ctx(ctx_n, "\x9F\x02", "\x12\x34", 2, del, 4);
+	ck_assert(!memcmp(del, del_n, sizeof(del_n)));
+	tlv_free(tlv);
+
+	/* Parse errors are recorded in the context.			      */
+	rc = tlv_parse_ctx(ctx_n, truncated, sizeof(truncated), &tlv);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+	ck_assert(libtlv_ctx_get_error(ctx_n, &offset) == rc);
+	ck_assert(offset == 6);
+	ck_assert(libtlv_ctx_get_error(ctx_b, NULL) == TLV_RC_OK);
+
+	/* Unlike in the shared default context.			      */
+	rc = tlv_parse_ctx(NULL, truncated, sizeof(truncated), &tlv);
+	ck_assert(rc == TLV_RC_UNEXPECTED_END_OF_STREAM);
+	ck_assert(libtlv_ctx_get_error(NULL, NULL) == TLV_RC_OK);
+
+	/* So are parser limits.					      */
+	libtlv_ctx_set_max_depth(ctx_b, 1);
+	rc = tlv_parse_ctx(ctx_b, nested, sizeof(nested), &tlv);
+	ck_assert(rc == TLV_RC_MAX_DEPTH_EXCEEDED);
+	rc = tlv_parse(nested, sizeof(nested), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+	tlv_free(tlv);
+
+	/* With an arena, nodes are released together with the arena.	      */
+	arena = tlv_arena_new(0);
+	ck_assert(arena != NULL);
+	libtlv_ctx_set_arena(ctx_n, arena);
+
+	rc = tlv_shallow_parse_ctx(ctx_n, nested, sizeof(nested), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(!tlv_is_constructed(tlv));
+
+	rc = tlv_view_parse_ctx(ctx_n, data, sizeof(data), &tlv);
+	ck_assert(rc == TLV_RC_OK);
+
+	rc = dol_and_del_to_tlv_ctx(ctx_n, dol, sizeof(dol), del_n,
+						       sizeof(del_n), &out);
+	ck_assert(rc == TLV_RC_OK);
+	ck_assert(tlv_get_key(out) == 0x9F02u);
+
+	tlv_arena_free(arena);
+	libtlv_ctx_free(ctx_b);
+	libtlv_ctx_free(ctx_n);
+}
+END_TEST
+
+#define LOG_ASYNC_THREADS	4
+#define LOG_ASYNC_MESSAGES	1000
+
+static unsigned int log_async_written;
+
+static int log_async_append(log4c_appender_t *appender,
+				    const log4c_logging_event_t *event)
+{
+	(void)appender;
+
+	if (event->evt_priority == LOG4C_PRIORITY_NOTICE)
+		__atomic_add_fetch(&log_async_written, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static const log4c_appender_type_t log_async_appender_type = {
+	.name	= "libtlv_test_count",
+	.append	= log_async_append,
+};
+
+static void *log_async_thread(void *arg)
+{
+	const log4c_category_t *cat = (const log4c_category_t *)arg;
+	int i;
+
+	for (i = 0; i < LOG_ASYNC_MESSAGES; i++)
+		libtlv_log(cat, LOG4C_PRIORITY_NOTICE, "message %d", i);
+
+	return NULL;
+}
+
+START_TEST(test_tlv_log_async)
+{
+	log4c_category_t *cat = log4c_category_get("libtlv_test.async");
+	log4c_appender_t *appender = log4c_appender_get("libtlv_test_count");
+	pthread_t threads[LOG_ASYNC_THREADS];
+	uint64_t dropped = 0;
+	int i, rc;
+
+	log4c_appender_set_type(appender, &log_async_appender_type);
+	log4c_category_set_appender(cat, appender);
+	log4c_category_set_additivity(cat, 0);
+	log4c_category_set_priority(cat, LOG4C_PRIORITY_TRACE);
+
+	rc = libtlv_log_async_start(3);
+	ck_assert(rc == TLV_RC_INVALID_ARG);
+
+	/* Synchronous logging never drops.				      */
+	log_async_written = 0;
+	log_async_thread(cat);
+	ck_assert(log_async_written == LOG_ASYNC_MESSAGES);
+
+	/* Tiny rings make sure some messages are dropped.		      */
+	rc = libtlv_log_async_start(4);
+	ck_assert(rc == TLV_RC_OK);
+	rc = libtlv_log_async_start(0);
+	ck_assert(rc == TLV_RC_OK);
+	libtlv_log_async_stop();
+
+	log_async_written = 0;
+	dropped = libtlv_log_get_dropped();
+
+	for (i = 0; i < LOG_ASYNC_THREADS; i++) {
+		rc = pthread_create(&threads[i], NULL, log_async_thread, cat);
+		ck_assert(rc == 0);
+	}
+	for (i = 0; i < LOG_ASYNC_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	libtlv_log_async_stop();
+
+	dropped = libtlv_log_get_dropped() - dropped;
+	ck_assert(log_async_written + dropped ==
+				      LOG_ASYNC_THREADS * LOG_ASYNC_MESSAGES);
+	ck_assert(log_async_written > 0);
+
+	/* Threads may exit while logging is being stopped.		      */
+	rc = libtlv_log_async_start(0);
+	ck_assert(rc == TLV_RC_OK);
+
+	for (i = 0; i < LOG_ASYNC_THREADS; i++) {
+		rc = pthread_create(&threads[i], NULL, log_async_thread, cat);
+		ck_assert(rc == 0);
+	}
+
+	libtlv_log_async_stop();
+
+	for (i = 0; i < LOG_ASYNC_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Once stopped, messages are written right away again.		      */
+	log_async_written = 0;
+	libtlv_log(cat, LOG4C_PRIORITY_NOTICE, "message");
+	ck_assert(log_async_written == 1);
+}
+END_TEST
+
 Suite *tlv_test_suite(void)
 {
 	Suite *suite = NULL;
 	TCase *tc_tlv_malformed_input = NULL, *tc_tlv_primitive_encoding = NULL;
 	TCase *tc_tlv_constructed_encoding = NULL, *tc_tlv_verisign_x509 = NULL;
 	TCase *tc_tlv_construct = NULL, *tc_tlv_deep_find = NULL;
-	TCase *tc_tlv_set_value = NULL;
+	TCase *tc_tlv_set_value = NULL, *tc_tlv_arena = NULL;
+	TCase *tc_tlv_view_parse = NULL, *tc_tlv_parse_limits = NULL;
+	TCase *tc_tlv_parse_ctx = NULL, *tc_tlv_encode_cache = NULL;
+	TCase *tc_tlv_find_key = NULL, *tc_tlv_index = NULL;
+	TCase *tc_tlv_hex = NULL, *tc_tlv_stream_parser = NULL;
+	TCase *tc_tlv_copy = NULL, *tc_dol_plan = NULL;
+	TCase *tc_tlv_encode_prefix = NULL, *tc_tlv_log_async = NULL;
+	TCase *tc_tlv_fmts = NULL, *tc_libtlv_ctx = NULL, *tc_tlv_bcd = NULL;
+	TCase *tc_tlv_encode_iov = NULL, *tc_tlv_encode_bind = NULL;
+	TCase *tc_tlv_new_reserve = NULL, *tc_tlv_lazy_parse = NULL;
+	TCase *tc_tlv_validate = NULL, *tc_tlv_path = NULL;
+	TCase *tc_tlv_extract = NULL, *tc_tlv_writer = NULL;
 
 	suite = suite_create("tlv_test");
 
@@ -453,6 +2306,102 @@ Suite *tlv_test_suite(void)
 	tcase_add_test(tc_tlv_set_value, test_tlv_set_value);
 	suite_add_tcase(suite, tc_tlv_set_value);
 
+	tc_tlv_arena = tcase_create("tlv-arena");
+	tcase_add_test(tc_tlv_arena, test_tlv_arena);
+	suite_add_tcase(suite, tc_tlv_arena);
+
+	tc_tlv_view_parse = tcase_create("tlv-view-parse");
+	tcase_add_test(tc_tlv_view_parse, test_tlv_view_parse);
+	suite_add_tcase(suite, tc_tlv_view_parse);
+
+	tc_tlv_parse_limits = tcase_create("tlv-parse-limits");
+	tcase_add_test(tc_tlv_parse_limits, test_tlv_parse_limits);
+	suite_add_tcase(suite, tc_tlv_parse_limits);
+
+	tc_tlv_parse_ctx = tcase_create("tlv-parse-ctx");
+	tcase_add_test(tc_tlv_parse_ctx, test_tlv_parse_ctx);
+	suite_add_tcase(suite, tc_tlv_parse_ctx);
+
+	tc_tlv_encode_cache = tcase_create("tlv-encode-cache");
+	tcase_add_test(tc_tlv_encode_cache, test_tlv_encode_cache);
+	suite_add_tcase(suite, tc_tlv_encode_cache);
+
+	tc_tlv_find_key = tcase_create("tlv-find-key");
+	tcase_add_test(tc_tlv_find_key, test_tlv_find_key);
+	suite_add_tcase(suite, tc_tlv_find_key);
+
+	tc_tlv_index = tcase_create("tlv-index");
+	tcase_add_test(tc_tlv_index, test_tlv_index);
+	suite_add_tcase(suite, tc_tlv_index);
+
+	tc_tlv_hex = tcase_create("tlv-hex");
+	tcase_add_test(tc_tlv_hex, test_tlv_hex);
+	suite_add_tcase(suite, tc_tlv_hex);
+
+	tc_tlv_stream_parser = tcase_create("tlv-stream-parser");
+	tcase_add_test(tc_tlv_stream_parser, test_tlv_stream_parser);
+	suite_add_tcase(suite, tc_tlv_stream_parser);
+
+	tc_tlv_copy = tcase_create("tlv-copy");
+	tcase_add_test(tc_tlv_copy, test_tlv_copy);
+	suite_add_tcase(suite, tc_tlv_copy);
+
+	tc_tlv_encode_prefix = tcase_create("tlv-encode-prefix");
+	tcase_add_test(tc_tlv_encode_prefix, test_tlv_encode_prefix);
+	suite_add_tcase(suite, tc_tlv_encode_prefix);
+
+	tc_tlv_encode_iov = tcase_create("tlv-encode-iov");
+	tcase_add_test(tc_tlv_encode_iov, test_tlv_encode_iov);
+	suite_add_tcase(suite, tc_tlv_encode_iov);
+
+	tc_tlv_encode_bind = tcase_create("tlv-encode-bind");
+	tcase_add_test(tc_tlv_encode_bind, test_tlv_encode_bind);
+	suite_add_tcase(suite, tc_tlv_encode_bind);
+
+	tc_tlv_new_reserve = tcase_create("tlv-new-reserve");
+	tcase_add_test(tc_tlv_new_reserve, test_tlv_new_reserve);
+	suite_add_tcase(suite, tc_tlv_new_reserve);
+
+	tc_tlv_lazy_parse = tcase_create("tlv-lazy-parse");
+	tcase_add_test(tc_tlv_lazy_parse, test_tlv_lazy_parse);
+	suite_add_tcase(suite, tc_tlv_lazy_parse);
+
+	tc_tlv_validate = tcase_create("tlv-validate");
+	tcase_add_test(tc_tlv_validate, test_tlv_validate);
+	suite_add_tcase(suite, tc_tlv_validate);
+
+	tc_tlv_path = tcase_create("tlv-path");
+	tcase_add_test(tc_tlv_path, test_tlv_path);
+	suite_add_tcase(suite, tc_tlv_path);
+
+	tc_tlv_extract = tcase_create("tlv-extract");
+	tcase_add_test(tc_tlv_extract, test_tlv_extract);
+	suite_add_tcase(suite, tc_tlv_extract);
+
+	tc_tlv_writer = tcase_create("tlv-writer");
+	tcase_add_test(tc_tlv_writer, test_tlv_writer);
+	suite_add_tcase(suite, tc_tlv_writer);
+
+	tc_dol_plan = tcase_create("dol-plan");
+	tcase_add_test(tc_dol_plan, test_dol_plan);
+	suite_add_tcase(suite, tc_dol_plan);
+
+	tc_tlv_bcd = tcase_create("tlv-bcd");
+	tcase_add_test(tc_tlv_bcd, test_tlv_bcd);
+	suite_add_tcase(suite, tc_tlv_bcd);
+
+	tc_tlv_fmts = tcase_create("tlv-fmts");
+	tcase_add_test(tc_tlv_fmts, test_tlv_fmts);
+	suite_add_tcase(suite, tc_tlv_fmts);
+
+	tc_libtlv_ctx = tcase_create("libtlv-ctx");
+	tcase_add_test(tc_libtlv_ctx, test_libtlv_ctx);
+	suite_add_tcase(suite, tc_libtlv_ctx);
+
+	tc_tlv_log_async = tcase_create("tlv-log-async");
+	tcase_add_test(tc_tlv_log_async, test_tlv_log_async);
+	suite_add_tcase(suite, tc_tlv_log_async);
+
 	return suite;
 }
 
@@ -129,26 +129,16 @@ static struct argp argp = { options, parse_opt, args_doc, doc };
 static int binary_to_hex(const uint8_t *binary, size_t binary_len,
 						 uint8_t **hex, size_t *hex_len)
 {
-	int i = 0;
-
 	assert(binary);
 	assert(hex);
 	assert(hex_len);
 
 	*hex_len = binary_len * 2;
-	*hex = malloc(*hex_len);
+	*hex = malloc(*hex_len + 1);
 	if (!*hex)
 		return TLV_RC_OUT_OF_MEMORY;
 
-	for (i = 0; i < binary_len; i++) {
-		static const uint8_t nibble_to_hex[16] = {
-			'0', '1', '2', '3', '4', '5', '6', '7',
-			'8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
-		};
-
-		(*hex)[2 * i]	  = nibble_to_hex[binary[i] >> 4];
-		(*hex)[2 * i + 1] = nibble_to_hex[binary[i] & 0xF];
-	}
+	libtlv_bin_to_hex(binary, binary_len, (char *)*hex);
 
 	return TLV_RC_OK;
 }
@@ -157,8 +147,8 @@ static int hex_to_binary(const uint8_t *hex, size_t hex_len, uint8_t **binary,
 							     size_t *binary_len)
 {
 	uint8_t *result = NULL;
-	size_t buffer_len = 256, i_hex = 0, nibbles = 0;
-	bool comment = false;
+	size_t result_len = hex_len / 2;
+	int rc = TLV_RC_OK;
 
 	assert(hex);
 	assert(binary);
@@ -167,53 +157,19 @@ static int hex_to_binary(const uint8_t *hex, size_t hex_len, uint8_t **binary,
 	*binary = NULL;
 	*binary_len = 0;
 
-	result = malloc(buffer_len);
+	result = malloc(result_len + 1);
 	if (!result)
 		return TLV_RC_OUT_OF_MEMORY;
 
-	for (i_hex = 0, nibbles = 0, comment = false; i_hex < hex_len;
-								      i_hex++) {
-
-		if ((nibbles / 2) >= buffer_len) {
-			uint8_t *new_buffer = NULL;
-
-			buffer_len *= 2;
-			new_buffer = realloc(result, buffer_len);
-			if (!new_buffer) {
-				free(result);
-				return TLV_RC_OUT_OF_MEMORY;
-			}
-			result = new_buffer;
-		}
-
-		if (!comment) {
-			if ((hex[i_hex] >= '0') && (hex[i_hex] <= '9')) {
-				result[nibbles >> 1] <<= 4;
-				result[nibbles >> 1] |= hex[i_hex] - '0';
-				nibbles++;
-			}
-			if ((tolower(hex[i_hex]) >= 'a') &&
-						 (tolower(hex[i_hex]) <= 'f')) {
-				result[nibbles >> 1] <<= 4;
-				result[nibbles >> 1] |= tolower(hex[i_hex]) -
-								       'a' + 10;
-				nibbles++;
-			}
-			if (hex[i_hex] == '#')
-				comment = true;
-		} else {
-			if (hex[i_hex] == '\n')
-				comment = false;
-		}
-	}
-
-	if (nibbles % 2) {
+	rc = libtlv_hex_decode_text((const char *)hex, hex_len, result,
+								  &result_len);
+	if (rc != TLV_RC_OK) {
 		free(result);
-		return TLV_RC_INVALID_ARG;
+		return rc;
 	}
 
 	*binary = result;
-	*binary_len = nibbles / 2;
+	*binary_len = result_len;
 	return TLV_RC_OK;
 }
 